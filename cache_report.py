@@ -0,0 +1,65 @@
+# Copyright (c) 2025 Pankaj Pansari
+# See the LICENSE file for details.
+
+"""Report prompt-cache reuse from the token logs that write_log() leaves in
+intermediates/.
+
+For each component (Proposer, Reviewer, Summarizer, ...) and overall, prints the
+number of API calls, input tokens, how many of those were served from the prompt
+cache, the hit ratio, and output tokens. A low ratio on later calls means the
+shared prompt prefix is not byte-identical across them.
+
+Typical usage example:
+
+$ python3 cache_report.py intermediates/example
+"""
+
+import argparse
+import re
+from collections import defaultdict
+from pathlib import Path
+
+LOG_LINE = re.compile(
+    r" : (\w+) Input / Cached / Output tokens: (\d+): / (\d+) / (\d+)$"
+)
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "log_path",
+        nargs="?",
+        default="intermediates",
+        help="Folder searched recursively for *_log.txt files",
+    )
+    args = parser.parse_args()
+
+    # component -> [calls, input, cached, output]
+    totals = defaultdict(lambda: [0, 0, 0, 0])
+    for log_file in sorted(Path(args.log_path).rglob("*_log.txt")):
+        with open(log_file, "r", encoding="utf-8") as f:
+            for line in f:
+                match = LOG_LINE.search(line.rstrip("\n"))
+                if match is None:
+                    continue
+                component = match.group(1)
+                counts = [1] + [int(match.group(i)) for i in (2, 3, 4)]
+                for key in (component, "Total"):
+                    totals[key] = [a + b for a, b in zip(totals[key], counts)]
+
+    if not totals:
+        print(f"No token logs found under {args.log_path}")
+        return
+
+    print(f"{'':12}{'calls':>8}{'input':>12}{'cached':>12}{'hit':>8}{'output':>12}")
+    for component in sorted(k for k in totals if k != "Total") + ["Total"]:
+        calls, prompt, cached, output = totals[component]
+        ratio = cached / prompt if prompt else 0.0
+        print(
+            f"{component:12}{calls:>8}{prompt:>12}{cached:>12}"
+            f"{ratio:>8.1%}{output:>12}"
+        )
+
+
+if __name__ == "__main__":
+    main()
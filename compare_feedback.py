@@ -0,0 +1,86 @@
+# Copyright (c) 2025 Pankaj Pansari
+# See the LICENSE file for details.
+
+"""Compare the final annotations of two runs on the same submission, e.g. a
+REVIEW_MODE="combined" run against the two-pass baseline.
+
+Both arguments are intermediates/ folders holding *_final.json files. For each
+file present in both, prints the number of annotations of each run, how many
+annotated lines they share (a line counts once however many annotations it has),
+the overlap of annotated lines (shared / either), and the critical and issue
+counts. Token use and latency of the two runs are in their metrics.jsonl.
+
+Typical usage example:
+
+$ python3 compare_feedback.py intermediates/two_pass intermediates/combined
+"""
+
+import argparse
+import json
+from collections import Counter
+from pathlib import Path
+
+
+def load_annotations(json_file: Path) -> list:
+    with open(json_file, "r", encoding="utf-8") as f:
+        return json.load(f)["annotations"]
+
+
+def print_row(label: str, counts: dict) -> None:
+    overlap = counts["shared"] / counts["either"] if counts["either"] else 1.0
+    print(
+        f"{label:28}{counts['base']:>6}{counts['cand']:>6}{counts['shared']:>8}"
+        f"{overlap:>9.1%}"
+        f"{str(counts['base_critical']) + '/' + str(counts['cand_critical']):>10}"
+        f"{str(counts['base_issue']) + '/' + str(counts['cand_issue']):>11}"
+    )
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline_path", help="intermediates/ folder of baseline run")
+    parser.add_argument("candidate_path", help="intermediates/ folder to compare")
+    args = parser.parse_args()
+    baseline_path = Path(args.baseline_path)
+    candidate_path = Path(args.candidate_path)
+
+    baseline = {p.name: p for p in baseline_path.rglob("*_final.json")}
+    candidate = {p.name: p for p in candidate_path.rglob("*_final.json")}
+    names = sorted(baseline.keys() & candidate.keys())
+    for name in sorted(baseline.keys() ^ candidate.keys()):
+        print(f"{name}: only in one run, skipped")
+    if not names:
+        print("No *_final.json files in common")
+        return
+
+    print(
+        f"{'file':28}{'base':>6}{'cand':>6}{'shared':>8}{'overlap':>9}"
+        f"{'crit b/c':>10}{'issue b/c':>11}"
+    )
+    totals = Counter()
+    for name in names:
+        base = load_annotations(baseline[name])
+        cand = load_annotations(candidate[name])
+        base_lines = {a["line_number"] for a in base}
+        cand_lines = {a["line_number"] for a in cand}
+        shared = len(base_lines & cand_lines)
+        either = len(base_lines | cand_lines)
+        base_sev = Counter(a["severity"] for a in base)
+        cand_sev = Counter(a["severity"] for a in cand)
+        counts = {
+            "base": len(base),
+            "cand": len(cand),
+            "shared": shared,
+            "either": either,
+            "base_critical": base_sev["critical"],
+            "cand_critical": cand_sev["critical"],
+            "base_issue": base_sev["issue"],
+            "cand_issue": cand_sev["issue"],
+        }
+        totals.update(counts)
+        print_row(name.removesuffix("_final.json"), counts)
+    print_row("Total", totals)
+
+
+if __name__ == "__main__":
+    main()
@@ -3,15 +3,22 @@
 
 import argparse
 import datetime
+import hashlib
 import json
 import os
+import random
 import shutil
 import subprocess
-import sys
 import textwrap
+import threading
+import time
+from collections import defaultdict, deque
+from contextlib import contextmanager
+from concurrent.futures import ThreadPoolExecutor
 from pathlib import Path
-from typing import List, Set
+from typing import Dict, List, Optional, Set, Tuple
 
+import openai
 from dotenv import load_dotenv
 from openai import OpenAI
 from openai.types.chat import ChatCompletion
@@ -33,6 +40,25 @@ class Config:
       inter_dir: high-level folder where intermediate data will go. Should be
         'intermediates/' by default. Subdirectory structure preserved.
       proposer_reviewer: the string representing the OpenAI model to be used.
+      max_workers: number of program files whose Proposer/Reviewer chains run
+        concurrently.
+      requests_per_min: API requests allowed per minute, across all workers.
+      tokens_per_min: API tokens (input and output) allowed per minute, across
+        all workers.
+      max_retries: how many times a failed API call is retried with backoff.
+      cache_path: folder of cached Proposer/Reviewer results; see FeedbackCache.
+      ignore_patterns: shell-style patterns of files and directories the repo
+        diff skips.
+      prompt_scope: "file" to send modified files whole, or "hunks" to send only
+        their changed hunks with context; see preprocess_program.
+      hunk_context: lines of context kept around each hunk in "hunks" scope.
+      function_max_lines: in "hunks" scope, a changed function up to this long is
+        sent whole.
+      lint_jobs: clang-tidy processes run at once.
+      review_mode: "two-pass" for separate Proposer and Reviewer calls, or
+        "combined" for one call that drafts, critiques and refines.
+      input_price, cached_price, output_price: USD per million input, cached
+        input and output tokens, for the cost figures in the metrics.
     """
 
     def __init__(self, input_path: Path, env_file: str = "config_repo.env") -> None:
@@ -55,11 +81,601 @@ class Config:
             self.summarizer = os.getenv(
                 "SUMMARIZER"
             )  # LLM model string (get it from OpenAI API docs)
+        # Concurrency and rate limits; defaults suit a low API usage tier
+        self.max_workers = int(os.getenv("MAX_WORKERS", "4"))
+        self.requests_per_min = int(os.getenv("REQUESTS_PER_MIN", "500"))
+        self.tokens_per_min = int(os.getenv("TOKENS_PER_MIN", "200000"))
+        self.max_retries = int(os.getenv("MAX_RETRIES", "5"))
+        self.cache_path = Path(os.getenv("FEEDBACK_CACHE", "cache"))
+        self.ignore_patterns = [
+            pat.strip()
+            for pat in os.getenv("IGNORE_PATTERNS", ".*").split(",")
+            if pat.strip()
+        ]
+        self.prompt_scope = os.getenv("PROMPT_SCOPE", "file")
+        self.hunk_context = int(os.getenv("HUNK_CONTEXT", "10"))
+        self.function_max_lines = int(os.getenv("FUNCTION_MAX_LINES", "150"))
+        self.lint_jobs = int(os.getenv("LINT_JOBS", str(os.cpu_count() or 1)))
+        self.review_mode = os.getenv("REVIEW_MODE", "two-pass")
+        self.input_price = float(os.getenv("INPUT_PRICE_PER_M", "1.10"))
+        self.cached_price = float(os.getenv("CACHED_PRICE_PER_M", "0.275"))
+        self.output_price = float(os.getenv("OUTPUT_PRICE_PER_M", "4.40"))
         self.intermediate_path = get_intermediate_path(input_path)
         self.output_path = get_output_path(input_path)
         self.input_path = Path("")
 
 
+# ===================== METRICS ==================================
+class Metrics:
+    """Thread-safe run instrumentation, streamed as JSON lines.
+
+    Every event is one JSON object per line in the metrics file, written as it
+    happens, so a run can be watched (tail -f) or analysed after a crash:
+      {"event": "stage", "stage": ..., "file": ..., "seconds": ...}
+      {"event": "api", "component": ..., "file": ..., "model": ...,
+       "input_tokens": ..., "cached_tokens": ..., "output_tokens": ..., "cost": ...}
+      {"event": "retry", "error": ..., "delay": ...}
+      {"event": "throttle", "seconds": ...}
+    finish() appends a summary event with totals per stage and overall, and
+    prints it. Until open() is called, events are only counted, not written.
+    """
+
+    def __init__(self) -> None:
+        self._lock = threading.Lock()
+        self._file = None
+        self._start = time.monotonic()
+        self._prices = (0.0, 0.0, 0.0)
+        self.stages = defaultdict(lambda: [0, 0.0, 0.0])  # count, total, max
+        self.tokens = [0, 0, 0]  # input, cached, output
+        self.cost = 0.0
+        self.api_calls = 0
+        self.retries = 0
+        self.throttle_seconds = 0.0
+
+    def open(self, path: Path, config: Config) -> None:
+        os.makedirs(path.parent, exist_ok=True)
+        self._file = open(path, "w", encoding="utf-8")
+        self._start = time.monotonic()
+        self._prices = (config.input_price, config.cached_price, config.output_price)
+
+    def _write(self, event: dict) -> None:
+        # Caller holds _lock
+        if self._file is not None:
+            event["t"] = round(time.monotonic() - self._start, 3)
+            self._file.write(json.dumps(event) + "\n")
+            self._file.flush()
+
+    @contextmanager
+    def stage(self, name: str, input_filename: Path = None):
+        """Time the body of a with statement as one run of stage name."""
+        start = time.monotonic()
+        try:
+            yield
+        finally:
+            seconds = time.monotonic() - start
+            with self._lock:
+                totals = self.stages[name]
+                totals[0] += 1
+                totals[1] += seconds
+                totals[2] = max(totals[2], seconds)
+                self._write(
+                    {
+                        "event": "stage",
+                        "stage": name,
+                        "file": str(input_filename) if input_filename else None,
+                        "seconds": round(seconds, 3),
+                    }
+                )
+
+    def api(
+        self,
+        component: str,
+        input_filename: Path,
+        model: str,
+        prompt_tokens: int,
+        cached_tokens: int,
+        output_tokens: int,
+    ) -> None:
+        input_price, cached_price, output_price = self._prices
+        cost = (
+            (prompt_tokens - cached_tokens) * input_price
+            + cached_tokens * cached_price
+            + output_tokens * output_price
+        ) / 1e6
+        with self._lock:
+            self.api_calls += 1
+            for i, n in enumerate((prompt_tokens, cached_tokens, output_tokens)):
+                self.tokens[i] += n
+            self.cost += cost
+            self._write(
+                {
+                    "event": "api",
+                    "component": component,
+                    "file": str(input_filename),
+                    "model": model,
+                    "input_tokens": prompt_tokens,
+                    "cached_tokens": cached_tokens,
+                    "output_tokens": output_tokens,
+                    "cost": round(cost, 6),
+                }
+            )
+
+    def retry(self, error: Exception, delay: float) -> None:
+        with self._lock:
+            self.retries += 1
+            self._write(
+                {"event": "retry", "error": type(error).__name__, "delay": delay}
+            )
+
+    def throttle(self, seconds: float) -> None:
+        with self._lock:
+            self.throttle_seconds += seconds
+            self._write({"event": "throttle", "seconds": round(seconds, 3)})
+
+    def finish(self) -> None:
+        """Write and print the end-of-run summary, and close the file."""
+        with self._lock:
+            summary = {
+                "event": "summary",
+                "wall_seconds": round(time.monotonic() - self._start, 3),
+                "stages": {
+                    name: {
+                        "count": count,
+                        "seconds": round(total, 3),
+                        "max_seconds": round(longest, 3),
+                    }
+                    for name, (count, total, longest) in self.stages.items()
+                },
+                "api_calls": self.api_calls,
+                "input_tokens": self.tokens[0],
+                "cached_tokens": self.tokens[1],
+                "output_tokens": self.tokens[2],
+                "cost": round(self.cost, 4),
+                "retries": self.retries,
+                "throttle_seconds": round(self.throttle_seconds, 3),
+            }
+            self._write(summary)
+            if self._file is not None:
+                self._file.close()
+                self._file = None
+
+        print(f"\nRun took {summary['wall_seconds']:.1f}s")
+        print(f"{'stage':16}{'count':>7}{'total s':>10}{'max s':>9}")
+        for name, st in summary["stages"].items():
+            print(
+                f"{name:16}{st['count']:>7}{st['seconds']:>10.1f}"
+                f"{st['max_seconds']:>9.1f}"
+            )
+        print(
+            f"API calls {summary['api_calls']}, tokens in/cached/out "
+            f"{summary['input_tokens']}/{summary['cached_tokens']}/"
+            f"{summary['output_tokens']}, cost ${summary['cost']:.4f}, "
+            f"retries {summary['retries']}, "
+            f"throttled {summary['throttle_seconds']:.1f}s"
+        )
+
+
+# One instance for the whole run, shared by all threads
+metrics = Metrics()
+
+
+# ===================== RESULT CACHE =============================
+
+# Bump whenever the prompt templates or the structured output schemas change,
+# so that results cached under the old prompts are no longer used.
+PROMPT_VERSION = "3"
+
+
+class FeedbackCache:
+    """Persistent, content-addressed cache of Proposer/Reviewer results.
+
+    An entry is keyed by a hash of everything the LLM sees for one program file:
+    the processed program text, problem statement, rubric, model and
+    PROMPT_VERSION, plus a kind string telling the two scripts' schemas apart.
+    It holds the file's *_intermediate.json and *_final.json, so a hit replaces
+    both API calls with two file copies. Entries live outside intermediates/,
+    which every run clears, and are never expired; delete the folder to reset.
+
+    Attributes:
+      cache_path: folder holding one subfolder per entry, named by its key
+      kind: which pipeline the entries belong to, e.g. "repo" or "single"
+    """
+
+    FILES = ("intermediate", "final")
+
+    def __init__(self, cache_path: Path, kind: str) -> None:
+        self.cache_path = cache_path
+        self.kind = kind
+
+    def key(
+        self,
+        submission_program: str,
+        problem_statement: str,
+        rubric: str,
+        model: str,
+        extra: str = "",
+    ) -> str:
+        """Hash the inputs of one file's Proposer/Reviewer calls; extra is any
+        further input, such as the linter output the Reviewer is given."""
+        h = hashlib.sha256()
+        for part in (
+            self.kind,
+            PROMPT_VERSION,
+            model,
+            problem_statement,
+            rubric,
+            submission_program,
+            extra,
+        ):
+            data = part.encode("utf-8")
+            # Length-prefix each part so that no two inputs hash alike by
+            # moving text across a boundary.
+            h.update(len(data).to_bytes(8, "little"))
+            h.update(data)
+        return h.hexdigest()
+
+    def load(self, key: str, input_filename: Path, config: Config) -> bool:
+        """On a hit, copy the entry's results to intermediates/ and return True."""
+        entry = self.cache_path / key
+        if not self.has(key):
+            return False
+        for name in self.FILES:
+            shutil.copyfile(
+                entry / f"{name}.json",
+                intermediate_file(input_filename, config, f"{name}.json"),
+            )
+        return True
+
+    def has(self, key: str) -> bool:
+        return all(
+            (self.cache_path / key / f"{name}.json").is_file() for name in self.FILES
+        )
+
+    def store(self, key: str, input_filename: Path, config: Config) -> None:
+        """Save this file's results from intermediates/ under key. Each file is
+        written under a temporary name and renamed, so concurrent runs and
+        interrupted writes never leave a partial entry behind."""
+        entry = self.cache_path / key
+        os.makedirs(entry, exist_ok=True)
+        for name in self.FILES:
+            tmp = entry / f"{name}.json.{os.getpid()}.{threading.get_ident()}"
+            shutil.copyfile(
+                intermediate_file(input_filename, config, f"{name}.json"), tmp
+            )
+            os.replace(tmp, entry / f"{name}.json")
+
+
+# ===================== RATE LIMITING ============================
+class RateLimiter:
+    """Thread-safe sliding-window limiter on requests and tokens per minute.
+
+    Each API call first reserves one request and an estimate of its tokens with
+    acquire(), which blocks until both fit in the last minute's budget. Once the
+    response arrives, record() replaces the estimate with the actual usage.
+
+    Attributes:
+      requests_per_min: maximum requests in any 60-second window
+      tokens_per_min: maximum tokens in any 60-second window
+    """
+
+    WINDOW = 60.0  # seconds
+
+    def __init__(self, requests_per_min: int, tokens_per_min: int) -> None:
+        self.requests_per_min = requests_per_min
+        self.tokens_per_min = tokens_per_min
+        self._events = deque()  # [timestamp, tokens] per request in the window
+        self._tokens = 0
+        self._lock = threading.Lock()
+
+    def _expire(self, now: float) -> None:
+        while self._events and now - self._events[0][0] >= self.WINDOW:
+            self._tokens -= self._events.popleft()[1]
+
+    def acquire(self, est_tokens: int) -> list:
+        """Block until a request of est_tokens fits; return its reservation.
+
+        A single request larger than the whole token budget is let through once
+        the window is empty, rather than waiting forever.
+        """
+        waited = 0.0
+        while True:
+            with self._lock:
+                now = time.monotonic()
+                self._expire(now)
+                fits_tokens = (
+                    self._tokens + est_tokens <= self.tokens_per_min
+                    or not self._events
+                )
+                if len(self._events) < self.requests_per_min and fits_tokens:
+                    event = [now, est_tokens]
+                    self._events.append(event)
+                    self._tokens += est_tokens
+                    if waited:
+                        metrics.throttle(waited)
+                    return event
+                wait = max(self.WINDOW - (now - self._events[0][0]), 0.05)
+            time.sleep(wait)
+            waited += wait
+
+    def record(self, event: list, actual_tokens: int) -> None:
+        """Correct a reservation from acquire() with the tokens actually used."""
+        with self._lock:
+            if any(e is event for e in self._events):
+                self._tokens += actual_tokens - event[1]
+            event[1] = actual_tokens
+
+
+# Errors worth retrying: throttling, timeouts, dropped connections, and
+# server-side failures. Anything else (bad request, auth) fails at once.
+RETRYABLE_ERRORS = (
+    openai.RateLimitError,
+    openai.APIConnectionError,
+    openai.InternalServerError,
+)
+
+
+def parse_with_retry(
+    client: OpenAI, limiter: RateLimiter, config: Config, est_tokens: int, **kwargs
+):
+    """Call client.responses.parse(**kwargs) under limiter, retrying transient
+    errors with exponential backoff and jitter.
+
+    Args:
+      client: OpenAI client, shared by all worker threads
+      limiter: RateLimiter shared by all worker threads
+      config: instance of Config class that gives max_retries
+      est_tokens: estimate of input plus output tokens, reserved before the call
+      kwargs: arguments for client.responses.parse
+
+    Returns:
+      The parsed response object.
+
+    Raises:
+      The last API error, once max_retries retries have failed.
+    """
+    delay = 1.0
+    for attempt in range(config.max_retries + 1):
+        event = limiter.acquire(est_tokens)
+        try:
+            response = client.responses.parse(**kwargs)
+        except RETRYABLE_ERRORS as api_error:
+            if attempt == config.max_retries:
+                raise
+            metrics.retry(api_error, delay)
+            time.sleep(delay + random.uniform(0, delay))
+            delay = min(delay * 2, 60.0)
+            continue
+        usage = response.usage
+        limiter.record(event, usage.input_tokens + usage.output_tokens)
+        return response
+
+
+def estimate_tokens(*texts: str, output_tokens: int = 4000) -> int:
+    """Rough token count of a request: about 4 characters per input token,
+    plus an allowance for the output."""
+    return sum(len(t) for t in texts) // 4 + output_tokens
+
+
+# ===================== LINTING ==================================
+DEFAULT_LINT_FLAGS = ["-std=gnu11"]
+CLANG_TIDY_CONFIG = Path(".clang-tidy")  # Check set, next to these scripts
+LINT_BATCH_CHARS = 100000  # Linter output per summary call, about 25k tokens
+
+
+def load_compile_flags(repo: Path) -> Dict[str, List[str]]:
+    """Read the compiler flags of each file from repo's compile_commands.json.
+
+    The database may come from another machine, so entries are matched by path
+    relative to their build directory, and only the flags are kept: the compiler,
+    -c, -o and its argument, and the file name itself are dropped. Returns {} if
+    the repo has no database.
+    """
+    db_file = repo / "compile_commands.json"
+    if not db_file.is_file():
+        return {}
+    with open(db_file, "r", encoding="utf-8") as f:
+        entries = json.load(f)
+
+    flags = {}
+    for entry in entries:
+        args = entry.get("arguments") or entry["command"].split()
+        rel = os.path.relpath(entry["file"], entry["directory"])
+        kept, skip = [], False
+        for arg in args[1:]:
+            if skip:
+                skip = False
+            elif arg == "-o":
+                skip = True
+            elif arg != "-c" and os.path.basename(arg) != os.path.basename(rel):
+                kept.append(arg)
+        flags[Path(rel).as_posix()] = kept
+    return flags
+
+
+def lint_flags(flags: Dict[str, List[str]], rel: Path) -> List[str]:
+    """Flags for rel: its own entry, else (for a file new in the submission)
+    the most common flags in the database, else DEFAULT_LINT_FLAGS."""
+    if rel.as_posix() in flags:
+        return flags[rel.as_posix()]
+    if flags:
+        counts = {}
+        for f in flags.values():
+            counts[tuple(f)] = counts.get(tuple(f), 0) + 1
+        return list(max(counts, key=counts.get))
+    return DEFAULT_LINT_FLAGS
+
+
+def lint_key(program_file: Path, flags: List[str]) -> str:
+    """Cache key of a clang-tidy run: the file's contents, its flags, and the
+    check set in .clang-tidy."""
+    h = hashlib.sha256()
+    check_set = CLANG_TIDY_CONFIG.read_bytes() if CLANG_TIDY_CONFIG.is_file() else b""
+    for part in (program_file.read_bytes(), "\0".join(flags).encode(), check_set):
+        h.update(len(part).to_bytes(8, "little"))
+        h.update(part)
+    return h.hexdigest()
+
+
+def run_clang_tidy(program_file: Path, repo: Path, flags: List[str]) -> str:
+    """Run clang-tidy on one file from repo's directory, so that #includes
+    resolve as in the build, and return its output with repo's path removed."""
+    args = ["clang-tidy", str(program_file.relative_to(repo))]
+    if CLANG_TIDY_CONFIG.is_file():
+        args.append(f"--config-file={CLANG_TIDY_CONFIG.resolve()}")
+    process = subprocess.run(
+        args + ["--"] + flags, cwd=repo, capture_output=True, text=True
+    )
+    if process.returncode != 0:
+        print(
+            f"clang-tidy exited with code {process.returncode} on {program_file}: "
+            f"{process.stderr.strip()[-500:]}"
+        )
+    return process.stdout.replace(str(repo.resolve()) + os.sep, "")
+
+
+def lint_files(
+    program_files: List[Path], repo: Path, flags: Dict[str, List[str]], config: Config
+) -> Dict[Path, str]:
+    """Lint program_files (paths under repo) with clang-tidy, config.lint_jobs
+    processes at a time. Outputs are cached under config.cache_path/lint by
+    lint_key(), so an unchanged file is never linted twice.
+
+    Returns:
+        Dict from each program file to clang-tidy's output.
+    """
+    lint_cache = config.cache_path / "lint"
+    os.makedirs(lint_cache, exist_ok=True)
+
+    outputs, todo = {}, []
+    for program_file in program_files:
+        file_flags = lint_flags(flags, program_file.relative_to(repo))
+        cached = lint_cache / f"{lint_key(program_file, file_flags)}.txt"
+        if cached.is_file():
+            outputs[program_file] = cached.read_text(encoding="utf-8")
+        else:
+            todo.append((program_file, file_flags, cached))
+
+    # Each worker thread just waits on its own clang-tidy process, so the
+    # linting itself runs lint_jobs processes in parallel.
+    with ThreadPoolExecutor(max_workers=max(1, config.lint_jobs)) as executor:
+        results = executor.map(
+            lambda job: run_clang_tidy(job[0], repo, job[1]), todo
+        )
+        for (program_file, _, cached), output in zip(todo, results):
+            tmp = cached.with_suffix(f".{os.getpid()}.tmp")
+            tmp.write_text(output, encoding="utf-8")
+            os.replace(tmp, cached)
+            outputs[program_file] = output
+    return outputs
+
+
+def summarize_lint_batch(
+    client: OpenAI,
+    limiter: RateLimiter,
+    names: List[str],
+    outputs: Dict[str, str],
+    config: Config,
+) -> Dict[str, str]:
+    """Summarize the clang-tidy output of the files in names with one LLM call;
+    see summarize_lints()."""
+    linter_text = "".join(
+        f'<linter index="{i}" file="{name}">\n{outputs[name]}\n</linter>\n'
+        for i, name in enumerate(names)
+    )
+    prompt = (
+        "The following is output from a linter, one <linter> block per program "
+        "file. For each file, please retain the essential points only. These will "
+        "be used to guide an LLM-based automated programming feedback tool. Give "
+        "one summary per block, in the order of the blocks, with the index and "
+        "file name of its block."
+    )
+    response = parse_with_retry(
+        client,
+        limiter,
+        config,
+        estimate_tokens(prompt, linter_text),
+        model=config.summarizer or config.proposer_reviewer,
+        input=[
+            {"role": "user", "content": prompt},
+            {"role": "user", "content": linter_text},
+        ],
+        text_format=LintSummaries,
+    )
+
+    usage = response.usage
+    metrics.api(
+        "LintSummary",
+        Path(""),
+        response.model,
+        usage.input_tokens,
+        usage.input_tokens_details.cached_tokens,
+        usage.output_tokens,
+    )
+
+    summaries = {}
+    for s in response.output_parsed.summaries:
+        if not 0 <= s.index < len(names):
+            print(f"Warning: linter summary for unknown block {s.index} ({s.file})")
+            continue
+        name = names[s.index]
+        if s.file != name:
+            print(f"Warning: linter summary of {name} came back named {s.file}")
+        summaries[name] = s.summary
+    for name in names:
+        if name not in summaries:
+            print(f"Warning: no linter summary for {name}")
+    return summaries
+
+
+def summarize_lints(
+    client: OpenAI, limiter: RateLimiter, outputs: Dict[str, str], config: Config
+) -> Dict[str, str]:
+    """Summarize the clang-tidy output of many files, with one LLM call per batch
+    of files whose output comes to at most LINT_BATCH_CHARS, so that a large
+    repo does not overflow the model's context. A file's output beyond that is
+    cut off. The calls run concurrently through parse_with_retry() under limiter.
+
+    Args:
+      client: OpenAI client
+      limiter: RateLimiter shared with the other API calls
+      outputs: dict from file name to its clang-tidy output
+      config: instance of Config class that gives the summarizer model
+
+    Returns:
+      Dict from file name to the summary of its linter output; files with no
+      warnings are left out. Summaries are matched to files by block index, not
+      by the file name the model echoes, which it may alter.
+
+    Raises:
+      The last API error of a call whose retries have all failed.
+    """
+    names = sorted(name for name, out in outputs.items() if out.strip())
+    if not names:
+        return {}
+    texts = {}
+    for name in names:
+        texts[name] = outputs[name]
+        if len(texts[name]) > LINT_BATCH_CHARS:
+            texts[name] = texts[name][:LINT_BATCH_CHARS] + "\n... (truncated)"
+
+    batches, size = [[]], 0
+    for name in names:
+        if batches[-1] and size + len(texts[name]) > LINT_BATCH_CHARS:
+            batches.append([])
+            size = 0
+        batches[-1].append(name)
+        size += len(texts[name])
+
+    summaries = {}
+    with ThreadPoolExecutor(max_workers=max(1, config.max_workers)) as executor:
+        for part in executor.map(
+            lambda batch: summarize_lint_batch(client, limiter, batch, texts, config),
+            batches,
+        ):
+            summaries.update(part)
+    return summaries
+
+
 # ===================== UTILS ====================================
 def get_intermediate_path(input_path: Path):
     """Return the folder path where intermediate results go"""
@@ -69,6 +685,17 @@ def get_intermediate_path(input_path: Path):
         return Path("intermediates" / input_path.relative_to("input"))
 
 
+def intermediate_file(input_filename: Path, config: Config, kind: str) -> Path:
+    """Path of one of a program file's intermediate files, e.g.
+    intermediates/.../proc_final.json for kind "final.json". A header keeps its
+    suffix in the name (proc.h_final.json), so that it does not share files with
+    the .c file of the same stem."""
+    prefix = input_filename.stem
+    if input_filename.suffix == ".h":
+        prefix = input_filename.name
+    return config.intermediate_path / f"{prefix}_{kind}"
+
+
 def get_output_path(input_path: Path):
     """Return the folder path where final output feedback should go"""
     if input_path.is_file():
@@ -95,10 +722,10 @@ def write_log(
     Reviewer appends to the same log file. This logging lets us monitor prompt
     caching.
     """
-    log_file = config.intermediate_path / f"{input_filename.stem}_log.txt"
+    log_file = intermediate_file(input_filename, config, "log.txt")
 
     # If file exists before first log write during this call, overwrite it
-    permission = "w" if id_str == "Proposer" else "a"
+    permission = "w" if id_str in ("Proposer", "Combined") else "a"
 
     with open(log_file, permission, encoding="utf-8") as f:
         response_dict = response.model_dump()
@@ -111,6 +738,69 @@ def write_log(
             f"/ {cached_tokens} / {output_tokens}\n"
         )
 
+    metrics.api(
+        id_str,
+        input_filename,
+        response_dict.get("model"),
+        prompt_tokens,
+        cached_tokens,
+        output_tokens,
+    )
+
+
+def function_span(lines: List[str], line_number: int) -> Optional[Tuple[int, int]]:
+    """Return the first and last line numbers (1-based) of the C function whose
+    body contains line_number, or None if it is outside any function.
+
+    Relies on the usual layout, as in xv6, where a function's opening and closing
+    braces are alone at the start of a line: the body runs from the nearest '{'
+    in column 0 above to the next '}' in column 0, and the signature is the run
+    of non-blank lines just above the '{'. In a header, a struct or enum body
+    opens at the end of its first line, so its lines are outside any function.
+    """
+    open_line = None
+    for i in range(line_number - 1, -1, -1):
+        if lines[i].startswith("}") and i != line_number - 1:
+            return None
+        if lines[i].startswith("{"):
+            open_line = i
+            break
+    if open_line is None:
+        return None
+    close_line = None
+    for i in range(max(open_line + 1, line_number - 1), len(lines)):
+        if lines[i].startswith("}"):
+            close_line = i
+            break
+    if close_line is None:
+        return None
+    first = open_line
+    while first > 0 and lines[first - 1].strip() and not lines[first - 1].rstrip(
+    ).endswith((";", "}")):
+        first -= 1
+    return first + 1, close_line + 1
+
+
+def select_hunk_lines(lines: List[str], hunk_set: Set, config: Config) -> Set:
+    """Return the line numbers to send for a modified file in "hunks" scope: the
+    changed lines, config.hunk_context lines around each, and the whole of every
+    function they touch that is at most config.function_max_lines long."""
+    selected = set()
+    for n in hunk_set:
+        lo = max(1, n - config.hunk_context)
+        hi = min(len(lines), n + config.hunk_context)
+        selected.update(range(lo, hi + 1))
+    spans = set()
+    for n in hunk_set:
+        if 1 <= n <= len(lines):
+            span = function_span(lines, n)
+            if span is not None:
+                spans.add(span)
+    for first, last in spans:
+        if last - first + 1 <= config.function_max_lines:
+            selected.update(range(first, last + 1))
+    return selected
+
 
 def preprocess_program(
     input_filename: Path, config: Config, hunk_set: Set = None
@@ -122,6 +812,12 @@ def preprocess_program(
 
     This makes it easier for the LLM to tell us where the annotations will be placed
 
+    With config.prompt_scope "hunks", a modified file is cut down to the lines
+    select_hunk_lines() picks, and each run of left-out lines becomes one line
+    '... | (lines a-b unchanged, omitted)'. Lines keep their numbers in the whole
+    file, so annotations need no mapping back, and prompt size follows the size
+    of the change rather than of the file.
+
     Args:
         input_filename: Path object with relative path to input program file
         hunk_set: A Set object containing all line numbers that are new/modified
@@ -133,16 +829,33 @@ def preprocess_program(
     """
     processed_input_filename = config.intermediate_path / f"{input_filename.name}"
 
-    with open(input_filename, "r", encoding="utf-8") as f_input, open(
-        processed_input_filename, "w"
-    ) as f_processed_input:
-        i = 0
-        for line in f_input:
-            i += 1
+    with open(input_filename, "r", encoding="utf-8") as f_input:
+        lines = f_input.readlines()
+
+    selected = None
+    if hunk_set is not None and config.prompt_scope == "hunks":
+        selected = select_hunk_lines(lines, hunk_set, config)
+
+    with open(processed_input_filename, "w") as f_processed_input:
+        omitted_from = None
+        for i, line in enumerate(lines, start=1):
+            if selected is not None and i not in selected:
+                if omitted_from is None:
+                    omitted_from = i
+                continue
+            if omitted_from is not None:
+                f_processed_input.write(
+                    f"... | (lines {omitted_from}-{i - 1} unchanged, omitted)\n"
+                )
+                omitted_from = None
             if hunk_set is not None and i not in hunk_set:
                 f_processed_input.write(f"{i} | {line}")
             else:
                 f_processed_input.write(f"{i} | + {line}")
+        if omitted_from is not None:
+            f_processed_input.write(
+                f"... | (lines {omitted_from}-{len(lines)} unchanged, omitted)\n"
+            )
 
     return processed_input_filename
 
@@ -172,16 +885,38 @@ class Annotation(BaseModel):
     )
 
 
+class LintSummary(BaseModel):
+    """Summary of the linter output for one program file."""
+
+    index: int = Field(description="Index of the <linter> block")
+    file: str = Field(description="File name, as given in its <linter> block")
+    summary: str = Field(description="Essential points of the linter output")
+
+
+class LintSummaries(BaseModel):
+    """Linter summaries of several files, from one LLM call."""
+
+    summaries: list[LintSummary]
+
+
 # ==========================PROMPT TEMPLATES===================================
-def create_common_prompt_str(
-    problem_statement: str, rubric: str, submission_program: str
-) -> str:
-    """Common part of the prompt to Proposer and Reviewer. Benefits from prompt caching.
+# Prompts are laid out for prompt caching, which reuses the longest prefix that is
+# byte-identical to an earlier request's. So everything shared comes first, in the
+# same order for every call: system prompt, then create_common_prompt_str() (the
+# problem statement, rubric and general instructions, shared by the Proposer and
+# Reviewer of every file of every student), then the role's fixed instructions.
+# Only then come the parts that vary: the program text, and for the Reviewer the
+# linter summary and the Proposer's feedback. Keep new per-call text at the end.
+
+
+def create_common_prompt_str(problem_statement: str, rubric: str) -> str:
+    """Common first part of the prompt to Proposer and Reviewer: the same for
+    every file and every submission of an assignment, so it is served from the
+    prompt cache after the first call.
 
     Args:
       problem_statement: string read from the problem description file
       rubric: string read for the rubric file
-      submission_program: string of the program in a processed format
 
     Returns:
         common initial part of prompt as string
@@ -200,14 +935,12 @@ def create_common_prompt_str(
      {rubric}
      </rubric>
 
-     <submission>
-     {submission_program}
-     </submission>
-     
      If all lines are marked by '+', it can either mean that the submission is
      in form of a single code file, or that the file is a new addition to the
      target_repo (not present in source_repo). If only some lines are marked by '+'
      it implies that the existing code in source_repo has been modified.
+     A line starting with '...' stands for unchanged lines left out of the
+     submission to save space; the line numbers are still those of the whole file.
 
      So, if submission is a target repo, please note that this particular program
      file is only a part of the solution of the assignment.
@@ -217,17 +950,27 @@ def create_common_prompt_str(
      """
 
 
+def create_submission_str(submission_program: str) -> str:
+    """The per-file part of the prompt: the processed program text."""
+    return f"""
+     <submission>
+     {submission_program}
+     </submission>
+     """
+
+
 def create_proposer_prompt(
     problem_statement: str, rubric: str, submission_program: str
 ) -> str:
     return (
-        create_common_prompt_str(problem_statement, rubric, submission_program)
+        create_common_prompt_str(problem_statement, rubric)
         + "Suggest a list of annotations (comments) of feedback based on "
         "the rubric. Adhere to the structured output schema. If only some lines "
         "have been added to an existing program file in source_repo (marked by '+'), "
         "then give feedback only on the modified lines. It's okay to not give any "
         "feedback if there isn't a strong need for one. For single program file "
         "submissions, also generate a summary feedback"
+        + create_submission_str(submission_program)
     )
 
 
@@ -240,13 +983,17 @@ def create_reviewer_prompt(
 ) -> str:
 
     reviewer_prompt = (
-        create_common_prompt_str(problem_statement, rubric, submission_program)
-        + f"Look at the following list of annotations and the summary of "
-        "feedback.PatchSet Do the following:"
+        create_common_prompt_str(problem_statement, rubric)
+        + "Look at the list of annotations and the summary of feedback given "
+        "after the submission. Note summary is present only for single program "
+        "file submissions, and not for repo submissions. Do the following:"
         "1. For each annotation, check if line number is correct and if "
-        "annotation is useful to give and valid"
-        "2. Incorporate the linter output in annotations and summary, if needed."
-        "3. Discard annotations which are not very helpful and may clutter."
+        "annotation is useful to give and valid. "
+        "2. Incorporate the linter output in annotations and summary, if needed. "
+        "Note these are available only for single file submissions, not for repo"
+        "submissions. "
+        "3. Discard annotations which are not very helpful and may clutter. "
+        + create_submission_str(submission_program)
     )
 
     if linter_summary:
@@ -257,24 +1004,49 @@ def create_reviewer_prompt(
             "</linter>"
         )
 
-    reviewer_prompt += (
-        "Look at the following list of annotations and the summary of feedback. "
-        "Note summary is present only for single program file submissions, "
-        "and not for repo submissions. Do the following:"
-        "1. For each annotation, check if line number is correct and if "
-        "annotation is useful to give and valid. "
-        "2. Incorporate the linter output in annotations and summary, if needed. "
-        "Note these are available only for single file submissions, not for repo"
-        "submissions. "
-        "3. Discard annotations which are not very helpful and may clutter. "
-        "<feedback>"
-        f"{proposal_json}"
-        "</feedback>"
-    )
+    reviewer_prompt += f"<feedback>{proposal_json}</feedback>"
 
     return reviewer_prompt
 
 
+def create_combined_prompt(
+    problem_statement: str,
+    rubric: str,
+    submission_program: str,
+    linter_summary: str = None,
+) -> str:
+    """Prompt for one call that does the Proposer's and the Reviewer's work: a
+    draft, a critique of the draft, and the refined annotations."""
+    combined_prompt = (
+        create_common_prompt_str(problem_statement, rubric)
+        + "Work in three steps, filling the fields of the structured output "
+        "schema in order. "
+        "1. draft: suggest a list of annotations (comments) of feedback based on "
+        "the rubric. If only some lines have been added to an existing program "
+        "file in source_repo (marked by '+'), give feedback only on the modified "
+        "lines. "
+        "2. critique: review the draft as a strict second reader would. For each "
+        "draft annotation, check if the line number is correct and if the "
+        "annotation is useful to give and valid. Name those which are not very "
+        "helpful and may clutter, and any important issue the draft missed. "
+        "3. annotations: give the final list, with the draft annotations that "
+        "survive the critique, corrected, plus any it found missing. Incorporate "
+        "the linter output, if given. It's okay to give no feedback if there "
+        "isn't a strong need for one."
+        + create_submission_str(submission_program)
+    )
+
+    if linter_summary:
+        combined_prompt += (
+            f"Clang-tidy linter gave the following output (summary) for the submission."
+            "<linter>"
+            f"{linter_summary}"
+            "</linter>"
+        )
+
+    return combined_prompt
+
+
 def create_system_prompt():
     return (
         "Your role is to act as an OS course TA who provides qualitative "
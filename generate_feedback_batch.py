@@ -0,0 +1,346 @@
+# Copyright (c) 2025 Pankaj Pansari
+# See the LICENSE file for details.
+
+"""Generate feedback for a whole class of repo submissions with the OpenAI Batch API.
+
+Each subdirectory of the submissions directory is one target repo, graded against
+the same source repo exactly as generate_feedback_repo.py would grade it. Instead of
+one synchronous call per file and stage, all Proposer requests of the class go into
+one Batch job. Once it completes, all Reviewer requests go into a second one. Batch
+jobs cost less per token and are not held to the per-minute rate limits, at the
+price of latency (up to the 24h completion window), which suits overnight runs.
+
+Responses are parsed into FeedbackResponse and postprocessed with
+generate_feedback_repo.postprocess(), so each submission's feedback.c is the same
+as a synchronous run would write. Files already in the cache (see FeedbackCache)
+are not sent at all.
+
+Please make sure that config_repo.env contains appropriate path values.
+
+Typical usage example:
+
+$ python3 generate_feedback_batch.py input/class_submissions input/xv6-public
+"""
+
+import argparse
+import json
+import os
+import shutil
+import sys
+import time
+from pathlib import Path
+from typing import Dict, List, Optional
+
+from feedback_utils import (
+    Config,
+    FeedbackCache,
+    create_proposer_prompt,
+    create_reviewer_prompt,
+    create_system_prompt,
+    intermediate_file,
+    metrics,
+    write_log,
+)
+from generate_feedback_repo import FeedbackResponse, collect_files, postprocess
+from openai import OpenAI
+from openai.types.responses import Response
+
+POLL_SECONDS = 60  # How often to check on a running batch
+DONE_STATUSES = ("completed", "failed", "expired", "cancelled")
+
+client = None
+
+# ===================== BATCH JOBS ================================
+
+
+class FileJob:
+    """One program file of one submission, carried through both batches.
+
+    Attributes:
+      custom_id: identifies the file's requests and responses within a batch
+      input_filename: Path of the processed program file under intermediates/
+      config: Config of the submission the file belongs to
+      submission_program: processed program text
+      cache_key: key of the file's FeedbackCache entry, or None without a cache
+    """
+
+    def __init__(
+        self,
+        custom_id: str,
+        input_filename: Path,
+        config: Config,
+        submission_program: str,
+        cache_key: Optional[str],
+    ) -> None:
+        self.custom_id = custom_id
+        self.input_filename = input_filename
+        self.config = config
+        self.submission_program = submission_program
+        self.cache_key = cache_key
+
+
+def strict_schema(schema: dict) -> dict:
+    """Close every object of a JSON schema to extra keys and require all its
+    properties, as Structured Outputs' strict mode wants. Applied to
+    FeedbackResponse.model_json_schema(), this gives the schema that
+    client.responses.parse() sends, without the SDK's private helper."""
+    if schema.get("type") == "object":
+        schema["additionalProperties"] = False
+        schema["required"] = list(schema.get("properties", {}))
+    for value in schema.values():
+        for item in value if isinstance(value, list) else [value]:
+            if isinstance(item, dict):
+                strict_schema(item)
+    return schema
+
+
+def batch_request(custom_id: str, user_prompt: str, model: str) -> dict:
+    """Build one line of a Batch input file: the same request the synchronous
+    scripts make with client.responses.parse(text_format=FeedbackResponse)."""
+    return {
+        "custom_id": custom_id,
+        "method": "POST",
+        "url": "/v1/responses",
+        "body": {
+            "model": model,
+            "input": [
+                {"role": "system", "content": create_system_prompt()},
+                {"role": "user", "content": user_prompt},
+            ],
+            "text": {
+                "format": {
+                    "type": "json_schema",
+                    "name": "FeedbackResponse",
+                    "schema": strict_schema(FeedbackResponse.model_json_schema()),
+                    "strict": True,
+                }
+            },
+        },
+    }
+
+
+def run_batch(requests: List[dict], name: str, work_path: Path) -> Dict[str, dict]:
+    """Submit requests as one Batch job, wait for it, and return the response
+    bodies of the requests that succeeded, by custom_id.
+
+    Args:
+      requests: lines of the Batch input file, from batch_request()
+      name: stage name, for file names and progress messages
+      work_path: folder for the Batch input and output files
+
+    Returns:
+      Dict from custom_id to the response body (a Response as a dict).
+    """
+    if not requests:
+        return {}
+
+    input_file = work_path / f"{name}_batch_input.jsonl"
+    with open(input_file, "w", encoding="utf-8") as f:
+        for request in requests:
+            f.write(json.dumps(request, ensure_ascii=False) + "\n")
+
+    with open(input_file, "rb") as f:
+        uploaded = client.files.create(file=f, purpose="batch")
+    batch = client.batches.create(
+        input_file_id=uploaded.id,
+        endpoint="/v1/responses",
+        completion_window="24h",
+    )
+    print(f"{name}: submitted batch {batch.id} with {len(requests)} requests")
+
+    while batch.status not in DONE_STATUSES:
+        time.sleep(POLL_SECONDS)
+        batch = client.batches.retrieve(batch.id)
+        counts = batch.request_counts
+        print(
+            f"{name}: {batch.status}, {counts.completed}/{counts.total} done, "
+            f"{counts.failed} failed"
+        )
+
+    if batch.status != "completed" or batch.output_file_id is None:
+        print(f"{name}: batch {batch.id} ended {batch.status}")
+        return {}
+
+    output_file = work_path / f"{name}_batch_output.jsonl"
+    output = client.files.content(batch.output_file_id).text
+    with open(output_file, "w", encoding="utf-8") as f:
+        f.write(output)
+
+    bodies = {}
+    for line in output.splitlines():
+        if not line.strip():
+            continue
+        result = json.loads(line)
+        response = result.get("response")
+        if result.get("error") or not response or response["status_code"] != 200:
+            print(f"{name}: request {result['custom_id']} failed: {line[:200]}")
+            continue
+        bodies[result["custom_id"]] = response["body"]
+    return bodies
+
+
+def parse_feedback(body: dict) -> FeedbackResponse:
+    """Parse the structured output text of a Responses API body, as
+    client.responses.parse() does for output_parsed."""
+    for item in body["output"]:
+        if item.get("type") != "message":
+            continue
+        for content in item["content"]:
+            if content.get("type") == "output_text":
+                return FeedbackResponse.model_validate_json(content["text"])
+    raise ValueError("no output text in response")
+
+
+def save_stage(
+    bodies: Dict[str, dict], jobs: List[FileJob], stage: str, id_str: str
+) -> List[FileJob]:
+    """Write each job's parsed feedback to its *_{stage}.json and log its token
+    usage, as call_proposer()/call_reviewer() do. Returns the jobs that have it."""
+    done = []
+    for job in jobs:
+        body = bodies.get(job.custom_id)
+        if body is None:
+            print(f"{id_str}: no response for {job.input_filename}, skipping it")
+            continue
+        try:
+            feedback = parse_feedback(body)
+        except ValueError as parse_error:
+            print(f"{id_str}: bad response for {job.input_filename}: {parse_error}")
+            continue
+        json_file = intermediate_file(job.input_filename, job.config, f"{stage}.json")
+        with open(json_file, "w", encoding="utf-8") as f:
+            json.dump(feedback.model_dump(), f, indent=4, ensure_ascii=False)
+        write_log(Response.model_validate(body), id_str, job.input_filename, job.config)
+        done.append(job)
+    return done
+
+
+# ===================== DRIVER ====================================
+
+
+def main() -> None:
+    """Given a directory of target repos and the source repo they build on,
+    generate feedback for every submission in two Batch jobs.
+
+    Files are numbered in submission order, then in the order collect_files()
+    gives, so output is deterministic. A file whose Proposer or Reviewer request
+    fails gets no feedback; the rest of the class is unaffected.
+    """
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "submissions_path", help="Directory with one target repo per submission"
+    )
+    parser.add_argument("source_repo_path", help="Path of original repo (source)")
+    parser.add_argument(
+        "--no-cache", action="store_true", help="Ignore and don't update the cache"
+    )
+    args = parser.parse_args()
+    submissions_path = Path(args.submissions_path)
+    source_repo = Path(args.source_repo_path)
+
+    class_config = Config(submissions_path, "config_repo.env")
+
+    global client
+    client = OpenAI()
+    cache = None
+    if not args.no_cache:
+        cache = FeedbackCache(class_config.cache_path, "repo")
+
+    try:
+        with open(class_config.problem_statement, "r", encoding="utf-8") as f:
+            problem_statement = f.read()
+        with open(class_config.rubric, "r", encoding="utf-8") as f:
+            rubric = f.read()
+    except FileNotFoundError as missing:
+        print(f"Error: {missing.filename} not found")
+        sys.exit(1)
+
+    work_path = class_config.intermediate_path
+    os.makedirs(work_path, exist_ok=True)
+    metrics.open(work_path / "metrics.jsonl", class_config)
+
+    # Collect every file of every submission; answer what we can from the cache
+    submissions = []  # (config, processed filenames) per submission
+    pending = []  # FileJobs that need the API
+    for target_repo in sorted(p for p in submissions_path.iterdir() if p.is_dir()):
+        config = Config(target_repo, "config_repo.env")
+        for path in (config.intermediate_path, config.output_path):
+            if os.path.exists(path):
+                shutil.rmtree(path)
+            os.makedirs(path, exist_ok=True)
+
+        filenames = [p for p, _ in collect_files(source_repo, target_repo, config)]
+        submissions.append((config, filenames))
+        for input_filename in filenames:
+            with open(input_filename, "r", encoding="utf-8") as f:
+                submission_program = f.read()
+            key = None
+            if cache is not None:
+                key = cache.key(
+                    submission_program,
+                    problem_statement,
+                    rubric,
+                    config.proposer_reviewer,
+                )
+                if cache.load(key, input_filename, config):
+                    continue
+            custom_id = f"{len(submissions) - 1}-{len(pending)}"
+            pending.append(
+                FileJob(custom_id, input_filename, config, submission_program, key)
+            )
+
+    print(
+        f"{len(submissions)} submissions, "
+        f"{sum(len(f) for _, f in submissions)} files, {len(pending)} not cached"
+    )
+
+    # Proposer batch
+    requests = [
+        batch_request(
+            job.custom_id,
+            create_proposer_prompt(problem_statement, rubric, job.submission_program),
+            job.config.proposer_reviewer,
+        )
+        for job in pending
+    ]
+    with metrics.stage("proposer_batch"):
+        bodies = run_batch(requests, "proposer", work_path)
+    proposed = save_stage(bodies, pending, "intermediate", "Proposer")
+
+    # Reviewer batch, built from the Proposer's feedback
+    requests = []
+    for job in proposed:
+        json_file = intermediate_file(
+            job.input_filename, job.config, "intermediate.json"
+        )
+        with open(json_file, "r", encoding="utf-8") as f:
+            proposal_json = json.dumps(json.load(f))
+        requests.append(
+            batch_request(
+                job.custom_id,
+                create_reviewer_prompt(
+                    problem_statement, rubric, job.submission_program, proposal_json
+                ),
+                job.config.proposer_reviewer,
+            )
+        )
+    with metrics.stage("reviewer_batch"):
+        bodies = run_batch(requests, "reviewer", work_path)
+    for job in save_stage(bodies, proposed, "final", "Reviewer"):
+        if cache is not None:
+            cache.store(job.cache_key, job.input_filename, job.config)
+
+    # Postprocess each submission in file order
+    for config, filenames in submissions:
+        for input_filename in filenames:
+            final_json = intermediate_file(input_filename, config, "final.json")
+            if final_json.is_file():
+                with metrics.stage("postprocess", input_filename):
+                    postprocess(input_filename, config)
+        print(f"Feedback generation complete for {config.output_path}.")
+
+    metrics.finish()
+
+
+if __name__ == "__main__":
+    main()
@@ -5,12 +5,34 @@
 and modifications to an existing codebase (source repo), resulting in target repo.
 
 We generate feedback for each individual modified or added file separately; these
-files are identified by diffing source and target repos. The feedback for each
+files are identified by diffing source and target repos in-process, looking only
+at program sources and skipping ignored paths. The feedback for each
 such file is written in a common feedback output file. The script first calls
 Proposer to generate initial feedback for each modified/added file, giving problem
 statement and rubric (what make good quality code?) as context. A reviewer then
 reflects on these annotations to generate final feedback.
 
+The Proposer/Reviewer chains of different files are independent, so they run
+concurrently on a thread pool (MAX_WORKERS in config_repo.env). All API calls
+share one rate limiter (REQUESTS_PER_MIN, TOKENS_PER_MIN) and are retried with
+backoff on transient errors. Feedback is still written in diff order.
+
+Results are cached by content (see FeedbackCache), so a file whose processed
+text, prompts and model are unchanged since an earlier run costs no API calls.
+Pass --no-cache to call the API regardless.
+
+With --lint, every reviewed .c file is also linted with clang-tidy, using the flags
+from the source repo's compile_commands.json, in parallel and cached by file hash
+and check set. LLM calls summarize the linter output a batch of files at a time,
+and the Reviewer of each file gets its file's summary.
+
+With REVIEW_MODE="combined", one call per file replaces the Proposer/Reviewer
+pair: the model drafts annotations, critiques the draft and gives the refined
+list in one structured response (CombinedFeedbackResponse). This roughly halves
+input tokens and latency per file. The draft and critique are kept in
+intermediates/ as *_intermediate.json, so compare_feedback.py can compare its
+final feedback against a two-pass run.
+
 Please make sure that config_repo.env contains appropriate path values.
 
 Typical usage example:
@@ -20,68 +42,131 @@ $ python3 scripts/generate_feedback_repo.py input/threads-in-xv6-submission inpu
 
 import argparse
 import datetime
+import difflib
+import fnmatch
+import hashlib
 import json
 import os
 import shutil
-import subprocess
 import sys
 import textwrap
+from concurrent.futures import ThreadPoolExecutor
 from pathlib import Path
-from typing import List, Set
+from typing import Iterator, List, Set, Tuple
 
 from feedback_utils import (
     Annotation,
     Config,
+    FeedbackCache,
+    RateLimiter,
+    create_combined_prompt,
     create_proposer_prompt,
     create_reviewer_prompt,
     create_system_prompt,
+    estimate_tokens,
+    intermediate_file,
+    lint_files,
+    load_compile_flags,
+    metrics,
+    parse_with_retry,
     preprocess_program,
+    summarize_lints,
     write_log,
 )
 from openai import OpenAI
 from openai.types.chat import ChatCompletion
 from pydantic import BaseModel, Field
-from unidiff import PatchSet
 
 THRESHOLD = 10  # Give feedback on files with at least THRESHOLD modifications/additions
 DEFAULT_WRAP_WIDTH = 80
 ANNOTATION_PREFIX = "/* \n * REVIEW: "
 ANNOTATION_SUFFIX = "\n */"
 PROGRAM_LANG = ".c"  # What is the programming language of submission?
+SOURCE_SUFFIXES = (PROGRAM_LANG, ".h")  # Files diffed and reviewed
+DIFF_CONTEXT = 3  # Context lines around each change, as in diff -u
 
 client = None
+limiter = None
+cache = None  # FeedbackCache, or None with --no-cache
 # ===================== UTILS ====================================
 
 
-def run_diff(source_repo: Path, target_repo: Path, config: Config) -> Path:
-    """Runs diff tool between source and target repos.
-    Output is in unified diff format.
+def walk_sources(repo: Path, ignore_patterns: List[str]) -> Iterator[Path]:
+    """Yields the relative paths of the source files under repo, in sorted order.
+
+    Only files with a suffix in SOURCE_SUFFIXES are yielded, so build outputs
+    (object files, listings, binaries, disk images) are never read. A file or
+    directory whose name or relative path matches one of ignore_patterns
+    (shell-style, as in fnmatch) is skipped, directories without descending.
+    """
+
+    def ignored(rel: Path) -> bool:
+        return any(
+            fnmatch.fnmatch(rel.name, pat) or fnmatch.fnmatch(rel.as_posix(), pat)
+            for pat in ignore_patterns
+        )
+
+    for dirpath, dirnames, filenames in os.walk(repo):
+        rel_dir = Path(dirpath).relative_to(repo)
+        dirnames[:] = sorted(d for d in dirnames if not ignored(rel_dir / d))
+        for name in sorted(filenames):
+            rel = rel_dir / name
+            if rel.suffix in SOURCE_SUFFIXES and not ignored(rel):
+                yield rel
+
+
+def file_digest(path: Path) -> str:
+    with open(path, "rb") as f:
+        return hashlib.sha256(f.read()).hexdigest()
+
+
+def changed_lines(source_file: Path, target_file: Path) -> Set[int]:
+    """Returns the line numbers in target_file covered by the hunks of a unified
+    diff against source_file: changed and added lines, plus DIFF_CONTEXT lines of
+    context around them, as diff -u would group them."""
+    with open(source_file, "r", encoding="utf-8", errors="replace") as f:
+        source_lines = f.readlines()
+    with open(target_file, "r", encoding="utf-8", errors="replace") as f:
+        target_lines = f.readlines()
+
+    hunk_set = set()
+    matcher = difflib.SequenceMatcher(None, source_lines, target_lines, autojunk=False)
+    for group in matcher.get_grouped_opcodes(DIFF_CONTEXT):
+        first, last = group[0][3], group[-1][4]  # target range of the hunk
+        hunk_set.update(range(first + 1, last + 1))
+    return hunk_set
+
+
+def diff_repos(
+    source_repo: Path, target_repo: Path, config: Config
+) -> Tuple[List[Path], List[Tuple[Path, Set[int]]]]:
+    """Compares the source files of source and target repos.
+
+    A file present in both is skipped without reading it line by line when the
+    two copies have the same size and hash.
 
     Args:
         source_repo: Path object containing relative path to source repo.
         target_repo: Path object containing relative path to target repo.
-        config: Instance of Config class that gives path to problem statement
+        config: Instance of Config class that gives the ignore patterns.
 
     Returns:
-        diff_filename: Path object containing relative path to diff file.
+        added: paths (under target_repo) of files only in target repo.
+        modified: (path under target_repo, hunk set) of each changed file.
     """
-    process = subprocess.Popen(
-        ["diff", "-r", "-u", source_repo, target_repo],
-        stdout=subprocess.PIPE,
-        stderr=subprocess.PIPE,
-        text=True,
-    )
-    diff_out, diff_err = process.communicate()
-    if process.returncode == 2:  # diff returns 2 if there's some error
-        print(f"Error running diff: {diff_err}")
-        sys.exit(1)
-
-    diff_filename = config.intermediate_path / "repo.diff"
-
-    with open(diff_filename, "w", encoding="utf-8") as f:
-        f.write(diff_out)
-
-    return diff_filename
+    added, modified = [], []
+    for rel in walk_sources(target_repo, config.ignore_patterns):
+        target_file = target_repo / rel
+        source_file = source_repo / rel
+        if not source_file.is_file():
+            added.append(target_file)
+            continue
+        if source_file.stat().st_size == target_file.stat().st_size and file_digest(
+            source_file
+        ) == file_digest(target_file):
+            continue
+        modified.append((target_file, changed_lines(source_file, target_file)))
+    return added, modified
 
 
 # ========================= STRUCTURED OUTPUT SCHEMA ================
@@ -98,6 +183,26 @@ class FeedbackResponse(BaseModel):
     )
 
 
+class CombinedFeedbackResponse(BaseModel):
+    """Draft, self-critique and refined annotations from one call, in the order
+    the model writes them. Used by OpenAI API for structured output.
+
+    Attributes:
+        draft: annotations as the Proposer would give them
+        critique: review of the draft, as the Reviewer would do it
+        annotations: final annotations, as in FeedbackResponse
+    """
+
+    draft: list[Annotation] = Field(description="First list of line-specific feedback")
+    critique: str = Field(
+        description="Which draft annotations are wrong, unhelpful or cluttering, "
+        "and what is missing"
+    )
+    annotations: list[Annotation] = Field(
+        description="Final list of line-specific code feedback"
+    )
+
+
 def call_proposer(
     problem_statement: str,
     rubric: str,
@@ -130,27 +235,32 @@ def call_proposer(
     system_prompt = create_system_prompt()
 
     try:
-        proposer_response = client.responses.parse(
-            model=config.proposer_reviewer,
-            input=[
-                {
-                    "role": "system",
-                    "content": system_prompt,
-                },
-                {
-                    "role": "user",
-                    "content": user_prompt,
-                },
-            ],
-            text_format=FeedbackResponse,
-        )
+        with metrics.stage("proposer", input_filename):
+            proposer_response = parse_with_retry(
+                client,
+                limiter,
+                config,
+                estimate_tokens(system_prompt, user_prompt),
+                model=config.proposer_reviewer,
+                input=[
+                    {
+                        "role": "system",
+                        "content": system_prompt,
+                    },
+                    {
+                        "role": "user",
+                        "content": user_prompt,
+                    },
+                ],
+                text_format=FeedbackResponse,
+            )
     except Exception as api_error:
         print(f"API call error for proposer: {str(api_error)}")
         sys.exit(1)
 
     initial_feedback = proposer_response.output_parsed
 
-    json_file = config.intermediate_path / f"{input_filename.stem}_intermediate.json"
+    json_file = intermediate_file(input_filename, config, "intermediate.json")
 
     with open(json_file, "w") as f:
         json.dump(initial_feedback.model_dump(), f, indent=4, ensure_ascii=False)
@@ -164,12 +274,10 @@ def call_reviewer(
     submission_program: str,
     input_filename: Path,
     config: Config,
+    linter_summary: str = None,
 ) -> None:
-    """Reviewer reviews the feedback generated by Proposer.
-
-    Note that if you want to integrate linter output, please make use of run_linter
-    from generate_feedback_single.py Include processed linter summary in prompt
-    to reviewer.
+    """Reviewer reviews the feedback generated by Proposer, and integrates the
+    summary of clang-tidy output when linting (--lint).
 
     Arg:
       problem_statement: string read from the problem description file
@@ -180,12 +288,13 @@ def call_reviewer(
         lines (with respect to source_repo) with '+'
       input_filename: Path object containing the relative path of program file
       config: Instance of Config class that gives path to problem statement
+      linter_summary: summary of clang-tidy output for this file, or None
 
     Return:
       None
     """
 
-    json_file = config.intermediate_path / f"{input_filename.stem}_intermediate.json"
+    json_file = intermediate_file(input_filename, config, "intermediate.json")
 
     try:
         with open(json_file, "r", encoding="utf-8") as f:
@@ -197,32 +306,37 @@ def call_reviewer(
     proposal_json = json.dumps(proposer_output_data)
 
     user_prompt = create_reviewer_prompt(
-        problem_statement, rubric, submission_program, proposal_json
+        problem_statement, rubric, submission_program, proposal_json, linter_summary
     )
     system_prompt = create_system_prompt()
 
     try:
-        reviewer_response = client.responses.parse(
-            model=config.proposer_reviewer,
-            input=[
-                {
-                    "role": "system",
-                    "content": system_prompt,
-                },
-                {
-                    "role": "user",
-                    "content": user_prompt,
-                },
-            ],
-            text_format=FeedbackResponse,
-        )
+        with metrics.stage("reviewer", input_filename):
+            reviewer_response = parse_with_retry(
+                client,
+                limiter,
+                config,
+                estimate_tokens(system_prompt, user_prompt),
+                model=config.proposer_reviewer,
+                input=[
+                    {
+                        "role": "system",
+                        "content": system_prompt,
+                    },
+                    {
+                        "role": "user",
+                        "content": user_prompt,
+                    },
+                ],
+                text_format=FeedbackResponse,
+            )
     except Exception as api_error:
-        print(f"API call error for proposer: {str(api_error)}")
+        print(f"API call error for reviewer: {str(api_error)}")
         sys.exit(1)
 
     refined_feedback = reviewer_response.output_parsed
 
-    json_file = config.intermediate_path / f"{input_filename.stem}_final.json"
+    json_file = intermediate_file(input_filename, config, "final.json")
 
     with open(json_file, "w", encoding="utf-8") as f:
         json.dump(refined_feedback.model_dump(), f, indent=4, ensure_ascii=False)
@@ -230,6 +344,75 @@ def call_reviewer(
     write_log(reviewer_response, "Reviewer", input_filename, config)
 
 
+def call_combined(
+    problem_statement: str,
+    rubric: str,
+    submission_program: str,
+    input_filename: Path,
+    config: Config,
+    linter_summary: str = None,
+) -> None:
+    """Proposer and Reviewer in one call (REVIEW_MODE="combined").
+
+    Writes the same files as call_proposer() and call_reviewer(): the draft and
+    critique go to *_intermediate.json, the final annotations to *_final.json.
+
+    Arg:
+      problem_statement: string read from the problem description file
+      rubric: string read for the rubric file
+      submission_program: string of the program in a processed format
+      input_filename: Path object containing the relative path of program file
+      config: Instance of Config class that gives path to problem statement
+      linter_summary: summary of clang-tidy output for this file, or None
+
+    Return:
+      None
+    """
+
+    user_prompt = create_combined_prompt(
+        problem_statement, rubric, submission_program, linter_summary
+    )
+    system_prompt = create_system_prompt()
+
+    try:
+        with metrics.stage("combined", input_filename):
+            combined_response = parse_with_retry(
+                client,
+                limiter,
+                config,
+                estimate_tokens(system_prompt, user_prompt, output_tokens=8000),
+                model=config.proposer_reviewer,
+                input=[
+                    {
+                        "role": "system",
+                        "content": system_prompt,
+                    },
+                    {
+                        "role": "user",
+                        "content": user_prompt,
+                    },
+                ],
+                text_format=CombinedFeedbackResponse,
+            )
+    except Exception as api_error:
+        print(f"API call error for combined review: {str(api_error)}")
+        sys.exit(1)
+
+    feedback = combined_response.output_parsed.model_dump()
+
+    json_file = intermediate_file(input_filename, config, "intermediate.json")
+    with open(json_file, "w", encoding="utf-8") as f:
+        draft = {"annotations": feedback["draft"], "critique": feedback["critique"]}
+        json.dump(draft, f, indent=4, ensure_ascii=False)
+
+    json_file = intermediate_file(input_filename, config, "final.json")
+    with open(json_file, "w", encoding="utf-8") as f:
+        final = {"annotations": feedback["annotations"]}
+        json.dump(final, f, indent=4, ensure_ascii=False)
+
+    write_log(combined_response, "Combined", input_filename, config)
+
+
 def postprocess(input_filename: Path, config: Config) -> None:
     """Write all annotations for this program file in feedback file. Localize
     each feedback with line number and corresponding program text at this line number.
@@ -245,7 +428,7 @@ def postprocess(input_filename: Path, config: Config) -> None:
     Return:
       None
     """
-    json_file = config.intermediate_path / f"{input_filename.stem}_final.json"
+    json_file = intermediate_file(input_filename, config, "final.json")
 
     with open(json_file, "r", encoding="utf-8") as f:
         json_content = json.load(f)
@@ -275,28 +458,22 @@ def postprocess(input_filename: Path, config: Config) -> None:
             f"\n/*============================{input_filename.name}============="
             f"============================/*\n"
         )
-        i = 0
+        # Take each line's number from its 'N | ' prefix rather than counting,
+        # since in "hunks" scope the processed file has gaps.
         for line in f_input:
-            i += 1
+            number, _, text = line.partition(" | ")
+            if not number.isdigit():
+                continue  # an omitted-lines marker
+            i = int(number)
             if i in annotation_dict:
                 comment = annotation_dict[i]
                 comment = "\n" + comment + "\n"
                 f_output.write(comment)
-                f_output.write(f"line {i}: {line[2:]}")
-
+                f_output.write(f"line {i}: {text}")
 
-def generate_file_feedback(input_filename: Path, config: Config) -> None:
-    """Generates and writes feedback for this program file.
 
-    Calls Proposer, Reviewer, and postprocessing modules in sequence.
-
-    Args:
-      input_filename: Path object containing relative path of program file
-      config: Instance of Config class that gives path to problem statement
-        and rubric.
-    Returns:
-      None
-    """
+def read_assignment(config: Config) -> Tuple[str, str]:
+    """Returns the problem statement and rubric named in config."""
     try:
         with open(config.problem_statement, "r", encoding="utf-8") as f:
             problem_statement = f.read()
@@ -311,14 +488,116 @@ def generate_file_feedback(input_filename: Path, config: Config) -> None:
         print(f"Error: {config.rubric} not found")
         sys.exit(1)
 
+    return problem_statement, rubric
+
+
+def feedback_key(input_filename: Path, config: Config, lint_output: str = "") -> str:
+    """Returns the cache key of this program file's feedback, or None without a
+    cache. The key covers the lint output and, if there is any, the model that
+    summarizes it for the Reviewer."""
+    if cache is None:
+        return None
+    problem_statement, rubric = read_assignment(config)
+    with open(input_filename, "r", encoding="utf-8") as f:
+        submission_program = f.read()
+    return cache.key(
+        submission_program,
+        problem_statement,
+        rubric,
+        config.proposer_reviewer,
+        f"{config.summarizer}\n{lint_output}" if lint_output else "",
+    )
+
+
+def generate_file_feedback(
+    input_filename: Path,
+    config: Config,
+    lint_output: str = "",
+    linter_summary: str = None,
+) -> None:
+    """Generates feedback for this program file.
+
+    Calls Proposer and Reviewer in sequence, or the one combined call with
+    REVIEW_MODE="combined", unless the cache already has their results for this
+    exact input. Runs on a worker thread; the caller postprocesses the final
+    annotations once earlier files are written.
+
+    Args:
+      input_filename: Path object containing relative path of program file
+      config: Instance of Config class that gives path to problem statement
+        and rubric.
+      lint_output: clang-tidy output for this file, part of the cache key
+      linter_summary: summary of lint_output for the Reviewer, or None
+    Returns:
+      None
+    """
+    problem_statement, rubric = read_assignment(config)
+
     with open(input_filename, "r", encoding="utf-8") as f:
         submission_program = f.read()
-    call_proposer(problem_statement, rubric, submission_program, input_filename, config)
-    call_reviewer(problem_statement, rubric, submission_program, input_filename, config)
 
-    postprocess(input_filename, config)
+    key = feedback_key(input_filename, config, lint_output)
+    if key is not None:
+        with metrics.stage("cache_load", input_filename):
+            hit = cache.load(key, input_filename, config)
+    if key is not None and hit:
+        print(f"Cached feedback found for {input_filename}.")
+        return
+
+    if config.review_mode == "combined":
+        call_combined(
+            problem_statement,
+            rubric,
+            submission_program,
+            input_filename,
+            config,
+            linter_summary,
+        )
+    else:
+        call_proposer(
+            problem_statement, rubric, submission_program, input_filename, config
+        )
+        call_reviewer(
+            problem_statement,
+            rubric,
+            submission_program,
+            input_filename,
+            config,
+            linter_summary,
+        )
+
+    if key is not None:
+        cache.store(key, input_filename, config)
+
 
-    print(f"Feedback generation complete for {input_filename}. Output saved.")
+def collect_files(
+    source_repo: Path, target_repo: Path, config: Config
+) -> List[Tuple[Path, Path]]:
+    """Diffs the repos and preprocesses every file to give feedback on: new files
+    first, then modified files with at least THRESHOLD changed lines.
+
+    Returns:
+        (processed program file under intermediates/, file in target repo)
+        for each file, in order.
+    """
+    with metrics.stage("diff"):
+        added, modified = diff_repos(source_repo, target_repo, config)
+    processed_filenames = []
+
+    # Collect new files (files only in target_repo)
+    for input_filename in added:
+        with metrics.stage("preprocess", input_filename):
+            processed = preprocess_program(input_filename, config)
+        processed_filenames.append((processed, input_filename))
+
+    # Collect modified files
+    for input_filename, hunk_set in modified:
+        if len(hunk_set) < THRESHOLD:
+            continue
+        with metrics.stage("preprocess", input_filename):
+            processed = preprocess_program(input_filename, config, hunk_set)
+        processed_filenames.append((processed, input_filename))
+    return processed_filenames
 
 
 def main() -> None:
@@ -327,23 +606,37 @@ def main() -> None:
     to files in source repo, along with completely new program files not present
     in source repo.
 
-    To identify newly added files and modified files, we run diff tool between
-    source and target repo and generate diff output in unified format.
+    To identify newly added files and modified files, we diff the source files
+    of source and target repo (diff_repos), which also gives the changed lines.
 
-    The newly added files and modified files are handled separately in this main
-    function, but the pipeline is essentially identical.
+    The newly added files and modified files are found separately in this main
+    function, but the pipeline is essentially identical. Their Proposer/Reviewer
+    chains run concurrently; feedback is appended to the output file in the order
+    the files were found, new files first.
     """
     parser = argparse.ArgumentParser()
     parser.add_argument("source_repo_path", help="Path of original repo (source)")
     parser.add_argument("target_repo_path", help="Path of modified repo (target)")
+    parser.add_argument(
+        "--no-cache", action="store_true", help="Ignore and don't update the cache"
+    )
+    parser.add_argument(
+        "--lint", action="store_true", help="Give the Reviewer clang-tidy output"
+    )
     args = parser.parse_args()
     source_repo = Path(args.source_repo_path)
     target_repo = Path(args.target_repo_path)
 
     config = Config(target_repo, "config_repo.env")
 
-    global client
+    global client, limiter, cache
     client = OpenAI()
+    limiter = RateLimiter(config.requests_per_min, config.tokens_per_min)
+    if not args.no_cache:
+        kind = "repo-lint" if args.lint else "repo"
+        if config.review_mode == "combined":
+            kind += "-combined"
+        cache = FeedbackCache(config.cache_path, kind)
 
     # Clear existing contents under intermediates/ and output/
     if os.path.exists(config.intermediate_path):
@@ -354,40 +647,68 @@ def main() -> None:
     # Create destination folders under intermediates/ and output/
     os.makedirs(config.intermediate_path, exist_ok=True)
     os.makedirs(config.output_path, exist_ok=True)
-
-    diff_filename = run_diff(source_repo, target_repo, config)
-
-    # Generate feedback for new files (files only in target_repo)
-    target_str = "Only in " + str(target_repo)
-    with open(diff_filename, "r", encoding="utf-8") as f:
-        for line in f:
-            if target_str in line:
-                filename = line.split()[-1]
-                if filename.endswith(PROGRAM_LANG):
-                    input_filename = target_repo / filename
-                    processed_input_filename = preprocess_program(
-                        input_filename, config
-                    )
-                    generate_file_feedback(processed_input_filename, config)
-
-    # Generate feedback for modified files
-    patch = PatchSet.from_filename(diff_filename)
-    for p in patch:
-        if Path(p.source_file).suffix == PROGRAM_LANG:
-            hunk_set = set()
-
-            for hunk in p:
-                for i in range(hunk.target_length):
-                    hunk_set.add(hunk.target_start + i)
-
-            if len(hunk_set) < THRESHOLD:
-                continue
-
-            input_filename = Path(p.target_file)
-            processed_input_filename = preprocess_program(
-                input_filename, config, hunk_set
+    metrics.open(config.output_path / "metrics.jsonl", config)
+
+    files = collect_files(source_repo, target_repo, config)
+    processed_filenames = [processed for processed, _ in files]
+
+    # Lint all files in parallel, then summarize the output of those whose
+    # feedback is not cached, a batch of files per LLM call
+    lint_outputs, summaries = {}, {}
+    if args.lint:
+        with metrics.stage("lint"):
+            outputs = lint_files(
+                [target for _, target in files if target.suffix == PROGRAM_LANG],
+                target_repo,
+                load_compile_flags(source_repo),
+                config,
+            )
+        # Headers are reviewed without lint output: most need the includes a
+        # .c file puts before them, so clang-tidy on its own would report only
+        # the missing types.
+        for processed, target in files:
+            if target in outputs:
+                lint_outputs[processed] = outputs[target]
+                linter_file = intermediate_file(processed, config, "linter_out.txt")
+                with open(linter_file, "w", encoding="utf-8") as f:
+                    f.write(outputs[target])
+        uncached = {
+            processed.name: lint_outputs[processed]
+            for processed in lint_outputs
+            if cache is None
+            or not cache.has(feedback_key(processed, config, lint_outputs[processed]))
+        }
+        try:
+            with metrics.stage("lint_summary"):
+                summaries = summarize_lints(client, limiter, uncached, config)
+        except Exception as api_error:
+            print(f"API call error for linter summary: {str(api_error)}")
+            sys.exit(1)
+
+    # Run the Proposer/Reviewer chains concurrently, but postprocess in the
+    # order the files were collected so feedback.c is deterministic.
+    with ThreadPoolExecutor(max_workers=config.max_workers) as executor:
+        futures = [
+            executor.submit(
+                generate_file_feedback,
+                filename,
+                config,
+                lint_outputs.get(filename, ""),
+                summaries.get(filename.name),
             )
-            generate_file_feedback(processed_input_filename, config)
+            for filename in processed_filenames
+        ]
+        try:
+            for filename, future in zip(processed_filenames, futures):
+                future.result()
+                with metrics.stage("postprocess", filename):
+                    postprocess(filename, config)
+                print(f"Feedback generation complete for {filename}. Output saved.")
+        except BaseException:
+            executor.shutdown(wait=False, cancel_futures=True)
+            raise
+
+    metrics.finish()
 
 
 if __name__ == "__main__":
@@ -11,6 +11,10 @@ statement and rubric (what make good quality code?) as context. A reviewer then
 reflects on these annotations to generate final feedback and also integrates
 output from clang-tidy linter run on the program file.
 
+Proposer/Reviewer results are cached by content (see FeedbackCache); on a hit
+the linter summary, Proposer and Reviewer are skipped. Pass --no-cache to skip
+the cache.
+
 Please make sure that config.env contains appropriate path values.
 
 Typical usage example:
@@ -23,7 +27,6 @@ import datetime
 import json
 import os
 import shutil
-import subprocess
 import sys
 import textwrap
 from pathlib import Path
@@ -34,10 +37,17 @@ from pydantic import BaseModel, Field
 from feedback_utils import (
     Annotation,
     Config,
+    FeedbackCache,
+    RateLimiter,
     create_proposer_prompt,
     create_reviewer_prompt,
     create_system_prompt,
+    intermediate_file,
+    lint_files,
+    load_compile_flags,
+    metrics,
     preprocess_program,
+    summarize_lints,
     write_log,
 )
 
@@ -47,60 +57,63 @@ ANNOTATION_SUFFIX = "\n */"
 PROGRAM_LANG = ".c"  # What is the programming language of submission?
 
 client = None
+limiter = None
+cache = None  # FeedbackCache, or None with --no-cache
 
 # ===================== UTILS ====================================
 
 
 def run_linter(input_filename: Path, config: Config) -> str:
-    """Calls clang-tidy linter on the C program file and makes LLM call to
-        summarize the linter output in a more readable format.
+    """Calls clang-tidy linter on the C program file and saves its output to
+        intermediates/.
 
-    It helps to use LLM as summarizer since otherwise linter output is cluttered
-        with pathnames.
+    Uses the flags from a compile_commands.json next to the file if there is
+        one, and the cached output if the file and check set have not changed
+        (see lint_files in feedback_utils.py).
 
     Args:
         input_filename: Path object containing relative path to the program file
             submission
-        config: Instance of Config class that specifies the model of summary LLM
+        config: Instance of Config class that gives the intermediates/ path
 
     Returns:
-        summary of linter output as string.
+        linter output as string.
     """
-    process = subprocess.Popen(
-        ["clang-tidy", str(input_filename), "--", "-std=gnu11"],
-        stdout=subprocess.PIPE,
-        stderr=subprocess.PIPE,
-        text=True,
-    )
-    linter_output, error_output = process.communicate()
+    repo = input_filename.parent
+    linter_output = lint_files(
+        [input_filename], repo, load_compile_flags(repo), config
+    )[input_filename]
 
-    linter_filename = config.intermediate_path / f"{input_filename.stem}_linter_out.txt"
+    linter_filename = intermediate_file(input_filename, config, "linter_out.txt")
 
     with open(linter_filename, "w") as f:
         f.write(linter_output)
+    return linter_output
 
-    if process.returncode != 0:
-        print(f"clang-tidy exited with code {process.returncode}: {error_output}")
-        sys.exit(1)
 
+def summarize_linter(input_filename: Path, linter_output: str, config: Config) -> str:
+    """Makes LLM call to summarize the linter output in a more readable format.
+
+    It helps to use LLM as summarizer since otherwise linter output is cluttered
+        with pathnames.
+
+    Args:
+        input_filename: Path object containing relative path to the program file
+            submission
+        linter_output: output of run_linter() for the file
+        config: Instance of Config class that specifies the model of summary LLM
+
+    Returns:
+        summary of linter output as string.
+    """
     try:
-        response = client.responses.create(
-            model=config.summarizer,
-            input=[
-                {
-                    "role": "user",
-                    "content": f"The following is output from a linter. Please "
-                    f"retain the essential points only. These will be used "
-                    f"to guide an LLM-based automated programming feedback tool",
-                },
-                {"role": "user", "content": linter_output},
-            ],
+        summaries = summarize_lints(
+            client, limiter, {input_filename.name: linter_output}, config
         )
     except Exception as api_error:
-        print(f"API call error for proposer: {str(api_error)}")
+        print(f"API call error for linter summary: {str(api_error)}")
         sys.exit(1)
-
-    return response.output_text
+    return summaries.get(input_filename.name, "")
 
 
 # ========================= STRUCTURED OUTPUT SCHEMA ================
@@ -190,7 +203,7 @@ def call_proposer(
 
     initial_feedback = proposer_response.output_parsed
 
-    json_file = config.intermediate_path / f"{input_filename.stem}_intermediate.json"
+    json_file = intermediate_file(input_filename, config, "intermediate.json")
 
     with open(json_file, "w") as f:
         json.dump(initial_feedback.model_dump(), f, indent=4, ensure_ascii=False)
@@ -223,7 +236,7 @@ def call_reviewer(
       None
     """
 
-    json_file = config.intermediate_path / f"{input_filename.stem}_intermediate.json"
+    json_file = intermediate_file(input_filename, config, "intermediate.json")
 
     try:
         with open(json_file, "r") as f:
@@ -260,7 +273,7 @@ def call_reviewer(
 
     refined_feedback = reviewer_response.output_parsed
 
-    json_file = config.intermediate_path / f"{input_filename.stem}_final.json"
+    json_file = intermediate_file(input_filename, config, "final.json")
 
     with open(json_file, "w") as f:
         json.dump(refined_feedback.model_dump(), f, indent=4, ensure_ascii=False)
@@ -281,7 +294,7 @@ def postprocess(input_filename: Path, config: Config):
       None
     """
 
-    json_file = config.intermediate_path / f"{input_filename.stem}_final.json"
+    json_file = intermediate_file(input_filename, config, "final.json")
 
     with open(json_file, "r", encoding="utf-8") as f:
         json_content = json.load(f)
@@ -354,15 +367,19 @@ def postprocess(input_filename: Path, config: Config):
 
 
 def generate_file_feedback(
-    input_filename: Path, linter_summary: str, config: Config
+    input_filename: Path, program_filename: Path, config: Config
 ) -> None:
-    """Generates and writes feedback for this program file.
+    """Generates feedback for this program file.
 
-    Calls Proposer, Reviewer, and postprocessing modules in sequence.
+    Calls linter, Proposer and Reviewer in sequence. The Proposer and Reviewer
+    are skipped if the cache already has their results for this exact input,
+    which includes the linter output and the model that summarizes it.
 
     Args:
-      input_filename: Path object containing relative path of program file
-      linter_summary: string containing clean summary of clang-tidy linter output
+      input_filename: Path object containing relative path of processed program
+        file
+      program_filename: Path object containing relative path of the original
+        program file, for the linter
       config: Instance of Config class that gives path to problem statement
         and rubric.
     Returns:
@@ -384,15 +401,42 @@ def generate_file_feedback(
 
     with open(input_filename, "r", encoding="utf-8") as f:
         submission_program = f.read()
-    call_proposer(problem_statement, rubric, submission_program, input_filename, config)
-    call_reviewer(
-        problem_statement,
-        rubric,
-        submission_program,
-        linter_summary,
-        input_filename,
-        config,
-    )
+
+    # Run linter on program file; its summary goes to the Reviewer
+    with metrics.stage("lint", program_filename):
+        linter_output = run_linter(program_filename, config)
+
+    if cache is not None:
+        key = cache.key(
+            submission_program,
+            problem_statement,
+            rubric,
+            config.proposer_reviewer,
+            f"{config.summarizer}\n{linter_output}",
+        )
+        if cache.load(key, input_filename, config):
+            print(f"Cached feedback found for {program_filename}.")
+            return
+
+    with metrics.stage("lint_summary", program_filename):
+        linter_summary = summarize_linter(program_filename, linter_output, config)
+
+    with metrics.stage("proposer", input_filename):
+        call_proposer(
+            problem_statement, rubric, submission_program, input_filename, config
+        )
+    with metrics.stage("reviewer", input_filename):
+        call_reviewer(
+            problem_statement,
+            rubric,
+            submission_program,
+            linter_summary,
+            input_filename,
+            config,
+        )
+
+    if cache is not None:
+        cache.store(key, input_filename, config)
 
 
 def main():
@@ -402,13 +446,19 @@ def main():
     """
     parser = argparse.ArgumentParser()
     parser.add_argument("program_filepath", help="Path of program file to be evaluated")
+    parser.add_argument(
+        "--no-cache", action="store_true", help="Ignore and don't update the cache"
+    )
     args = parser.parse_args()
     input_filename = Path(args.program_filepath)
 
     config = Config(input_filename, "config_single.env")
 
-    global client
+    global client, limiter, cache
     client = OpenAI()
+    limiter = RateLimiter(config.requests_per_min, config.tokens_per_min)
+    if not args.no_cache:
+        cache = FeedbackCache(config.cache_path, "single")
 
     # Clear existing contents under intermediates/ and output/
     if os.path.exists(config.intermediate_path):
@@ -419,15 +469,16 @@ def main():
     # Create destination folders under intermediates/ and output/
     os.makedirs(config.intermediate_path, exist_ok=True)
     os.makedirs(config.output_path, exist_ok=True)
+    metrics.open(config.output_path / "metrics.jsonl", config)
 
-    # Run linter on program file and summarize linter output
-    linter_summary = run_linter(input_filename, config)
-
-    processed_input_filename = preprocess_program(input_filename, config)
-    generate_file_feedback(processed_input_filename, linter_summary, config)
+    with metrics.stage("preprocess", input_filename):
+        processed_input_filename = preprocess_program(input_filename, config)
+    generate_file_feedback(processed_input_filename, input_filename, config)
 
-    postprocess(input_filename, config)
+    with metrics.stage("postprocess", input_filename):
+        postprocess(input_filename, config)
     print(f"Feedback generation complete for {input_filename}. Output saved.")
+    metrics.finish()
 
 
 if __name__ == "__main__":
@@ -0,0 +1,191 @@
+// NUMA topology from the ACPI System Resource Affinity Table.
+// Search memory for ACPI description structures.
+//
+// The SRAT gives the proximity domain of each cpu, by local
+// APIC ID, and of each range of physical memory.  acpiinit()
+// numbers the domains it sees from 0 as NUMA nodes, sets each
+// cpu's node, and keeps the memory ranges for physnode(), by
+// which kalloc.c sorts free pages.  Without an SRAT, or with
+// one it can't read, everything is on node 0.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "acpi.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+
+#define NMEMRANGE 16
+
+// Physical memory [start, end) is on node node.
+static struct memrange {
+  uint start;
+  uint end;
+  int node;
+} memranges[NMEMRANGE];
+static int nmemrange;
+
+int nnode = 1;
+
+static uchar
+sum(uchar *addr, int len)
+{
+  int i, sum;
+
+  sum = 0;
+  for(i=0; i<len; i++)
+    sum += addr[i];
+  return sum;
+}
+
+// Look for an RSDP in the len bytes at addr.
+static struct acpirsdp*
+rsdpsearch1(uint a, int len)
+{
+  uchar *e, *p, *addr;
+
+  addr = P2V(a);
+  e = addr+len;
+  for(p = addr; p < e; p += 16)
+    if(memcmp(p, "RSD PTR ", 8) == 0 && sum(p, sizeof(struct acpirsdp)) == 0)
+      return (struct acpirsdp*)p;
+  return 0;
+}
+
+// The RSDP is on a 16-byte boundary in the first KB of the
+// EBDA or in the BIOS ROM between 0xE0000 and 0xFFFFF.
+static struct acpirsdp*
+rsdpsearch(void)
+{
+  uchar *bda;
+  uint p;
+  struct acpirsdp *rsdp;
+
+  bda = (uchar *) P2V(0x400);
+  if((p = ((bda[0x0F]<<8)| bda[0x0E]) << 4))
+    if((rsdp = rsdpsearch1(p, 1024)))
+      return rsdp;
+  return rsdpsearch1(0xE0000, 0x20000);
+}
+
+// Map the table at physical address pa, if the kernel maps
+// all of it, and check it.
+static struct acpisdt*
+sdtmap(uint pa, char *sig)
+{
+  struct acpisdt *t;
+
+  if(pa + sizeof(*t) < pa || pa + sizeof(*t) > phystop)
+    return 0;
+  t = (struct acpisdt*)P2V(pa);
+  if(memcmp(t->signature, sig, 4) != 0 || pa + t->length < pa ||
+     pa + t->length > phystop || sum((uchar*)t, t->length) != 0)
+    return 0;
+  return t;
+}
+
+// Find the SRAT through the RSDT.
+static struct acpisrat*
+sratfind(void)
+{
+  struct acpirsdp *rsdp;
+  struct acpisdt *rsdt, *t;
+  uint *p, *e;
+
+  if((rsdp = rsdpsearch()) == 0 || (rsdt = sdtmap(rsdp->rsdtaddr, "RSDT")) == 0)
+    return 0;
+  e = (uint*)((uchar*)rsdt + rsdt->length);
+  for(p = (uint*)(rsdt+1); p < e; p++)
+    if((t = sdtmap(*p, "SRAT")) != 0)
+      return (struct acpisrat*)t;
+  return 0;
+}
+
+// The node number of proximity domain dom, numbering new
+// domains in the order found.  Domains past NNODE share the
+// last node.
+static int
+domnode(uint dom, uint *doms)
+{
+  int i;
+
+  for(i = 0; i < nnode; i++)
+    if(doms[i] == dom)
+      return i;
+  if(nnode == NNODE)
+    return NNODE-1;
+  doms[nnode] = dom;
+  return nnode++;
+}
+
+// Call after mpinit(), which finds the cpus, and before
+// kinit2() hands out the memory the tables are in.
+void
+acpiinit(void)
+{
+  struct acpisrat *srat;
+  struct sratcpu *sc;
+  struct sratmem *sm;
+  struct memrange *m;
+  uchar *p, *e;
+  uint doms[NNODE];
+  int i;
+
+  if((srat = sratfind()) == 0)
+    return;
+  nnode = 0;
+  for(p=(uchar*)(srat+1), e=(uchar*)srat+srat->hdr.length; p+2 <= e && p[1] > 0; p += p[1]){
+    switch(*p){
+    case SRATCPU:
+      sc = (struct sratcpu*)p;
+      if(!(sc->flags & SRAT_ENABLED))
+        break;
+      for(i = 0; i < ncpu; i++)
+        if(cpus[i].apicid == sc->apicid)
+          cpus[i].node = domnode(sc->domainlo | sc->domainhi[0] << 8 |
+                                 sc->domainhi[1] << 16 | sc->domainhi[2] << 24, doms);
+      break;
+    case SRATMEM:
+      sm = (struct sratmem*)p;
+      // The kernel only uses memory below 4GB.
+      if(!(sm->flags & SRAT_ENABLED) || sm->basehi != 0 || nmemrange == NMEMRANGE)
+        break;
+      m = &memranges[nmemrange++];
+      m->start = sm->baselo;
+      m->end = sm->lenhi != 0 || sm->baselo + sm->lenlo < sm->baselo ?
+               0xFFFFFFFF : sm->baselo + sm->lenlo;
+      m->node = domnode(sm->domain, doms);
+      break;
+    }
+  }
+  if(nnode == 0)
+    nnode = 1;
+  KLOG(KL_INFO, "acpi: %d numa nodes\n", nnode);
+}
+
+// The node of physical address pa.  If end is not 0, set
+// *end to where the range of memory holding pa stops, or the
+// next range starts, so that [pa, *end) is all on the node.
+int
+physnode(uint pa, uint *end)
+{
+  struct memrange *m;
+  uint e;
+  int node;
+
+  node = 0;
+  e = 0xFFFFFFFF;
+  for(m = memranges; m < &memranges[nmemrange]; m++){
+    if(m->start <= pa && pa < m->end){
+      node = m->node;
+      if(m->end < e)
+        e = m->end;
+    } else if(pa < m->start && m->start < e)
+      e = m->start;
+  }
+  if(end)
+    *end = e;
+  return node;
+}
@@ -0,0 +1,59 @@
+// See ACPI Specification 6.x, sections 5.2.5 to 5.2.16.
+
+struct acpirsdp {       // root system description pointer
+  uchar signature[8];           // "RSD PTR "
+  uchar checksum;               // first 20 bytes must add up to 0
+  uchar oemid[6];
+  uchar revision;               // 0 for ACPI 1.0
+  uint rsdtaddr;                // phys addr of the RSDT
+};
+
+struct acpisdt {        // header of every system description table
+  uchar signature[4];           // "RSDT", "SRAT", ...
+  uint length;                  // of the whole table
+  uchar revision;
+  uchar checksum;               // all bytes must add up to 0
+  uchar oemid[6];
+  uchar oemtableid[8];
+  uint oemrevision;
+  uint creatorid;
+  uint creatorrevision;
+};
+
+struct acpisrat {       // system resource affinity table
+  struct acpisdt hdr;           // "SRAT"
+  uint reserved1;               // 1
+  uchar reserved2[8];
+};                              // then the entries below
+
+struct sratcpu {        // processor local APIC affinity entry
+  uchar type;                   // entry type (0)
+  uchar length;                 // 16
+  uchar domainlo;               // bits 0-7 of the proximity domain
+  uchar apicid;                 // local APIC ID
+  uint flags;                   // SRAT_ENABLED
+  uchar sapiceid;
+  uchar domainhi[3];            // bits 8-31 of the proximity domain
+  uint clockdomain;
+};
+
+struct sratmem {        // memory affinity entry
+  uchar type;                   // entry type (1)
+  uchar length;                 // 40
+  uint domain;                  // proximity domain
+  ushort reserved1;
+  uint baselo;                  // physical base address
+  uint basehi;
+  uint lenlo;                   // length in bytes
+  uint lenhi;
+  uint reserved2;
+  uint flags;                   // SRAT_ENABLED
+  uchar reserved3[8];
+} __attribute__((packed));
+
+// SRAT entry types
+#define SRATCPU   0x00  // One per processor
+#define SRATMEM   0x01  // One per memory range
+
+// SRAT entry flags
+#define SRAT_ENABLED 0x01  // Ignore the entry if clear
@@ -0,0 +1,122 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include "types.h"
+
+// Atomic operations for user programs.  All of them are full
+// barriers, as locked x86 instructions are, except the plain
+// load_acquire() and store_release(): x86 keeps loads in order
+// with later accesses and stores in order with earlier ones, so
+// those only need to stop the compiler reordering.
+
+// Atomically add val to *addr; returns the value *addr held before.
+static inline uint
+xadd(volatile uint *addr, uint val)
+{
+  asm volatile("lock; xaddl %0, %1"
+               : "+r" (val), "+m" (*addr) // val in/out, *addr in/out
+               : // no pure inputs
+               : "memory");
+  return val; // xaddl returns the original value of *addr
+}
+
+// Atomically subtract val from *addr; returns the value before.
+static inline uint
+xsub(volatile uint *addr, uint val)
+{
+  return xadd(addr, -val);
+}
+
+// Atomically store val in *addr and return the old value.
+static inline uint
+xchg(volatile uint *addr, uint val)
+{
+  asm volatile("lock; xchgl %0, %1"
+               : "+r" (val), "+m" (*addr)
+               :
+               : "memory");
+  return val;
+}
+
+// Atomically replace *addr with new if it holds old.
+// Returns the value *addr held before.
+static inline uint
+cmpxchg(volatile uint *addr, uint old, uint new)
+{
+  uint prev;
+
+  asm volatile("lock; cmpxchgl %2, %1"
+               : "=a" (prev), "+m" (*addr)
+               : "r" (new), "0" (old)
+               : "memory");
+  return prev;
+}
+
+// cmpxchg() on 8 bytes, which need not be one value: a pointer
+// and a count, say.  addr must be 8-byte aligned.
+static inline unsigned long long
+cmpxchg64(volatile unsigned long long *addr, unsigned long long old,
+          unsigned long long new)
+{
+  unsigned long long prev;
+
+  asm volatile("lock; cmpxchg8b %1"
+               : "=A" (prev), "+m" (*addr)
+               : "b" ((uint)new), "c" ((uint)(new >> 32)), "0" (old)
+               : "memory");
+  return prev;
+}
+
+// Whether cmpxchg() replaced old with new.
+static inline int
+cas(volatile uint *addr, uint old, uint new)
+{
+  return cmpxchg(addr, old, new) == old;
+}
+
+// Atomically or bits into *addr; returns the value before.
+static inline uint
+fetch_or(volatile uint *addr, uint bits)
+{
+  uint old;
+
+  do
+    old = *addr;
+  while (!cas(addr, old, old | bits));
+  return old;
+}
+
+// *addr, read before any loads or stores that follow it.
+static inline uint
+load_acquire(volatile uint *addr)
+{
+  uint v = *addr;
+
+  asm volatile("" ::: "memory");
+  return v;
+}
+
+// Store val in *addr after all loads and stores before it.
+static inline void
+store_release(volatile uint *addr, uint val)
+{
+  asm volatile("" ::: "memory");
+  *addr = val;
+}
+
+// Order everything before against everything after, including
+// a store before against a load after, which x86 alone does not.
+static inline void
+mfence(void)
+{
+  asm volatile("mfence" ::: "memory");
+}
+
+// Spin-wait hint.
+static inline void
+cpu_relax(void)
+{
+  asm volatile("pause" ::: "memory");
+}
+
+#endif
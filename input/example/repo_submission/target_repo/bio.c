@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,33 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To start reading a block that will be wanted soon,
+//     call bprefetch.  It doesn't wait for the disk.
+// * breadasync and bwriteasync start a read or write and
+//     return with the buffer locked; call bwait before using
+//     the data or releasing the buffer.  Many can be in flight.
+//
+// The buffers are kept in a hash table by (dev, blockno), each
+// bucket with its own lock, so looking up different blocks on
+// different cpus doesn't contend.  Only one cpu at a time
+// recycles buffers, holding bcache.evict.
+//
+// Recycling is scan resistant, in the manner of 2Q: a buffer is
+// cold until it is found in the cache a second time, and cold
+// buffers are recycled before hot ones, least recently released
+// first.  So reading through a big file, which uses each block
+// once, doesn't push out the blocks in steady use.  Metadata
+// blocks (everything before the data blocks) start out hot.
+// Hot buffers are only recycled first if they fill more than
+// three quarters of the cache.
+//
+// binit() sets up NBUF buffers; once all of memory is free to
+// allocate, bgrow() adds more in proportion to its size.
+//
+// A buffer's data is normally its own space[], but a disk held
+// in memory (memide.c) lends the cache its blocks instead: see
+// idemap().  Such a buffer is valid as soon as it is bound to
+// its block, and writing it changes the disk at once.
 //
 // The implementation uses two state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
@@ -21,75 +48,280 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "fs.h"
 #include "buf.h"
+#include "counter.h"
 
-struct {
+#define NBUCKET 61
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;   // list through prev/next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock evict;  // serializes recycling
+  struct buf buf[NBUF];
+  struct buf raw;         // for bwriteraw(), not in the cache
+  struct bucket bucket[NBUCKET];
+  int nbuf;
+  int nwait;              // bget()s waiting for a free buffer
 } bcache;
 
+static struct bucket*
+bbucket(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 7 + blockno) % NBUCKET];
+}
+
+// Insert b at the front of bucket k's list.
+// Caller must hold k->lock.
+static void
+binsert(struct bucket *k, struct buf *b)
+{
+  b->next = k->head.next;
+  b->prev = &k->head;
+  k->head.next->prev = b;
+  k->head.next = b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *k;
 
-  initlock(&bcache.lock, "bcache");
+  initlock(&bcache.evict, "bcache");
+  for(k = bcache.bucket; k < bcache.bucket+NBUCKET; k++){
+    initlock(&k->lock, "bcache.bucket");
+    k->head.prev = &k->head;
+    k->head.next = &k->head;
+  }
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // All buffers start out in the first bucket.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = b->space;
+    binsert(&bcache.bucket[0], b);
   }
+  bcache.nbuf = NBUF;
+  initsleeplock(&bcache.raw.lock, "buffer");
+  bcache.raw.data = bcache.raw.space;
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf*
-bget(uint dev, uint blockno)
+// Number of buffers in the cache.
+int
+bufcount(void)
+{
+  return bcache.nbuf;
+}
+
+// Add buffers to the cache, 1/BCACHEFRAC of physical memory's
+// worth, up to NBUFMAX in all.  Called once kinit2() has made all
+// of memory available.
+void
+bgrow(void)
 {
+  static struct kmcache bufcache;
   struct buf *b;
+  uint n;
 
-  acquire(&bcache.lock);
+  kmcacheinit(&bufcache, "buf", sizeof(struct buf), 0);
+  for(n = phystop/BCACHEFRAC/bufcache.slot; n > 0 && bcache.nbuf < NBUFMAX; n--){
+    if((b = slaballoc(&bufcache)) == 0)
+      break;
+    memset(b, 0, sizeof(*b));
+    initsleeplock(&b->lock, "buffer");
+    b->data = b->space;
+    acquire(&bcache.bucket[0].lock);
+    binsert(&bcache.bucket[0], b);
+    bcache.nbuf++;
+    release(&bcache.bucket[0].lock);
+  }
+}
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+// Is blockno a metadata block: boot, super, log, inode
+// or bitmap?
+static int
+bmeta(uint blockno)
+{
+  return blockno < sb.size - sb.nblocks;
+}
+
+// Find the cached block in bucket k and take a reference.
+// Caller must hold k->lock.
+static struct buf*
+blookup(struct bucket *k, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = k->head.next; b != &k->head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      b->hot = 1;
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+// Take a buffer that is not in use out of its bucket, sleeping
+// until there is one if wait is set, else returning 0.
+// Caller must hold bcache.evict.
+static struct buf*
+bvictim(int wait)
+{
+  struct buf *b, *cold, *hot;
+  struct bucket *k;
+  int nhot, waiting;
+
+  waiting = 0;
+  for(;;){
+    cold = hot = 0;
+    nhot = 0;
+    for(k = bcache.bucket; k < bcache.bucket+NBUCKET; k++){
+      acquire(&k->lock);
+      for(b = k->head.next; b != &k->head; b = b->next){
+        nhot += b->hot;
+        // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+        // because log.c has modified it but not yet committed it.
+        if(b->refcnt != 0 || (b->flags & B_DIRTY) != 0)
+          continue;
+        if(b->hot){
+          if(hot == 0 || b->lastuse < hot->lastuse)
+            hot = b;
+        } else if(cold == 0 || b->lastuse < cold->lastuse)
+          cold = b;
+      }
+      release(&k->lock);
+    }
+
+    b = cold;
+    if(hot && (b == 0 || nhot > bcache.nbuf - bcache.nbuf/4))
+      b = hot;
+    if(b == 0 && !wait)
+      return 0;
+    if(b == 0){
+      // Say we are waiting before looking once more, so
+      // brelse() can't free a buffer unseen in between.
+      if(waiting)
+        sleep(&bcache, &bcache.evict);
+      else {
+        bcache.nwait++;
+        waiting = 1;
+      }
+      continue;
+    }
+
+    // Nobody can move b to another bucket while we hold
+    // bcache.evict, but it may have been used since the scan.
+    k = bbucket(b->dev, b->blockno);
+    acquire(&k->lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0){
+      b->next->prev = b->prev;
+      b->prev->next = b->next;
+      release(&k->lock);
+      if(waiting)
+        bcache.nwait--;
       return b;
     }
+    release(&k->lock);
+  }
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer, or return 0 if none is
+// free and wait is not set.  In either case, return the
+// buffer with a reference taken but not locked.
+static struct buf*
+bgetref(uint dev, uint blockno, int wait)
+{
+  struct buf *b;
+  struct bucket *k;
+
+  k = bbucket(dev, blockno);
+  acquire(&k->lock);
+
+  // Is the block already cached?
+  if((b = blookup(k, dev, blockno)) != 0){
+    release(&k->lock);
+    cntadd(CNT_BHIT, 1);
+    return b;
+  }
+  release(&k->lock);
+
+  // Not cached; recycle an unused buffer.  Look again once
+  // holding bcache.evict, in case another cpu just read the
+  // block in; after that nobody else can add it.
+  acquire(&bcache.evict);
+  acquire(&k->lock);
+  if((b = blookup(k, dev, blockno)) != 0){
+    release(&k->lock);
+    release(&bcache.evict);
+    cntadd(CNT_BHIT, 1);
+    return b;
+  }
+  release(&k->lock);
+
+  if((b = bvictim(wait)) == 0){
+    release(&bcache.evict);
+    return 0;
+  }
+  cntadd(CNT_BMISS, 1);
+  b->dev = dev;
+  b->blockno = blockno;
+  if((b->data = idemap(dev, blockno)) != 0)
+    b->flags = B_VALID;
+  else {
+    b->data = b->space;
+    b->flags = 0;
+  }
+  b->refcnt = 1;
+  b->hot = bmeta(blockno);
+  acquire(&k->lock);
+  binsert(k, b);
+  release(&k->lock);
+  release(&bcache.evict);
+  return b;
+}
+
+// Return locked buffer for block on device dev.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bgetref(dev, blockno, 1);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Drop a reference to b, taken by bgetref().
+static void
+bunref(struct buf *b)
+{
+  struct bucket *k;
+  int free;
+
+  k = bbucket(b->dev, b->blockno);
+  acquire(&k->lock);
+  b->refcnt--;
+  free = b->refcnt == 0;
+  if(free)
+    b->lastuse = ticks;
+  release(&k->lock);
+
+  if(free && bcache.nwait){
+    acquire(&bcache.evict);
+    wakeup(&bcache);
+    release(&bcache.evict);
   }
-  panic("bget: no buffers");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -115,8 +347,66 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Return a locked buf for a block the caller will overwrite
+// entirely, without reading it from disk if it isn't cached.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  return bget(dev, blockno);
+}
+
+// Write data to the block on disk, bypassing the cache: the
+// block's buffer, if it has one, is left as it is.
+void
+bwriteraw(uint dev, uint blockno, uchar *data)
+{
+  struct buf *b = &bcache.raw;
+
+  acquiresleep(&b->lock);
+  b->dev = dev;
+  b->blockno = blockno;
+  memmove(b->data, data, BSIZE);
+  b->flags = B_DIRTY;
+  iderw(b);
+  releasesleep(&b->lock);
+}
+
+// Return a locked buf for the block, with a read of it
+// started if it isn't valid.  Call bwait() before using it.
+struct buf*
+breadasync(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if((b->flags & B_VALID) == 0)
+    idestartrw(b);
+  return b;
+}
+
+// Start writing b's contents to disk.  Must be locked.
+// Call bwait() before releasing it.
+void
+bwriteasync(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwriteasync");
+  b->flags |= B_DIRTY;
+  idestartrw(b);
+}
+
+// Wait for the reads and writes started on n locked buffers
+// by breadasync() and bwriteasync() to finish.
+void
+bwait(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    ideawait(bs[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void
 brelse(struct buf *b)
 {
@@ -124,20 +414,47 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bunref(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// Start reading the block into the cache, unless it is there
+// already or its buffer is busy, and return without waiting.
+// The buffer stays locked until the read is done, when the
+// disk interrupt calls bdone().  Never sleeps for a buffer: if
+// none is free the block is not read ahead.
+void
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bgetref(dev, blockno, 0)) == 0)
+    return;
+  if(!tryacquiresleep(&b->lock)){
+    bunref(b);
+    return;
   }
-  
-  release(&bcache.lock);
+  if(b->flags & B_VALID){
+    releasesleep(&b->lock);
+    bunref(b);
+    return;
+  }
+  b->flags |= B_ASYNC;
+  idestartrw(b);
+}
+
+// Release a buffer read by bprefetch(), or written by
+// log_data(), once the disk is done.  Called from the disk
+// interrupt, or for IDE from the work it defers (ide.c).
+void
+bdone(struct buf *b)
+{
+  if(b->flags & B_ORDERED){
+    b->flags &= ~B_ORDERED;
+    logdatadone();
+  }
+  b->flags &= ~B_ASYNC;
+  releasesleep(&b->lock);
+  bunref(b);
 }
 //PAGEBREAK!
 // Blank page.
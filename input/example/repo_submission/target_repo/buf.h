@@ -4,11 +4,20 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks at last brelse, for recycling
+  int hot;      // used more than once, or metadata
+  uint logslot; // log slot of the last committed copy (log.c)
+  struct buf *prev; // hash bucket list
   struct buf *next;
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  struct buf *cknext; // log.c's list of blocks to checkpoint
+  uchar *data;   // space, or the block itself on a memory disk
+  uchar space[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // I/O started by bprefetch or log_data; ideintr releases the buffer
+#define B_LOGGED 0x10 // in the log transaction being built
+#define B_CKPT  0x20 // committed to the log, not yet written home
+#define B_ORDERED 0x40 // file data write by log_data(), in flight
 
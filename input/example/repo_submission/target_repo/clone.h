@@ -0,0 +1,5 @@
+// clone() flags.  Without them the new thread gets its own
+// copy of the fd table and current directory, as with fork().
+#define CLONE_FILES 0x1   // share the fd table
+#define CLONE_FS    0x2   // share the current directory
+#define CLONE_SETTLS 0x4  // make tls the thread's %gs segment base
@@ -10,12 +10,15 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "poll.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "x86.h"
 
 static void consputc(int);
+static void cgaflush(void);
 
 static int panicked = 0;
 
@@ -25,7 +28,7 @@ static struct {
 } cons;
 
 static void
-printint(int xx, int base, int sign)
+printint(void (*put)(int, void*), void *arg, int xx, int base, int sign)
 {
   static char digits[] = "0123456789abcdef";
   char buf[16];
@@ -46,29 +49,24 @@ printint(int xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    put(buf[i], arg);
 }
 //PAGEBREAK: 50
 
-// Print to the console. only understands %d, %x, %p, %s.
+// Format fmt with the arguments at argp, handing each character
+// to put(c, arg).  Only understands %d, %x, %p, %s.
 void
-cprintf(char *fmt, ...)
+vprintfmt(void (*put)(int, void*), void *arg, char *fmt, uint *argp)
 {
-  int i, c, locking;
-  uint *argp;
+  int i, c;
   char *s;
 
-  locking = cons.locking;
-  if(locking)
-    acquire(&cons.lock);
-
   if (fmt == 0)
     panic("null fmt");
 
-  argp = (uint*)(void*)(&fmt + 1);
   for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
     if(c != '%'){
-      consputc(c);
+      put(c, arg);
       continue;
     }
     c = fmt[++i] & 0xff;
@@ -76,29 +74,63 @@ cprintf(char *fmt, ...)
       break;
     switch(c){
     case 'd':
-      printint(*argp++, 10, 1);
+      printint(put, arg, *argp++, 10, 1);
       break;
     case 'x':
     case 'p':
-      printint(*argp++, 16, 0);
+      printint(put, arg, *argp++, 16, 0);
       break;
     case 's':
       if((s = (char*)*argp++) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        put(*s, arg);
       break;
     case '%':
-      consputc('%');
+      put('%', arg);
       break;
     default:
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c);
+      put('%', arg);
+      put(c, arg);
       break;
     }
   }
+}
+
+static void
+consput(int c, void *arg)
+{
+  consputc(c);
+}
 
+// Print to the console. only understands %d, %x, %p, %s.
+void
+cprintf(char *fmt, ...)
+{
+  int locking;
+
+  locking = cons.locking;
+  if(locking)
+    acquire(&cons.lock);
+  vprintfmt(consput, 0, fmt, (uint*)(void*)(&fmt + 1));
+  cgaflush();
+  if(locking)
+    release(&cons.lock);
+}
+
+// Print the n characters at s to the console.
+void
+consputs(char *s, int n)
+{
+  int locking;
+
+  locking = cons.locking;
+  if(locking)
+    acquire(&cons.lock);
+  while(n-- > 0)
+    consputc(*s++);
+  cgaflush();
   if(locking)
     release(&cons.lock);
 }
@@ -111,6 +143,7 @@ panic(char *s)
 
   cli();
   cons.locking = 0;
+  klogflush();
   // use lapiccpunum so that we can call panic from mycpu()
   cprintf("lapicid %d: panic: ", lapicid());
   cprintf(s);
@@ -124,66 +157,101 @@ panic(char *s)
 }
 
 //PAGEBREAK: 50
+// The CGA screen shows 25 rows of its 16K cells from crtbase on.
+// Scrolling moves crtbase down a row, so text is copied only
+// when it reaches the end of the cells.  cgaputc() just updates
+// memory and crtpos; cgaflush() sets the hardware's start
+// address and cursor, once per console write.
 #define BACKSPACE 0x100
 #define CRTPORT 0x3d4
+#define CRTCELLS 16384
 static ushort *crt = (ushort*)P2V(0xb8000);  // CGA memory
+static int crtbase;       // cell at the top left
+static int crtpos = -1;   // cursor, from crtbase; -1 until read
 
 static void
 cgaputc(int c)
 {
-  int pos;
-
-  // Cursor position: col + 80*row.
-  outb(CRTPORT, 14);
-  pos = inb(CRTPORT+1) << 8;
-  outb(CRTPORT, 15);
-  pos |= inb(CRTPORT+1);
+  if(crtpos < 0){
+    // Cursor position: col + 80*row.
+    outb(CRTPORT, 14);
+    crtpos = inb(CRTPORT+1) << 8;
+    outb(CRTPORT, 15);
+    crtpos |= inb(CRTPORT+1);
+  }
 
   if(c == '\n')
-    pos += 80 - pos%80;
+    crtpos += 80 - crtpos%80;
   else if(c == BACKSPACE){
-    if(pos > 0) --pos;
+    if(crtpos > 0) --crtpos;
   } else
-    crt[pos++] = (c&0xff) | 0x0700;  // black on white
+    crt[crtbase + crtpos++] = (c&0xff) | 0x0700;  // black on white
 
-  if(pos < 0 || pos > 25*80)
+  if(crtpos < 0 || crtpos > 25*80)
     panic("pos under/overflow");
 
-  if((pos/80) >= 24){  // Scroll up.
-    memmove(crt, crt+80, sizeof(crt[0])*23*80);
-    pos -= 80;
-    memset(crt+pos, 0, sizeof(crt[0])*(24*80 - pos));
+  if((crtpos/80) >= 24){  // Scroll up.
+    if(crtbase + 80 + 25*80 > CRTCELLS){
+      memmove(crt, crt+crtbase+80, sizeof(crt[0])*23*80);
+      crtbase = 0;
+    } else
+      crtbase += 80;
+    crtpos -= 80;
+    memset(crt+crtbase+crtpos, 0, sizeof(crt[0])*(25*80 - crtpos));
   }
+  crt[crtbase + crtpos] = ' ' | 0x0700;
+}
+
+static void
+cgaflush(void)
+{
+  int pos;
 
+  if(crtpos < 0)
+    return;
+  outb(CRTPORT, 12);
+  outb(CRTPORT+1, crtbase>>8);
+  outb(CRTPORT, 13);
+  outb(CRTPORT+1, crtbase);
+  pos = crtbase + crtpos;
   outb(CRTPORT, 14);
   outb(CRTPORT+1, pos>>8);
   outb(CRTPORT, 15);
   outb(CRTPORT+1, pos);
-  crt[pos] = ' ' | 0x0700;
 }
 
 void
 consputc(int c)
 {
+  void (*put)(int);
+
   if(panicked){
     cli();
     for(;;)
       ;
   }
 
+  // panic() turns locking off; its output can't wait for an
+  // interrupt.
+  put = cons.locking ? uartputc : uartputcsync;
   if(c == BACKSPACE){
-    uartputc('\b'); uartputc(' '); uartputc('\b');
+    put('\b'); put(' '); put('\b');
   } else
-    uartputc(c);
+    put(c);
   cgaputc(c);
 }
 
-#define INPUT_BUF 128
+// Input waits in a ring until it's read.  Lines are edited in
+// place until a newline commits them.  In raw mode, set through
+// dev/consctl, each character is committed as it arrives,
+// without echo or editing, so scripts can be fed in at speed.
+#define INPUT_BUF 2048  // a power of 2, so the indices can wrap
 struct {
   char buf[INPUT_BUF];
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+  int raw;
 } input;
 
 #define C(x)  ((x)-'@')  // Control-x
@@ -195,6 +263,15 @@ consoleintr(int (*getc)(void))
 
   acquire(&cons.lock);
   while((c = getc()) >= 0){
+    if(input.raw){
+      if(input.e-input.r < INPUT_BUF){
+        input.buf[input.e++ % INPUT_BUF] = (c == '\r') ? '\n' : c;
+        input.w = input.e;
+        wakeup(&input.r);
+        pollwakeup();
+      }
+      continue;
+    }
     switch(c){
     case C('P'):  // Process listing.
       // procdump() locks cons.lock indirectly; invoke later
@@ -221,21 +298,27 @@ consoleintr(int (*getc)(void))
         if(c == '\n' || c == C('D') || input.e == input.r+INPUT_BUF){
           input.w = input.e;
           wakeup(&input.r);
+          pollwakeup();
         }
       }
       break;
     }
   }
+  cgaflush();
   release(&cons.lock);
   if(doprocdump) {
     procdump();  // now call procdump() wo. cons.lock held
   }
 }
 
+// Copy out input up to n bytes or the end of a line, a run at
+// a time.  A ^D ends the read; it is the read's result, 0, only
+// when it comes first.
 int
 consoleread(struct inode *ip, char *dst, int n)
 {
-  uint target;
+  uint target, i, m, k;
+  char *p;
   int c;
 
   iunlock(ip);
@@ -250,17 +333,28 @@ consoleread(struct inode *ip, char *dst, int n)
       }
       sleep(&input.r, &cons.lock);
     }
-    c = input.buf[input.r++ % INPUT_BUF];
+    // The ready input in one piece of the ring.
+    i = input.r % INPUT_BUF;
+    m = input.w - input.r;
+    if(m > INPUT_BUF - i)
+      m = INPUT_BUF - i;
+    if(m > n)
+      m = n;
+    p = input.buf + i;
+    for(k = 0; k < m && p[k] != '\n' && p[k] != C('D'); k++)
+      ;
+    c = k < m ? p[k] : 0;
+    if(c == '\n')
+      k++;
+    memmove(dst, p, k);
+    dst += k;
+    n -= k;
+    input.r += k;
     if(c == C('D')){  // EOF
-      if(n < target){
-        // Save ^D for next time, to make sure
-        // caller gets a 0-byte result.
-        input.r--;
-      }
+      if(n == target)
+        input.r++;
       break;
     }
-    *dst++ = c;
-    --n;
     if(c == '\n')
       break;
   }
@@ -279,12 +373,45 @@ consolewrite(struct inode *ip, char *buf, int n)
   acquire(&cons.lock);
   for(i = 0; i < n; i++)
     consputc(buf[i] & 0xff);
+  cgaflush();
   release(&cons.lock);
   ilock(ip);
 
   return n;
 }
 
+// A line, or ^D, is ready to read.
+int
+consolepoll(struct inode *ip)
+{
+  int r;
+
+  acquire(&cons.lock);
+  r = POLLOUT;
+  if(input.r != input.w)
+    r |= POLLIN;
+  release(&cons.lock);
+  return r;
+}
+
+// "1" turns raw input on, "0" back off.  Input not yet committed
+// when raw mode starts is committed as it stands.
+static int
+consctlwrite(struct inode *ip, char *src, int n)
+{
+  if(n < 1 || (src[0] != '0' && src[0] != '1'))
+    return -1;
+  acquire(&cons.lock);
+  input.raw = src[0] == '1';
+  if(input.raw && input.w != input.e){
+    input.w = input.e;
+    wakeup(&input.r);
+    pollwakeup();
+  }
+  release(&cons.lock);
+  return n;
+}
+
 void
 consoleinit(void)
 {
@@ -292,6 +419,8 @@ consoleinit(void)
 
   devsw[CONSOLE].write = consolewrite;
   devsw[CONSOLE].read = consoleread;
+  devsw[CONSOLE].poll = consolepoll;
+  devsw[CONSCTL].write = consctlwrite;
   cons.locking = 1;
 
   ioapicenable(IRQ_KBD, 0);
@@ -0,0 +1,56 @@
+// Kernel event counters.
+//
+// Each cpu adds to its own row of counts, with interrupts off
+// rather than a lock or a locked instruction, so counting never
+// contends.  counters() sums the rows when asked.  A new counter
+// is a CNT_ number in counter.h and a name here.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+#include "counter.h"
+
+static char *cntnames[NCNT] = {
+[CNT_SYSCALL] "syscall",
+[CNT_INTR]    "intr",
+[CNT_TICK]    "tick",
+[CNT_PGFAULT] "pgfault",
+[CNT_CSWITCH] "cswitch",
+[CNT_FORK]    "fork",
+[CNT_BHIT]    "bcache.hit",
+[CNT_BMISS]   "bcache.miss",
+};
+
+// Each cpu's row is a whole number of cache lines.
+static struct {
+  uint64 n[NCNT];
+} __attribute__((aligned(CACHELINE))) counts[NCPU];
+
+// Add n to counter c on this cpu.
+void
+cntadd(int c, uint n)
+{
+  pushcli();
+  counts[cpuid()].n[c] += n;
+  popcli();
+}
+
+// Fill in up to n records, summing each counter over the cpus
+// without stopping them, so a total may miss adds in progress.
+// Returns the number of counters, which may be more than n.
+int
+cntread(struct counter *ct, int n)
+{
+  int i, c;
+
+  for(i = 0; i < n && i < NCNT; i++){
+    safestrcpy(ct[i].name, cntnames[i], CNTNAME);
+    ct[i].n = 0;
+    for(c = 0; c < ncpu; c++)
+      ct[i].n += counts[c].n[i];
+  }
+  return NCNT;
+}
@@ -0,0 +1,19 @@
+// Kernel event counters, as read by counters(): one record per
+// counter, in CNT_ order.
+
+#define CNT_SYSCALL  0  // system calls
+#define CNT_INTR     1  // device interrupts
+#define CNT_TICK     2  // timer ticks, over all cpus
+#define CNT_PGFAULT  3  // page faults handled (not fatal ones)
+#define CNT_CSWITCH  4  // switches from the scheduler to a process
+#define CNT_FORK     5  // fork(), vfork() and clone()
+#define CNT_BHIT     6  // buffer cache lookups that found the block
+#define CNT_BMISS    7  // and that had to recycle a buffer
+#define NCNT         8
+
+#define CNTNAME 16
+
+struct counter {
+  char name[CNTNAME];
+  uint64 n;          // summed over the cpus
+};
@@ -0,0 +1,58 @@
+// counters: show the kernel's event counters, summed over the
+// cpus.  With names, just those counters.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "counter.h"
+
+#define MAXCNT 64
+
+struct counter ct[MAXCNT];
+
+// printf() has no 64-bit %d: print n in two halves of at most
+// nine digits.
+void
+putu64(uint64 n)
+{
+  char buf[10];
+  uint hi, lo;
+  int i;
+
+  hi = udiv64(n, 1000000000);
+  lo = n - (uint64)hi * 1000000000;
+  if(hi == 0){
+    printf(1, "%d", lo);
+    return;
+  }
+  for(i = 8; i >= 0; i--){
+    buf[i] = '0' + lo % 10;
+    lo /= 10;
+  }
+  buf[9] = 0;
+  printf(1, "%d%s", hi, buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, j;
+
+  if((n = counters(ct, MAXCNT)) < 0){
+    printf(2, "counters: failed\n");
+    exit();
+  }
+  if(n > MAXCNT)
+    n = MAXCNT;
+  for(i = 0; i < n; i++){
+    for(j = 1; j < argc; j++)
+      if(strcmp(argv[j], ct[i].name) == 0)
+        break;
+    if(argc > 1 && j == argc)
+      continue;
+    printf(1, "%s\t", ct[i].name);
+    putu64(ct[i].n);
+    printf(1, "\n");
+  }
+  exit();
+}
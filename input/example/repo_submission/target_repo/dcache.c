@@ -0,0 +1,244 @@
+// Directory name cache.
+//
+// The dcache remembers the result of looking a name up in a
+// directory, indexed by (dev, directory inum, name), so that
+// dirlookup() need not read the whole directory for every
+// path element.  An entry with inum 0 is negative: it records
+// that the name is not in the directory.
+//
+// Interface:
+// * dirlookup calls dclookup before scanning a directory and
+//     dcenter with what the scan found.
+// * namex calls dcpeek first, without the directory's lock.
+// * Code that adds or removes a directory entry calls dcenter
+//     with the new state of that name.
+// * itrunc calls dcinval, so a freed directory's names do not
+//     outlive it if its inode number is reused.
+// * Callers hold the directory's inode lock, which is what
+//     keeps the cache consistent with the directory's contents.
+//
+// dcache.lock protects the hash chains and the LRU list.
+// dcpeek() reads without it: entries are never freed, so it can
+// follow a chain that is changing under it, and each entry's
+// seq, odd while the entry changes, tells it whether what it
+// read was whole.  It leaves the LRU list alone too, and only
+// sets ref, which gives an entry a second chance before
+// dcenter() recycles it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs.h"
+
+#define NDCACHE 256
+#define NDCHASH 61
+
+struct dentry {
+  uint dev;
+  uint dir;            // inum of the directory, 0 if unused
+  char name[DIRSIZ];
+  uint inum;           // 0 for a negative entry
+  uint off;            // byte offset of the dirent in dir
+  uint seq;            // odd while the above change
+  int ref;             // looked up since it last came to the front
+  struct dentry *hnext; // hash chain
+  struct dentry *prev;  // LRU list
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDCACHE];
+  struct dentry *hash[NDCHASH];
+
+  // Linked list of all entries, through prev/next.
+  // head.next is most recently used.
+  struct dentry head;
+} dcache;
+
+static uint
+dchash(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dir * 17;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 33 + name[i];
+  return h % NDCHASH;
+}
+
+void
+dcinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.next = &dcache.head;
+  for(d = dcache.ent; d < dcache.ent+NDCACHE; d++){
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+  }
+}
+
+// Move d to the front of the LRU list.
+// Caller must hold dcache.lock.
+static void
+dcfront(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = dcache.head.next;
+  d->prev = &dcache.head;
+  dcache.head.next->prev = d;
+  dcache.head.next = d;
+}
+
+// Bracket a change to d, for dcpeek().
+// Caller must hold dcache.lock.
+static void
+dcbegin(struct dentry *d)
+{
+  d->seq++;
+  __sync_synchronize();
+}
+
+static void
+dcend(struct dentry *d)
+{
+  __sync_synchronize();
+  d->seq++;
+}
+
+// Take d out of its hash chain and mark it unused.
+// Caller must hold dcache.lock.
+static void
+dcunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dchash(d->dev, d->dir, d->name)]; *pp != d; pp = &(*pp)->hnext)
+    ;
+  *pp = d->hnext;
+  dcbegin(d);
+  d->dir = 0;
+  dcend(d);
+}
+
+// Caller must hold dcache.lock.
+static struct dentry*
+dcfind(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dchash(dev, dir, name)]; d; d = d->hnext)
+    if(d->dev == dev && d->dir == dir && strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  return 0;
+}
+
+// Look name up in directory dir.  If the cache knows the
+// answer, set *inum (0 if the name is absent) and *off and
+// return 1; otherwise return 0.
+int
+dclookup(uint dev, uint dir, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dev, dir, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  dcfront(d);
+  *inum = d->inum;
+  *off = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// dclookup() without dcache.lock, and so without writing to
+// anything shared, for path walks that may run on every cpu at
+// once.  Returns 0 both when the cache doesn't know and when the
+// entry changed while being read, so the caller can always fall
+// back to looking in the directory.  The caller need not hold
+// the directory's lock, so the answer may be stale by the time
+// it returns.
+int
+dcpeek(uint dev, uint dir, char *name, uint *inum)
+{
+  struct dentry *d;
+  uint seq;
+  int n, hit;
+
+  d = dcache.hash[dchash(dev, dir, name)];
+  for(n = 0; d && n < NDCACHE; n++, d = d->hnext){
+    seq = d->seq;
+    __sync_synchronize();
+    hit = d->dev == dev && d->dir == dir && strncmp(d->name, name, DIRSIZ) == 0;
+    *inum = d->inum;
+    __sync_synchronize();
+    if((seq & 1) || d->seq != seq)
+      return 0;
+    if(hit){
+      if(!d->ref)
+        d->ref = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Record that name in directory dir refers to inum, in the
+// dirent at byte offset off, or is absent if inum is 0.
+void
+dcenter(uint dev, uint dir, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+  int n;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dev, dir, name)) == 0){
+    // Recycle the least recently used entry that dcpeek()
+    // hasn't found since it came to the front.
+    for(n = 0; (d = dcache.head.prev)->ref && n < NDCACHE; n++){
+      d->ref = 0;
+      dcfront(d);
+    }
+    if(d->dir)
+      dcunhash(d);
+    dcbegin(d);
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+    dcend(d);
+    h = dchash(dev, dir, d->name);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  dcbegin(d);
+  d->inum = inum;
+  d->off = off;
+  dcend(d);
+  d->ref = 0;
+  dcfront(d);
+  release(&dcache.lock);
+}
+
+// Forget every name in directory dir.
+void
+dcinval(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < dcache.ent+NDCACHE; d++)
+    if(d->dir == dir && d->dev == dev)
+      dcunhash(d);
+  release(&dcache.lock);
+}
@@ -1,55 +1,128 @@
 struct buf;
 struct context;
+struct counter;
+struct direntstat;
+struct cwd;
+struct fdtable;
 struct file;
 struct inode;
+struct iovec;
+struct kmcache;
+struct mm;
+struct cpage;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct rusage;
+struct lockstat;
+struct meminfo;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct trapframe;
+struct work;
+
+// acpi.c
+extern int      nnode;
+void            acpiinit(void);
+int             physnode(uint, uint*);
 
 // bio.c
 void            binit(void);
+void            bgrow(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+struct buf*     breadasync(uint, uint);
+struct buf*     bnew(uint, uint);
+void            bwriteraw(uint, uint, uchar*);
+void            bwriteasync(struct buf*);
+void            bwait(struct buf**, int);
+void            bprefetch(uint, uint);
+void            bdone(struct buf*);
+int             bufcount(void);
 
 // console.c
 void            consoleinit(void);
 void            cprintf(char*, ...);
+void            vprintfmt(void(*)(int, void*), void*, char*, uint*);
+void            consputs(char*, int);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// counter.c
+void            cntadd(int, uint);
+int             cntread(struct counter*, int);
+
+// dcache.c
+void            dcinit(void);
+int             dclookup(uint, uint, char*, uint*, uint*);
+int             dcpeek(uint, uint, char*, uint*);
+void            dcenter(uint, uint, char*, uint, uint);
+void            dcinval(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
 
 // file.c
+struct cwd*     cwdalloc(struct inode*);
+struct cwd*     cwdcopy(struct cwd*);
+struct cwd*     cwddup(struct cwd*);
+struct inode*   cwdget(struct cwd*);
+void            cwdput(struct cwd*);
+struct inode*   cwdset(struct cwd*, struct inode*);
+struct fdtable* fdtalloc(void);
+struct fdtable* fdtcopy(struct fdtable*);
+struct fdtable* fdtdup(struct fdtable*);
+void            fdtput(struct fdtable*);
+int             fdtinstall(struct fdtable*, struct file*);
+struct file*    fdtremove(struct fdtable*, int);
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+int             filepoll(struct file*, int);
 int             fileread(struct file*, char*, int n);
+int             filereadv(struct file*, struct iovec*, int, int);
+int             filesplice(struct file*, struct file*, int);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filewritev(struct file*, struct iovec*, int, int);
+uint            pollbegin(void);
+void            pollwait(uint, int, int);
+void            pollwakeup(void);
+
+// fpu.c
+void            fpuinit(void);
+int             fpuload(void);
+void            fpusave(struct proc*);
+void            fpufork(struct proc*);
+void            fpureset(void);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+extern struct superblock sb;
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+int             dirstat(struct inode*, uint*, struct direntstat*, int);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            bcommitted(void);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            ilockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
+int             mount(struct inode*);
+void            orphaninit(int);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+char*           readipage(struct inode*, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
@@ -57,33 +130,77 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idestartrw(struct buf*);
+void            ideawait(struct buf*);
+uchar*          idemap(uint, uint);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
+void            ioapicenablelevel(int irq, int cpu);
 extern uchar    ioapicid;
 void            ioapicinit(void);
+int             ioapiccpu(int);
+void            ioapicroute(int, int);
+
+// irq.c
+void            irqbalance(void);
+void            irqcount(uint, uint64);
+void            irqinit(void);
+
+// klog.c
+void            klog(char*, ...);
+void            klogflush(void);
+void            kloginit(void);
+
+// KLOG(level, fmt, ...) logs through klog() if level is
+// KLOGLEVEL (param.h) or more urgent; otherwise it compiles
+// to nothing.
+#define KL_ERR   0
+#define KL_WARN  1
+#define KL_INFO  2
+#define KL_DEBUG 3
+#define KLOG(level, ...) \
+  do { if((level) <= KLOGLEVEL) klog(__VA_ARGS__); } while(0)
 
 // kalloc.c
-char*           kalloc(void);
+char*           kalloc(int);
 void            kfree(char*);
+void            kfreemany(char**, int);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+extern uint     phystop;
+char*           kzalloc(int);
+char*           ksuperalloc(void);
+void            ksuperfree(char*);
+void            kref(char*);
+int             krefcount(char*);
+int             kzeroidle(void);
+void            kmeminfo(struct meminfo*);
 
 // kbd.c
 void            kbdintr(void);
 
 // lapic.c
 void            cmostime(struct rtcdate *r);
+uint            cmosmemtop(void);
 int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
-void            lapicstartap(uchar, uint);
+void            lapiconeshot(uint);
+void            lapicstartaps(uchar*, int, uint);
+void            lapicipi(uchar, int);
 void            microdelay(int);
 
 // log.c
 void            initlog(int dev);
+void            logsync(void);
+uint            logtxn(void);
+void            logwait(uint);
 void            log_write(struct buf*);
+void            log_data(struct buf*);
+void            logdatadone(void);
+int             logroom(void);
 void            begin_op();
 void            end_op();
 
@@ -95,17 +212,44 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// pcache.c
+void            pcinit(void);
+struct cpage*   pcget(uint, uint, uint);
+void            pcput(struct cpage*);
+int             pcclaim(struct cpage*);
+void            pcfilled(struct cpage*);
+void            pcwrite(uint, uint, char*, uint, uint);
+void            pcinval(uint, uint);
+int             pcreclaim(int);
+int             pchas(uint, uint, uint);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
+void            pipeinit(void);
+int             pipepoll(struct pipe*);
 int             piperead(struct pipe*, char*, int);
+int             pipesplicein(struct pipe*, struct file*, int);
+int             pipespliceout(struct pipe*, struct file*, int);
 int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
+// pmc.c
+void            pmcinit(void);
+void            pmcswitch(struct proc*);
+int             perfctr(int, uint64*);
+
 // proc.c
 int             cpuid(void);
 void            exit(void);
+void            exitgroup(void);
 int             fork(void);
+int             vfork(void);
+void            vforkdone(struct proc*);
+int             futexwait(uint, int, int);
+int             futexwake(uint, int);
+int             ipccall(int);
+int             ipcreplywait(int, int);
 int             growproc(int);
 int             kill(int);
 struct cpu*     mycpu(void);
@@ -113,14 +257,29 @@ struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
+int             getrusage(int, int, struct rusage*);
+int             procrss(int);
+struct mm*      mmnext(int*);
 void            sched(void);
+void            schedlend(struct proc*, int*);
+int             schedpreempt(struct proc*);
+void            schedunlend(struct proc*, int*);
+uint            schedvmin(void);
+int             setpriority(int, int, int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+void            sleepcond(void*, struct spinlock*, volatile int*);
 void            userinit(void);
+int             kthreadstart(void(*)(void*), void*, char*);
 int             wait(void);
 void            wakeup(void*);
+void            wakeproc(struct proc*, void*);
 void            yield(void);
 
+// prof.c
+void            profinit(void);
+void            profsample(struct trapframe*);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
@@ -129,16 +288,36 @@ void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            initlockq(struct spinlock*, char*);
+void            lockstatacquired(struct lockstat*, char*, int, uint64, uint);
+int             lockstatdump(int);
+void            lockstatreg(struct sleeplock*);
+void            lockstatreleased(struct lockstat*);
 void            release(struct spinlock*);
 void            pushcli(void);
+int             needbreak(void);
 void            popcli(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// shm.c
+void            shminit(void);
+int             shmopen(int, uint);
+int             shmattach(int);
+int             shmunlink(int);
+
+// slab.c
+void            kmcacheinit(struct kmcache*, char*, uint, void (*)(void*));
+void*           slaballoc(struct kmcache*);
+void            slabfree(struct kmcache*, void*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -148,47 +327,134 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(int);
+void            swapdup(uint);
+void            swapfree(uint);
+int             swapwrite(char*);
+void            swapread(uint, char*);
+int             reclaim(int);
+
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argptrw(int, char**, int);
 int             argstr(int, char**);
+int             fetchbuf(uint, int, int);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
 void            syscall(void);
+int             sysstatdump(int);
 
 // timer.c
 void            timerinit(void);
+int             timerintr(void);
+void            timeridle(int);
+int             timersleep(uint, uint);
+int             sleeptimeout(void*, struct spinlock*, uint);
+void            tickhold(int);
+
+// tmpfs.c
+void            tmpinit(void);
+uint            tmpialloc(short);
+void            tmpiload(struct inode*);
+void            tmpiupdate(struct inode*);
+void            tmptrunc(struct inode*);
+int             tmpread(struct inode*, char*, uint, uint);
+int             tmpwrite(struct inode*, char*, uint, uint);
+char*           tmppage(struct inode*, uint);
 
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
 void            tvinit(void);
+void            dfault(void);
 extern struct spinlock tickslock;
 
+// trace.c
+extern int      tracing;
+void            traceinit(void);
+void            traceev(int, uint);
+// Record an event if tracing is on; see trace.h for ev and arg.
+#define trace(ev, arg) do { if(KTRACE && tracing) traceev(ev, arg); } while(0)
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
+void            uartputcsync(int);
+
+// virtio.c
+int             virtioinit(void);
+void            virtiointr(void);
+void            virtiorw(struct buf*);
+void            virtioawait(struct buf*);
+extern uint     virtioirq;
 
 // vm.c
 void            seginit(void);
+uint            vdsotick(uint);
 void            kvmalloc(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
+int             uvashared(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, int, struct spinlock*);
+int             cowfault(uint);
+int             pagein(uint);
+int             pagefault(uint, uint);
+int             uvmprefault(uint, uint, int);
+int             uvmsharepage(uint, char*);
+uint            uvmrss(pde_t*);
+int             uvmswapout(struct mm*, int);
+void            tlbshootdown(pde_t*, uint, uint);
+void            tlbpoll(void);
 void            switchuvm(struct proc*);
+void            switchtss(struct proc*);
+int             kstackmap(char*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+int             mprotectuvm(pde_t*, uint, uint, int);
+void            madviseuvm(pde_t*, uint, uint);
+void            mminit(void);
+struct mm*      mmalloc(pde_t*, uint);
+struct mm*      mmdup(struct mm*);
+int             mmaddfile(struct mm*, uint, uint, struct inode*, uint, uint);
+void            mmexit(struct mm*);
+uint            uvmend(struct mm*, uint);
+int             vmaoverlap(struct mm*, uint, uint);
+int             mmapregion(struct mm*, uint, int, int, struct inode*, uint, uint);
+int             munmapregion(struct mm*, uint, uint);
+int             mmapshared(struct mm*, char**, uint);
+struct mm*      mmcopy(struct mm*);
+void            mmput(struct mm*);
+int             mmunref(struct mm*);
+void            mmfree(struct mm*);
+
+// workq.c
+void            initwork(struct work*, void(*)(void*), void*);
+int             queuework(struct work*);
+void            workinit(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
+// A per-cpu variable: an array of NCPU copies of type, each
+// on cache lines of its own, so that cpus updating their own
+// copies don't contend for the lines.  percpu(name) is this
+// cpu's copy (interrupts must be off); percpuof(name, c) is
+// cpu c's.
+#define PERCPU(type, name) \
+  struct { type v; } __attribute__((aligned(CACHELINE))) name[NCPU]
+#define percpu(name)        (name[cpuid()].v)
+#define percpuof(name, c)   (name[c].v)
+
 // In kernel/defs.h, within the proc.c function prototypes section
-int             clone(void(*fcn)(void *, void *), void *arg1, void *arg2, void *stack);
-int             join(void **stack);
\ No newline at end of file
+int             clone(void(*fcn)(void *, void *), void *arg1, void *arg2, void *stack, int flags, uint tls);
+int             join(int tid, void **stack);
+int             join_many(int *tids, int n, void **stacks);
\ No newline at end of file
@@ -0,0 +1,7 @@
+// What getdents() returns for each directory entry: the
+// dirent, and the stat of the inode it names.  Needs stat.h
+// and fs.h.
+struct direntstat {
+  struct dirent de;
+  struct stat st;
+};
@@ -2,21 +2,109 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "mm.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+// Read and check the ELF headers of ip, and keep what exec()
+// needs in ip->elfentry and ip->elfseg[].  Caller holds ip->lock.
+static int
+elfscan(struct inode *ip)
+{
+  struct elfhdr elf;
+  struct proghdr ph;
+  struct elfseg *seg;
+  int i, off, n;
+
+  if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
+    return -1;
+  if(elf.magic != ELF_MAGIC)
+    return -1;
+  n = 0;
+  for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
+    if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
+      return -1;
+    if(ph.type != ELF_PROG_LOAD)
+      continue;
+    if(ph.memsz < ph.filesz)
+      return -1;
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE)
+      return -1;
+    if(ph.vaddr % PGSIZE != 0)
+      return -1;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      return -1;
+    if(n == NELFSEG)
+      return -1;
+    seg = &ip->elfseg[n++];
+    seg->vaddr = ph.vaddr;
+    seg->memsz = ph.memsz;
+    seg->off = ph.off;
+    seg->filesz = ph.filesz;
+  }
+  if(n == 0)
+    return -1;
+  ip->elfentry = elf.entry;
+  ip->nelfseg = n;
+  return 0;
+}
+
+// Map the shared library, /libu, into mm at LIBBASE.  Programs
+// are linked against its symbols rather than a copy each of the
+// user library (see the Makefile).  Like the program, it is
+// mapped private and read in as it is touched, so every process
+// shares its pages through the page cache until it writes one.
+// A missing or malformed /libu leaves it out, which only
+// programs that call into it notice.  Returns -1 if mm has no
+// free vma.  Caller is in an FS call.
+static int
+libmap(struct mm *mm)
+{
+  struct inode *ip;
+  struct elfseg *seg;
+  int i, r;
+
+  if((ip = namei("/libu")) == 0)
+    return 0;
+  ilockshared(ip);
+  if(ip->nelfseg == 0){
+    iunlock(ip);
+    ilock(ip);
+  }
+  r = 0;
+  if(ip->nelfseg == 0 && elfscan(ip) < 0)
+    goto out;
+  for(i = 0; i < ip->nelfseg; i++){
+    seg = &ip->elfseg[i];
+    if(seg->vaddr < LIBBASE || vmaoverlap(mm, seg->vaddr, seg->vaddr + seg->memsz))
+      continue;
+    if(mmaddfile(mm, seg->vaddr, seg->memsz, ip, seg->off, seg->filesz) < 0){
+      r = -1;
+      break;
+    }
+  }
+out:
+  iunlockput(ip);
+  return r;
+}
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
-  uint argc, sz, sp, ustack[3+MAXARG+1];
-  struct elfhdr elf;
+  int i;
+  uint argc, sz, sp, entry, ustack[3+MAXARG+1];
   struct inode *ip;
-  struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
+  struct elfseg *seg;
+  pde_t *pgdir;
+  struct mm *mm, *oldmm;
   struct proc *curproc = myproc();
 
   begin_op();
@@ -26,39 +114,48 @@ exec(char *path, char **argv)
     cprintf("exec: fail\n");
     return -1;
   }
-  ilock(ip);
+  // Processes running the same program read it together; only
+  // the first, which checks and caches the ELF headers, needs
+  // ip to itself.
+  ilockshared(ip);
+  if(ip->nelfseg == 0){
+    iunlock(ip);
+    ilock(ip);
+  }
   pgdir = 0;
+  mm = 0;
 
-  // Check ELF header
-  if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
-    goto bad;
-  if(elf.magic != ELF_MAGIC)
+  // Check the ELF headers, unless they were when ip last ran.
+  if(ip->nelfseg == 0 && elfscan(ip) < 0)
     goto bad;
+  entry = ip->elfentry;
 
   if((pgdir = setupkvm()) == 0)
     goto bad;
+  if((mm = mmalloc(pgdir, 0)) == 0)
+    goto bad;
 
-  // Load program into memory.
+  // Map the program; its pages are read in as they are
+  // touched (see pagein()).
   sz = 0;
-  for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
-    if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
-      goto bad;
-    if(ph.type != ELF_PROG_LOAD)
-      continue;
-    if(ph.memsz < ph.filesz)
-      goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
-      goto bad;
+  for(i = 0; i < ip->nelfseg; i++){
+    seg = &ip->elfseg[i];
+    if(mmaddfile(mm, seg->vaddr, seg->memsz, ip, seg->off, seg->filesz) < 0){
+      // Out of vmas: load this segment now.
+      if(allocuvm(pgdir, sz, seg->vaddr + seg->memsz) == 0)
+        goto bad;
+      if(loaduvm(pgdir, (char*)seg->vaddr, ip, seg->off, seg->filesz) < 0)
+        goto bad;
+    }
+    if(seg->vaddr + seg->memsz > sz)
+      sz = seg->vaddr + seg->memsz;
   }
   iunlockput(ip);
-  end_op();
   ip = 0;
+  i = libmap(mm);
+  end_op();
+  if(i < 0)
+    goto bad;
 
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible.  Use the second as the user stack.
@@ -93,22 +190,37 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
-  // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
+  // Commit to the user image, in an address space of its own.
+  // Threads still sharing the old one keep it alive.
+  // The group's usage and fair share carry over, unless the
+  // old one is a vfork() parent's.
+  mm->sz = sz;
+  oldmm = curproc->mm;
+  if(!curproc->vfork)
+    mm->ru = oldmm->ru;
+  mm->vruntime = oldmm->vruntime;
+  curproc->mm = mm;
+  curproc->tf->eip = entry;  // main
   curproc->tf->esp = sp;
+  curproc->tf->gs = 0;           // the new image has no TLS yet
+  curproc->tls = 0;
+  fpureset();
   switchuvm(curproc);
-  freevm(oldpgdir);
+  mmexit(oldmm);
+  mmput(oldmm);
+  if(curproc->vfork)
+    vforkdone(curproc);
   return 0;
 
  bad:
-  if(pgdir)
-    freevm(pgdir);
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  if(mm){
+    mmexit(mm);
+    mmput(mm);
+  } else if(pgdir)
+    freevm(pgdir);
   return -1;
 }
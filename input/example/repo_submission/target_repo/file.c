@@ -5,50 +5,367 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "file.h"
+#include "uio.h"
+#include "poll.h"
+#include "meminfo.h"
 
 struct devsw devsw[NDEV];
+
+static struct kmcache filecache;
+static struct kmcache fdtcache;
+static struct kmcache fdacache;
+static struct kmcache cwdcache;
+
+// poll() waits on one queue for all files.  A poller takes
+// pollq.seq with pollbegin() before it looks at its files,
+// and pollwait() sleeps only if no pollwakeup() has bumped
+// seq since: so a file that becomes ready while the poller
+// looks is not missed.  Files call pollwakeup() when they may
+// have become ready; it costs nothing while nobody polls.
+// A poller with a timeout sleeps with sleeptimeout().
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
-} ftable;
+  uint seq;
+  int nwait;       // pollers between pollbegin() and pollwait()
+} pollq;
+
+static void
+fdtctor(void *o)
+{
+  initlock(&((struct fdtable*)o)->lock, "fdtable");
+}
+
+static void
+cwdctor(void *o)
+{
+  initlock(&((struct cwd*)o)->lock, "cwd");
+}
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  kmcacheinit(&filecache, "file", sizeof(struct file), 0);
+  kmcacheinit(&fdtcache, "fdtable", sizeof(struct fdtable), fdtctor);
+  kmcacheinit(&fdacache, "fdarray", sizeof(struct fdarray), 0);
+  kmcacheinit(&cwdcache, "cwd", sizeof(struct cwd), cwdctor);
+  initlock(&pollq.lock, "pollq");
+}
+
+// Allocate an empty fd array, with one reference and room for
+// nfd files.  Return 0 if out of memory or nfd is too many.
+static struct fdarray*
+fdaalloc(int nfd)
+{
+  struct fdarray *a;
+
+  if(nfd > NOFILEMAX || (a = slaballoc(&fdacache)) == 0)
+    return 0;
+  memset(a, 0, sizeof(*a));
+  a->ref = 1;
+  a->nfd = NOFILE;
+  a->ofile = a->ofile0;
+  if(nfd > NOFILE){
+    if((a->ofile = (struct file**)kzalloc(KM_KERN)) == 0){
+      slabfree(&fdacache, a);
+      return 0;
+    }
+    a->nfd = NOFILEMAX;
+  }
+  return a;
+}
+
+// Drop a reference to a, closing its files with the last.
+static void
+fdaput(struct fdarray *a)
+{
+  int i, fd;
+  uint w;
+
+  if(__sync_sub_and_fetch(&a->ref, 1) > 0)
+    return;
+  for(i = 0; i < NELEM(a->used); i++)
+    for(w = a->used[i]; w; w &= w - 1){
+      fd = i*32 + __builtin_ctz(w);
+      fileclose(a->ofile[fd]);
+    }
+  if(a->ofile != a->ofile0)
+    kfree((char*)a->ofile);
+  slabfree(&fdacache, a);
+}
+
+// Lowest free fd of a, or -1 if all are open.
+static int
+fdafree(struct fdarray *a)
+{
+  int i, fd;
+
+  for(i = 0; i < (a->nfd + 31) / 32; i++)
+    if(a->used[i] != ~0){
+      fd = i*32 + __builtin_ctz(~a->used[i]);
+      return fd < a->nfd ? fd : -1;
+    }
+  return -1;
+}
+
+// Allocate an empty fd table with one reference.
+// Return 0 if out of memory.
+struct fdtable*
+fdtalloc(void)
+{
+  struct fdtable *t;
+
+  if((t = slaballoc(&fdtcache)) == 0)
+    return 0;
+  if((t->arr = fdaalloc(NOFILE)) == 0){
+    slabfree(&fdtcache, t);
+    return 0;
+  }
+  t->ref = 1;
+  return t;
+}
+
+// Take another reference to t, for a thread sharing it.
+struct fdtable*
+fdtdup(struct fdtable *t)
+{
+  acquire(&t->lock);
+  t->ref++;
+  release(&t->lock);
+  return t;
+}
+
+// Make a new table with t's open files, for fork().  It shares
+// t's array until one of them changes it.
+struct fdtable*
+fdtcopy(struct fdtable *t)
+{
+  struct fdtable *nt;
+
+  if((nt = slaballoc(&fdtcache)) == 0)
+    return 0;
+  nt->ref = 1;
+  acquire(&t->lock);
+  nt->arr = t->arr;
+  __sync_fetch_and_add(&nt->arr->ref, 1);
+  release(&t->lock);
+  return nt;
+}
+
+// Drop a reference to t, closing its files with the last.
+void
+fdtput(struct fdtable *t)
+{
+  acquire(&t->lock);
+  if(--t->ref > 0){
+    release(&t->lock);
+    return;
+  }
+  release(&t->lock);
+
+  fdaput(t->arr);
+  slabfree(&fdtcache, t);
+}
+
+// Lock t for changing its array, first replacing the array
+// with a copy if it is shared or has room for fewer than nfd
+// files.  Returns the array, with t->lock held, or 0 if out
+// of memory or nfd is over NOFILEMAX.
+static struct fdarray*
+fdtlock(struct fdtable *t, int nfd)
+{
+  struct fdarray *a, *na;
+  int fd;
+
+  for(;;){
+    acquire(&t->lock);
+    a = t->arr;
+    if(a->ref == 1 && a->nfd >= nfd)
+      return a;
+    // A reference of our own keeps a from being freed, and
+    // so from changing, while it is copied without the lock.
+    __sync_fetch_and_add(&a->ref, 1);
+    release(&t->lock);
+    if((na = fdaalloc(nfd > a->nfd ? nfd : a->nfd)) == 0){
+      fdaput(a);
+      return 0;
+    }
+    memmove(na->used, a->used, sizeof(a->used));
+    for(fd = 0; fd < a->nfd; fd++)
+      if((na->ofile[fd] = a->ofile[fd]) != 0)
+        filedup(na->ofile[fd]);
+    acquire(&t->lock);
+    if(t->arr == a){
+      t->arr = na;
+      __sync_fetch_and_sub(&a->ref, 1);  // t's, never the last
+      na = 0;
+    }
+    release(&t->lock);
+    fdaput(a);
+    if(na)
+      fdaput(na);  // another thread replaced it first
+  }
+}
+
+// Put f in the lowest free fd of t, growing it if it is full.
+// Returns the fd, or -1 if there is no room.
+int
+fdtinstall(struct fdtable *t, struct file *f)
+{
+  struct fdarray *a;
+  int fd, nfd;
+
+  nfd = 0;
+  for(;;){
+    if((a = fdtlock(t, nfd)) == 0)
+      return -1;
+    if((fd = fdafree(a)) >= 0)
+      break;
+    nfd = a->nfd + 1;
+    release(&t->lock);
+  }
+  a->ofile[fd] = f;
+  a->used[fd / 32] |= 1 << (fd % 32);
+  release(&t->lock);
+  return fd;
 }
 
-// Allocate a file structure.
+// Take the file at fd out of t and return it, for the caller
+// to close, or 0 if fd is not open.
 struct file*
-filealloc(void)
+fdtremove(struct fdtable *t, int fd)
 {
+  struct fdarray *a;
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  // Not open: don't copy a shared array for nothing.
+  acquire(&t->lock);
+  a = t->arr;
+  f = fd >= 0 && fd < a->nfd ? a->ofile[fd] : 0;
+  release(&t->lock);
+  if(f == 0 || (a = fdtlock(t, 0)) == 0)
+    return 0;
+  if(fd >= a->nfd || (f = a->ofile[fd]) == 0){
+    release(&t->lock);
+    return 0;
+  }
+  a->ofile[fd] = 0;
+  a->used[fd / 32] &= ~(1 << (fd % 32));
+  release(&t->lock);
+  return f;
+}
+
+// Wrap directory ip, whose reference passes to the new cwd.
+// Return 0 if out of memory.
+struct cwd*
+cwdalloc(struct inode *ip)
+{
+  struct cwd *c;
+
+  if((c = slaballoc(&cwdcache)) == 0)
+    return 0;
+  c->ip = ip;
+  c->ref = 1;
+  return c;
+}
+
+struct cwd*
+cwddup(struct cwd *c)
+{
+  acquire(&c->lock);
+  c->ref++;
+  release(&c->lock);
+  return c;
+}
+
+// Make a private cwd naming the same directory as c.
+struct cwd*
+cwdcopy(struct cwd *c)
+{
+  struct inode *ip;
+  struct cwd *nc;
+
+  ip = cwdget(c);
+  if((nc = cwdalloc(ip)) == 0){
+    begin_op();
+    iput(ip);
+    end_op();
   }
-  release(&ftable.lock);
-  return 0;
+  return nc;
 }
 
-// Increment ref count for file f.
+// Drop a reference to c, releasing the directory with the last.
+// Must be called inside a transaction since it calls iput().
+void
+cwdput(struct cwd *c)
+{
+  acquire(&c->lock);
+  if(--c->ref > 0){
+    release(&c->lock);
+    return;
+  }
+  release(&c->lock);
+
+  iput(c->ip);
+  c->ip = 0;
+  slabfree(&cwdcache, c);
+}
+
+// Return a new reference to c's directory.
+struct inode*
+cwdget(struct cwd *c)
+{
+  struct inode *ip;
+
+  acquire(&c->lock);
+  ip = idup(c->ip);
+  release(&c->lock);
+  return ip;
+}
+
+// Make ip, whose reference passes to c, the current directory.
+// Return the old directory for the caller to iput().
+struct inode*
+cwdset(struct cwd *c, struct inode *ip)
+{
+  struct inode *old;
+
+  acquire(&c->lock);
+  old = c->ip;
+  c->ip = ip;
+  release(&c->lock);
+  return old;
+}
+
+// Allocate a file structure.  Return 0 if out of memory.
+struct file*
+filealloc(void)
+{
+  struct file *f;
+
+  if((f = slaballoc(&filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
+}
+
+// Increment ref count for file f.  The caller holds a
+// reference, so the count can't reach 0 meanwhile and needs
+// no lock.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__sync_fetch_and_add(&f->ref, 1) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -57,18 +374,16 @@ void
 fileclose(struct file *f)
 {
   struct file ff;
+  int ref;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
-    panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if((ref = __sync_sub_and_fetch(&f->ref, 1)) > 0)
     return;
-  }
+  if(ref < 0)
+    panic("fileclose");
+  // That was the last reference: no one else can see f.
   ff = *f;
-  f->ref = 0;
   f->type = FD_NONE;
-  release(&ftable.lock);
+  slabfree(&filecache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -84,7 +399,7 @@ int
 filestat(struct file *f, struct stat *st)
 {
   if(f->type == FD_INODE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, st);
     iunlock(f->ip);
     return 0;
@@ -96,18 +411,60 @@ filestat(struct file *f, struct stat *st)
 int
 fileread(struct file *f, char *addr, int n)
 {
-  int r;
+  struct iovec v;
+
+  v.iov_base = addr;
+  v.iov_len = n;
+  return filereadv(f, &v, 1, -1);
+}
+
+// Read into the cnt buffers of iov in turn from file f, at
+// offset off, or at f's offset, advancing it, if off is -1.
+int
+filereadv(struct file *f, struct iovec *iov, int cnt, int off)
+{
+  int i, r, tot;
+  uint pos;
 
   if(f->readable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return piperead(f->pipe, addr, n);
+  tot = 0;
+  if(f->type == FD_PIPE){
+    if(off != -1)
+      return -1;
+    for(i = 0; i < cnt; i++){
+      if((r = piperead(f->pipe, iov[i].iov_base, iov[i].iov_len)) < 0)
+        return tot ? tot : -1;
+      tot += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
+    return tot;
+  }
   if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
+    // f->off is kept under the inode lock, so a read that moves
+    // it locks ip exclusive unless no one else can reach f.
+    if(off != -1 || (f->ref == 1 && myproc()->files->ref == 1 &&
+                     myproc()->files->arr->ref == 1))
+      ilockshared(f->ip);
+    else
+      ilock(f->ip);
+    pos = off == -1 ? f->off : off;
+    for(i = 0; i < cnt; i++){
+      if((r = readi(f->ip, iov[i].iov_base, pos, iov[i].iov_len)) < 0){
+        if(tot == 0)
+          tot = -1;
+        break;
+      }
+      pos += r;
+      tot += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
+    if(off == -1)
+      f->off = pos;
     iunlock(f->ip);
-    return r;
+    return tot;
   }
   panic("fileread");
 }
@@ -117,41 +474,173 @@ fileread(struct file *f, char *addr, int n)
 int
 filewrite(struct file *f, char *addr, int n)
 {
-  int r;
+  struct iovec v;
+
+  v.iov_base = addr;
+  v.iov_len = n;
+  return filewritev(f, &v, 1, -1);
+}
+
+// Write the cnt buffers of iov in turn to file f, at offset
+// off, or at f's offset, advancing it, if off is -1.
+int
+filewritev(struct file *f, struct iovec *iov, int cnt, int off)
+{
+  int i, r, n, n1, room, done, tot;
+  uint pos;
 
   if(f->writable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return pipewrite(f->pipe, addr, n);
+  n = 0;
+  for(i = 0; i < cnt; i++)
+    n += iov[i].iov_len;
+  if(f->type == FD_PIPE){
+    if(off != -1)
+      return -1;
+    for(i = 0; i < cnt; i++)
+      if(pipewrite(f->pipe, iov[i].iov_base, iov[i].iov_len) < 0)
+        return -1;
+    return n;
+  }
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write in chunks to avoid exceeding the maximum log
+    // transaction size.  File data bypasses the log (see
+    // log_data()), so a chunk logs only the i-node, up to
+    // 3 indirect blocks (a double-indirect block and two
+    // of its leaves) and the allocation bitmap blocks; half
+    // an indirect block's worth of data can't need more.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
+    // Successive buffers go to successive bytes of the
+    // file, so they share transactions as one buffer would.
+    int max = (NINDIRECT / 2) * BSIZE;
+    i = done = tot = 0;
+    r = 0;
+    while(tot < n){
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      pos = off == -1 ? f->off : off + tot;
+      for(room = max; room > 0 && tot < n; ){
+        n1 = iov[i].iov_len - done;
+        if(n1 > room)
+          n1 = room;
+        if(n1 > 0 && (r = writei(f->ip, (char*)iov[i].iov_base + done, pos, n1)) != n1)
+          break;
+        pos += n1;
+        room -= n1;
+        done += n1;
+        tot += n1;
+        if(done == iov[i].iov_len){
+          i++;
+          done = 0;
+        }
+      }
+      if(off == -1)
+        f->off = pos;
       iunlock(f->ip);
       end_op();
 
       if(r < 0)
         break;
-      if(r != n1)
+      if(tot < n && room > 0)
         panic("short filewrite");
-      i += r;
     }
-    return i == n ? n : -1;
+    return tot == n ? n : -1;
   }
   panic("filewrite");
 }
 
+// Copy up to n bytes from file in to file out, neither of them
+// a pipe, through a kernel page rather than user memory.
+// Returns the number copied, which is short only at the end of
+// in, or -1 if nothing could be.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  char *page;
+  int tot, m, r;
+
+  if(in->type != FD_INODE || out->type != FD_INODE ||
+     !in->readable || !out->writable)
+    return -1;
+  if((page = kalloc(KM_KERN)) == 0)
+    return -1;
+  r = 0;
+  for(tot = 0; tot < n; tot += r){
+    m = n - tot < PGSIZE ? n - tot : PGSIZE;
+    if((r = fileread(in, page, m)) <= 0)
+      break;
+    if(filewrite(out, page, r) != r){
+      r = -1;
+      break;
+    }
+  }
+  kfree(page);
+  if(tot == 0 && r < 0)
+    return -1;
+  return tot;
+}
+
+
+// Return the events in events|POLLHUP that f is ready for.
+int
+filepoll(struct file *f, int events)
+{
+  int r;
+
+  if(f->type == FD_PIPE)
+    r = pipepoll(f->pipe);
+  else if(f->type == FD_INODE && f->ip->type == T_DEV &&
+          f->ip->major >= 0 && f->ip->major < NDEV && devsw[f->ip->major].poll)
+    r = devsw[f->ip->major].poll(f->ip);
+  else
+    r = POLLIN | POLLOUT;  // files never block
+  if(!f->readable)
+    r &= ~POLLIN;
+  if(!f->writable)
+    r &= ~POLLOUT;
+  return r & (events | POLLHUP);
+}
+
+// Start looking at files for poll(); returns the token for
+// pollwait().
+uint
+pollbegin(void)
+{
+  uint seq;
+
+  acquire(&pollq.lock);
+  pollq.nwait++;
+  seq = pollq.seq;
+  release(&pollq.lock);
+  return seq;
+}
+
+// Sleep until a file may have become ready since pollbegin()
+// returned seq, or for at most timeout ticks if timeout is
+// not negative.  Pass block 0 to end the poll without waiting.
+void
+pollwait(uint seq, int block, int timeout)
+{
+  acquire(&pollq.lock);
+  if(block && pollq.seq == seq){
+    if(timeout < 0)
+      sleep(&pollq.seq, &pollq.lock);
+    else
+      sleeptimeout(&pollq.seq, &pollq.lock, timeout);
+  }
+  pollq.nwait--;
+  release(&pollq.lock);
+}
+
+// A file may have become ready: wake the pollers.
+void
+pollwakeup(void)
+{
+  if(pollq.nwait == 0)
+    return;
+  acquire(&pollq.lock);
+  pollq.seq++;
+  wakeup(&pollq.seq);
+  release(&pollq.lock);
+}
@@ -1,6 +1,6 @@
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE } type;
-  int ref; // reference count
+  int ref; // reference count, changed atomically
   char readable;
   char writable;
   struct pipe *pipe;
@@ -8,21 +8,73 @@ struct file {
   uint off;
 };
 
+// The open files of fd tables.  An array starts with room for
+// NOFILE files, in ofile0[], and grows once, to a page of
+// NOFILEMAX.  fork() shares its parent's array copy-on-write:
+// a table copies an array with ref > 1 before changing it
+// (fdtlock()), so a shared array never changes, and holds one
+// reference to each file however many tables share it.
+struct fdarray {
+  int ref;                     // Tables using it, changed atomically
+  int nfd;                     // Size of ofile[]
+  struct file **ofile;         // Open files, by fd
+  uint used[NOFILEMAX/32];     // Bit fd is set if ofile[fd] is
+  struct file *ofile0[NOFILE];
+};
+
+// Open file descriptors.  Threads cloned with CLONE_FILES share
+// one table; fork() and plain clone() make a copy.
+struct fdtable {
+  struct spinlock lock;        // Protects arr and ref
+  int ref;                     // Number of procs using this table
+  struct fdarray *arr;
+};
+
+// Current directory, shared like fdtable by CLONE_FS.
+struct cwd {
+  struct spinlock lock;        // Protects ip and ref
+  int ref;
+  struct inode *ip;
+};
+
+// A loadable segment of a program, as exec() found it in the
+// ELF headers.  The inode keeps the list (see fs.c), so running
+// the same program again reads no headers.
+struct elfseg {
+  uint vaddr;
+  uint memsz;
+  uint off;
+  uint filesz;
+};
 
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // icache hash chain
+  struct inode *prev; // icache free list, if ref is 0
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
+  struct spinlock maplock; // and map[] against other readers
   int valid;          // inode has been read from disk?
+  uint seqoff;        // where a sequential reader would read next
+  uint goal;          // next block balloc() tries for this file
+  uint resvend;       // end of its window [goal, resvend); bsum.lock
+  uint wsize;         // length of that window; bsum.lock
+  uint txn;           // log transaction iupdate() last wrote it in
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+  uint mapblk;        // index block copied in map[], or 0
+  uint map[NINDIRECT];
+  uint elfentry;      // if nelfseg > 0, the cached ELF headers
+  int nelfseg;
+  struct elfseg elfseg[NELFSEG];
 };
 
 // table mapping major device number to
@@ -30,8 +82,13 @@ struct inode {
 struct devsw {
   int (*read)(struct inode*, char*, int);
   int (*write)(struct inode*, char*, int);
+  int (*poll)(struct inode*);  // ready POLL* events; 0 means always ready
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define PROF    2  // prof.c
+#define TRACE   3  // trace.c
+#define IRQSTAT 4  // irq.c
+#define CONSCTL 5  // console.c
@@ -0,0 +1,108 @@
+// FPU and SSE registers of user processes, switched lazily.
+//
+// Each proc has room for its registers in p->fpu, in the
+// format of fxsave.  A cpu's registers belong to the process
+// named by cpu->fpu, or to no one if it is 0, and CR0.TS is set
+// exactly when they belong to no one.  So a process that runs
+// without touching them never pays for them; the first FPU or
+// SSE instruction one does traps (T_DEVICE), and fpuload()
+// gives it its registers for the rest of its time slice.
+// sched() calls fpusave() as it gives up the cpu, so the
+// registers never stay behind on a cpu the process may not run
+// on next.
+//
+// The kernel does not use them itself.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "x86.h"
+#include "rusage.h"
+#include "proc.h"
+
+#define MXCSR_DEFAULT 0x1f80  // all SSE exceptions masked
+
+static int fpuok;  // the cpus have fxsave, fxrstor and SSE
+
+// Set up this cpu's FPU, with no one owning its registers.
+void
+fpuinit(void)
+{
+  fpuok = (cpuidedx(1) & CPUID_FXSR) && (cpuidedx(1) & CPUID_SSE);
+  if(!fpuok){
+    lcr0(rcr0() | CR0_EM);  // every FPU instruction traps
+    return;
+  }
+  lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+  lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+  mycpu()->fpu = 0;
+}
+
+// The current process has used an FPU or SSE instruction while
+// the registers are not its own: load them.  Returns -1 if
+// there is no FPU to use.  Called from trap() with interrupts
+// off.
+int
+fpuload(void)
+{
+  struct proc *p = myproc();
+
+  if(!fpuok)
+    return -1;
+  clts();
+  if(p->fpuused)
+    fxrstor(p->fpu);
+  else {
+    fninit();
+    ldmxcsr(MXCSR_DEFAULT);
+    p->fpuused = 1;
+  }
+  mycpu()->fpu = p;
+  return 0;
+}
+
+// Save p's registers to p->fpu if this cpu has them, and
+// take them from it.  Interrupts must be off.
+void
+fpusave(struct proc *p)
+{
+  struct cpu *c = mycpu();
+
+  if(c->fpu != p)
+    return;
+  fxsave(p->fpu);
+  c->fpu = 0;
+  lcr0(rcr0() | CR0_TS);
+}
+
+// Give np, a fork of the current process, a copy of its
+// registers.
+void
+fpufork(struct proc *np)
+{
+  struct proc *p = myproc();
+
+  pushcli();
+  if(mycpu()->fpu == p)
+    fxsave(p->fpu);
+  popcli();
+  memmove(np->fpu, p->fpu, sizeof(np->fpu));
+  np->fpuused = p->fpuused;
+}
+
+// The current process starts a new program: the next FPU or
+// SSE instruction it uses finds the registers reset.
+void
+fpureset(void)
+{
+  struct proc *p = myproc();
+
+  pushcli();
+  if(mycpu()->fpu == p){
+    mycpu()->fpu = 0;
+    lcr0(rcr0() | CR0_TS);
+  }
+  p->fpuused = 0;
+  popcli();
+}
@@ -8,21 +8,31 @@
 // This file contains the low-level file system manipulation
 // routines.  The (higher-level) system call implementations
 // are in sysfile.c.
+//
+// Inodes of device TMPDEV belong to tmpfs, which keeps them and
+// their data in memory (tmpfs.c); the inode functions below pass
+// them on to it where they would use the disk.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "stat.h"
+#include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "fs.h"
 #include "buf.h"
+#include "pcache.h"
 #include "file.h"
+#include "meminfo.h"
+#include "dirstat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
-static void itrunc(struct inode*);
+static int itrunc(struct inode*);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -51,30 +61,239 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// balloc() gives each in-memory inode a window of BWINDOW
+// consecutive free blocks, remembered only in memory as
+// [ip->goal, ip->resvend), and allocates the file's blocks in
+// order from it.  Other files skip blocks inside the window,
+// so files appended at the same time do not interleave on disk
+// and readahead and multi-sector transfers see long runs.
+// A file that runs off the end of its window looks for the
+// next window just past it, twice as long as the last, up to
+// BWINDOWMAX blocks: a file being appended to is laid out in
+// ever longer runs, much as if its blocks were allocated only
+// once its size were known.
+//
+// bsum.nfree[] counts the free blocks each bitmap block
+// describes, so scans skip full stretches of the disk without
+// reading them.  bsum.win[] lists the inodes that may own a
+// window.  bsum.lock serializes allocation and freeing and
+// protects the window fields of every inode.
+//
+// File data is written in place rather than through the log
+// (see log_data()), so a block freed by the transaction being
+// built must not be given new data: if the transaction never
+// commits, the block still belongs to its old file.
+// bsum.pending[] marks such blocks until bcommitted() clears
+// it; only FS calls touch it and the commit runs when there
+// are none, so it needs no lock.
+//
+// Both are sized for the disk the superblock describes, in
+// pages bsuminit() allocates: a page of nfree counts per
+// FREEPP bitmap blocks and a page of pending bits per PENDPP
+// blocks.  bsum.pendpg[] says which pending pages have bits set.
+
+#define BWINDOW 16
+#define BWINDOWMAX 256
+#define NBWIN   16
+#define FREEPP  (PGSIZE/sizeof(ushort))
+#define PENDPP  (PGSIZE*8)
+
+struct {
+  struct sleeplock lock;
+  int ready;
+  int nbmap;          // bitmap blocks in use
+  ushort *nfree[(FSMAX/BPB + FREEPP-1) / FREEPP];
+  struct inode *win[NBWIN];
+  int nextwin;        // next owner to displace when win[] is full
+  uchar *pending[FSMAX/PENDPP];  // freed since the last commit
+  uchar pendpg[FSMAX/PENDPP];
+  int npending;
+} bsum;
+
+#define NFREE(bb)   bsum.nfree[(bb)/FREEPP][(bb)%FREEPP]
+#define BPENDING(b) (bsum.pending[(b)/PENDPP][(b)%PENDPP/8] & (1 << ((b) % 8)))
+
+// Is block b inside the allocation window of an in-memory
+// inode other than ip, or, unless pend, freed since the last
+// commit?  Caller holds bsum.lock.  The ref check is racy,
+// but a stale answer only costs layout.
+static int
+breserved(struct inode *ip, uint b, int pend)
+{
+  struct inode *p;
+  int i;
+
+  if(!pend && BPENDING(b))
+    return 1;
+  if(ip == 0)
+    return 0;
+  for(i = 0; i < NBWIN; i++){
+    p = bsum.win[i];
+    if(p && p != ip && p->ref > 0 && b >= p->goal && b < p->resvend)
+      return 1;
+  }
+  return 0;
+}
+
+// Record ip as the owner of a window, taking the slot of an
+// owner that has no window left or else displacing the oldest.
+// Caller holds bsum.lock.
+static void
+bwinadd(struct inode *ip)
+{
+  struct inode *p;
+  int i;
+
+  for(i = 0; i < NBWIN; i++)
+    if(bsum.win[i] == ip)
+      return;
+  for(i = 0; i < NBWIN; i++){
+    p = bsum.win[i];
+    if(p == 0 || p->ref == 0 || p->goal >= p->resvend){
+      bsum.win[i] = ip;
+      return;
+    }
+  }
+  i = bsum.nextwin++ % NBWIN;
+  bsum.win[i]->resvend = 0;
+  bsum.win[i] = ip;
+}
+
+// Allocate bsum's tables and count the free blocks under each
+// bitmap block.  Caller holds bsum.lock.
+static void
+bsuminit(uint dev)
+{
+  int b, bi;
+  struct buf *bp;
+
+  if(sb.size > FSMAX)
+    panic("bsuminit: disk too big");
+  bsum.nbmap = (sb.size + BPB - 1) / BPB;
+  for(b = 0; b < bsum.nbmap; b += FREEPP)
+    if((bsum.nfree[b/FREEPP] = (ushort*)kzalloc(KM_KERN)) == 0)
+      panic("bsuminit: nfree");
+  for(b = 0; b < sb.size; b += PENDPP)
+    if((bsum.pending[b/PENDPP] = (uchar*)kzalloc(KM_KERN)) == 0)
+      panic("bsuminit: pending");
+  for(b = 0; b < bsum.nbmap; b++){
+    bp = bread(dev, b + sb.bmapstart);
+    for(bi = 0; bi < BPB && b*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        NFREE(b)++;
+    brelse(bp);
+  }
+  bsum.ready = 1;
+}
 
-// Allocate a zeroed disk block.
+// Find the first block at or after start, wrapping around the
+// disk, that begins a run of n free blocks outside other
+// files' windows and, unless pend, not freed since the last
+// commit.  Runs do not span bitmap blocks.  If ip is 0,
+// windows are ignored.  Returns 0 if there is none.
 static uint
-balloc(uint dev)
+bscan(uint dev, uint start, int n, struct inode *ip, int pend)
 {
-  int b, bi, m;
+  int i, bb, bi, lim, len;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+  if(start >= sb.size)
+    start = 0;
+  for(i = 0; i <= bsum.nbmap; i++){
+    bb = (start/BPB + i) % bsum.nbmap;
+    if(NFREE(bb) < n)
+      continue;
+    bp = bread(dev, bb + sb.bmapstart);
+    lim = min(BPB, sb.size - bb*BPB);
+    len = 0;
+    for(bi = (i == 0 ? start % BPB : 0); bi < lim; bi++){
+      if(bi % 8 == 0 && bi + 8 <= lim && bp->data[bi/8] == 0xff){
+        len = 0;
+        bi += 7;
+        continue;
+      }
+      if((bp->data[bi/8] & (1 << (bi % 8))) || breserved(ip, bb*BPB + bi, pend))
+        len = 0;
+      else if(++len == n){
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        return bb*BPB + bi - n + 1;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  return 0;
+}
+
+// Mark free block b in use.
+static void
+btake(uint dev, uint b)
+{
+  struct buf *bp;
+  int bi, m;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m)
+    panic("btake: block in use");
+  bp->data[bi/8] |= m;
+  log_write(bp);
+  brelse(bp);
+  NFREE(b / BPB)--;
+}
+
+// Allocate a disk block for inode ip, zeroed through the log.
+// If fresh is set, the caller will fill the block itself and
+// write it in place: then the block is not zeroed, unless it
+// was freed since the last commit, and *fresh says whether it
+// was left unzeroed.
+static uint
+balloc(struct inode *ip, int *fresh)
+{
+  uint b, n;
+  int zero;
+
+  acquiresleep(&bsum.lock);
+  if(!bsum.ready)
+    bsuminit(ip->dev);
+
+  b = 0;
+  if(ip->goal < ip->resvend && bscan(ip->dev, ip->goal, 1, ip, 0) == ip->goal)
+    b = ip->goal;                               // next block of the window
+  if(b == 0){
+    // A fresh window, longer if ip used up the last one.
+    n = BWINDOW;
+    if(ip->goal == ip->resvend && ip->wsize >= BWINDOW)
+      n = min(2*ip->wsize, BWINDOWMAX);
+    if((b = bscan(ip->dev, ip->goal, n, ip, 0)) == 0 && n > BWINDOW)
+      b = bscan(ip->dev, ip->goal, n = BWINDOW, ip, 0);
+    if(b != 0){
+      ip->resvend = b + n;
+      ip->wsize = n;
+      bwinadd(ip);
+    }
+  }
+  if(b == 0 && (b = bscan(ip->dev, ip->goal, 1, ip, 0)) != 0)
+    ip->resvend = 0;                            // fragmented: no window
+  if(b == 0 && (b = bscan(ip->dev, 0, 1, 0, 0)) != 0)
+    ip->resvend = 0;                            // take from another window
+  // Last, a block freed by this transaction: zeroing it through
+  // the log keeps its new data in the log too, but needs room.
+  if(b == 0 && logroom() > 3 && (b = bscan(ip->dev, 0, 1, 0, 1)) != 0)
+    ip->resvend = 0;
+  if(b == 0)
+    panic("balloc: out of blocks");
+  btake(ip->dev, b);
+  ip->goal = b + 1;
+  zero = fresh == 0 || BPENDING(b);
+  releasesleep(&bsum.lock);
+
+  if(zero)
+    bzero(ip->dev, b);
+  if(fresh)
+    *fresh = !zero;
+  return b;
 }
 
 // Free a disk block.
@@ -84,6 +303,9 @@ bfree(int dev, uint b)
   struct buf *bp;
   int bi, m;
 
+  acquiresleep(&bsum.lock);
+  if(!bsum.ready)
+    bsuminit(dev);
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
@@ -92,6 +314,29 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  NFREE(b / BPB)++;
+  bsum.pending[b/PENDPP][b%PENDPP/8] |= 1 << (b % 8);
+  bsum.pendpg[b/PENDPP] = 1;
+  bsum.npending++;
+  releasesleep(&bsum.lock);
+}
+
+// The transaction that freed the pending blocks has committed,
+// so they may take new data.  Called by commit().
+void
+bcommitted(void)
+{
+  int i;
+
+  if(bsum.npending){
+    for(i = 0; i < NELEM(bsum.pendpg); i++){
+      if(bsum.pendpg[i]){
+        memset(bsum.pending[i], 0, PGSIZE);
+        bsum.pendpg[i] = 0;
+      }
+    }
+    bsum.npending = 0;
+  }
 }
 
 // Inodes.
@@ -134,7 +379,11 @@ bfree(int dev, uint b)
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
-//   has first locked the inode.
+//   has first locked the inode.  ilockshared() locks it
+//   only against modification, so that readi(), dirlookup()
+//   and stati() in several processes can run at once; the
+//   little those change (map[], seqoff, the page cache) is
+//   kept safe for concurrent readers.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -159,26 +408,100 @@ bfree(int dev, uint b)
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
 //
+// Entries are hashed by (dev, inum).  An entry whose ref falls
+// to zero stays hashed, and still valid, on the free list, so
+// that iget() of a recently used inode need not read the disk;
+// iget() recycles the least recently released entry.  iinit()
+// adds entries beyond the static NINODE in proportion to memory.
+//
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+
+  // Unreferenced entries, through prev/next.
+  // free.next is most recently released.
+  struct inode free;
+  int n;               // number of entries
+  uint lastiblk;       // inode block ilock() read last, a hint
 } icache;
 
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIHASH;
+}
+
+// Put ip at the front of the free list.
+// Caller must hold icache.lock.
+static void
+ifreeput(struct inode *ip)
+{
+  ip->next = icache.free.next;
+  ip->prev = &icache.free;
+  icache.free.next->prev = ip;
+  icache.free.next = ip;
+}
+
+// Take ip off the free list.
+// Caller must hold icache.lock.
+static void
+ifreetake(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+// Add entries from a slab cache, 1/ICACHEFRAC of physical
+// memory's worth, up to NINODEMAX in all, but no more than the
+// disk has inodes.
+static void
+igrow(void)
+{
+  static struct kmcache inodecache;
+  struct inode *ip;
+  uint n;
+
+  kmcacheinit(&inodecache, "inode", sizeof(struct inode), 0);
+  for(n = phystop/ICACHEFRAC/inodecache.slot; n > 0; n--){
+    if(icache.n >= NINODEMAX || icache.n >= sb.ninodes)
+      break;
+    if((ip = slaballoc(&inodecache)) == 0)
+      break;
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    initlock(&ip->maplock, "inodemap");
+    acquire(&icache.lock);
+    ifreeput(ip);
+    icache.n++;
+    release(&icache.lock);
+  }
+}
+
 void
 iinit(int dev)
 {
   int i = 0;
   
   initlock(&icache.lock, "icache");
+  initsleeplock(&bsum.lock, "bsum");
+  icache.free.prev = &icache.free;
+  icache.free.next = &icache.free;
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    initlock(&icache.inode[i].maplock, "inodemap");
+    ifreeput(&icache.inode[i]);
   }
+  icache.n = NINODE;
 
   readsb(dev, &sb);
+  igrow();
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
@@ -198,6 +521,8 @@ ialloc(uint dev, short type)
   struct buf *bp;
   struct dinode *dip;
 
+  if(dev == TMPDEV)
+    return (inum = tmpialloc(type)) ? iget(dev, inum) : 0;
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
@@ -213,6 +538,32 @@ ialloc(uint dev, short type)
   panic("ialloc: no inodes");
 }
 
+// Inodes that have lost their last link and reference, for
+// freer() to truncate and free, through ip->next: they are not
+// on the free list, since freer() holds a reference to each.
+// Freeing a big file takes many transactions, and unlink()
+// does not wait for it.  The superblock counts the inodes
+// whose links are gone but which are not yet free, so that at
+// boot orphanscan() knows whether a crash left any behind.
+static struct {
+  struct spinlock lock;
+  struct inode *head;
+  int dev;
+} orphans;
+
+// Add n to the superblock's count of orphans, in the caller's
+// transaction.
+static void
+sborphan(uint dev, int n)
+{
+  struct buf *bp;
+
+  bp = bread(dev, 1);
+  ((struct superblock*)bp->data)->norphan += n;
+  log_write(bp);
+  brelse(bp);
+}
+
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
 // that lives on disk, since i-node cache is write-through.
@@ -223,8 +574,17 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
+  if(ip->dev == TMPDEV){
+    tmpiupdate(ip);
+    return;
+  }
+  ip->txn = logtxn();
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
+  if(dip->nlink > 0 && ip->nlink == 0 && ip->type != 0)
+    sborphan(ip->dev, 1);   // its last link is gone
+  else if(dip->type != 0 && ip->type == 0)
+    sborphan(ip->dev, -1);  // and now it is free
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
@@ -241,31 +601,45 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
+  uint h;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  h = ihash(dev, inum);
+  for(ip = icache.hash[h]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        ifreetake(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Recycle the least recently released entry.
+  ip = icache.free.prev;
+  if(ip == &icache.free)
     panic("iget: no inodes");
-
-  ip = empty;
+  ifreetake(ip);
+  if(ip->inum){
+    for(pp = &icache.hash[ihash(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
+  ip->hnext = icache.hash[h];
+  icache.hash[h] = ip;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->seqoff = 0;
+  ip->mapblk = 0;
+  ip->goal = 0;
+  ip->resvend = 0;
+  ip->wsize = 0;
+  ip->txn = logtxn();  // its last update may not have committed
+  ip->nelfseg = 0;
   release(&icache.lock);
 
   return ip;
@@ -289,6 +663,7 @@ ilock(struct inode *ip)
 {
   struct buf *bp;
   struct dinode *dip;
+  uint bno;
 
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
@@ -296,36 +671,80 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode*)bp->data + ip->inum%IPB;
-    ip->type = dip->type;
-    ip->major = dip->major;
-    ip->minor = dip->minor;
-    ip->nlink = dip->nlink;
-    ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
-    brelse(bp);
+    if(ip->dev == TMPDEV)
+      tmpiload(ip);
+    else {
+      // Reading through the inode table in order, as stat()s
+      // of the files of a directory made at once do: start on
+      // the next block too.
+      bno = IBLOCK(ip->inum, sb);
+      if(bno == icache.lastiblk + 1 && bno + 1 < sb.bmapstart)
+        bprefetch(ip->dev, bno + 1);
+      icache.lastiblk = bno;
+      bp = bread(ip->dev, bno);
+      dip = (struct dinode*)bp->data + ip->inum%IPB;
+      ip->type = dip->type;
+      ip->major = dip->major;
+      ip->minor = dip->minor;
+      ip->nlink = dip->nlink;
+      ip->size = dip->size;
+      memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+      brelse(bp);
+    }
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
   }
 }
 
-// Unlock the given inode.
+// Start reading ip's block of the inode table, if ilock() will
+// need it, without waiting, so that a caller about to lock many
+// inodes has the disk fetch their blocks together.
+static void
+iprefetch(struct inode *ip)
+{
+  if(!ip->valid && ip->dev != TMPDEV)
+    bprefetch(ip->dev, IBLOCK(ip->inum, sb));
+}
+
+// Lock ip in shared mode, for reading only: its data, and the
+// entries of a directory.  Other readers may hold it too.  An
+// inode not yet read from disk is locked exclusive instead, as
+// ilock() reads it in.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquiresleepshared(&ip->lock);
+  if(ip->valid)
+    return;
+  releasesleepshared(&ip->lock);
+  ilock(ip);
+}
+
+// Unlock the given inode, locked either way.
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+  if(ip == 0 || ip->ref < 1)
     panic("iunlock");
 
-  releasesleep(&ip->lock);
+  if(ip->lock.locked){
+    if(!holdingsleep(&ip->lock))
+      panic("iunlock");
+    releasesleep(&ip->lock);
+  } else
+    releasesleepshared(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
 // be recycled.
 // If that was the last reference and the inode has no links
-// to it, free the inode (and its content) on disk.
+// to it, free the inode (and its content) on disk: freer()
+// does so later, except for tmpfs.
 // All calls to iput() must be inside a transaction in
 // case it has to free the inode.
 void
@@ -336,6 +755,17 @@ iput(struct inode *ip)
     acquire(&icache.lock);
     int r = ip->ref;
     release(&icache.lock);
+    if(r == 1 && ip->dev != TMPDEV){
+      // No links and no other references: leave the inode, and
+      // this reference, to freer().
+      releasesleep(&ip->lock);
+      acquire(&orphans.lock);
+      ip->next = orphans.head;
+      orphans.head = ip;
+      wakeup(&orphans);
+      release(&orphans.lock);
+      return;
+    }
     if(r == 1){
       // inode has no links and no other references: truncate and free.
       itrunc(ip);
@@ -347,7 +777,8 @@ iput(struct inode *ip)
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0)
+    ifreeput(ip);
   release(&icache.lock);
 }
 
@@ -365,19 +796,58 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT].  The last NDINDIRECT
+// blocks hang off the double-indirect block ip->addrs[NDIRECT+1],
+// which lists up to NINDIRECT further indirect blocks.
+//
+// ip->map[] keeps a copy of the index block bmap() used last,
+// so a sequential pass over a large file reads each index
+// block once rather than once per data block.
+
+// Return entry i of index block addr in inode ip,
+// allocating a block for it if there is none (see balloc()
+// for fresh).  Readers holding ip->lock shared may be here at
+// once, so map[] is only touched under ip->maplock; only a
+// writer, holding ip->lock exclusive, allocates.
+static uint
+bindex(struct inode *ip, uint addr, uint i, int *fresh)
+{
+  uint x, *a;
+  struct buf *bp;
+
+  acquire(&ip->maplock);
+  x = ip->mapblk == addr ? ip->map[i] : 0;
+  release(&ip->maplock);
+  if(x != 0)
+    return x;
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((x = a[i]) == 0){
+    a[i] = x = balloc(ip, fresh);
+    log_write(bp);
+  }
+  acquire(&ip->maplock);
+  memmove(ip->map, a, BSIZE);
+  ip->mapblk = addr;
+  release(&ip->maplock);
+  brelse(bp);
+  return x;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, zeroed unless
+// the caller passes fresh (see balloc()).  Index blocks are
+// always zeroed.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int *fresh)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
 
+  if(fresh)
+    *fresh = 0;
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip, fresh);
     return addr;
   }
   bn -= NDIRECT;
@@ -385,53 +855,173 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+      ip->addrs[NDIRECT] = addr = balloc(ip, 0);
+    return bindex(ip, addr, bn, fresh);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloc(ip, 0);
+    addr = bindex(ip, addr, bn / NINDIRECT, 0);
+    return bindex(ip, addr, bn % NINDIRECT, fresh);
   }
 
   panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
+// Log blocks a step of itrunc() keeps in hand for the next
+// block it frees: its bitmap block, the two index blocks above
+// it, the inode and the superblock.
+#define TRUNCROOM 5
+
+// Free the blocks index block addr lists, from the end, and at
+// level 2 the blocks the index blocks it lists list in turn,
+// while the caller's transaction has room.  Once they are all
+// free, free addr too and return 1; otherwise clear the entries
+// of the blocks freed and return 0.
+static int
+ifreeindex(struct inode *ip, uint addr, int level)
+{
+  int j, done, changed;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  done = 1;
+  changed = 0;
+  for(j = NINDIRECT-1; j >= 0; j--){
+    if(a[j] == 0)
+      continue;
+    if(logroom() <= TRUNCROOM || (level > 1 && !ifreeindex(ip, a[j], level-1))){
+      done = 0;
+      break;
+    }
+    if(level == 1)
+      bfree(ip->dev, a[j]);
+    a[j] = 0;
+    changed = 1;
+  }
+  if(done)
+    bfree(ip->dev, addr);  // what it holds no longer matters
+  else if(changed)
+    log_write(bp);
+  brelse(bp);
+  return done;
+}
+
+// Truncate inode (discard contents), as much of it as the
+// caller's transaction has room for; return 1 once it is all
+// gone.  The inode is consistent on disk after every step.
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
 // and has no in-memory reference to it (is
 // not an open file or current directory).
-static void
+static int
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  if(ip->dev == TMPDEV)
+    tmptrunc(ip);  // its addrs[] are all zero
+  ip->mapblk = 0;
+  ip->nelfseg = 0;
+  if(ip->size > 0){
+    pcinval(ip->dev, ip->inum);
+    if(ip->type == T_DIR)
+      dcinval(ip->dev, ip->inum);
+    ip->size = 0;
+  }
 
-  for(i = 0; i < NDIRECT; i++){
+  for(i = 0; i < NDIRECT && logroom() > TRUNCROOM; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
       ip->addrs[i] = 0;
     }
   }
+  if(ip->addrs[NDIRECT] && logroom() > TRUNCROOM &&
+     ifreeindex(ip, ip->addrs[NDIRECT], 1))
+    ip->addrs[NDIRECT] = 0;
+  if(ip->addrs[NDIRECT+1] && logroom() > TRUNCROOM &&
+     ifreeindex(ip, ip->addrs[NDIRECT+1], 2))
+    ip->addrs[NDIRECT+1] = 0;
+  iupdate(ip);
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < NDIRECT+2; i++)
+    if(ip->addrs[i])
+      return 0;
+  return 1;
+}
+
+// Queue the inodes of dev a crash left with no links but not
+// freed, if the superblock says there are any.  Runs once the
+// log has been recovered.
+static void
+orphanscan(uint dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  struct inode *ip;
+  uint inum;
+
+  readsb(dev, &sb);
+  if(sb.norphan == 0)
+    return;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type != 0 && dip->nlink == 0){
+      ip = iget(dev, inum);
+      acquire(&orphans.lock);
+      ip->next = orphans.head;
+      orphans.head = ip;
+      release(&orphans.lock);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+}
 
-  ip->size = 0;
-  iupdate(ip);
+// The kernel thread that frees orphans, each over as many
+// transactions as it takes.
+static void
+freer(void *arg)
+{
+  struct inode *ip;
+  int done;
+
+  orphanscan(orphans.dev);
+  for(;;){
+    acquire(&orphans.lock);
+    while((ip = orphans.head) == 0)
+      sleep(&orphans, &orphans.lock);
+    orphans.head = ip->next;
+    release(&orphans.lock);
+
+    do {
+      begin_op();
+      ilock(ip);
+      if((done = itrunc(ip)) != 0){
+        ip->type = 0;
+        iupdate(ip);
+        ip->valid = 0;
+      }
+      iunlock(ip);
+      if(done)
+        iput(ip);  // not valid: just drops the reference
+      end_op();
+    } while(!done);
+  }
+}
+
+// Start freer() on dev, after initlog().
+void
+orphaninit(int dev)
+{
+  initlock(&orphans.lock, "orphans");
+  orphans.dev = dev;
+  if(kthreadstart(freer, 0, "ifree") < 0)
+    panic("orphaninit");
 }
 
 // Copy stat information from inode.
@@ -446,14 +1036,101 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Copy n bytes at off in ip from the buffer cache.
+// Caller must hold ip->lock.
+static void
+readblocks(struct inode *ip, char *dst, uint off, uint n)
+{
+  uint tot, m;
+  struct buf *bp;
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 0));
+    m = min(n - tot, BSIZE - off%BSIZE);
+    memmove(dst, bp->data + off%BSIZE, m);
+    brelse(bp);
+  }
+}
+
+// Return page pgno of ip from the page cache, reading
+// it in if need be, or 0 if there is no memory for it.
+// The blocks of the page past the end of the file are
+// zero, which is what writei() will find in them
+// once they are allocated.
+// Caller must hold ip->lock.
+static struct cpage*
+pcfill(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+  struct buf *bp;
+  uint i, off;
+
+  if((cp = pcget(ip->dev, ip->inum, pgno)) == 0)
+    return 0;
+  if(cp->valid || !pcclaim(cp))
+    return cp;
+  // Queue all the page's blocks at once before waiting on any.
+  for(off = pgno*PGSIZE; off < ip->size && off < (pgno+1)*PGSIZE; off += BSIZE)
+    bprefetch(ip->dev, bmap(ip, off/BSIZE, 0));
+  for(i = 0; i < PGSIZE/BSIZE; i++){
+    off = pgno*PGSIZE + i*BSIZE;
+    if(off < ip->size){
+      bp = bread(ip->dev, bmap(ip, off/BSIZE, 0));
+      memmove(cp->data + i*BSIZE, bp->data, BSIZE);
+      brelse(bp);
+    } else
+      memset(cp->data + i*BSIZE, 0, BSIZE);
+  }
+  pcfilled(cp);
+  return cp;
+}
+
+// Start reading the NREADAHEAD blocks of ip from off on
+// into the buffer cache, skipping pages that are in the page
+// cache already.  Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off)
+{
+  uint end;
+
+  end = min(ip->size, off + NREADAHEAD*BSIZE);
+  for(off -= off%BSIZE; off < end; off += BSIZE)
+    if(!pchas(ip->dev, ip->inum, off/PGSIZE))
+      bprefetch(ip->dev, bmap(ip, off/BSIZE, 0));
+}
+
 //PAGEBREAK!
+// Return the page-cache page holding the page of ip at
+// page-aligned offset off, with a kref() reference for the
+// caller, who may map it into user memory but must never write
+// it; pcwrite() drops such pages from the cache rather than
+// change them.  Returns 0 if there is no memory to cache the
+// page in.  Caller must hold ip->lock.
+char*
+readipage(struct inode *ip, uint off)
+{
+  struct cpage *cp;
+  char *mem;
+
+  if(ip->type == T_DEV || off % PGSIZE || off >= ip->size)
+    return 0;
+  if(ip->dev == TMPDEV)
+    return tmppage(ip, off);
+  if((cp = pcfill(ip, off/PGSIZE)) == 0)
+    return 0;
+  mem = cp->data;
+  kref(mem);
+  pcput(cp);
+  return mem;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  struct cpage *cp;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -465,13 +1142,33 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(ip->dev == TMPDEV)
+    return tmpread(ip, dst, off, n);
 
+  // File data comes from the page cache, or straight from
+  // the buffer cache if there is no memory to cache it in.
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
-    brelse(bp);
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((cp = pcfill(ip, off/PGSIZE)) == 0){
+      readblocks(ip, dst, off, m);
+      continue;
+    }
+    // A whole page for a page of user memory: hand the process
+    // the cached page itself, copy-on-write, instead of a copy.
+    if(m == PGSIZE && (uint)dst < KERNBASE && (uint)dst % PGSIZE == 0 &&
+       uvmsharepage((uint)dst, cp->data) == 0){
+      pcput(cp);
+      continue;
+    }
+    memmove(dst, cp->data + off%PGSIZE, m);
+    pcput(cp);
   }
+
+  // Reading on from where the last read stopped: get the disk
+  // started on what comes next while the caller works on this.
+  if(n > 0 && off - n == ip->seqoff)
+    readahead(ip, off);
+  ip->seqoff = off;
   return n;
 }
 
@@ -481,7 +1178,8 @@ readi(struct inode *ip, char *dst, uint off, uint n)
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
+  int fresh, r;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -494,14 +1192,39 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  ip->nelfseg = 0;  // the ELF headers may change
+
+  if(ip->dev == TMPDEV){
+    if((r = tmpwrite(ip, src, off, n)) > 0 && off + r > ip->size){
+      ip->size = off + r;
+      iupdate(ip);
+    }
+    return r;
+  }
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if(ip->type != T_FILE){
+      // Directory contents are metadata: log them.
+      bp = bread(ip->dev, bmap(ip, off/BSIZE, 0));
+      memmove(bp->data + off%BSIZE, src, m);
+      log_write(bp);
+      brelse(bp);
+      continue;
+    }
+    // File data goes to disk in place (see log_data()).  A
+    // fresh block, or one overwritten entirely, need not be read.
+    addr = bmap(ip, off/BSIZE, &fresh);
+    if(fresh || m == BSIZE){
+      bp = bnew(ip->dev, addr);
+      if(m != BSIZE)
+        memset(bp->data, 0, BSIZE);
+    } else
+      bp = bread(ip->dev, addr);
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
-    brelse(bp);
+    log_data(bp);
   }
+  pcwrite(ip->dev, ip->inum, src - n, off - n, n);
 
   if(n > 0 && off > ip->size){
     ip->size = off;
@@ -519,31 +1242,323 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// Is dp a hashed directory?  A flat one starts with ".".
+static int
+dirhashed(struct inode *dp)
 {
-  uint off, inum;
-  struct dirent de;
+  struct dirbucket h;
 
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
+  if(dp->size < BSIZE || readi(dp, (char*)&h, 0, sizeof(h)) != sizeof(h))
+    return 0;
+  return h.zero == 0 && h.magic == DIRMAGIC;
+}
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
+// Read the header of bucket bk of hashed directory dp.
+static void
+dirhead(struct inode *dp, uint bk, struct dirbucket *h)
+{
+  if(readi(dp, (char*)h, bk*BSIZE, sizeof(*h)) != sizeof(*h) || h->magic != DIRMAGIC)
+    panic("dirhead");
+}
+
+// Return the first bucket for name in hashed directory dp.
+static uint
+dirbucket(struct inode *dp, char *name)
+{
+  struct dirindex *x = 0;
+  ushort depth, bk;
+  uint i;
+
+  if(readi(dp, (char*)&depth, (uint)&x->depth, sizeof(depth)) != sizeof(depth))
+    panic("dirbucket");
+  i = dirhash(name) & ((1 << depth) - 1);
+  if(readi(dp, (char*)&bk, (uint)&DIRPTR(x, i), sizeof(bk)) != sizeof(bk))
+    panic("dirbucket");
+  return bk;
+}
+
+// Look for name among the dirents in [off, end) of dp.
+// Return its inum, setting *poff, or 0.
+static uint
+dirfind(struct inode *dp, char *name, uint off, uint end, uint *poff)
+{
+  struct dirent de;
+
+  for(; off < end; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
       continue;
     if(namecmp(name, de.name) == 0){
       // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      *poff = off;
+      return de.inum;
     }
   }
+  return 0;
+}
+
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint off, inum, bk;
+  struct dirbucket h;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if(dclookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
 
+  inum = 0;
+  if(dirhashed(dp)){
+    for(bk = dirbucket(dp, name); bk && inum == 0; bk = h.next){
+      dirhead(dp, bk, &h);
+      inum = dirfind(dp, name, bk*BSIZE + sizeof(h), (bk+1)*BSIZE, &off);
+    }
+  } else
+    inum = dirfind(dp, name, 0, dp->size, &off);
+
+  if(inum == 0){
+    dcenter(dp->dev, dp->inum, name, 0, 0);
+    return 0;
+  }
+  dcenter(dp->dev, dp->inum, name, inum, off);
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
+}
+
+// Look name up in directory dp through the dcache alone,
+// without dp's lock, for namex().  dp must be referenced; the
+// dcache only has names for directories.  Returns the inode,
+// or 0 if the dcache doesn't know or the name changed.
+static struct inode*
+dirpeek(struct inode *dp, char *name)
+{
+  struct inode *ip;
+  uint inum, again;
+
+  if(!dcpeek(dp->dev, dp->inum, name, &inum) || inum == 0)
+    return 0;
+  ip = iget(dp->dev, inum);
+  // The inode can't be freed now; make sure it wasn't before.
+  if(dcpeek(dp->dev, dp->inum, name, &again) && again == inum)
+    return ip;
+  iput(ip);
+  return 0;
+}
+
+// Fill in ds[] with up to n entries of directory dp, from byte
+// *off on, and the stat of each inode; advance *off past them.
+// Returns the number filled in, or -1 if dp is not a directory.
+// Like namex(), holds one inode lock at a time: a batch of
+// entries is pinned with iget() under dp's lock, then each is
+// locked for stati() after.  Caller is in a transaction.
+int
+dirstat(struct inode *dp, uint *off, struct direntstat *ds, int n)
+{
+  struct inode *ip[DIRSTATBATCH];
+  struct dirent de;
+  int got, m, i;
+
+  for(got = 0; got < n; got += m){
+    ilockshared(dp);
+    if(dp->type != T_DIR){
+      iunlock(dp);
+      return -1;
+    }
+    for(m = 0; m < n - got && m < DIRSTATBATCH && *off < dp->size; *off += sizeof(de)){
+      if(readi(dp, (char*)&de, *off, sizeof(de)) != sizeof(de))
+        panic("dirstat read");
+      if(de.inum == 0)
+        continue;
+      ds[got+m].de = de;
+      ip[m++] = iget(dp->dev, de.inum);
+    }
+    iunlock(dp);
+    if(m == 0)
+      break;
+    for(i = 0; i < m; i++)
+      if(i == 0 || ip[i]->inum/IPB != ip[i-1]->inum/IPB)
+        iprefetch(ip[i]);
+    for(i = 0; i < m; i++){
+      ilockshared(ip[i]);
+      stati(ip[i], &ds[got+i].st);
+      iunlockput(ip[i]);
+    }
+  }
+  return got;
+}
+
+// Write bucket header h as bucket bk of dp.
+static void
+dirsethead(struct inode *dp, uint bk, struct dirbucket *h)
+{
+  if(writei(dp, (char*)h, bk*BSIZE, sizeof(*h)) != sizeof(*h))
+    panic("dirsethead");
+}
+
+// Add an empty bucket of depth depth at the end of dp.
+// Return its block number, or 0 if dp is too big.
+static uint
+diraddbucket(struct inode *dp, ushort depth)
+{
+  struct dirbucket h;
+  uint bk;
+
+  bk = dp->size / BSIZE;
+  if(bk > 0xffff || bk >= MAXFILE)
+    return 0;
+  memset(&h, 0, sizeof(h));
+  h.magic = DIRMAGIC;
+  h.depth = depth;
+  dirsethead(dp, bk, &h);
+  // The rest of the block is zero (balloc clears it): free dirents.
+  dp->size = (bk+1)*BSIZE;
+  iupdate(dp);
+  return bk;
+}
+
+// Split full bucket bk of hashed directory dp, whose header
+// is h, moving the names with bit h->depth of their hash set to
+// a new bucket, and doubling the index first if need be.
+static int
+dirsplit(struct inode *dp, uint bk, struct dirbucket *h)
+{
+  char *mem;
+  struct dirindex *x;
+  struct dirent *old, *new;
+  struct dirbucket *oh, *nh;
+  uint i, j, k, nb, d;
+
+  if((mem = kalloc(KM_KERN)) == 0)
+    return -1;
+  x = (struct dirindex*)mem;
+  old = (struct dirent*)(mem + BSIZE);
+  new = (struct dirent*)(mem + 2*BSIZE);
+  if(readi(dp, (char*)x, 0, BSIZE) != BSIZE ||
+     readi(dp, (char*)old, bk*BSIZE, BSIZE) != BSIZE)
+    panic("dirsplit read");
+
+  d = h->depth;
+  if(d == x->depth){
+    for(i = 0; i < (1 << d); i++)
+      DIRPTR(x, i + (1 << d)) = DIRPTR(x, i);
+    x->depth++;
+  }
+  nb = dp->size / BSIZE;
+  if(nb > 0xffff || nb >= MAXFILE){
+    kfree(mem);
+    return -1;
+  }
+  for(i = 0; i < (1 << x->depth); i++)
+    if(DIRPTR(x, i) == bk && ((i >> d) & 1))
+      DIRPTR(x, i) = nb;
+
+  memset(new, 0, BSIZE);
+  oh = (struct dirbucket*)old;
+  nh = (struct dirbucket*)new;
+  nh->magic = DIRMAGIC;
+  oh->depth = nh->depth = d + 1;
+  for(j = k = 1; j < DPB; j++){
+    if(old[j].inum && ((dirhash(old[j].name) >> d) & 1)){
+      new[k++] = old[j];
+      memset(&old[j], 0, sizeof(old[j]));
+    }
+  }
+
+  if(writei(dp, (char*)new, nb*BSIZE, BSIZE) != BSIZE ||
+     writei(dp, (char*)old, bk*BSIZE, BSIZE) != BSIZE ||
+     writei(dp, (char*)x, 0, BSIZE) != BSIZE)
+    panic("dirsplit write");
+  kfree(mem);
+  dcinval(dp->dev, dp->inum);    // names have moved
+  return 0;
+}
+
+// Return the offset of a free dirent for name in hashed
+// directory dp, splitting its bucket or chaining a new one
+// if the bucket is full.  Returns -1 if dp cannot grow.
+static int
+dirslot(struct inode *dp, char *name, int cansplit)
+{
+  struct dirent de;
+  struct dirbucket h;
+  uint head, bk, off;
+
+again:
+  head = bk = dirbucket(dp, name);
+  for(;;){
+    dirhead(dp, bk, &h);
+    for(off = bk*BSIZE + sizeof(h); off < (bk+1)*BSIZE; off += sizeof(de)){
+      if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirslot read");
+      if(de.inum == 0)
+        return off;
+    }
+    if(h.next == 0)
+      break;
+    bk = h.next;
+  }
+
+  // Split only a bucket without overflow buckets, and only
+  // once per call, to bound the blocks one call writes.
+  if(cansplit && bk == head && h.depth < DIRDEPTH){
+    if(dirsplit(dp, bk, &h) < 0)
+      return -1;
+    cansplit = 0;
+    goto again;
+  }
+  if((h.next = diraddbucket(dp, h.depth)) == 0)
+    return -1;
+  dirsethead(dp, bk, &h);
+  return h.next*BSIZE + sizeof(h);
+}
+
+// Turn flat directory dp, one full block, into a hashed
+// directory with two buckets.
+static int
+dirconvert(struct inode *dp)
+{
+  char *mem;
+  struct dirindex *x;
+  struct dirent *de;
+  int i, off;
+
+  if((mem = kalloc(KM_KERN)) == 0)
+    return -1;
+  de = (struct dirent*)mem;
+  x = (struct dirindex*)(mem + BSIZE);
+  if(readi(dp, (char*)de, 0, BSIZE) != BSIZE)
+    panic("dirconvert read");
+
+  memset(x, 0, BSIZE);
+  x->magic = DIRMAGIC;
+  x->depth = 1;
+  DIRPTR(x, 0) = 1;
+  DIRPTR(x, 1) = 2;
+  if(writei(dp, (char*)x, 0, BSIZE) != BSIZE)
+    panic("dirconvert write");
+  if(diraddbucket(dp, 1) != 1 || diraddbucket(dp, 1) != 2)
+    panic("dirconvert grow");
+
+  for(i = 0; i < DPB; i++){
+    if(de[i].inum == 0)
+      continue;
+    if((off = dirslot(dp, de[i].name, 0)) < 0 ||
+       writei(dp, (char*)&de[i], off, sizeof(de[i])) != sizeof(de[i]))
+      panic("dirconvert");
+  }
+  kfree(mem);
+  dcinval(dp->dev, dp->inum);    // names have moved
   return 0;
 }
 
@@ -561,18 +1576,31 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dirhashed(dp))
+    off = dirslot(dp, name, 1);
+  else {
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+    // A full one-block directory becomes hashed.
+    if(off == BSIZE && dp->size == BSIZE){
+      if(dirconvert(dp) < 0)
+        return -1;
+      off = dirslot(dp, name, 1);
+    }
   }
+  if(off < 0)
+    return -1;
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcenter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
@@ -617,6 +1645,35 @@ skipelem(char *path, char *name)
   return path;
 }
 
+// The one mount: tmpfs's root, mnt.root, on the disk directory
+// mnt.on.  Both stay referenced, so namex() can compare inode
+// pointers without a lock; they are set once, by mount().
+static struct {
+  int taken;
+  struct inode *on;
+  struct inode *root;
+} mnt;
+
+// Mount tmpfs on directory dp, which the caller has locked.
+// There is only one tmpfs and it can't be unmounted.
+int
+mount(struct inode *dp)
+{
+  struct inode *root;
+
+  if(dp->type != T_DIR || dp->dev == TMPDEV || __sync_lock_test_and_set(&mnt.taken, 1))
+    return -1;
+  root = iget(TMPDEV, ROOTINO);
+  ilock(root);
+  if(dirlink(root, ".", ROOTINO) < 0 || dirlink(root, "..", ROOTINO) < 0)
+    panic("mount");
+  iunlock(root);
+  mnt.root = root;
+  __sync_synchronize();
+  mnt.on = idup(dp);
+  return 0;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
@@ -629,24 +1686,40 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = cwdget(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
-    if(ip->type != T_DIR){
-      iunlockput(ip);
-      return 0;
+    // ".." out of a mounted root goes up from what it is on.
+    if(ip == mnt.root && namecmp(name, "..") == 0){
+      iput(ip);
+      ip = idup(mnt.on);
     }
-    if(nameiparent && *path == '\0'){
-      // Stop one level early.
+    // A name the dcache knows needs no lock on ip.
+    next = 0;
+    if(!nameiparent || *path != '\0')
+      next = dirpeek(ip, name);
+    if(next == 0){
+      ilockshared(ip);
+      if(ip->type != T_DIR){
+        iunlockput(ip);
+        return 0;
+      }
+      if(nameiparent && *path == '\0'){
+        // Stop one level early.
+        iunlock(ip);
+        return ip;
+      }
+      if((next = dirlookup(ip, name, 0)) == 0){
+        iunlockput(ip);
+        return 0;
+      }
       iunlock(ip);
-      return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
-      return 0;
+    iput(ip);
+    if(next == mnt.on){  // a mount point: go on in the mounted root
+      iput(next);
+      next = idup(mnt.root);
     }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
@@ -7,7 +7,7 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                              free bit map | data blocks | swap ]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -19,11 +19,15 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of the swap area, after the file system
+  uint nswap;        // Number of swap blocks
+  uint norphan;      // Inodes whose links are gone, not yet freed
 };
 
-#define NDIRECT 12
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +36,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
@@ -55,3 +59,49 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+#define DPB (BSIZE / sizeof(struct dirent))   // dirents per block
+
+// A directory that outgrows one block is hashed, by extendible
+// hashing on dirhash() of the name.  Block 0 becomes an index
+// of 1<<depth bucket block numbers, and each bucket block starts
+// with a struct dirbucket and holds DPB-1 dirents.  A bucket
+// that cannot be split chains to overflow buckets through next.
+// Every 16-byte record of the index and of bucket headers starts
+// with a zero inum, so programs that read a directory as an array
+// of dirents, like ls, see them as free entries.
+#define DIRMAGIC 0xd1e5
+#define DIRDEPTH 7     // maximum index depth
+
+struct dirindex {
+  ushort zero;
+  ushort magic;        // DIRMAGIC
+  ushort depth;
+  ushort pad[5];
+  struct {
+    ushort zero;
+    ushort b[7];
+  } ptr[BSIZE/16 - 1];
+};
+
+// Bucket number i of a struct dirindex *x.
+#define DIRPTR(x, i) ((x)->ptr[(i)/7].b[(i)%7])
+
+struct dirbucket {
+  ushort zero;
+  ushort magic;        // DIRMAGIC
+  ushort depth;        // index bits all names in the bucket share
+  ushort next;         // block of the overflow bucket, or 0
+  ushort pad[4];
+};
+
+static inline uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
@@ -0,0 +1,291 @@
+// fsbench: file system benchmarks.
+//   fsbench [kb [nfiles [nprocs]]]
+// writes a kb-KB file (default 1024) and reads it back, creates
+// and unlinks nfiles small files (default 200), times mkdir,
+// link and stat over as many names, then has nprocs processes
+// (default 4) each write and read a file of kb/nprocs KB at
+// once.  Bandwidths are in KB/sec, the rest in ops/sec.  The
+// last line has every result for scripts:
+//   fsbench kb=.. seqwrite=.. seqread=.. create=.. unlink=..
+//     mkdir=.. link=.. lookup=.. parwrite=.. parread=..
+// Times come from the TSC, so compare runs on one machine.
+// Where the cpu has performance counters (perfctr()), each
+// result but the last line is followed by the thousands of
+// cycles and instructions and the cache and branch misses it
+// took, counted for fsbench and its children.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "rusage.h"
+#include "fcntl.h"
+
+#define CHUNK 8192
+
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
+char buf[CHUNK];
+uint cpus;  // TSC cycles per microsecond
+int pmcmask;          // PMC_ events perfctr() says are counted
+uint64 pmc0[NPMC];    // their counts when the run began
+uint64 pmc1[NPMC];    // and when it ended
+
+// Event counts of this process and its waited-for children
+// so far.
+void
+pmcsnap(uint64 *pmc)
+{
+  struct rusage self, kids;
+  int i;
+
+  getrusage(0, RUSAGE_SELF, &self);
+  getrusage(0, RUSAGE_CHILDREN, &kids);
+  for(i = 0; i < NPMC; i++)
+    pmc[i] = self.pmc[i] + kids.pmc[i];
+}
+
+// Start a timed run.
+uint64
+start(void)
+{
+  pmcsnap(pmc0);
+  return rdtsc();
+}
+
+// The rate of n things done in the cycles since t0.
+uint
+rate(uint n, uint64 t0)
+{
+  uint us;
+
+  us = udiv64(rdtsc() - t0, cpus);
+  pmcsnap(pmc1);
+  if(us == 0)
+    us = 1;
+  return udiv64((uint64)n * 1000000, us);
+}
+
+// End a result's line with the events of its run.
+void
+events(void)
+{
+  static char *names[NPMC] = { "kcycles", "kinstr", "llcmiss", "brmiss" };
+  int i;
+
+  for(i = 0; i < NPMC; i++)
+    if(pmcmask & (1<<i))
+      printf(1, " %s=%d", names[i],
+             udiv64(pmc1[i] - pmc0[i], i < PMC_LLCMISS ? 1000 : 1));
+  printf(1, "\n");
+}
+
+// name <- prefix followed by i.
+void
+mkname(char *name, char *prefix, int i)
+{
+  char d[12];
+  int n;
+
+  strcpy(name, prefix);
+  name += strlen(name);
+  n = 0;
+  do {
+    d[n++] = '0' + i % 10;
+    i /= 10;
+  } while(i);
+  while(n > 0)
+    *name++ = d[--n];
+  *name = 0;
+}
+
+// Write kb KB to path, then fsync.  Returns -1 on error.
+int
+writefile(char *path, int kb)
+{
+  int fd, n, left;
+
+  unlink(path);
+  if((fd = open(path, O_CREATE | O_WRONLY)) < 0)
+    return -1;
+  for(left = kb*1024; left > 0; left -= n){
+    n = left < CHUNK ? left : CHUNK;
+    if(write(fd, buf, n) != n){
+      close(fd);
+      return -1;
+    }
+  }
+  fsync(fd);
+  close(fd);
+  return 0;
+}
+
+// Read path to the end.  Returns -1 on error.
+int
+readfile(char *path)
+{
+  int fd, n;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  while((n = read(fd, buf, CHUNK)) > 0)
+    ;
+  close(fd);
+  return n;
+}
+
+void
+fail(char *what)
+{
+  printf(2, "fsbench: %s failed\n", what);
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int kb, nfiles, nprocs, i, fd, pkb;
+  uint seqw, seqr, creat, unl, mkd, lnk, look, parw, parr;
+  char name[32];
+  struct stat st;
+  uint64 t0;
+
+  kb = argc > 1 ? atoi(argv[1]) : 1024;
+  nfiles = argc > 2 ? atoi(argv[2]) : 200;
+  nprocs = argc > 3 ? atoi(argv[3]) : 4;
+  if(kb <= 0 || nfiles <= 0 || nprocs <= 0){
+    printf(2, "usage: fsbench [kb [nfiles [nprocs]]]\n");
+    exit();
+  }
+  if((cpus = vtscpertick() / USPERTICK) == 0){
+    printf(2, "fsbench: TSC not calibrated yet, assuming 1GHz\n");
+    cpus = 1000;
+  }
+  if((pmcmask = perfctr(0, pmc0)) < 0)
+    pmcmask = 0;
+  memset(buf, 'f', sizeof(buf));
+
+  // Sequential bandwidth.
+  t0 = start();
+  if(writefile("fsb.dat", kb) < 0)
+    fail("write");
+  seqw = rate(kb, t0);
+  printf(1, "seq write: %d KB/sec", seqw);
+  events();
+  t0 = start();
+  if(readfile("fsb.dat") < 0)
+    fail("read");
+  seqr = rate(kb, t0);
+  printf(1, "seq read: %d KB/sec", seqr);
+  events();
+
+  // Small files.
+  t0 = start();
+  for(i = 0; i < nfiles; i++){
+    mkname(name, "fsbf", i);
+    if((fd = open(name, O_CREATE | O_WRONLY)) < 0)
+      fail("create");
+    write(fd, buf, 100);
+    close(fd);
+  }
+  creat = rate(nfiles, t0);
+  printf(1, "create: %d ops/sec", creat);
+  events();
+  t0 = start();
+  for(i = 0; i < nfiles; i++){
+    mkname(name, "fsbf", i);
+    if(unlink(name) < 0)
+      fail("unlink");
+  }
+  unl = rate(nfiles, t0);
+  printf(1, "unlink: %d ops/sec", unl);
+  events();
+
+  // Metadata.
+  t0 = start();
+  for(i = 0; i < nfiles; i++){
+    mkname(name, "fsbd", i);
+    if(mkdir(name) < 0)
+      fail("mkdir");
+  }
+  mkd = rate(nfiles, t0);
+  printf(1, "mkdir: %d ops/sec", mkd);
+  events();
+  t0 = start();
+  for(i = 0; i < nfiles; i++){
+    mkname(name, "fsbl", i);
+    if(link("fsb.dat", name) < 0)
+      fail("link");
+  }
+  lnk = rate(nfiles, t0);
+  printf(1, "link: %d ops/sec", lnk);
+  events();
+  t0 = start();
+  for(i = 0; i < nfiles; i++){
+    mkname(name, "fsbl", i);
+    if(stat(name, &st) < 0)
+      fail("stat");
+  }
+  look = rate(nfiles, t0);
+  printf(1, "lookup: %d ops/sec", look);
+  events();
+  for(i = 0; i < nfiles; i++){
+    mkname(name, "fsbd", i);
+    unlink(name);
+    mkname(name, "fsbl", i);
+    unlink(name);
+  }
+  unlink("fsb.dat");
+
+  // Several processes at once.
+  pkb = kb / nprocs ? kb / nprocs : 1;
+  t0 = start();
+  for(i = 0; i < nprocs; i++){
+    if((fd = fork()) < 0)
+      fail("fork");
+    if(fd == 0){
+      mkname(name, "fsbp", i);
+      if(writefile(name, pkb) < 0)
+        fail("write");
+      exit();
+    }
+  }
+  for(i = 0; i < nprocs; i++)
+    wait();
+  parw = rate(pkb * nprocs, t0);
+  printf(1, "parallel write x%d: %d KB/sec", nprocs, parw);
+  events();
+  t0 = start();
+  for(i = 0; i < nprocs; i++){
+    if((fd = fork()) < 0)
+      fail("fork");
+    if(fd == 0){
+      mkname(name, "fsbp", i);
+      if(readfile(name) < 0)
+        fail("read");
+      exit();
+    }
+  }
+  for(i = 0; i < nprocs; i++)
+    wait();
+  parr = rate(pkb * nprocs, t0);
+  printf(1, "parallel read x%d: %d KB/sec", nprocs, parr);
+  events();
+  for(i = 0; i < nprocs; i++){
+    mkname(name, "fsbp", i);
+    unlink(name);
+  }
+
+  printf(1, "fsbench kb=%d seqwrite=%d seqread=%d create=%d unlink=%d",
+         kb, seqw, seqr, creat, unl);
+  printf(1, " mkdir=%d link=%d lookup=%d parwrite=%d parread=%d\n",
+         mkd, lnk, look, parw, parr);
+  exit();
+}
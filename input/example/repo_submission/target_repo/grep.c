@@ -1,37 +1,190 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The pattern is compiled once.  A file is mapped with mmap()
+// when it can be, and read in large pieces when not.  If every
+// match must contain some literal text, grep looks for it with
+// Boyer-Moore-Horspool and runs the matcher only on the lines
+// where it occurs.
 
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "mman.h"
 
-char buf[1024];
-int match(char*, char*);
+#define MAXRE 128
+#define BUFSZ (64*1024)
+
+struct item {
+  char c;     // '.' matches any character
+  char star;  // c* rather than c
+};
+
+struct {
+  int bol;               // ^: match only at the start of a line
+  int eol;               // $: ... and the end
+  int n;
+  struct item item[MAXRE];
+  char lit[MAXRE];       // a run of text every match contains
+  int nlit;
+  uchar skip[256];       // Horspool shifts for lit
+} re;
+
+char buf[BUFSZ];
+
+// Compile pat into re.  Parses as the recursive matcher of
+// Kernighan & Pike did: ^ only first, $ only last, * after a
+// character, anything else literally.
+int
+compile(char *pat)
+{
+  int i, j, n;
+
+  if(*pat == '^'){
+    re.bol = 1;
+    pat++;
+  }
+  while(*pat){
+    if(pat[0] == '$' && pat[1] == 0){
+      re.eol = 1;
+      break;
+    }
+    if(re.n == MAXRE)
+      return -1;
+    re.item[re.n].c = pat[0];
+    re.item[re.n].star = pat[1] == '*';
+    pat += re.item[re.n].star ? 2 : 1;
+    re.n++;
+  }
+
+  // The longest run of plain characters.
+  for(i = 0; i < re.n; i = j + 1){
+    for(j = i; j < re.n && !re.item[j].star && re.item[j].c != '.'; j++)
+      ;
+    if(j - i > re.nlit){
+      re.nlit = j - i;
+      for(n = 0; n < re.nlit; n++)
+        re.lit[n] = re.item[i+n].c;
+    }
+  }
+  for(i = 0; i < 256; i++)
+    re.skip[i] = re.nlit;
+  for(i = 0; i < re.nlit - 1; i++)
+    re.skip[(uchar)re.lit[i]] = re.nlit - 1 - i;
+  return 0;
+}
+
+int matchhere(struct item*, int, char*, char*);
+
+// matchstar: search for it->c* then the rest at s
+int
+matchstar(struct item *it, int n, char *s, char *e)
+{
+  int c = it->c;
+
+  do{  // a * matches zero or more instances
+    if(matchhere(it+1, n-1, s, e))
+      return 1;
+  }while(s < e && (*s++ == c || c == '.'));
+  return 0;
+}
+
+// matchhere: search for the n items at it at the start of [s, e)
+int
+matchhere(struct item *it, int n, char *s, char *e)
+{
+  for(; n > 0; it++, n--){
+    if(it->star)
+      return matchstar(it, n, s, e);
+    if(s == e || (it->c != '.' && it->c != *s))
+      return 0;
+    s++;
+  }
+  return !re.eol || s == e;
+}
+
+// Does the line [s, e) match?
+int
+match(char *s, char *e)
+{
+  if(re.bol)
+    return matchhere(re.item, re.n, s, e);
+  do{  // must look at empty string
+    if(matchhere(re.item, re.n, s, e))
+      return 1;
+  }while(s++ < e);
+  return 0;
+}
+
+// The first occurrence of re.lit in [p, e), or 0.
+char*
+findlit(char *p, char *e)
+{
+  int i, n;
+
+  n = re.nlit;
+  while(e - p >= n){
+    for(i = n - 1; i >= 0 && p[i] == re.lit[i]; i--)
+      ;
+    if(i < 0)
+      return p;
+    p += re.skip[(uchar)p[n-1]];
+  }
+  return 0;
+}
+
+// Write out the lines in [p, e) that match.  A last line with
+// no newline is left alone; returns where it starts.
+char*
+grepbuf(char *p, char *e)
+{
+  char *l, *nl;
+
+  for(;;){
+    l = p;
+    if(re.nlit){
+      if((nl = findlit(p, e)) == 0)
+        break;
+      for(l = nl; l > p && l[-1] != '\n'; l--)
+        ;
+    }
+    for(nl = l; nl < e && *nl != '\n'; nl++)
+      ;
+    if(nl == e)
+      return l;
+    if(match(l, nl))
+      write(1, l, nl+1 - l);
+    p = nl+1;
+  }
+  // No more matches; skip to the last line.
+  for(l = e; l > p && l[-1] != '\n'; l--)
+    ;
+  return l;
+}
 
 void
-grep(char *pattern, int fd)
+grep(int fd)
 {
+  struct stat st;
+  char *p;
   int n, m;
-  char *p, *q;
+
+  if(fstat(fd, &st) == 0 && st.type == T_FILE && st.size > 0){
+    p = mmap(0, st.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p != MAP_FAILED){
+      grepbuf(p, p + st.size);
+      munmap(p, st.size);
+      return;
+    }
+  }
 
   m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
+  while((n = read(fd, buf+m, sizeof(buf)-m)) > 0){
     m += n;
-    buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
-      p = q+1;
-    }
-    if(p == buf)
-      m = 0;
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
-    }
+    p = grepbuf(buf, buf+m);
+    if(p == buf && m == sizeof(buf))
+      p = buf+m;  // a line too long to hold: drop it
+    m -= p - buf;
+    memmove(buf, p, m);
   }
 }
 
@@ -39,16 +192,18 @@ int
 main(int argc, char *argv[])
 {
   int fd, i;
-  char *pattern;
 
   if(argc <= 1){
     printf(2, "usage: grep pattern [file ...]\n");
     exit();
   }
-  pattern = argv[1];
+  if(compile(argv[1]) < 0){
+    printf(2, "grep: pattern too long\n");
+    exit();
+  }
 
   if(argc <= 2){
-    grep(pattern, 0);
+    grep(0);
     exit();
   }
 
@@ -57,51 +212,8 @@ main(int argc, char *argv[])
       printf(1, "grep: cannot open %s\n", argv[i]);
       exit();
     }
-    grep(pattern, fd);
+    grep(fd);
     close(fd);
   }
   exit();
 }
-
-// Regexp matcher from Kernighan & Pike,
-// The Practice of Programming, Chapter 9.
-
-int matchhere(char*, char*);
-int matchstar(int, char*, char*);
-
-int
-match(char *re, char *text)
-{
-  if(re[0] == '^')
-    return matchhere(re+1, text);
-  do{  // must look at empty string
-    if(matchhere(re, text))
-      return 1;
-  }while(*text++ != '\0');
-  return 0;
-}
-
-// matchhere: search for re at beginning of text
-int matchhere(char *re, char *text)
-{
-  if(re[0] == '\0')
-    return 1;
-  if(re[1] == '*')
-    return matchstar(re[0], re+2, text);
-  if(re[0] == '$' && re[1] == '\0')
-    return *text == '\0';
-  if(*text!='\0' && (re[0]=='.' || re[0]==*text))
-    return matchhere(re+1, text+1);
-  return 0;
-}
-
-// matchstar: search for c*re at beginning of text
-int matchstar(int c, char *re, char *text)
-{
-  do{  // a * matches zero or more instances
-    if(matchhere(re, text))
-      return 1;
-  }while(*text!='\0' && (*text++==c || c=='.'));
-  return 0;
-}
-
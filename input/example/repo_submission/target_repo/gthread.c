@@ -0,0 +1,274 @@
+// Green threads; see gthread.h.
+
+#include "types.h"
+#include "user.h"
+#include "gthread.h"
+
+enum { GT_RUNNABLE, GT_RUNNING, GT_DONE };
+
+static struct carrier carriers[GT_MAXCARRIERS];
+static int ncarriers;
+static volatile uint nextc;    // round-robin carrier for gt_spawn() outside
+static volatile uint live;     // green threads spawned and not yet done
+static volatile uint work;
+static volatile uint idle;     // carriers that may be in futex_wait
+static volatile uint stop;
+
+// The carrier this thread is, or 0 outside the carriers.
+static struct carrier*
+mycarrier(void)
+{
+  void *tls = thread_tls();
+  int i;
+
+  for (i = 0; i < ncarriers; i++)
+    if (carriers[i].tls == tls)
+      return &carriers[i];
+  return 0;
+}
+
+static void
+enqueue(struct carrier *c, struct gthread *g)
+{
+  g->next = 0;
+  ticket_lock_acquire(&c->lock);
+  if (c->tail)
+    c->tail->next = g;
+  else
+    c->head = g;
+  c->tail = g;
+  c->n++;
+  ticket_lock_release(&c->lock);
+}
+
+static struct gthread*
+dequeue(struct carrier *c)
+{
+  struct gthread *g;
+
+  if (c->n == 0)
+    return 0;
+  ticket_lock_acquire(&c->lock);
+  if ((g = c->head) != 0) {
+    if ((c->head = g->next) == 0)
+      c->tail = 0;
+    c->n--;
+  }
+  ticket_lock_release(&c->lock);
+  return g;
+}
+
+// Take a green thread from another carrier, starting with the
+// one after c so thieves spread over their victims.
+static struct gthread*
+steal(struct carrier *c)
+{
+  struct gthread *g;
+  int i, me;
+
+  me = c - carriers;
+  for (i = 1; i < ncarriers; i++)
+    if ((g = dequeue(&carriers[(me + i) % ncarriers])) != 0)
+      return g;
+  return 0;
+}
+
+static void
+kick(void)
+{
+  xadd(&work, 1);
+  if (idle)
+    futex_wake(&work, 1);
+}
+
+// First code a green thread runs: uswtch() into a new context
+// "returns" here.
+static void
+gt_entry(void)
+{
+  struct gthread *g = mycarrier()->cur;
+
+  g->fn(g->arg);
+  gt_exit();
+}
+
+// A carrier's scheduling loop.  Green threads switch back to
+// c->sched, not straight to each other, so that a thread is
+// requeued (and can be stolen) only once its registers are saved.
+static void
+carrier(void *arg1, void *arg2)
+{
+  struct carrier *c = arg1;
+  struct gthread *g;
+  uint w;
+
+  c->tls = thread_tls();
+  for (;;) {
+    w = work;
+    if ((g = dequeue(c)) != 0 || (g = steal(c)) != 0) {
+      g->state = GT_RUNNING;
+      c->cur = g;
+      uswtch(&c->sched, g->ctx);
+      c->cur = 0;
+      if (g->state == GT_DONE) {
+        free((char *)g - GT_STACKSIZE);
+        if (xadd(&live, -1) == 1)
+          futex_wake(&live, FUTEX_ALL);
+      } else {
+        enqueue(c, g);
+      }
+      continue;
+    }
+    if (stop)
+      break;
+    xadd(&idle, 1);
+    futex_wait(&work, w);  // returns at once if a thread was spawned since
+    xadd(&idle, -1);
+  }
+  exit();
+}
+
+// Start ncarriers (at most GT_MAXCARRIERS) carrier threads.
+// Returns 0, or -1 if none could be started.
+int
+gt_start(int n)
+{
+  int i;
+
+  if (n > GT_MAXCARRIERS)
+    n = GT_MAXCARRIERS;
+  live = work = idle = stop = nextc = 0;
+  ncarriers = 0;
+  for (i = 0; i < n; i++) {
+    memset(&carriers[i], 0, sizeof(carriers[i]));
+    ticket_lock_init(&carriers[i].lock);
+  }
+  // Carriers look each other up by index, so publish the count
+  // before any of them can start.
+  ncarriers = n;
+  for (i = 0; i < n; i++) {
+    if (thread_create(&carriers[i].tid, carrier, &carriers[i], 0) < 0) {
+      ncarriers = i;
+      break;
+    }
+  }
+  return ncarriers > 0 ? 0 : -1;
+}
+
+// Make a green thread running fn(arg).  One spawned by a green
+// thread starts on the same carrier; one spawned from outside
+// goes to the carriers in turn.
+int
+gt_spawn(void (*fn)(void *), void *arg)
+{
+  struct carrier *c;
+  struct gthread *g;
+  char *mem;
+  uint *sp;
+
+  if (ncarriers == 0 || (mem = malloc(GT_STACKSIZE + sizeof(*g))) == 0)
+    return -1;
+  g = (struct gthread *)(mem + GT_STACKSIZE);
+  g->fn = fn;
+  g->arg = arg;
+  g->state = GT_RUNNABLE;
+
+  // A frame for uswtch() to pop: callee-saved registers, then
+  // gt_entry as the return address, with a fake return address
+  // above that keeping the ABI's 16-byte alignment at entry.
+  sp = (uint *)((uint)g & ~15);
+  *--sp = 0;
+  *--sp = (uint)gt_entry;
+  sp -= 4;
+  memset(sp, 0, 4 * sizeof(uint));
+  g->ctx = (struct gtctx *)sp;
+
+  if ((c = mycarrier()) == 0)
+    c = &carriers[xadd(&nextc, 1) % ncarriers];
+  xadd(&live, 1);
+  enqueue(c, g);
+  kick();
+  return 0;
+}
+
+// Let other green threads on this carrier run.  Outside a green
+// thread, gives up the cpu (sleep(0)) instead.
+void
+gt_yield(void)
+{
+  struct carrier *c = mycarrier();
+  struct gthread *g;
+
+  if (c == 0 || (g = c->cur) == 0) {
+    sleep(0);
+    return;
+  }
+  g->state = GT_RUNNABLE;
+  uswtch(&g->ctx, c->sched);
+  // May now be running on a different carrier.
+}
+
+void
+gt_exit(void)
+{
+  struct carrier *c = mycarrier();
+  struct gthread *g = c->cur;
+
+  g->state = GT_DONE;
+  uswtch(&g->ctx, c->sched);
+  for (;;)
+    ;
+}
+
+// Wait until every green thread is done, then stop and join
+// the carriers.  Called from outside the carriers.
+void
+gt_wait(void)
+{
+  uint l;
+  int i;
+
+  while ((l = live) != 0)
+    futex_wait(&live, l);
+  stop = 1;
+  xadd(&work, 1);
+  futex_wake(&work, FUTEX_ALL);
+  for (i = 0; i < ncarriers; i++)
+    thread_join(carriers[i].tid);
+  ncarriers = 0;
+}
+
+// About to block in the kernel: wake idle carriers to steal the
+// green threads queued behind this one.
+void
+gt_block(void)
+{
+  struct carrier *c = mycarrier();
+
+  if (c == 0 || c->n == 0)
+    return;
+  xadd(&work, 1);
+  if (idle)
+    futex_wake(&work, c->n);
+}
+
+int
+gt_read(int fd, void *buf, int n)
+{
+  gt_block();
+  return read(fd, buf, n);
+}
+
+int
+gt_write(int fd, const void *buf, int n)
+{
+  gt_block();
+  return write(fd, buf, n);
+}
+
+int
+gt_sleep(int ticks)
+{
+  gt_block();
+  return sleep(ticks);
+}
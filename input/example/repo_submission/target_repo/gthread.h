@@ -0,0 +1,55 @@
+#ifndef _GTHREAD_H_
+#define _GTHREAD_H_
+
+#include "thread.h"
+
+// Green threads: many user-level threads multiplexed onto a few
+// carrier threads from thread_create().  A green thread switches
+// only when it calls gt_yield(), gt_exit() or returns, so it
+// costs a small stack and a uswtch() instead of a kernel thread.
+//
+// Each carrier runs green threads from its own queue and, when
+// that is empty, steals from the other carriers' queues.  Idle
+// carriers sleep on work, which every gt_spawn() bumps.
+
+#define GT_MAXCARRIERS 8
+#define GT_STACKSIZE 4096      // bytes of stack per green thread
+
+struct gtctx;                  // saved registers; see uswtch.S
+
+struct gthread {
+  struct gtctx *ctx;
+  struct gthread *next;        // run queue link
+  int state;
+  void (*fn)(void *);
+  void *arg;
+};
+
+struct carrier {
+  ticket_lock_t lock;          // guards head, tail, n
+  struct gthread *head, *tail;
+  volatile uint n;
+  struct gtctx *sched;         // the carrier's scheduling loop
+  struct gthread *cur;         // green thread running here
+  void *tls;                   // thread_tls() of this carrier
+  int tid;
+} __attribute__((aligned(CACHELINE)));
+
+int gt_start(int ncarriers);
+int gt_spawn(void (*fn)(void *), void *arg);
+void gt_yield(void);
+void gt_exit(void) __attribute__((noreturn));
+void gt_wait(void);
+
+// A green thread that blocks in the kernel holds up its whole
+// carrier.  gt_block() hands the carrier's queued green threads
+// to idle carriers first; the wrappers call it for common
+// blocking calls.
+void gt_block(void);
+int gt_read(int fd, void *buf, int n);
+int gt_write(int fd, const void *buf, int n);
+int gt_sleep(int ticks);
+
+void uswtch(struct gtctx **old, struct gtctx *new);
+
+#endif
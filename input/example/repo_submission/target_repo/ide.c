@@ -5,13 +5,16 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
 #include "spinlock.h"
+#include "trace.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "workq.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -24,15 +27,46 @@
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
 
+#define IDE_MAXRUN    32   // most blocks in one command
+#define IDE_DEADLINE  20   // ticks a request may wait for the next sweep
+
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
+// A run of bufs for consecutive blocks, all reads or all writes,
+// goes to the disk as one command: iderun is how many bufs at the
+// front of idequeue the command in progress still has to move.
+// The disk interrupts once per buf.
+//
+// Requests are served in C-SCAN order.  Behind the command in
+// progress, idequeue holds the requests past idepos, the last
+// block of that command, sorted by block number; idenext holds
+// the rest, sorted, for the next sweep up the disk.  The next
+// sweep starts when this one runs out, or sooner if idenext has
+// been waiting IDE_DEADLINE ticks, so a stream of requests just
+// ahead of the head can't starve the others.
 // You must hold idelock while manipulating queue.
+//
+// The interrupt handler only moves the data, which PIO must read
+// from the data port before the disk goes on, and starts the next
+// command.  Finished bufs wait on idedone for idework, run by a
+// kernel worker (workq.c), to mark them done and wake or release
+// them, so the ptable scan of wakeup() is off the interrupt cpu.
+// A buf on idedone is not yet B_VALID, so no one can requeue it.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *idenext;
+static uint idenextsince;  // ticks when idenext became non-empty
+static uint idepos;
+static int iderun;
+static struct buf *idedone;
+static struct work idework;
 
 static int havedisk1;
+static int havevirtio;  // disk 1 is a virtio device (virtio.c)
 static void idestart(struct buf*);
+static void idesorted(struct buf**, struct buf*);
+static void idecomplete(void*);
 
 // Wait for IDE disk to become ready.
 static int
@@ -52,7 +86,8 @@ ideinit(void)
 {
   int i;
 
-  initlock(&idelock, "ide");
+  initlockq(&idelock, "ide");
+  initwork(&idework, idecomplete, 0);
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
 
@@ -67,16 +102,35 @@ ideinit(void)
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  havevirtio = virtioinit();
+}
+
+// Does b continue the run ending with p?
+static int
+iderunnext(struct buf *p, struct buf *b)
+{
+  return b->dev == p->dev && b->blockno == p->blockno + 1 &&
+    (b->flags & B_DIRTY) == (p->flags & B_DIRTY);
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Start the request for b, and for as many of the bufs queued
+// behind it as continue its run.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *p;
+  int n;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  n = 1;
+  for(p = b; n < IDE_MAXRUN && p->qnext && iderunnext(p, p->qnext); p = p->qnext)
+    n++;
+  if(sb.size && p->blockno >= sb.swapstart + sb.nswap)
     panic("incorrect blockno");
+  iderun = n;
+  idepos = p->blockno;
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
   int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
@@ -86,7 +140,7 @@ idestart(struct buf *b)
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, n * sector_per_block);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
@@ -118,18 +172,98 @@ ideintr(void)
   if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
     insl(0x1f0, b->data, BSIZE/4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Leave the rest to idecomplete().
+  b->qnext = idedone;
+  idedone = b;
+  queuework(&idework);
+
+  // Go on with the command's next buf, or start the disk
+  // on the next buf in queue.
+  if(--iderun > 0){
+    if(idequeue->flags & B_DIRTY){
+      idewait(0);
+      outsl(0x1f0, idequeue->data, BSIZE/4);
+    }
+  } else {
+    if(idenext && (idequeue == 0 || ticks - idenextsince >= IDE_DEADLINE)){
+      // Start the next sweep, taking along what is left of
+      // this one.
+      while((b = idequeue) != 0){
+        idequeue = b->qnext;
+        idesorted(&idenext, b);
+      }
+      idequeue = idenext;
+      idenext = 0;
+    }
+    if(idequeue != 0)
+      idestart(idequeue);
+  }
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  release(&idelock);
+}
+
+// Finish the bufs ideintr() has put on idedone: mark them done
+// and wake their waiters, or release those started by
+// bprefetch() or log_data().
+static void
+idecomplete(void *arg)
+{
+  struct buf *b, *next;
 
+  acquire(&idelock);
+  b = idedone;
+  idedone = 0;
+  for(; b; b = next){
+    next = b->qnext;
+    trace(TR_DISKDONE, b->blockno | (b->flags & B_DIRTY ? TR_WRITE : 0));
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->flags & B_ASYNC)
+      bdone(b);
+  }
   release(&idelock);
 }
 
+// Insert b into the list *pp, sorted by block number.
+static void
+idesorted(struct buf **pp, struct buf *b)
+{
+  for(; *pp; pp=&(*pp)->qnext){  //DOC:insert-queue
+    if(b->blockno < (*pp)->blockno ||
+       (b->blockno == (*pp)->blockno && b->dev < (*pp)->dev))
+      break;
+  }
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// Queue b, starting the disk if it is idle.  Caller must hold idelock.
+static void
+ideappend(struct buf *b)
+{
+  struct buf **pp;
+  int i;
+
+  if(idequeue == 0){
+    b->qnext = 0;
+    idequeue = b;
+    idestart(b);
+    return;
+  }
+  if(b->blockno > idepos){
+    // This sweep, behind the command in progress.
+    pp = &idequeue;
+    for(i = 0; i < iderun; i++)
+      pp = &(*pp)->qnext;
+    idesorted(pp, b);
+  } else {
+    if(idenext == 0)
+      idenextsince = ticks;
+    idesorted(&idenext, b);
+  }
+}
+
 //PAGEBREAK!
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
@@ -137,32 +271,58 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
+  idestartrw(b);
+  ideawait(b);
+}
 
+// Start syncing buf with disk as iderw() does, but return
+// without waiting for the disk; ideawait() waits.  A read
+// started by bprefetch() (B_ASYNC) is instead finished by
+// idecomplete(), which hands the buffer to bdone().
+void
+idestartrw(struct buf *b)
+{
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
     panic("iderw: nothing to do");
+  trace(TR_DISKSUB, b->blockno | (b->flags & B_DIRTY ? TR_WRITE : 0));
+  if(myproc()){
+    if(b->flags & B_DIRTY)
+      myproc()->ru.oublock++;
+    else
+      myproc()->ru.inblock++;
+  }
+  if(b->dev == 1 && havevirtio){
+    virtiorw(b);
+    return;
+  }
   if(b->dev != 0 && !havedisk1)
     panic("iderw: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
+  ideappend(b);
+  release(&idelock);
+}
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
-
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
-
-  // Wait for request to finish.
+// Wait for the request idestartrw() started on buf to finish.
+void
+ideawait(struct buf *b)
+{
+  if(b->dev == 1 && havevirtio){
+    virtioawait(b);
+    return;
+  }
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
-
-
   release(&idelock);
 }
+
+// The disks are not in memory: the buffer cache keeps copies.
+uchar*
+idemap(uint dev, uint blockno)
+{
+  return 0;
+}
@@ -10,7 +10,7 @@ char *argv[] = { "sh", 0 };
 int
 main(void)
 {
-  int pid, wpid;
+  int pid, wpid, fd;
 
   if(open("console", O_RDWR) < 0){
     mknod("console", 1, 1);
@@ -19,6 +19,33 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  if((fd = open("dev/prof", O_RDONLY)) < 0){
+    mkdir("dev");
+    mknod("dev/prof", 2, 0);  // PROF in file.h
+    mknod("dev/trace", 3, 0); // TRACE
+    mknod("dev/irqstat", 4, 0); // IRQSTAT
+    mknod("dev/consctl", 5, 0); // CONSCTL
+  } else
+    close(fd);
+  mkdir("tmp");  // fails if it is there already
+  mount("tmp");  // tmpfs, for scratch files
+
+  // The file system "make bench" builds has a script for sh to
+  // run first; runbench stops the machine when it sees it done.
+  if((fd = open("benchrc", O_RDONLY)) >= 0){
+    if((pid = fork()) == 0){
+      close(0);
+      dup(fd);
+      close(fd);
+      exec("sh", argv);
+      exit();
+    }
+    close(fd);
+    while(pid > 0 && (wpid=wait()) >= 0 && wpid != pid)
+      ;
+    printf(1, "init: benchrc done\n");
+  }
+
   for(;;){
     printf(1, "init: starting sh\n");
     pid = fork();
@@ -24,6 +24,9 @@
 
 volatile struct ioapic *ioapic;
 
+#define NIOIRQ 32
+static int irqcpu[NIOIRQ];  // cpu each enabled irq goes to, -1 if disabled
+
 // IO APIC MMIO structure: write reg, then read or write data.
 struct ioapic {
   uint reg;
@@ -62,6 +65,8 @@ ioapicinit(void)
     ioapicwrite(REG_TABLE+2*i, INT_DISABLED | (T_IRQ0 + i));
     ioapicwrite(REG_TABLE+2*i+1, 0);
   }
+  for(i = 0; i < NIOIRQ; i++)
+    irqcpu[i] = -1;
 }
 
 void
@@ -72,4 +77,35 @@ ioapicenable(int irq, int cpunum)
   // which happens to be that cpu's APIC ID.
   ioapicwrite(REG_TABLE+2*irq, T_IRQ0 + irq);
   ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
+  irqcpu[irq] = cpunum;
+}
+
+// Like ioapicenable, but level-triggered, as a PCI
+// interrupt line is.
+void
+ioapicenablelevel(int irq, int cpunum)
+{
+  ioapicwrite(REG_TABLE+2*irq, INT_LEVEL | (T_IRQ0 + irq));
+  ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
+  irqcpu[irq] = cpunum;
+}
+
+// The cpu enabled interrupt irq goes to, or -1 if it is not
+// enabled.
+int
+ioapiccpu(int irq)
+{
+  if(irq < 0 || irq >= NIOIRQ)
+    return -1;
+  return irqcpu[irq];
+}
+
+// Send enabled interrupt irq to cpunum from now on.  An
+// interrupt already on its way to the old cpu still lands
+// there.
+void
+ioapicroute(int irq, int cpunum)
+{
+  ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
+  irqcpu[irq] = cpunum;
 }
@@ -0,0 +1,186 @@
+// Interrupt statistics and IRQ balancing.
+//
+// trap() counts each interrupt from T_IRQ0 up, and the TSC
+// cycles its handler took, per cpu.  The IRQSTAT device
+// (/dev/irqstat) reads the counts as struct irqstat (irq.h),
+// and takes commands written to it:
+//   irq cpu   route device interrupt irq to cpu
+//   b n       rebalance every n ticks; 0 stops
+// To rebalance, cpu 0 compares how busy each cpu was (not
+// halted in the idle loop, whether in handlers or running
+// processes) since last time, and moves the device interrupt
+// costing the busiest cpu the most to the idlest, if that
+// leaves the two closer.  One interrupt moves at a time, so a
+// cpu saturated by one disk hands it on rather than back.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "irq.h"
+#include "counter.h"
+
+struct irqcount {
+  uint n;
+  uint64 cycles;
+};
+
+// Each cpu's row is a whole number of cache lines.
+static struct irqcount irqcounts[NCPU][NIRQSTAT] __attribute__((aligned(CACHELINE)));
+
+static struct {
+  struct spinlock lock;
+  uint every;      // ticks between rebalancing, 0 for never
+  uint last;       // ticks at the last one
+  uint64 tsc;      // rdtsc then
+  uint64 idle[NCPU];
+  uint64 cycles[NIRQSTAT];
+} bal;
+
+// Count an interrupt on vector trapno that took cycles to
+// handle.  Called by trap() with interrupts off.
+void
+irqcount(uint trapno, uint64 cycles)
+{
+  struct irqcount *ic;
+
+  if(trapno < T_IRQ0 || trapno >= T_IRQ0 + NIRQSTAT)
+    return;
+  ic = &irqcounts[cpuid()][trapno - T_IRQ0];
+  ic->n++;
+  ic->cycles += cycles;
+  cntadd(CNT_INTR, 1);
+}
+
+// Load-balance the device interrupts, if it is time to.
+// Called on cpu 0's clock tick.  A kernel for one cpu has
+// nowhere to move them.
+void
+irqbalance(void)
+{
+  uint64 now, span, busy[NCPU], cost[NIRQSTAT], c1;
+  int c, irq, hot, cold, move;
+
+  if(NCPU == 1 || bal.every == 0 || ticks - bal.last < bal.every)
+    return;
+  acquire(&bal.lock);
+  now = rdtsc();
+  span = now - bal.tsc;
+  for(c = 0; c < ncpu; c++){
+    c1 = cpus[c].idlecycles;
+    busy[c] = c1 - bal.idle[c] < span ? span - (c1 - bal.idle[c]) : 0;
+    bal.idle[c] = c1;
+  }
+  for(irq = 0; irq < NIRQSTAT; irq++){
+    c1 = 0;
+    for(c = 0; c < ncpu; c++)
+      c1 += irqcounts[c][irq].cycles;
+    cost[irq] = c1 - bal.cycles[irq];
+    bal.cycles[irq] = c1;
+  }
+  // The first interval runs from boot; skip it.
+  if(bal.tsc != 0){
+    hot = cold = 0;
+    for(c = 1; c < ncpu; c++){
+      if(busy[c] > busy[hot])
+        hot = c;
+      if(busy[c] < busy[cold])
+        cold = c;
+    }
+    move = -1;
+    for(irq = 0; irq < NIRQSTAT; irq++)
+      if(ioapiccpu(irq) == hot && cost[irq] > 0 &&
+         (move < 0 || cost[irq] > cost[move]))
+        move = irq;
+    if(move >= 0 && busy[cold] + cost[move] < busy[hot])
+      ioapicroute(move, cold);
+  }
+  bal.tsc = now;
+  bal.last = ticks;
+  release(&bal.lock);
+}
+
+// Read a record for every cpu and vector with interrupts, as
+// many as fit in n bytes.
+static int
+irqread(struct inode *ip, char *dst, int n)
+{
+  struct irqstat st;
+  int c, irq, i;
+
+  i = 0;
+  for(c = 0; c < ncpu; c++){
+    for(irq = 0; irq < NIRQSTAT; irq++){
+      if(irqcounts[c][irq].n == 0)
+        continue;
+      if((i+1) * sizeof(st) > n)
+        return i * sizeof(st);
+      st.irq = irq;
+      st.cpu = c;
+      st.n = irqcounts[c][irq].n;
+      st.cycles = irqcounts[c][irq].cycles;
+      st.routed = ioapiccpu(irq) == c;
+      memmove(dst + i*sizeof(st), &st, sizeof(st));
+      i++;
+    }
+  }
+  return i * sizeof(st);
+}
+
+static int
+irqatoi(char **s, char *end)
+{
+  int n;
+
+  while(*s < end && **s == ' ')
+    (*s)++;
+  if(*s == end || **s < '0' || **s > '9')
+    return -1;
+  for(n = 0; *s < end && **s >= '0' && **s <= '9'; (*s)++)
+    n = n*10 + **s - '0';
+  return n;
+}
+
+// Carry out a command; see the top of the file.
+static int
+irqwrite(struct inode *ip, char *src, int n)
+{
+  char *s, *end;
+  int irq, c;
+
+  s = src;
+  end = src + n;
+  if(n > 0 && src[0] == 'b'){
+    s++;
+    if((c = irqatoi(&s, end)) < 0)
+      return -1;
+    acquire(&bal.lock);
+    bal.every = c;
+    release(&bal.lock);
+    return n;
+  }
+  if((irq = irqatoi(&s, end)) < 0 || (c = irqatoi(&s, end)) < 0 ||
+     irq >= NIRQSTAT || c >= ncpu || ioapiccpu(irq) < 0)
+    return -1;
+  acquire(&bal.lock);
+  ioapicroute(irq, c);
+  release(&bal.lock);
+  return n;
+}
+
+void
+irqinit(void)
+{
+  initlock(&bal.lock, "irqbal");
+  bal.every = IRQBALANCE;
+  devsw[IRQSTAT].read = irqread;
+  devsw[IRQSTAT].write = irqwrite;
+}
@@ -0,0 +1,11 @@
+// Interrupt counts, as read from /dev/irqstat: one record for
+// each cpu and interrupt vector T_IRQ0+irq it has taken.
+struct irqstat {
+  ushort irq;
+  ushort cpu;
+  uint n;            // interrupts taken
+  uint64 cycles;     // rdtsc cycles spent handling them
+  int routed;        // 1 if the IOAPIC sends irq to cpu now
+};
+
+#define NIRQSTAT 32  // vectors counted, from T_IRQ0
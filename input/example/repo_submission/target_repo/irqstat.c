@@ -0,0 +1,54 @@
+// irqstat: show interrupt counts, or steer device interrupts.
+//   irqstat           interrupts taken and cycles spent, per
+//                     cpu; * marks the cpu an IRQ goes to now
+//   irqstat irq cpu   send irq to cpu
+//   irqstat -b n      let the kernel rebalance every n ticks
+//                     (0 stops it)
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "param.h"
+#include "irq.h"
+
+struct irqstat st[NCPU*NIRQSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  char buf[32], *p;
+  int fd, n, i;
+
+  if(argc != 1 && argc != 3){
+    printf(2, "usage: irqstat [irq cpu | -b ticks]\n");
+    exit();
+  }
+  if((fd = open("dev/irqstat", argc == 3 ? O_WRONLY : O_RDONLY)) < 0){
+    printf(2, "irqstat: cannot open dev/irqstat\n");
+    exit();
+  }
+  if(argc == 3){
+    p = buf;
+    if(strcmp(argv[1], "-b") == 0)
+      *p++ = 'b';
+    else {
+      strcpy(p, argv[1]);
+      p += strlen(p);
+    }
+    *p++ = ' ';
+    strcpy(p, argv[2]);
+    if(strlen(argv[1]) + strlen(argv[2]) > 16 ||
+       write(fd, buf, strlen(buf)) < 0)
+      printf(2, "irqstat: %s %s failed\n", argv[1], argv[2]);
+    close(fd);
+    exit();
+  }
+  n = read(fd, (char*)st, sizeof(st)) / sizeof(st[0]);
+  close(fd);
+  printf(1, "irq\tcpu\tcount\tkcycles\n");
+  for(i = 0; i < n; i++)
+    printf(1, "%d\t%d%s\t%d\t%d\n", st[i].irq, st[i].cpu,
+           st[i].routed ? "*" : "", st[i].n, udiv64(st[i].cycles, 1000));
+  exit();
+}
@@ -8,6 +8,10 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "rusage.h"
+#include "proc.h"
+#include "trace.h"
+#include "meminfo.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,29 +21,139 @@ struct run {
   struct run *next;
 };
 
-struct {
+uint phystop;  // Top of the physical memory in use
+
+// References to each physical page, for pages shared
+// copy-on-write.  kalloc() sets it to 1, kref() adds one,
+// and kfree() only frees the page when it drops to 0.
+// kinit2() moves the table from pageref0, which only covers
+// the first 4MB, to the bottom of the rest of memory.
+static ushort pageref0[4*1024*1024/PGSIZE];
+static ushort *pageref = pageref0;
+
+// The kind (KM_) each allocated page was asked for as, so
+// kfree() knows which count to take it off.  Moved with pageref.
+static uchar pagetype0[4*1024*1024/PGSIZE];
+static uchar *pagetype = pagetype0;
+
+// The free pages of a NUMA node (physnode()), with a lock of
+// its own so that cpus allocating on different nodes don't
+// share one.  A page is only ever on its own node's list.
+struct knode {
   struct spinlock lock;
-  int use_lock;
   struct run *freelist;
+  char *fresh;                 // [fresh, freshend) was never allocated
+  char *freshend;
+} __attribute__((aligned(CACHELINE)));
+
+// use_lock and nzeroed are read without the lock, by every
+// kalloc() and kzalloc(); the lock keeps them off the cache
+// line that holders of it write.  kmem.lock comes before the
+// lock of a node.
+struct {
+  int use_lock;
+  int nzeroed;
+  struct spinlock lock;
+  struct run *zeroed;          // Pages zeroed by kzeroidle(), for kzalloc()
+  struct run *super;           // Free 4MB frames, for ksuperalloc()
+  uint npages;                 // Pages managed, free or not
+  uint nfail;                  // kalloc()s that returned 0
+  struct knode node[NNODE];
 } kmem;
 
+// Per-cpu caches of free pages in front of the node lists, so
+// most kalloc()s and kfree()s take no lock.  A cache is only
+// touched by its own cpu with interrupts off.  It refills from
+// the lists, its own cpu's node first, and drains to them
+// KBATCH pages at a time; any cpu may free any page into its
+// own cache.  At most NCPU*KCACHEMAX
+// free pages sit in caches, where other cpus can't get them.
+// used[] counts the pages allocated, by kind, on this cpu less
+// those freed on it; only the sum over the cpus means anything.
+#define KCACHEMAX 64
+#define KBATCH    32
+struct kcache {
+  struct run *freelist;
+  int n;
+  int used[NKM];
+};
+static PERCPU(struct kcache, kcaches);
+
+static void kcachefree(struct kcache*, struct run*);
+static void ksuperbreak(void);
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
-// the pages mapped by entrypgdir on free list.
+// the pages mapped by entrypgdir on free list.  It also sets
+// phystop from the memory size in the CMOS, for kvmalloc().
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Those are not put on the free list, which for a lot of memory
+// takes a while, but handed out from the bottom up when the free
+// list runs dry.
 void
 kinit1(void *vstart, void *vend)
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  initlockq(&kmem.lock, "kmem");
+  for(i = 0; i < NNODE; i++)
+    initlockq(&kmem.node[i].lock, "knode");
   kmem.use_lock = 0;
+  // Memory the kernel can't map, above PHYSMAX, goes unused.
+  phystop = PGROUNDDOWN(cmosmemtop());
+  if(phystop > PHYSMAX)
+    phystop = PHYSMAX;
+  if(phystop < V2P(vend))
+    panic("kinit1: too little memory");
   freerange(vstart, vend);
 }
 
+// kinit2() also sets aside up to NSUPERPAGE 4MB-aligned frames
+// at the top of memory for ksuperalloc(), and splits the rest
+// by node, once acpiinit() has said where the nodes are.
 void
 kinit2(void *vstart, void *vend)
 {
-  freerange(vstart, vend);
+  struct knode *kn;
+  struct run *r;
+  char *top, *p, *q;
+  uint n, end;
+  int i;
+
+  // The page reference and type tables for all of memory.
+  p = (char*)PGROUNDUP((uint)vstart);
+  n = PGROUNDUP(phystop/PGSIZE * (sizeof(pageref[0]) + sizeof(pagetype[0])));
+  memset(p, 0, n);
+  memmove(p, pageref0, sizeof(pageref0));
+  pageref = (ushort*)p;
+  p += phystop/PGSIZE * sizeof(pageref[0]);
+  memmove(p, pagetype0, sizeof(pagetype0));
+  pagetype = (uchar*)p;
+  vstart = (char*)pageref + n;
+
+  top = (char*)((uint)vend & ~(PDSIZE-1));
+  freerange(top, vend);
+  for(i = 0; i < NSUPERPAGE && top - PDSIZE >= (char*)vstart; i++){
+    top -= PDSIZE;
+    r = (struct run*)top;
+    r->next = kmem.super;
+    kmem.super = r;
+  }
+  kmem.npages += i*NPTENTRIES;
+  // Each node's first range is fresh; any more it has are
+  // freed page by page.
+  for(p = vstart; p < top; p = q){
+    kn = &kmem.node[physnode(V2P(p), &end)];
+    q = end < V2P(top) ? P2V(PGROUNDUP(end)) : top;
+    if(kn->fresh == kn->freshend){
+      kn->fresh = p;
+      kn->freshend = q;
+      kmem.npages += (q - p) / PGSIZE;
+    } else
+      freerange(p, q);
+  }
+  __sync_synchronize();  // the other cpus are up, and may look
   kmem.use_lock = 1;
 }
 
@@ -48,49 +162,382 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    pageref[V2P(p) / PGSIZE] = 1;
+    kmem.npages++;
     kfree(p);
+  }
+}
+// Take another reference to page v, which is in use.
+void
+kref(char *v)
+{
+  if(__sync_fetch_and_add(&pageref[V2P(v) / PGSIZE], 1) == 0)
+    panic("kref");
 }
+
+// Number of references to page v.
+int
+krefcount(char *v)
+{
+  return pageref[V2P(v) / PGSIZE];
+}
+
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
+// Drop a reference to the page at v for kfree() and kfreemany().
+// Returns the page if that was the last reference, else 0.
+static struct run*
+kunref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
+    panic("kfree");
+  if(pageref[V2P(v) / PGSIZE] == 0)
+    panic("kfree: free page");
+  if(__sync_sub_and_fetch(&pageref[V2P(v) / PGSIZE], 1) > 0)
+    return 0;
+
+#if KJUNK
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE);
+#endif
+  return (struct run*)v;
+}
+
+// Drop a reference to the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc(), and free it with the last one.  (The exception
+// is when initializing the allocator; see kinit above.)
 void
 kfree(char *v)
 {
+  struct knode *kn;
   struct run *r;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
-    panic("kfree");
+  if((r = kunref(v)) == 0)
+    return;
+  if(kmem.use_lock){
+    trace(TR_KFREE, (uint)v);
+    pushcli();
+    kcachefree(&percpu(kcaches), r);
+    popcli();
+    return;
+  }
+  kn = &kmem.node[physnode(V2P(v), 0)];
+  r->next = kn->freelist;
+  kn->freelist = r;
+}
 
-  // Fill with junk to catch dangling refs.
-  memset(v, 1, PGSIZE);
+// kfree() the n pages in v, with interrupts turned off once for
+// all of them rather than once each, as when unmapping a range
+// of user memory.  Not for use before kinit2().
+void
+kfreemany(char **v, int n)
+{
+  struct kcache *kc;
+  struct run *r;
+  int i;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  pushcli();
+  kc = &percpu(kcaches);
+  for(i = 0; i < n; i++){
+    if((r = kunref(v[i])) == 0)
+      continue;
+    trace(TR_KFREE, (uint)v[i]);
+    kcachefree(kc, r);
+  }
+  popcli();
+}
+
+// Put r in cache kc, this cpu's, draining a batch to the node
+// lists if the cache is full.  The batch is sorted by node
+// first, so each list's lock is taken once.  Caller must have
+// interrupts off.
+static void
+kcachefree(struct kcache *kc, struct run *r)
+{
+  struct knode *kn;
+  struct run *head[NNODE], *tail[NNODE];
+  int i, n;
+
+  kc->used[pagetype[V2P(r) / PGSIZE]]--;
+  r->next = kc->freelist;
+  kc->freelist = r;
+  if(++kc->n > KCACHEMAX){
+    for(n = 0; n < nnode; n++)
+      head[n] = 0;
+    for(i = 0; i < KBATCH; i++){
+      r = kc->freelist;
+      kc->freelist = r->next;
+      n = physnode(V2P(r), 0);
+      if(head[n] == 0)
+        tail[n] = r;
+      r->next = head[n];
+      head[n] = r;
+    }
+    kc->n -= KBATCH;
+    for(n = 0; n < nnode; n++){
+      if(head[n] == 0)
+        continue;
+      kn = &kmem.node[n];
+      acquire(&kn->lock);
+      tail[n]->next = kn->freelist;
+      kn->freelist = head[n];
+      release(&kn->lock);
+    }
+  }
 }
 
-// Allocate one 4096-byte page of physical memory.
+// Whether node kn has no free pages.  Only a hint without
+// kn->lock.
+static int
+knodeempty(struct knode *kn)
+{
+  return kn->freelist == 0 && kn->fresh == kn->freshend;
+}
+
+// Move up to KBATCH free pages to cache kc, from node and
+// then from the others in turn.  Returns the number moved.
+static int
+kcacherefill(struct kcache *kc, int node)
+{
+  struct knode *kn;
+  struct run *r;
+  int i, k;
+
+  for(k = 0; k < nnode; k++){
+    kn = &kmem.node[(node + k) % nnode];
+    if(knodeempty(kn))
+      continue;
+    acquire(&kn->lock);
+    for(i = 0; i < KBATCH; i++){
+      if((r = kn->freelist) != 0)
+        kn->freelist = r->next;
+      else if(kn->fresh < kn->freshend){
+        r = (struct run*)kn->fresh;
+        kn->fresh += PGSIZE;
+      } else
+        break;
+      r->next = kc->freelist;
+      kc->freelist = r;
+      kc->n++;
+    }
+    release(&kn->lock);
+    if(i > 0)
+      return i;
+  }
+  return 0;
+}
+
+// Allocate one 4096-byte page of physical memory, to be used
+// as type (a KM_ kind from meminfo.h).
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 char*
-kalloc(void)
+kalloc(int type)
 {
+  struct kcache *kc;
   struct run *r;
+  struct knode *kn;
+  int brk;
+
+  if(!kmem.use_lock){
+    for(kn = kmem.node; kn < &kmem.node[NNODE-1] && kn->freelist == 0; kn++)
+      ;
+    r = kn->freelist;
+    if(r){
+      kn->freelist = r->next;
+      pageref[V2P(r) / PGSIZE] = 1;
+      pagetype[V2P(r) / PGSIZE] = type;
+      percpuof(kcaches, 0).used[type]++;
+    }
+    return (char*)r;
+  }
 
-  if(kmem.use_lock)
+  pushcli();
+  kc = &percpu(kcaches);
+  if(kc->freelist == 0 && kcacherefill(kc, mycpu()->node) == 0){
+    // Nearly out of memory: fall back on the zeroed pages,
+    // then on the 4MB frames.
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
+    brk = 0;
+    if((r = kmem.zeroed) != 0){
+      kmem.zeroed = r->next;
+      kmem.nzeroed--;
+      r->next = 0;
+      kc->freelist = r;
+      kc->n++;
+      kc->used[KM_ZERO]--;
+    } else if(kmem.super){
+      ksuperbreak();
+      brk = 1;
+    }
     release(&kmem.lock);
+    if(brk)
+      kcacherefill(kc, mycpu()->node);
+  }
+  if((r = kc->freelist) != 0){
+    kc->freelist = r->next;
+    kc->n--;
+    kc->used[type]++;
+    pageref[V2P(r) / PGSIZE] = 1;
+    pagetype[V2P(r) / PGSIZE] = type;
+    trace(TR_KALLOC, (uint)r);
+  }
+  popcli();
+  if(r == 0){
+    // Out of memory: give back cached file pages and try again.
+    if(pcreclaim(KBATCH) > 0)
+      return kalloc(type);
+    __sync_fetch_and_add(&kmem.nfail, 1);
+  }
+  return (char*)r;
+}
+
+// Allocate a zeroed page, from the pool kept by kzeroidle()
+// if possible.  Returns 0 if the memory cannot be allocated.
+char*
+kzalloc(int type)
+{
+  struct run *r;
+
+  r = 0;
+  if(kmem.nzeroed > 0){
+    acquire(&kmem.lock);
+    if((r = kmem.zeroed) != 0){
+      kmem.zeroed = r->next;
+      kmem.nzeroed--;
+    }
+    release(&kmem.lock);
+  }
+  if(r){
+    r->next = 0;  // the only word of the page that wasn't zero
+    pushcli();
+    percpu(kcaches).used[KM_ZERO]--;
+    percpu(kcaches).used[type]++;
+    popcli();
+    pagetype[V2P(r) / PGSIZE] = type;
+    trace(TR_KALLOC, (uint)r);
+    return (char*)r;
+  }
+  if((r = (struct run*)kalloc(type)) != 0)
+    memset(r, 0, PGSIZE);
+  return (char*)r;
+}
+
+// Zero one free page for kzalloc(), unless KZEROMAX are ready.
+// Called by idle cpus.  Returns whether it did any work.
+int
+kzeroidle(void)
+{
+  struct run *r;
+  int i;
+
+  // Don't take free memory from the page cache to zero it.
+  if(!kmem.use_lock || kmem.nzeroed >= KZEROMAX)
+    return 0;
+  for(i = 0; i < nnode && knodeempty(&kmem.node[i]); i++)
+    ;
+  if(i == nnode)
+    return 0;
+  if((r = (struct run*)kalloc(KM_ZERO)) == 0)
+    return 0;
+  memset(r, 0, PGSIZE);
+  acquire(&kmem.lock);
+  r->next = kmem.zeroed;
+  kmem.zeroed = r;
+  kmem.nzeroed++;
+  release(&kmem.lock);
+  return 1;
+}
+
+// Allocate a zeroed, 4MB-aligned 4MB frame for a user superpage.
+// Returns 0 if none is left.  Each of its pages has a reference,
+// so the frame can be split into ordinary pages and those freed
+// one at a time with kfree(); ksuperfree() frees it whole.
+char*
+ksuperalloc(void)
+{
+  struct run *r;
+  uint i;
+
+  acquire(&kmem.lock);
+  if((r = kmem.super) != 0)
+    kmem.super = r->next;
+  release(&kmem.lock);
+  if(r == 0)
+    return 0;
+  for(i = 0; i < NPTENTRIES; i++){
+    pageref[V2P(r) / PGSIZE + i] = 1;
+    pagetype[V2P(r) / PGSIZE + i] = KM_USER;
+  }
+  pushcli();
+  percpu(kcaches).used[KM_USER] += NPTENTRIES;
+  popcli();
+  memset(r, 0, PDSIZE);
   return (char*)r;
 }
 
+// Free a frame from ksuperalloc() that was never split.
+void
+ksuperfree(char *v)
+{
+  struct run *r;
+  uint i;
+
+  if((uint)v % PDSIZE || v < end || V2P(v) + PDSIZE > phystop)
+    panic("ksuperfree");
+  for(i = 0; i < NPTENTRIES; i++)
+    if(pageref[V2P(v) / PGSIZE + i] != 1)
+      panic("ksuperfree: shared");
+  for(i = 0; i < NPTENTRIES; i++)
+    pageref[V2P(v) / PGSIZE + i] = 0;
+  pushcli();
+  percpu(kcaches).used[KM_USER] -= NPTENTRIES;
+  popcli();
+  r = (struct run*)v;
+  acquire(&kmem.lock);
+  r->next = kmem.super;
+  kmem.super = r;
+  release(&kmem.lock);
+}
+
+// Out of ordinary pages: turn a free 4MB frame into them, on
+// the list of its node.  Caller holds kmem.lock.
+static void
+ksuperbreak(void)
+{
+  struct knode *kn;
+  struct run *r;
+  char *p, *frame;
+
+  frame = (char*)kmem.super;
+  kmem.super = kmem.super->next;
+  kn = &kmem.node[physnode(V2P(frame), 0)];
+  acquire(&kn->lock);
+  for(p = frame; p < frame + PDSIZE; p += PGSIZE){
+    r = (struct run*)p;
+    r->next = kn->freelist;
+    kn->freelist = r;
+  }
+  release(&kn->lock);
+}
+
+// Fill in the system-wide fields of *mi.
+void
+kmeminfo(struct meminfo *mi)
+{
+  int c, t, n, used;
+
+  used = 0;
+  for(t = 0; t < NKM; t++){
+    n = 0;
+    for(c = 0; c < NCPU; c++)
+      n += percpuof(kcaches, c).used[t];
+    mi->used[t] = n;
+    if(t != KM_ZERO)
+      used += n;
+  }
+  mi->total = kmem.npages;
+  mi->free = kmem.npages - used;
+  mi->failed = kmem.nfail;
+}
@@ -0,0 +1,110 @@
+// Kernel log: klog() formats a message into a ring buffer of
+// the calling cpu, and a kernel thread, klogd, copies the rings
+// to the console every KLOGDELAY ticks.  So logging never waits
+// for cons.lock or the CGA and serial hardware, and can be done
+// with any lock held, even ptable.lock.
+//
+// A ring has one writer, its cpu with interrupts off, and one
+// reader, klogd: the writer only moves head and the reader only
+// moves tail, each after a barrier, so neither takes a lock.  A
+// message that doesn't fit in what klogd has yet to drain is
+// dropped whole and counted, and klogd reports the count.
+// panic() drains the rings itself, with klogflush().
+//
+// Callers use KLOG() (defs.h), which drops messages less urgent
+// than KLOGLEVEL at compile time.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "rusage.h"
+#include "proc.h"
+
+struct klogring {
+  char buf[KLOGSIZE];
+  volatile uint head;   // next byte klog() writes
+  volatile uint tail;   // next byte klogd reads
+  uint pos;             // end of the message being written
+  volatile uint lost;   // messages dropped for want of room
+};
+
+static PERCPU(struct klogring, klogs);
+
+static void
+klogput(int c, void *arg)
+{
+  struct klogring *r = arg;
+
+  if(r->pos - r->tail < KLOGSIZE)
+    r->buf[r->pos % KLOGSIZE] = c;
+  r->pos++;
+}
+
+void
+klog(char *fmt, ...)
+{
+  struct klogring *r;
+
+  pushcli();
+  r = &percpu(klogs);
+  r->pos = r->head;
+  vprintfmt(klogput, r, fmt, (uint*)(void*)(&fmt + 1));
+  if(r->pos - r->tail > KLOGSIZE)
+    __sync_fetch_and_add(&r->lost, 1);
+  else {
+    __sync_synchronize();  // the message before head
+    r->head = r->pos;
+  }
+  popcli();
+}
+
+// Copy what is in r to the console.
+static void
+klogdrain(struct klogring *r)
+{
+  uint head, tail, n, lost;
+
+  if((lost = r->lost) != 0){
+    __sync_fetch_and_sub(&r->lost, lost);
+    cprintf("klog: %d messages lost\n", lost);
+  }
+  head = r->head;
+  __sync_synchronize();  // head before the message
+  for(tail = r->tail; tail != head; tail += n){
+    n = head - tail;
+    if(n > KLOGSIZE - tail % KLOGSIZE)
+      n = KLOGSIZE - tail % KLOGSIZE;
+    consputs(r->buf + tail % KLOGSIZE, n);
+  }
+  __sync_synchronize();  // the copy before klog() reuses it
+  r->tail = tail;
+}
+
+// Copy every cpu's log to the console.
+void
+klogflush(void)
+{
+  int i;
+
+  for(i = 0; i < ncpu; i++)
+    klogdrain(&percpuof(klogs, i));
+}
+
+static void
+klogd(void *arg)
+{
+  for(;;){
+    klogflush();
+    timersleep(KLOGDELAY, 0);
+  }
+}
+
+// Start klogd.  Needs a process context, for kthreadstart().
+void
+kloginit(void)
+{
+  if(kthreadstart(klogd, 0, "klogd") < 0)
+    panic("kloginit");
+}
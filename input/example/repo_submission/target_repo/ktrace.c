@@ -0,0 +1,106 @@
+// ktrace: drive kernel event tracing.
+//   ktrace 1   start tracing (0 stops)
+//   ktrace     print the events traced so far as Chrome trace
+//              JSON, for chrome://tracing or Perfetto: FS ops
+//              and commits as spans on the thread that ran them,
+//              disk requests as async spans keyed by block, the
+//              rest as instant events.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "trace.h"
+
+char *evname[NTREV] = {
+[TR_TRAP]       "trap",
+[TR_SWITCH]     "switch",
+[TR_SLEEP]      "sleep",
+[TR_WAKEUP]     "wakeup",
+[TR_DISKSUB]    "disk",
+[TR_DISKDONE]   "disk",
+[TR_BEGINOP]    "op",
+[TR_ENDOP]      "op",
+[TR_COMMIT]     "commit",
+[TR_COMMITDONE] "commit",
+[TR_KALLOC]     "kalloc",
+[TR_KFREE]      "kfree",
+[TR_CLONE]      "clone",
+[TR_JOIN]       "join",
+};
+
+struct traceev ev[64];
+uint64 tsc0;  // the first event read; other cpus' earlier ones show at 0
+uint cpus;  // TSC cycles per microsecond
+int nout;
+
+void
+emit(struct traceev *e)
+{
+  char *ph;
+
+  if(e->ev <= 0 || e->ev >= NTREV)
+    return;
+  switch(e->ev){
+  case TR_BEGINOP:
+  case TR_COMMIT:
+    ph = "B";
+    break;
+  case TR_ENDOP:
+  case TR_COMMITDONE:
+    ph = "E";
+    break;
+  case TR_DISKSUB:
+    ph = "b";
+    break;
+  case TR_DISKDONE:
+    ph = "e";
+    break;
+  default:
+    ph = "i";
+  }
+  printf(1, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%d,\"pid\":0,\"tid\":%d",
+         nout++ ? ",\n" : "", evname[e->ev], ph,
+         e->tsc > tsc0 ? udiv64(e->tsc - tsc0, cpus) : 0, e->pid);
+  if(ph[0] == 'b' || ph[0] == 'e')
+    printf(1, ",\"cat\":\"disk\",\"id\":%d", e->arg & ~TR_WRITE);
+  if(ph[0] == 'i')
+    printf(1, ",\"s\":\"t\"");
+  printf(1, ",\"args\":{\"cpu\":%d,\"arg\":\"%x\"}}", e->cpu, e->arg);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, i;
+
+  if(argc > 2){
+    printf(2, "usage: ktrace [1|0]\n");
+    exit();
+  }
+  if((fd = open("dev/trace", argc == 2 ? O_WRONLY : O_RDONLY)) < 0){
+    printf(2, "ktrace: cannot open dev/trace\n");
+    exit();
+  }
+  if(argc == 2){
+    if(write(fd, argv[1], strlen(argv[1])) < 0)
+      printf(2, "ktrace: write failed\n");
+    close(fd);
+    exit();
+  }
+  if((cpus = vtscpertick() / 10000) == 0){
+    printf(2, "ktrace: TSC not calibrated yet, assuming 1GHz\n");
+    cpus = 1000;
+  }
+  printf(1, "{\"traceEvents\":[\n");
+  while((n = read(fd, (char*)ev, sizeof(ev))) > 0){
+    for(i = 0; i < n / sizeof(ev[0]); i++){
+      if(tsc0 == 0)
+        tsc0 = ev[i].tsc;
+      emit(&ev[i]);
+    }
+  }
+  printf(1, "\n]}\n");
+  close(fd);
+  exit();
+}
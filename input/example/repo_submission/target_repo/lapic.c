@@ -64,9 +64,10 @@ lapicinit(void)
   // from lapic[TICR] and then issues an interrupt.
   // If xv6 cared more about precise timekeeping,
   // TICR would be calibrated using an external time source.
+  // Once timer.c goes tickless it arms the timer one-shot.
   lapicw(TDCR, X1);
   lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicw(TICR, TICKCOUNT);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -113,6 +114,32 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// Interrupt once, count bus cycles from now; 0 stops the timer.
+void
+lapiconeshot(uint count)
+{
+  lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  lapicw(TICR, count);
+}
+
+// Send an IPI of the given mode to the cpu with local APIC
+// id apicid, waiting until it is delivered.
+static void
+lapicsend(uchar apicid, int mode)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, mode);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
+// Send interrupt vector to the cpu with local APIC id apicid.
+void
+lapicipi(uchar apicid, int vector)
+{
+  lapicsend(apicid, FIXED | vector);
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
@@ -123,12 +150,14 @@ microdelay(int us)
 #define CMOS_PORT    0x70
 #define CMOS_RETURN  0x71
 
-// Start additional processor running entry code at addr.
+// Start the n processors with local APIC ids apicid[] running
+// entry code at addr, all at once: each step of the startup
+// sequence goes to every one of them before the wait after it.
 // See Appendix B of MultiProcessor Specification.
 void
-lapicstartap(uchar apicid, uint addr)
+lapicstartaps(uchar *apicid, int n, uint addr)
 {
-  int i;
+  int i, j;
   ushort *wrv;
 
   // "The BSP must initialize CMOS shutdown code to 0AH
@@ -142,10 +171,11 @@ lapicstartap(uchar apicid, uint addr)
 
   // "Universal startup algorithm."
   // Send INIT (level-triggered) interrupt to reset other CPU.
-  lapicw(ICRHI, apicid<<24);
-  lapicw(ICRLO, INIT | LEVEL | ASSERT);
+  for(j = 0; j < n; j++)
+    lapicsend(apicid[j], INIT | LEVEL | ASSERT);
   microdelay(200);
-  lapicw(ICRLO, INIT | LEVEL);
+  for(j = 0; j < n; j++)
+    lapicsend(apicid[j], INIT | LEVEL);
   microdelay(100);    // should be 10ms, but too slow in Bochs!
 
   // Send startup IPI (twice!) to enter code.
@@ -154,8 +184,8 @@ lapicstartap(uchar apicid, uint addr)
   // should be ignored, but it is part of the official Intel algorithm.
   // Bochs complains about the second one.  Too bad for Bochs.
   for(i = 0; i < 2; i++){
-    lapicw(ICRHI, apicid<<24);
-    lapicw(ICRLO, STARTUP | (addr>>12));
+    for(j = 0; j < n; j++)
+      lapicsend(apicid[j], STARTUP | (addr>>12));
     microdelay(200);
   }
 }
@@ -227,3 +257,22 @@ cmostime(struct rtcdate *r)
   *r = t1;
   r->year += 2000;
 }
+
+#define CMOS_EXTLO   0x30  // KB of memory from 1MB, up to 64MB
+#define CMOS_EXTHI   0x31
+#define CMOS_HIGHLO  0x34  // 64KB blocks of memory from 16MB
+#define CMOS_HIGHHI  0x35
+
+// The physical address of the top of memory below 4GB, as the
+// BIOS recorded it in the CMOS.
+uint
+cmosmemtop(void)
+{
+  uint n;
+
+  n = cmos_read(CMOS_HIGHLO) | cmos_read(CMOS_HIGHHI) << 8;
+  if(n > 0)
+    return 16*1024*1024 + n * 64*1024;
+  n = cmos_read(CMOS_EXTLO) | cmos_read(CMOS_EXTHI) << 8;
+  return EXTMEM + n * 1024;
+}
@@ -0,0 +1,180 @@
+// Lock-free data structures; see lockfree.h.
+
+#include "types.h"
+#include "user.h"
+#include "mmu.h"
+#include "thread.h"
+
+#define NODE(h)  ((lfnode_t *)(uint)(h))
+#define COUNT(h) ((uint)((h) >> 32))
+#define HEAD(n, count) ((uint)(n) | (unsigned long long)(count) << 32)
+
+void
+lfstack_init(lfstack_t *s)
+{
+  s->head = 0;
+}
+
+void
+lfstack_push(lfstack_t *s, lfnode_t *n)
+{
+  unsigned long long h, prev;
+
+  // A push needs no new count: it is a pop's read of the top
+  // node's next that a recycled node can make stale.
+  for (h = s->head; ; h = prev) {
+    n->next = NODE(h);
+    if ((prev = cmpxchg64(&s->head, h, HEAD(n, COUNT(h)))) == h)
+      return;
+  }
+}
+
+// Returns the top node, or 0 if the stack is empty.
+lfnode_t*
+lfstack_pop(lfstack_t *s)
+{
+  unsigned long long h, prev;
+
+  for (h = s->head; NODE(h) != 0; h = prev) {
+    prev = cmpxchg64(&s->head, h, HEAD(NODE(h)->next, COUNT(h) + 1));
+    if (prev == h)
+      return NODE(h);
+  }
+  return 0;
+}
+
+// Use slots, n of them, for q.  Returns -1 if n is not a power
+// of two.
+int
+lfqueue_init(lfqueue_t *q, struct lfslot *slots, uint n)
+{
+  uint i;
+
+  if (n == 0 || (n & (n - 1)) != 0)
+    return -1;
+  for (i = 0; i < n; i++)
+    slots[i].seq = i;
+  q->slot = slots;
+  q->mask = n - 1;
+  q->head = q->tail = 0;
+  return 0;
+}
+
+// Returns 0, or -1 if q is full.
+int
+lfqueue_push(lfqueue_t *q, void *item)
+{
+  struct lfslot *sl;
+  uint pos, seq;
+
+  pos = q->tail;
+  for (;;) {
+    sl = &q->slot[pos & q->mask];
+    seq = load_acquire(&sl->seq);
+    if (seq == pos) {
+      if (cas(&q->tail, pos, pos + 1))
+        break;
+      pos = q->tail;
+    } else if ((int)(seq - pos) < 0) {
+      return -1;  // full
+    } else {
+      pos = q->tail;
+    }
+  }
+  sl->item = item;
+  store_release(&sl->seq, pos + 1);  // publish
+  return 0;
+}
+
+// Returns the oldest item, or 0 if q is empty.
+void*
+lfqueue_pop(lfqueue_t *q)
+{
+  struct lfslot *sl;
+  uint pos, seq;
+  void *item;
+
+  pos = q->head;
+  for (;;) {
+    sl = &q->slot[pos & q->mask];
+    seq = load_acquire(&sl->seq);
+    if (seq == pos + 1) {
+      if (cas(&q->head, pos, pos + 1))
+        break;
+      pos = q->head;
+    } else if ((int)(seq - (pos + 1)) < 0) {
+      return 0;  // empty
+    } else {
+      pos = q->head;
+    }
+  }
+  item = sl->item;
+  store_release(&sl->seq, pos + q->mask + 1);  // free for next lap
+  return item;
+}
+
+// Use buf, n items long, for r.  Returns -1 if n is not a power
+// of two.
+int
+spsc_init(spsc_t *r, void **buf, uint n)
+{
+  if (n == 0 || (n & (n - 1)) != 0)
+    return -1;
+  r->buf = buf;
+  r->mask = n - 1;
+  r->head = r->tail = 0;
+  return 0;
+}
+
+// Returns 0, or -1 if r is full.  Producer only.
+int
+spsc_push(spsc_t *r, void *item)
+{
+  uint tail = r->tail;
+
+  if (tail - load_acquire(&r->head) > r->mask)
+    return -1;
+  r->buf[tail & r->mask] = item;
+  store_release(&r->tail, tail + 1);
+  return 0;
+}
+
+// Returns the oldest item, or 0 if r is empty.  Consumer only.
+void*
+spsc_pop(spsc_t *r)
+{
+  uint head = r->head;
+  void *item;
+
+  if (head == load_acquire(&r->tail))
+    return 0;
+  item = r->buf[head & r->mask];
+  store_release(&r->head, head + 1);
+  return item;
+}
+
+void
+shcounter_init(shcounter_t *c)
+{
+  memset(c, 0, sizeof(*c));
+}
+
+// Threads' TLS blocks are at the tops of their stacks, which are
+// whole pages apart, so the page number spreads them out.
+void
+shcounter_add(shcounter_t *c, uint n)
+{
+  xadd(&c->shard[(uint)thread_tls() / PGSIZE % NSHARD].n, n);
+}
+
+// The sum of the shards, which is exact once adds have stopped.
+uint
+shcounter_read(shcounter_t *c)
+{
+  uint sum = 0;
+  int i;
+
+  for (i = 0; i < NSHARD; i++)
+    sum += c->shard[i].n;
+  return sum;
+}
@@ -0,0 +1,83 @@
+#ifndef _LOCKFREE_H_
+#define _LOCKFREE_H_
+
+#include "types.h"
+#include "param.h"  // CACHELINE
+#include "atomic.h"
+
+// Lock-free data structures for user programs, in lockfree.c.
+// None of them allocate: the caller provides nodes and buffers.
+
+// Treiber stack of nodes embedded in the caller's objects.  head
+// holds the top node in its low word and a count that every pop
+// bumps in its high word, so a node popped and pushed back while
+// another pop is looking at it doesn't fool that pop's cmpxchg64
+// (the ABA problem).  A pop may still read the next of a node
+// another thread just took, so nodes' memory must stay mapped
+// while the stack is in use.
+typedef struct __lfnode_t {
+  struct __lfnode_t *next;
+} lfnode_t;
+
+typedef struct __lfstack_t {
+  volatile unsigned long long head;
+} __attribute__((aligned(8))) lfstack_t;
+
+// Bounded multi-producer, multi-consumer queue over n slots, n a
+// power of two.  Each slot's seq says whether it is free for the
+// push at tail or full for the pop at head, so pushes and pops
+// only contend on their own end.
+struct lfslot {
+  volatile uint seq;
+  void *item;
+};
+
+typedef struct __lfqueue_t {
+  struct lfslot *slot;
+  uint mask;
+  char pad0[CACHELINE - sizeof(void *) - sizeof(uint)];
+  volatile uint head;          // next slot to pop
+  char pad1[CACHELINE - sizeof(uint)];
+  volatile uint tail;          // next slot to push
+} __attribute__((aligned(CACHELINE))) lfqueue_t;
+
+// Ring buffer for one producer and one consumer, over n items, n
+// a power of two.  Each side writes only its own index, with a
+// store_release() once the item is in or out.
+typedef struct __spsc_t {
+  void **buf;
+  uint mask;
+  char pad0[CACHELINE - sizeof(void *) - sizeof(uint)];
+  volatile uint head;          // next item to pop, written by the consumer
+  char pad1[CACHELINE - sizeof(uint)];
+  volatile uint tail;          // next item to push, written by the producer
+} __attribute__((aligned(CACHELINE))) spsc_t;
+
+// Counter that threads add to without sharing a cache line:
+// each adds to the shard its TLS block picks, and a read sums
+// them all.
+#define NSHARD 8
+
+typedef struct __shcounter_t {
+  struct {
+    volatile uint n;
+  } __attribute__((aligned(CACHELINE))) shard[NSHARD];
+} shcounter_t;
+
+void lfstack_init(lfstack_t *s);
+void lfstack_push(lfstack_t *s, lfnode_t *n);
+lfnode_t *lfstack_pop(lfstack_t *s);
+
+int lfqueue_init(lfqueue_t *q, struct lfslot *slots, uint n);
+int lfqueue_push(lfqueue_t *q, void *item);
+void *lfqueue_pop(lfqueue_t *q);
+
+int spsc_init(spsc_t *r, void **buf, uint n);
+int spsc_push(spsc_t *r, void *item);
+void *spsc_pop(spsc_t *r);
+
+void shcounter_init(shcounter_t *c);
+void shcounter_add(shcounter_t *c, uint n);
+uint shcounter_read(shcounter_t *c);
+
+#endif
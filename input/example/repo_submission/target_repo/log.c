@@ -1,7 +1,11 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
 #include "spinlock.h"
+#include "trace.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -18,37 +22,113 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction has been committed.  Each
+// call in progress has MAXOPBLOCKS reserved, less the blocks
+// it has already added; blocks written again are absorbed
+// and use no more space.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// Commits are done by a kernel thread, committer(), so
+// end_op() returns as soon as the call's updates are in
+// the transaction.  The committer waits LOGDELAY ticks after
+// a transaction starts for more system calls to join it, then
+// commits once none is active; it commits at once if the log
+// is filling up or logsync() (the fsync system call) wants
+// the updates to be durable.
+//
+// The log is a physical re-do log containing disk blocks,
+// kept in a circular area of the disk.  Each commit appends
+// one transaction to it:
+//   descriptor, containing seq and block #s for A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The data blocks go first and the descriptor after them, so
+// writing the descriptor is what commits the transaction.
+// Log appends are synchronous, but the blocks of a commit are
+// written NLOGIO at a time, so the disk queue stays full.
+//
+// Committed blocks are written to their home locations later,
+// by checkpoint(), in block order.  Until then they stay pinned
+// in the buffer cache (B_DIRTY) and may be changed again by
+// later transactions.  The committer doubles as the writeback
+// daemon: it checkpoints in the background once the oldest
+// committed block has waited WBAGE ticks, the log is half full,
+// or committed blocks pin WBDIRTY percent of the cache, and
+// first thing in a commit that would not fit.  Past WBTHROTTLE
+// percent, begin_op() holds new FS calls until it has.  The log's first
+// block says where the oldest transaction not yet checkpointed
+// starts and its sequence number; recovery replays every
+// transaction from there on whose descriptor has the next
+// sequence number.
+//
+// File data does not go through the log: log_data() writes it
+// straight to its home location, and commit() waits for those
+// writes before writing the transaction that points at the
+// blocks, so a crash never leaves a file with blocks holding
+// someone else's old data.  (Blocks the transaction freed are
+// not given new data until it commits; see bfree().)  Only
+// the inodes, index blocks and bitmap blocks of a write use
+// log space.
+//
+// A disk kept in memory (memide.c) lends the buffer cache its
+// blocks, so a change to a buffer is a change to the disk and
+// there is nothing for a log to make atomic: with log.direct
+// set, log_write() and log_data() only check that they are in
+// an FS call, and no transactions are committed.
+
+#define LOGMAGIC 0x10c0ffee
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// A transaction's descriptor, on disk; in memory, the block
+// numbers of the transaction being built.
 struct logheader {
+  uint magic;
+  uint seq;
   int n;
   int block[LOGSIZE];
 };
 
+// The log's first block.
+struct logsuper {
+  uint magic;
+  uint tail;       // slot of the oldest transaction's descriptor
+  uint seq;        // and its sequence number
+};
+
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // slots in the circular area, after log.start
+  int cap;         // data blocks a transaction may log
+  int reserved;    // blocks calls in progress may still add
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int urgent;      // commit without waiting LOGDELAY
+  uint ncommit;    // number of commits done
+  int ndata;       // log_data() writes in flight
   int dev;
+  int direct;      // disk in memory: no logging (see idemap())
   struct logheader lh;
+  struct buf *lbuf[LOGSIZE];  // buffers of lh.block[]
+
+  // The circular area, used only by the committer.
+  uint head;       // slot for the next transaction
+  uint tail;       // slot of the oldest not checkpointed
+  uint used;       // slots from tail to head
+  uint seq;        // sequence number for the next transaction
+  struct buf *ckpt;  // committed, not yet written home; through cknext
+  int nckpt;       // buffers on ckpt
+  uint cktime;     // ticks when the first of them was committed
+  int flush;       // checkpoint now: begin_op() is throttled
 };
 struct log log;
 
+#define NLOGIO 8  // block writes a commit has in flight at once
+
 static void recover_from_log(void);
 static void commit();
+static void committer(void*);
+static void checkpoint(void);
 
 void
 initlog(int dev)
@@ -57,68 +137,156 @@ initlog(int dev)
     panic("initlog: too big logheader");
 
   struct superblock sb;
+  int n;
   initlock(&log.lock, "log");
   readsb(dev, &sb);
   log.start = sb.logstart;
-  log.size = sb.nlog;
+  // Committed blocks stay pinned in the buffer cache until they
+  // are checkpointed, so use no more of the log than the cache
+  // has room to pin.
+  n = bufcount() - LOGSIZE - MAXOPBLOCKS*3;
+  log.size = (sb.nlog < n ? sb.nlog : n) - 1;
+  log.cap = log.size - 1 < LOGSIZE ? log.size - 1 : LOGSIZE;
   log.dev = dev;
   recover_from_log();
+  if((log.direct = idemap(dev, log.start) != 0) != 0)
+    return;
+  if(kthreadstart(committer, 0, "logcommit") < 0)
+    panic("initlog: committer");
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(void)
+// Disk block of slot i of the circular area.
+static uint
+logslot(uint i)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  return log.start + 1 + i % log.size;
 }
 
-// Read the log header from disk into the in-memory log header
+// Write the log's first block, saying where recovery starts.
 static void
-read_head(void)
+write_super(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  struct buf *buf = bnew(log.dev, log.start);
+  struct logsuper *ls = (struct logsuper *) (buf->data);
+
+  memset(buf->data, 0, BSIZE);
+  ls->magic = LOGMAGIC;
+  ls->tail = log.tail;
+  ls->seq = log.seq;
+  bwrite(buf);
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Sort a list of buffers, linked through cknext, by block
+// number.
+static struct buf*
+cksort(struct buf *l)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  struct buf *a, *b, **pp;
+
+  if (l == 0 || l->cknext == 0)
+    return l;
+  a = b = 0;
+  while (l) {  // deal l out to a and b
+    struct buf *next = l->cknext;
+    l->cknext = a;
+    a = l;
+    l = next;
+    if (l == 0)
+      break;
+    next = l->cknext;
+    l->cknext = b;
+    b = l;
+    l = next;
   }
-  bwrite(buf);
-  brelse(buf);
+  a = cksort(a);
+  b = cksort(b);
+  for (pp = &l; a && b; pp = &(*pp)->cknext) {
+    if (a->blockno < b->blockno) {
+      *pp = a;
+      a = a->cknext;
+    } else {
+      *pp = b;
+      b = b->cknext;
+    }
+  }
+  *pp = a ? a : b;
+  return l;
 }
 
+// Replay the committed transactions after a crash, then mark
+// the log empty.  The log is read front to back in one pass,
+// each transaction's blocks read ahead while its descriptor is
+// handled, and each block's last copy is put in its buffer in
+// the cache, pinned as checkpoint() would find it; there is
+// room, since initlog() keeps the log to what the cache can
+// pin.  Then the home locations are written in block order,
+// NLOGIO at a time, so the disk sweeps across them once.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf, *lbuf, *dbuf, *list, *next, *pending[NLOGIO];
+  struct logsuper *ls;
+  struct logheader *lh;
+  int i, n;
+
+  buf = bread(log.dev, log.start);
+  ls = (struct logsuper *) (buf->data);
+  if (ls->magic == LOGMAGIC) {
+    log.tail = ls->tail % log.size;
+    log.seq = ls->seq;
+  } else {
+    log.tail = 0;  // a new log
+    log.seq = 1;
+  }
+  brelse(buf);
+
+  list = 0;
+  for (;;) {
+    buf = bread(log.dev, logslot(log.tail));
+    lh = (struct logheader *) (buf->data);
+    if (lh->magic != LOGMAGIC || lh->seq != log.seq || lh->n < 0 || lh->n > log.cap) {
+      brelse(buf);
+      break;
+    }
+    n = lh->n;
+    for (i = 0; i <= n; i++)  // its blocks, and the next descriptor
+      bprefetch(log.dev, logslot(log.tail+1+i));
+    for (i = 0; i < n; i++) {
+      lbuf = bread(log.dev, logslot(log.tail+1+i));  // read log block
+      dbuf = bnew(log.dev, lh->block[i]);            // dst, overwritten whole
+      memmove(dbuf->data, lbuf->data, BSIZE);
+      dbuf->flags |= B_VALID | B_DIRTY;  // B_DIRTY prevents eviction
+      if ((dbuf->flags & B_CKPT) == 0) {
+        dbuf->flags |= B_CKPT;
+        dbuf->cknext = list;
+        list = dbuf;
+      }
+      brelse(lbuf);
+      brelse(dbuf);
+    }
+    brelse(buf);
+    log.tail = (log.tail + 1 + n) % log.size;
+    log.seq++;
+  }
+
+  n = 0;
+  for (list = cksort(list); list; list = next) {
+    next = list->cknext;
+    dbuf = bread(log.dev, list->blockno);  // pinned: same buffer
+    dbuf->flags &= ~B_CKPT;
+    bwriteasync(dbuf);  // write dst to disk; also unpins it
+    pending[n++] = dbuf;
+    if (n == NLOGIO || next == 0) {
+      bwait(pending, n);
+      for (i = 0; i < n; i++)
+        brelse(pending[i]);
+      n = 0;
+    }
+  }
+  log.head = log.tail;
+  log.used = 0;
+  write_super(); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -129,76 +297,291 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(!log.direct && log.lh.n + log.reserved + MAXOPBLOCKS > log.cap){
       // this op might exhaust log space; wait for commit.
+      log.urgent = 1;
+      wakeup(&log.urgent);
+      sleep(&log, &log.lock);
+    } else if(!log.direct && log.nckpt > 0 &&
+              (log.nckpt + log.lh.n + log.reserved) * 100 > bufcount() * WBTHROTTLE){
+      // too much of the cache is pinned; wait for checkpoint.
+      log.flush = 1;
+      wakeup(&log.urgent);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += MAXOPBLOCKS;
+      myproc()->lognew = 0;
       release(&log.lock);
+      trace(TR_BEGINOP, 0);
       break;
     }
   }
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// leaves the commit to committer().
 void
 end_op(void)
 {
-  int do_commit = 0;
-
+  trace(TR_ENDOP, 0);
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  log.reserved -= MAXOPBLOCKS - myproc()->lognew;
+  // begin_op() may be waiting for log space, and the
+  // committer for the last outstanding operation; and
+  // decrementing log.outstanding has decreased the amount
+  // of reserved space.
+  wakeup(&log);
+  if(log.lh.n > 0)
+    wakeup(&log.urgent);  // there is something to commit
+  if(log.direct && log.outstanding == 0)
+    bcommitted();  // the blocks freed are free on disk already
+  release(&log.lock);
+}
+
+// The number of the transaction that updates made now go in.
+// Read without the lock: a caller outside an FS call may get
+// the one being committed, which is the safe answer.
+uint
+logtxn(void)
+{
+  return log.ncommit + 1;
+}
+
+// Wait until transaction txn, from logtxn(), has committed, and
+// the file data written so far is on disk.
+void
+logwait(uint txn)
+{
+  acquire(&log.lock);
+  if((int)(log.ncommit - txn) < 0 && (log.committing || log.lh.n > 0)){
+    log.urgent = 1;
+    wakeup(&log.urgent);
+    while((int)(log.ncommit - txn) < 0)
+      sleep(&log, &log.lock);
   }
+  while(log.ndata > 0)
+    sleep(&log.ndata, &log.lock);
   release(&log.lock);
+}
+
+// Wait until everything written so far has been committed.
+void
+logsync(void)
+{
+  uint target;
+
+  acquire(&log.lock);
+  if(log.committing || log.lh.n > 0){
+    // The transaction being committed, or else the
+    // current one, holds the caller's updates.
+    target = log.ncommit + 1;
+    log.urgent = 1;
+    wakeup(&log.urgent);
+    while((int)(log.ncommit - target) < 0)
+      sleep(&log, &log.lock);
+  }
+  while(log.ndata > 0)
+    sleep(&log.ndata, &log.lock);
+  release(&log.lock);
+}
+
+// Should the committer checkpoint?  Read without the lock;
+// a stale answer only moves writeback by a tick.
+static int
+wbdue(void)
+{
+  if(log.ckpt == 0)
+    return 0;
+  return log.flush || ticks - log.cktime >= WBAGE ||
+         log.used > log.size/2 || log.nckpt * 100 > bufcount() * WBDIRTY;
+}
+
+// The log's kernel thread: commit each transaction after
+// giving other system calls LOGDELAY ticks to join it, and
+// checkpoint when wbdue() says so.
+static void
+committer(void *arg)
+{
+  uint t0;
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+  for(;;){
+    // With committed blocks waiting, look again every tick,
+    // for them to come of age.
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    while(log.lh.n == 0 && !wbdue()){
+      if(log.ckpt == 0)
+        sleep(&log.urgent, &log.lock);
+      else
+        sleeptimeout(&log.urgent, &log.lock, 1);
+    }
     release(&log.lock);
+
+    if(log.lh.n > 0){
+      // Group commit: let more FS calls join the transaction.
+      acquire(&log.lock);
+      t0 = ticks;
+      while(ticks - t0 < LOGDELAY && !log.urgent && !log.flush)
+        sleeptimeout(&log.urgent, &log.lock, LOGDELAY - (ticks - t0));
+
+      // Keep new operations out and wait for the active ones.
+      log.committing = 1;
+      while(log.outstanding > 0)
+        sleep(&log, &log.lock);
+      release(&log.lock);
+
+      // commit w/o holding locks, since not allowed
+      // to sleep with locks.
+      commit();
+
+      acquire(&log.lock);
+      log.committing = 0;
+      log.urgent = 0;
+      log.ncommit++;
+      wakeup(&log);
+      release(&log.lock);
+    }
+
+    // Checkpoint in the background, while FS calls go on,
+    // rather than when a commit needs the room.
+    if(wbdue())
+      checkpoint();
+  }
+}
+
+// Write the home locations of the committed blocks, so their
+// log slots can be reused, in block order and NLOGIO at a
+// time, so the disk sweeps across them once.  A block that a
+// transaction still being built has changed again gets the
+// committed copy from the log instead of the newer one in the
+// cache.
+static void
+checkpoint(void)
+{
+  struct buf *b, *next, *lbuf, *pending[NLOGIO];
+  int i, n;
+
+  n = 0;
+  for (next = cksort(log.ckpt); next; ) {
+    b = bread(log.dev, next->blockno);  // pinned: same buffer
+    next = b->cknext;
+    if (b->flags & B_LOGGED) {
+      lbuf = bread(log.dev, logslot(b->logslot));
+      bwriteraw(log.dev, b->blockno, lbuf->data);
+      brelse(lbuf);
+      b->flags &= ~B_CKPT;
+      brelse(b);
+    } else {
+      b->flags &= ~B_CKPT;
+      bwriteasync(b);  // also unpins it
+      pending[n++] = b;
+    }
+    if (n == NLOGIO || (next == 0 && n > 0)) {
+      bwait(pending, n);
+      for (i = 0; i < n; i++)
+        brelse(pending[i]);
+      n = 0;
+    }
   }
+  log.ckpt = 0;
+  log.tail = log.head;
+  log.used = 0;
+  write_super();
+
+  acquire(&log.lock);
+  log.nckpt = 0;
+  log.flush = 0;
+  wakeup(&log);  // begin_op() may be throttled
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to the log, after the
+// descriptor's slot.
 static void
 write_log(void)
 {
-  int tail;
+  struct buf *pending[NLOGIO];
+  int tail, i, n;
 
+  n = 0;
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+    struct buf *to = bnew(log.dev, logslot(log.head+1+tail)); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    bwriteasync(to);  // start writing the log
     brelse(from);
-    brelse(to);
+    pending[n++] = to;
+    if (n == NLOGIO || tail == log.lh.n-1) {
+      bwait(pending, n);
+      for (i = 0; i < n; i++)
+        brelse(pending[i]);
+      n = 0;
+    }
   }
 }
 
+// Write the transaction's descriptor to disk.
+// This is the true point at which the
+// current transaction commits.
+static void
+write_head(void)
+{
+  struct buf *buf = bnew(log.dev, logslot(log.head));
+  struct logheader *hb = (struct logheader *) (buf->data);
+  int i;
+
+  memset(buf->data, 0, BSIZE);
+  hb->magic = LOGMAGIC;
+  hb->seq = log.seq;
+  hb->n = log.lh.n;
+  for (i = 0; i < log.lh.n; i++) {
+    hb->block[i] = log.lh.block[i];
+  }
+  bwrite(buf);
+  brelse(buf);
+}
+
 static void
 commit()
 {
+  struct buf *b;
+  int i;
+
+  trace(TR_COMMIT, log.lh.n);
+  // The data the transaction's blocks point to goes first.
+  acquire(&log.lock);
+  while (log.ndata > 0)
+    sleep(&log.ndata, &log.lock);
+  release(&log.lock);
+
   if (log.lh.n > 0) {
+    if (log.size - log.used < log.lh.n + 1)
+      checkpoint();  // Make room
     write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+    write_head();    // Write descriptor to disk -- the real commit
+
+    // The blocks wait in the cache for checkpoint().
+    for (i = 0; i < log.lh.n; i++) {
+      b = log.lbuf[i];
+      b->flags &= ~B_LOGGED;
+      b->logslot = log.head + 1 + i;
+      if ((b->flags & B_CKPT) == 0) {
+        if (log.ckpt == 0)
+          log.cktime = ticks;
+        b->flags |= B_CKPT;
+        b->cknext = log.ckpt;
+        log.ckpt = b;
+        log.nckpt++;
+      }
+    }
+    log.head = (log.head + 1 + log.lh.n) % log.size;
+    log.used += 1 + log.lh.n;
+    log.seq++;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
   }
+  bcommitted();
+  trace(TR_COMMITDONE, 0);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -213,22 +596,70 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
+  struct proc *p = myproc();
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
+  if (log.direct)
+    return;
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
-      break;
+  // A B_LOGGED buffer is in the transaction already: absorb
+  // the write.
+  if ((b->flags & B_LOGGED) == 0) {
+    if (log.lh.n >= log.cap || p->lognew >= MAXOPBLOCKS)
+      panic("too big a transaction");
+    log.lbuf[log.lh.n] = b;
+    log.lh.block[log.lh.n++] = b->blockno;
+    p->lognew++;
+    log.reserved--;
+    b->flags |= B_LOGGED | B_DIRTY; // B_DIRTY prevents eviction
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
-  b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
 
+// Caller has modified b->data of a file data block and is done
+// with the buffer: write it in place and release it.  The
+// write is asynchronous; commit() waits for it.  A block the
+// log holds a copy of gets the new data in the log as well, or
+// replaying the log would put the old data back.
+void
+log_data(struct buf *b)
+{
+  if (log.outstanding < 1)
+    panic("log_data outside of trans");
+
+  if (log.direct) {
+    brelse(b);     // b->data is the block on disk
+  } else if (b->flags & B_LOGGED) {
+    log_write(b);  // absorbed: no new log space
+    brelse(b);
+  } else if (b->flags & B_CKPT) {
+    bwriteraw(log.dev, logslot(b->logslot), b->data);
+    brelse(b);     // checkpoint() writes it home
+  } else {
+    acquire(&log.lock);
+    log.ndata++;
+    release(&log.lock);
+    b->flags |= B_ORDERED | B_ASYNC;
+    bwriteasync(b);  // bdone() releases it
+  }
+}
+
+// A log_data() write has finished.  Called by bdone(), from
+// the disk interrupt.
+void
+logdatadone(void)
+{
+  acquire(&log.lock);
+  if (--log.ndata == 0)
+    wakeup(&log.ndata);
+  release(&log.lock);
+}
+
+// How many more blocks the calling system call may log.
+int
+logroom(void)
+{
+  return MAXOPBLOCKS - myproc()->lognew;
+}
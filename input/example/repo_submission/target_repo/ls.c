@@ -2,6 +2,7 @@
 #include "stat.h"
 #include "user.h"
 #include "fs.h"
+#include "dirstat.h"
 
 char*
 fmtname(char *path)
@@ -22,12 +23,14 @@ fmtname(char *path)
   return buf;
 }
 
+#define NDS 32
+
 void
 ls(char *path)
 {
-  char buf[512], *p;
-  int fd;
-  struct dirent de;
+  static struct direntstat ds[NDS];
+  char name[DIRSIZ+1];
+  int fd, n, i;
   struct stat st;
 
   if((fd = open(path, 0)) < 0){
@@ -47,24 +50,17 @@ ls(char *path)
     break;
 
   case T_DIR:
-    if(strlen(path) + 1 + DIRSIZ + 1 > sizeof buf){
-      printf(1, "ls: path too long\n");
-      break;
-    }
-    strcpy(buf, path);
-    p = buf+strlen(buf);
-    *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        printf(1, "ls: cannot stat %s\n", buf);
-        continue;
+    // Entries come with their stat, a batch per call.
+    while((n = getdents(fd, ds, NDS)) > 0){
+      for(i = 0; i < n; i++){
+        memmove(name, ds[i].de.name, DIRSIZ);
+        name[DIRSIZ] = 0;
+        printf(1, "%s %d %d %d\n", fmtname(name), ds[i].st.type,
+               ds[i].st.ino, ds[i].st.size);
       }
-      printf(1, "%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
     }
+    if(n < 0)
+      printf(1, "ls: cannot list %s\n", path);
     break;
   }
   close(fd);
@@ -3,10 +3,13 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "x86.h"
+#include "meminfo.h"
 
 static void startothers(void);
+static void waitothers(void);
 static void mpmain(void)  __attribute__((noreturn));
 extern pde_t *kpgdir;
 extern char end[]; // first address after kernel loaded from ELF file
@@ -22,18 +25,31 @@ main(void)
   mpinit();        // detect other processors
   lapicinit();     // interrupt controller
   seginit();       // segment descriptors
+  acpiinit();      // NUMA nodes
   picinit();       // disable pic
   ioapicinit();    // another interrupt controller
   consoleinit();   // console hardware
   uartinit();      // serial port
   pinit();         // process table
+  mminit();        // address spaces
   tvinit();        // trap vectors
+  timerinit();     // per-cpu timers
   binit();         // buffer cache
+  pcinit();        // page cache
+  dcinit();        // directory name cache
+  tmpinit();       // in-memory file system
   fileinit();      // file table
+  pipeinit();      // pipes
+  shminit();       // shared memory segments
+  profinit();      // sampling profiler
+  traceinit();     // event tracing
+  irqinit();       // interrupt statistics
   ideinit();       // disk 
   startothers();   // start other processors
-  kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  kinit2(P2V(4*1024*1024), P2V(phystop)); // must come after startothers()
+  bgrow();         // more buffers, now memory is free
   userinit();      // first user process
+  waitothers();    // other processors are up
   mpmain();        // finish this processor's setup
 }
 
@@ -53,20 +69,25 @@ mpmain(void)
 {
   cprintf("cpu%d: starting %d\n", cpuid(), cpuid());
   idtinit();       // load idt register
-  xchg(&(mycpu()->started), 1); // tell startothers() we're up
+  fpuinit();       // FPU and SSE
+  pmcinit();       // performance counters
+  xchg(&(mycpu()->started), 1); // tell waitothers() we're up
   scheduler();     // start running processes
 }
 
 pde_t entrypgdir[];  // For entry.S
 
-// Start the non-boot (AP) processors.
+// Start the non-boot (AP) processors, all together.  They
+// come up while this cpu carries on with main().
 static void
 startothers(void)
 {
   extern uchar _binary_entryother_start[], _binary_entryother_size[];
+  static char *stacks[NCPU];
+  uchar apicids[NCPU];
   uchar *code;
   struct cpu *c;
-  char *stack;
+  int n;
 
   // Write entry code to unused memory at 0x7000.
   // The linker has placed the image of entryother.S in
@@ -74,24 +95,37 @@ startothers(void)
   code = P2V(0x7000);
   memmove(code, _binary_entryother_start, (uint)_binary_entryother_size);
 
+  n = 0;
   for(c = cpus; c < cpus+ncpu; c++){
     if(c == mycpu())  // We've started already.
       continue;
+    // One page: it only runs scheduler(), and the interrupts
+    // an idle cpu takes.
+    stacks[n] = kalloc(KM_KSTACK) + PGSIZE;
+    apicids[n++] = c->apicid;
+  }
+  if(n == 0)
+    return;
 
-    // Tell entryother.S what stack to use, where to enter, and what
-    // pgdir to use. We cannot use kpgdir yet, because the AP processor
-    // is running in low  memory, so we use entrypgdir for the APs too.
-    stack = kalloc();
-    *(void**)(code-4) = stack + KSTACKSIZE;
-    *(void(**)(void))(code-8) = mpenter;
-    *(int**)(code-12) = (void *) V2P(entrypgdir);
+  // Tell entryother.S what stacks to use, where to enter, and what
+  // pgdir to use. We cannot use kpgdir yet, because the AP processor
+  // is running in low  memory, so we use entrypgdir for the APs too.
+  *(char***)(code-4) = stacks;
+  *(void(**)(void))(code-8) = mpenter;
+  *(int**)(code-12) = (void *) V2P(entrypgdir);
 
-    lapicstartap(c->apicid, V2P(code));
+  lapicstartaps(apicids, n, V2P(code));
+}
 
-    // wait for cpu to finish mpmain()
-    while(c->started == 0)
+// Wait for the other processors to finish mpmain().
+static void
+waitothers(void)
+{
+  struct cpu *c;
+
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c->started == 0 && c != mycpu())
       ;
-  }
 }
 
 // The boot page table used in entry.S and entryother.S.
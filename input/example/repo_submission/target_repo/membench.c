@@ -0,0 +1,195 @@
+// membench: virtual memory benchmarks.
+//   membench [mb]
+// times fork() of a parent with 0, 1, 4 ... up to mb MB
+// (default 16) of touched heap, sbrk() grow and shrink, demand
+// faults on fresh sbrk() memory and copy-on-write faults after
+// fork(), and memmove() bandwidth in user space and in the
+// kernel (pread() of a cached file).  Lines have the form
+//   name: value unit (n ops in us us)
+// for runbench.  Times come from the TSC.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "mmu.h"
+#include "fcntl.h"
+
+#define NFORK    50
+#define NSBRK    2000
+#define SBRKSTEP (16*PGSIZE)
+#define NFAULT   1024       // pages
+#define COPYSZ   (256*1024)
+#define NCOPY    64
+
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
+uint cpus;  // TSC cycles per microsecond
+
+// Microseconds since t0, at least 1.
+uint
+since(uint64 t0)
+{
+  uint us;
+
+  us = udiv64(rdtsc() - t0, cpus);
+  return us ? us : 1;
+}
+
+// Report n ops in the time since t0 as a rate per second.
+void
+rate(char *name, char *unit, uint n, uint64 t0)
+{
+  uint us;
+
+  us = since(t0);
+  printf(1, "%s: %d %s (%d ops in %d us)\n", name,
+         udiv64((uint64)n * 1000000, us), unit, n, us);
+}
+
+// Write to every page of [p, p+n).
+void
+touch(char *p, uint n)
+{
+  uint i;
+
+  for(i = 0; i < n; i += PGSIZE)
+    p[i] = 1;
+}
+
+void
+fail(char *what)
+{
+  printf(2, "membench: %s failed\n", what);
+  exit();
+}
+
+// fork() latency with a parent of kb KB of touched heap.
+void
+benchfork(int kb)
+{
+  char *p;
+  uint64 t0;
+  int i, pid, us;
+
+  if((p = sbrk(kb*1024)) == (char*)-1)
+    fail("sbrk");
+  touch(p, kb*1024);
+  t0 = rdtsc();
+  for(i = 0; i < NFORK; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  us = since(t0);
+  sbrk(-kb*1024);
+  printf(1, "fork+exit+wait %dKB: %d us/op (%d ops in %d us)\n",
+         kb, us / NFORK, NFORK, us);
+}
+
+void
+benchsbrk(void)
+{
+  uint64 t0;
+  int i;
+
+  t0 = rdtsc();
+  for(i = 0; i < NSBRK; i++){
+    if(sbrk(SBRKSTEP) == (char*)-1)
+      fail("sbrk");
+    if(sbrk(-SBRKSTEP) == (char*)-1)
+      fail("sbrk shrink");
+  }
+  rate("sbrk grow+shrink", "ops/sec", NSBRK, t0);
+}
+
+void
+benchfault(void)
+{
+  char *p;
+  uint64 t0;
+  int pid;
+
+  if((p = sbrk(NFAULT*PGSIZE)) == (char*)-1)
+    fail("sbrk");
+  t0 = rdtsc();
+  touch(p, NFAULT*PGSIZE);
+  rate("demand fault", "faults/sec", NFAULT, t0);
+
+  // The child's writes each copy a page the parent shares.
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    t0 = rdtsc();
+    touch(p, NFAULT*PGSIZE);
+    rate("cow fault", "faults/sec", NFAULT, t0);
+    exit();
+  }
+  wait();
+  sbrk(-NFAULT*PGSIZE);
+}
+
+void
+benchcopy(void)
+{
+  char *a, *b;
+  uint64 t0;
+  int i, fd;
+
+  if((a = sbrk(2*COPYSZ)) == (char*)-1)
+    fail("sbrk");
+  b = a + COPYSZ;
+  memset(a, 'm', COPYSZ);
+  touch(b, COPYSZ);
+  t0 = rdtsc();
+  for(i = 0; i < NCOPY; i++)
+    memmove(b, a, COPYSZ);
+  rate("user memmove", "KB/sec", NCOPY*COPYSZ/1024, t0);
+
+  unlink("membench.tmp");
+  if((fd = open("membench.tmp", O_CREATE | O_RDWR)) < 0)
+    fail("create");
+  if(write(fd, a, COPYSZ) != COPYSZ)
+    fail("write");
+  pread(fd, b, COPYSZ, 0);  // now it is all in the page cache
+  t0 = rdtsc();
+  for(i = 0; i < NCOPY; i++)
+    if(pread(fd, b, COPYSZ, 0) != COPYSZ)
+      fail("pread");
+  rate("kernel copyout", "KB/sec", NCOPY*COPYSZ/1024, t0);
+  close(fd);
+  unlink("membench.tmp");
+  sbrk(-2*COPYSZ);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb, kb;
+
+  mb = argc > 1 ? atoi(argv[1]) : 16;
+  if(mb <= 0){
+    printf(2, "usage: membench [mb]\n");
+    exit();
+  }
+  if((cpus = vtscpertick() / USPERTICK) == 0){
+    printf(2, "membench: TSC not calibrated yet, assuming 1GHz\n");
+    cpus = 1000;
+  }
+  benchfork(0);
+  for(kb = 1024; kb <= mb*1024; kb *= 4)
+    benchfork(kb);
+  benchsbrk();
+  benchfault();
+  benchcopy();
+  exit();
+}
@@ -0,0 +1,55 @@
+// meminfo: show how physical memory is used: free pages, the
+// pages allocated for each kind of use, kalloc() failures and
+// the size of the buffer cache, then each process's resident
+// pages.  With pids, just the resident pages of those.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "rusage.h"
+#include "meminfo.h"
+
+char *kmname[NKM] = {
+[KM_USER]   "user",
+[KM_PGTBL]  "pgtable",
+[KM_KSTACK] "kstack",
+[KM_PIPE]   "pipe",
+[KM_CACHE]  "cache",
+[KM_SLAB]   "slab",
+[KM_KERN]   "kernel",
+[KM_ZERO]   "zeroed",
+[KM_TMPFS]  "tmpfs",
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct meminfo mi;
+  struct rusage ru;
+  int pid, last, i;
+
+  if(argc > 1){
+    for(i = 1; i < argc; i++){
+      if(meminfo(atoi(argv[i]), &mi) < 0)
+        printf(2, "meminfo: no process %s\n", argv[i]);
+      else
+        printf(1, "%s\t%d pages\n", argv[i], mi.rss);
+    }
+    exit();
+  }
+  if(meminfo(0, &mi) < 0){
+    printf(2, "meminfo: failed\n");
+    exit();
+  }
+  printf(1, "total\t%d pages\nfree\t%d\n", mi.total, mi.free);
+  for(i = 0; i < NKM; i++)
+    printf(1, "%s\t%d\n", kmname[i], mi.used[i]);
+  printf(1, "failed\t%d kallocs\nbuffers\t%d\n\npid\tname\trss\n",
+         mi.failed, mi.nbuf);
+  // Pids are handed out in order and never reused.
+  last = getpid();
+  for(pid = 1; pid <= last; pid++)
+    if(getrusage(pid, RUSAGE_THREAD, &ru) == 0 && meminfo(pid, &mi) == 0)
+      printf(1, "%d\t%s\t%d\n", pid, ru.name, mi.rss);
+  exit();
+}
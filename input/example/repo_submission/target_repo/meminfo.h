@@ -0,0 +1,22 @@
+// Physical memory use, from meminfo().
+
+// Kinds of page, as kalloc() callers say what they want one for.
+#define KM_USER   0  // user memory
+#define KM_PGTBL  1  // page directories and page tables
+#define KM_KSTACK 2  // kernel stacks
+#define KM_PIPE   3  // pipe buffers
+#define KM_CACHE  4  // file page cache
+#define KM_SLAB   5  // slab caches and proc structs
+#define KM_KERN   6  // other kernel memory
+#define KM_ZERO   7  // free pages kzeroidle() has zeroed
+#define KM_TMPFS  8  // tmpfs file data
+#define NKM       9
+
+struct meminfo {
+  uint total;        // pages the allocator manages
+  uint free;         // free pages, the zeroed ones included
+  uint used[NKM];    // pages allocated, by kind
+  uint failed;       // kalloc()s that found no memory
+  uint nbuf;         // buffer cache blocks
+  int rss;           // resident pages of the process asked about
+};
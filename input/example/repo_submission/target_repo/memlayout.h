@@ -1,12 +1,15 @@
 // Memory layout
 
 #define EXTMEM  0x100000            // Start of extended memory
-#define PHYSTOP 0xE000000           // Top physical memory
+#define PHYSMAX 0x7A800000          // Most physical memory used (up to KSTACKS)
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
 
 // Key addresses for address space layout (see kmap in vm.c for layout)
+#define LIBBASE  0x7F000000         // Where exec() maps /libu (see the Makefile)
 #define KERNBASE 0x80000000         // First kernel virtual address
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
+#define KSTACKS  (KERNBASE+PHYSMAX) // Kernel stacks, each above a guard page,
+#define KSTACKSEND 0xFDC00000       //   up to the vdso's 4MB
 
 #define V2P(a) (((uint) (a)) - KERNBASE)
 #define P2V(a) ((void *)(((char *) (a)) + KERNBASE))
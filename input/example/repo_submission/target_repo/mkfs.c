@@ -15,31 +15,40 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+#define NINODES 1000
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// [ boot block | sb block | log | inode blocks | free bit map | data blocks | swap ]
+//
+// The kernel takes the sizes from the superblock, so they can
+// be set with -s, -l and -i; these are the defaults.
+
+uint fssize = FSSIZE;
+uint ninodes = NINODES;
+int nlog = LOGBLOCKS;
+int nbitmap;
+int ninodeblocks;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
+int nswap = NSWAP * (4096 / BSIZE);  // Swap blocks, after the file system
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
+char *img;  // the file system, built in memory and written out once
 uint freeinode = 1;
 uint freeblock;
 
 
 void balloc(int);
-void wsect(uint, void*);
-void winode(uint, struct dinode*);
-void rinode(uint inum, struct dinode *ip);
-void rsect(uint sec, void *buf);
+void *sect(uint);
+struct dinode *dinode(uint);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirwrite(uint inum, struct dirent *de, int n);
+void flush(void);
+
+struct dirent *rootde;
+int nrootde;
 
 // convert to intel byte order
 ushort
@@ -67,19 +76,45 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, cc, fd, opt;
+  uint rootino, inum;
+  struct dirent *de;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
-
+  static_assert(sizeof(struct dirindex) == BSIZE, "dirindex must fill a block");
+
+  while((opt = getopt(argc, argv, "s:l:i:")) != -1){
+    switch(opt){
+    case 's':
+      fssize = strtoul(optarg, 0, 0);
+      break;
+    case 'l':
+      nlog = atoi(optarg);
+      break;
+    case 'i':
+      ninodes = strtoul(optarg, 0, 0);
+      break;
+    default:
+      goto usage;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  usage:
+    fprintf(stderr, "Usage: mkfs [-s blocks] [-l logblocks] [-i inodes] fs.img files...\n");
+    exit(1);
+  }
+  // A log must hold a descriptor and a whole FS operation.
+  if(fssize > FSMAX || nlog < MAXOPBLOCKS + 3 || ninodes < 2){
+    fprintf(stderr, "mkfs: at most %d blocks, a log of at least %d, 2 inodes\n",
+            FSMAX, MAXOPBLOCKS + 3);
     exit(1);
   }
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
@@ -92,40 +127,42 @@ main(int argc, char *argv[])
 
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  assert(nmeta < fssize);
+  nblocks = fssize - nmeta;
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.swapstart = xint(fssize);
+  sb.nswap = xint(nswap);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d swap %d\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize, nswap);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
-  memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  // calloc() of a big image maps zero pages on demand, so only
+  // the blocks written take memory.
+  if((img = calloc(fssize, BSIZE)) == 0 || (rootde = calloc(ninodes, sizeof(*rootde))) == 0){
+    perror("calloc");
+    exit(1);
+  }
+  memmove(sect(1), &sb, sizeof(sb));
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  de = &rootde[nrootde++];
+  de->inum = xshort(rootino);
+  strcpy(de->name, ".");
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  de = &rootde[nrootde++];
+  de->inum = xshort(rootino);
+  strcpy(de->name, "..");
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -144,10 +181,10 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nrootde < ninodes);
+    de = &rootde[nrootde++];
+    de->inum = xshort(inum);
+    strncpy(de->name, argv[i], DIRSIZ);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -155,143 +192,184 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  dirwrite(rootino, rootde, nrootde);
 
   balloc(freeblock);
+  flush();
 
   exit(0);
 }
 
-void
-wsect(uint sec, void *buf)
+// Block sec of the image.
+void*
+sect(uint sec)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
-    perror("write");
-    exit(1);
-  }
-}
-
-void
-winode(uint inum, struct dinode *ip)
-{
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
-}
-
-void
-rinode(uint inum, struct dinode *ip)
-{
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  assert(sec < fssize);
+  return img + (size_t)sec*BSIZE;
 }
 
+// Write the image to fsfd.  Only the blocks up to the last one
+// allocated are written; the rest of the file system and the
+// swap area after it are left as a hole, which reads as zeroes.
 void
-rsect(uint sec, void *buf)
+flush(void)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
+  char *p;
+  size_t n;
+  ssize_t cc;
+
+  p = img;
+  for(n = (size_t)freeblock * BSIZE; n > 0; n -= cc, p += cc){
+    if((cc = write(fsfd, p, n)) <= 0){
+      perror("write");
+      exit(1);
+    }
   }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
-    perror("read");
+  if(ftruncate(fsfd, (off_t)(fssize + nswap) * BSIZE) < 0){
+    perror("ftruncate");
     exit(1);
   }
 }
 
+// The on-disk inode inum, in the image.
+struct dinode*
+dinode(uint inum)
+{
+  return (struct dinode*)sect(IBLOCK(inum, sb)) + inum % IPB;
+}
+
 uint
 ialloc(ushort type)
 {
   uint inum = freeinode++;
-  struct dinode din;
-
-  bzero(&din, sizeof(din));
-  din.type = xshort(type);
-  din.nlink = xshort(1);
-  din.size = xint(0);
-  winode(inum, &din);
+  struct dinode *din;
+
+  assert(inum < ninodes);
+  din = dinode(inum);
+  bzero(din, sizeof(*din));
+  din->type = xshort(type);
+  din->nlink = xshort(1);
+  din->size = xint(0);
   return inum;
 }
 
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
+  uchar *bits;
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
+  assert(used <= nbitmap*BPB);
+  bits = sect(sb.bmapstart);  // the bitmap blocks are consecutive
   for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    bits[i/8] = bits[i/8] | (0x1 << (i%8));
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  printf("balloc: bitmap blocks at sector %d\n", sb.bmapstart);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// A newly allocated block.
+uint
+newblock(void)
+{
+  assert(freeblock < fssize);
+  return xint(freeblock++);
+}
+
+// Return entry i of the index block *addr, allocating the
+// index block first if there is none.
+uint*
+bindex(uint *addr, uint i)
+{
+  if(*addr == 0)
+    *addr = newblock();
+  return (uint*)sect(xint(*addr)) + i;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
-  struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
-  uint x;
+  uint fbn, off, n1, dbn;
+  struct dinode *din;
+  uint *x;
 
-  rinode(inum, &din);
-  off = xint(din.size);
-  // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  din = dinode(inum);
+  off = xint(din->size);
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
+    if(fbn < NDIRECT)
+      x = &din->addrs[fbn];
+    else if(fbn < NDIRECT + NINDIRECT)
+      x = bindex(&din->addrs[NDIRECT], fbn - NDIRECT);
+    else {
+      dbn = fbn - NDIRECT - NINDIRECT;
+      x = bindex(bindex(&din->addrs[NDIRECT+1], dbn / NINDIRECT), dbn % NINDIRECT);
     }
+    if(*x == 0)
+      *x = newblock();
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    memmove((char*)sect(xint(*x)) + off % BSIZE, p, n1);
     n -= n1;
     off += n1;
     p += n1;
   }
-  din.size = xint(off);
-  winode(inum, &din);
+  din->size = xint(off);
+}
+
+// Write the n entries de[] into empty directory inum, hashed
+// (see fs.h) if they do not fit in one block.
+void
+dirwrite(uint inum, struct dirent *de, int n)
+{
+  struct dinode *din;
+  struct dirindex x;
+  struct dirbucket *h;
+  struct dirent blk[DPB];
+  uint off, depth, b, i, k, cnt[1<<DIRDEPTH];
+
+  if(n <= DPB){
+    iappend(inum, de, n * sizeof(*de));
+
+    // fix size of directory
+    din = dinode(inum);
+    off = xint(din->size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din->size = xint(off);
+    return;
+  }
+
+  // Find the smallest depth at which every bucket fits in a block.
+  for(depth = 1; ; depth++){
+    assert(depth <= DIRDEPTH);
+    memset(cnt, 0, sizeof(cnt));
+    for(i = 0; i < n; i++)
+      cnt[dirhash(de[i].name) & ((1<<depth) - 1)]++;
+    for(b = 0; b < (1<<depth) && cnt[b] < DPB; b++)
+      ;
+    if(b == (1<<depth))
+      break;
+  }
+
+  memset(&x, 0, sizeof(x));
+  x.magic = xshort(DIRMAGIC);
+  x.depth = xshort(depth);
+  for(b = 0; b < (1<<depth); b++)
+    DIRPTR(&x, b) = xshort(1 + b);
+  iappend(inum, &x, sizeof(x));
+
+  for(b = 0; b < (1<<depth); b++){
+    memset(blk, 0, sizeof(blk));
+    h = (struct dirbucket*)blk;
+    h->magic = xshort(DIRMAGIC);
+    h->depth = xshort(depth);
+    k = 1;
+    for(i = 0; i < n; i++)
+      if((dirhash(de[i].name) & ((1<<depth) - 1)) == b)
+        blk[k++] = de[i];
+    iappend(inum, blk, sizeof(blk));
+  }
 }
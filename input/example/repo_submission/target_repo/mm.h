@@ -0,0 +1,40 @@
+// A range of user memory from exec() or mmap(): the first
+// filesz bytes of the range come from ip at off, the rest is
+// zero.  Pages are read in on first touch (see pagein()).
+struct vma {
+  uint start;                  // Page-aligned first address
+  uint end;                    // One past the last address
+  struct inode *ip;            // File, or 0 for zero-filled memory
+  uint off;                    // Offset in ip of start
+  uint filesz;                 // Bytes of ip in the range
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_ bits, or 0 if the slot is free
+};
+
+#define NVMA 16                // Ranges per address space
+
+// A user PTE without PTE_P that isn't zero is for a page out
+// on swap: the slot plus one in the address bits, and the PTE
+// flags the page had (see swap.c).
+#define SWAPPTE(slot, flags) ((((slot) + 1) << 12) | ((flags) & ~(PTE_P|PTE_A)))
+#define PTESLOT(pte)         (((pte) >> 12) - 1)
+
+// Address space, shared by all the threads of a process.
+// clone() takes another reference; fork() and exec() make
+// a new one.  The page table is freed with the last reference.
+// fork() shares pages copy-on-write.
+// Pages below sz that aren't mapped yet are read from a vma's
+// file or zero-filled when first touched.  mmap() places its
+// vmas between sz and KERNBASE, from the top down.
+struct mm {
+  struct spinlock lock;        // Protects sz, ref, users; serializes growth
+  pde_t *pgdir;                // Page table
+  uint sz;                     // Size of process memory (bytes)
+  int ref;                     // Number of procs using this address space
+  int users;                   // Procs not yet exited; the last drops the vmas
+  struct vma vma[NVMA];        // File-backed ranges
+  uint vruntime;               // Fair-share run time of its threads (proc.c)
+  uint swaphand;               // Where uvmswapout() sweeps from next
+  struct rusage ru;            // Resources used by its threads already freed
+  struct mm *reapnext;         // On the list for reaper() (proc.c)
+};
@@ -0,0 +1,19 @@
+// Memory protection for mprotect() and mmap().
+// xv6 user pages are always writable by the kernel, so
+// mprotect() only enforces PROT_NONE (no user access) versus
+// readable+writable; mmap() also honors a missing PROT_WRITE.
+#define PROT_NONE   0x0
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+
+// mmap() flags.  A shared writable file mapping isn't
+// supported: there is no write-back.
+#define MAP_SHARED     0x01  // Share changes with fork() children
+#define MAP_PRIVATE    0x02  // Changes are private
+#define MAP_ANONYMOUS  0x20  // Zero-filled, not from a file
+
+#define MAP_FAILED  ((void*)-1)
+
+// madvise() advice.
+#define MADV_NORMAL    0  // Nothing special
+#define MADV_DONTNEED  4  // Free the pages; the next touch reads or zero-fills them
@@ -6,10 +6,32 @@
 
 // Control Register flags
 #define CR0_PE          0x00000001      // Protection Enable
+#define CR0_MP          0x00000002      // Monitor coProcessor
+#define CR0_EM          0x00000004      // Emulation
+#define CR0_TS          0x00000008      // Task Switched
+#define CR0_NE          0x00000020      // Numeric Error
 #define CR0_WP          0x00010000      // Write Protect
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
+#define CR4_OSFXSR      0x00000200      // fxsave, fxrstor and SSE
+#define CR4_OSXMMEXCPT  0x00000400      // SSE exceptions
+
+// cpuid(1) %edx feature flags
+#define CPUID_SEP       (1<<11)         // sysenter and sysexit
+#define CPUID_PGE       (1<<13)         // Page global enable (PTE_G)
+#define CPUID_FXSR      (1<<24)         // fxsave and fxrstor
+#define CPUID_SSE       (1<<25)
+// cpuid(1) %ecx feature flags
+#define CPUID_MONITOR   (1<<3)          // monitor and mwait
+// cpuid(5) %ecx feature flags
+#define CPUID_MWAITINT  (1<<1)          // interrupts end mwait with IF clear
+
+// Model specific registers
+#define MSR_SYSENTER_CS   0x174  // kernel %cs for sysenter; sysexit uses +16
+#define MSR_SYSENTER_ESP  0x175  // kernel %esp for sysenter
+#define MSR_SYSENTER_EIP  0x176  // where sysenter enters the kernel
 
 // various segment selectors.
 #define SEG_KCODE 1  // kernel code
@@ -17,9 +39,13 @@
 #define SEG_UCODE 3  // user code
 #define SEG_UDATA 4  // user data+stack
 #define SEG_TSS   5  // this process's task state
+#define SEG_UTLS  6  // this thread's thread-local storage (%gs)
+#define SEG_UCPU  7  // limit is the cpu's index, for user lsl (vdso.h)
+#define SEG_KCPU  8  // this cpu's struct cpu (%fs in the kernel)
+#define SEG_DFTSS 9  // this cpu's double fault task
 
 // cpu->gdt[NSEGS] holds the above segments.
-#define NSEGS     6
+#define NSEGS     10
 
 #ifndef __ASSEMBLER__
 // Segment Descriptor
@@ -58,6 +84,7 @@ struct segdesc {
 #define STA_R       0x2     // Readable (executable segments)
 
 // System segment type bits
+#define STS_TG      0x5     // Task Gate
 #define STS_T32A    0x9     // Available 32-bit TSS
 #define STS_IG32    0xE     // 32-bit Interrupt Gate
 #define STS_TG32    0xF     // 32-bit Trap Gate
@@ -83,6 +110,7 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define PDSIZE          (PGSIZE*NPTENTRIES) // bytes mapped by a 4MB (PTE_PS) page
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -90,11 +118,20 @@ struct segdesc {
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// Page fault error code bits.
+#define FEC_PR          0x1     // Page was present (a protection fault)
+#define FEC_WR          0x2     // Fault was caused by a write
+
 // Page table/directory entry flags.
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global: kept across CR3 loads
+#define PTE_COW         0x200   // Copy-on-write (software, see copyuvm)
+#define PTE_SHARED      0x400   // Shared with fork() children (software)
+#define PDE_COW         0x200   // Page table shared since fork() (software)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -0,0 +1,33 @@
+// nice: run a command in another scheduling class.
+//   nice n cmd ...         fair share, at nice value n
+//   nice -f prio cmd ...   real time FIFO, at priority prio
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "sched.h"
+
+int
+main(int argc, char **argv)
+{
+  int sclass, prio, i;
+
+  sclass = SCHED_FAIR;
+  i = 1;
+  if(argc > 1 && strcmp(argv[1], "-f") == 0){
+    sclass = SCHED_FIFO;
+    i++;
+  }
+  if(argc < i + 2){
+    printf(2, "usage: nice [-f] prio cmd ...\n");
+    exit();
+  }
+  prio = argv[i][0] == '-' ? -atoi(argv[i] + 1) : atoi(argv[i]);
+  if(setpriority(0, sclass, prio) < 0){
+    printf(2, "nice: bad priority %s\n", argv[i]);
+    exit();
+  }
+  exec(argv[i+1], argv + i + 1);
+  printf(2, "nice: exec %s failed\n", argv[i+1]);
+  exit();
+}
@@ -1,14 +1,56 @@
-#define NPROC        64  // maximum number of processes
-#define KSTACKSIZE 4096  // size of per-process kernel stack
-#define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NPROC      4096  // maximum number of processes
+#define KSTACKSIZE 8192  // size of per-process kernel stack, in whole pages
+#ifndef NCPU
+#define NCPU          8  // maximum number of CPUs; make UP=1 sets 1
+#endif
+#define CACHELINE    64  // bytes per cache line, which cpus' data must not share
+#define NOFILE       16  // open files per process before its table grows
+#define NOFILEMAX  1024  // open files per process, a page of pointers
+#define NSYSARG       6  // most arguments a system call takes
+#define NINODE       50  // in-memory i-nodes before iinit() grows the table
+#define ICACHEFRAC  512  // iinit() gives the i-node table 1/ICACHEFRAC of memory
+#define NINODEMAX  1000  // most in-memory i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define TMPDEV        2  // device number of tmpfs, which is in memory
+#define NTMPINODE   256  // files and directories tmpfs can hold
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
-
+#define NELFSEG       4  // max loadable segments in a program
+#define DIRSTATBATCH 16  // entries getdents() pins at once
+#define MAXOPBLOCKS  12  // max # of blocks any FS op writes
+#define LOGSIZE      124  // max data blocks in a log transaction (its descriptor fills a block)
+#define LOGBLOCKS    (3*(LOGSIZE+1)+1)  // size of the on-disk log mkfs makes by default
+#define NBUF         (LOGBLOCKS+LOGSIZE+MAXOPBLOCKS*3)  // disk block cache buffers before bgrow()
+#define BCACHEFRAC   256  // bgrow() gives the block cache 1/BCACHEFRAC of memory
+#define NBUFMAX      2048 // most buffers bgrow() makes
+#define TICKCOUNT 10000000 // LAPIC timer counts per tick
+#define USPERTICK    10000 // microseconds a tick is taken to be
+#define LOGDELAY     3    // ticks a commit waits for more FS calls to join
+#define WBAGE      300    // ticks a committed block waits to be written home, at most
+#define WBDIRTY     25    // percent of the buffer cache committed blocks pin before writeback
+#define WBTHROTTLE  50    // percent pinned at which begin_op() waits for writeback
+#define NREADAHEAD   16   // blocks readi() reads ahead of a sequential reader
+#define FSSIZE       20000 // blocks in the file system mkfs makes by default
+#define FSMAX     (1<<24) // most blocks of a file system the kernel can use (8GB)
+#define NSWAP        1024 // pages of swap space mkfs puts after the file system
+#define NRECLAIM     32   // pages reclaim() frees when memory runs out
+#define NSHM         16   // shared memory segments
+#define RQSCAN        4  // run queue entries searched for a sibling thread
+#define SCHEDAFFINITY 4  // max sibling threads run back to back on a cpu
+#define SCHEDGRAN  4096  // fair-share lead (1024-cycle units) a sibling may have and still run next
+#define SCHEDLAG  32768  // most fair-share credit an address space keeps while asleep
+#define GANGSCHED     0  // 1: spread sibling threads across cpus instead
+#define LOCKSTAT  (NCPU > 1)  // count lock contention for lockstat()
+#define SLEEPSPIN  2000  // times acquiresleep() checks a running holder before sleeping
+#define LOCKBREAK 1000000 // cycles a loop under a lock keeps interrupts off before needbreak()
+#define CLIMAX  4000000 // cycles with interrupts off that lockstat() reports
+#define SYSSTAT      1  // count system calls and their cycles for sysstat()
+#define KTRACE       1  // compile in the tracepoints /dev/trace reports
+#define KLOGLEVEL KL_INFO  // least urgent KLOG() level compiled in (defs.h)
+#define KLOGSIZE  4096  // bytes of each cpu's kernel log ring
+#define KLOGDELAY    1  // ticks between klogd's copies of the log to the console
+#define IRQBALANCE 100  // ticks between moves of device interrupts to idler cpus (0 = never)
+#define KJUNK        0  // fill freed pages with junk to catch dangling refs
+#define KZEROMAX   256  // pre-zeroed pages the idle loop keeps for kzalloc()
+#define NNODE        4  // NUMA nodes kalloc() keeps apart (acpi.c)
+#define NSUPERPAGE   4  // 4MB frames set aside for large user regions (0 = none)
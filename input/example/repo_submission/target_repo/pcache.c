@@ -0,0 +1,347 @@
+// Page cache.
+//
+// The page cache holds file data a page at a time, indexed by
+// (dev, inum, page number), in memory that would otherwise sit
+// free.  The buffer cache (bio.c) is only big enough for the
+// blocks that are in use, so without the page cache every
+// read of a file goes to the disk.
+//
+// Interface:
+// * To get the page at pgno of a file, call pcget.  If the
+//     page is not valid, the caller claims it with pcclaim,
+//     fills it and calls pcfilled.
+// * When done with the page, call pcput.
+// * Only call pcget while holding the inode's lock, shared or
+//     not, and do not keep a page after releasing it: the inode
+//     lock is what keeps the page's contents consistent.
+// * pcwrite copies written data into any cached pages, and
+//     pcinval discards a file's pages when it is truncated.
+// * readi and pagein may map a cached page into user memory
+//     without copying it (see readipage in fs.c).  The page
+//     is then shared, and pcwrite drops it from the cache
+//     rather than write to it.
+// * kalloc calls pcreclaim when it runs out of memory, which
+//     frees unreferenced pages, least recently used first.
+//
+// pcache.lock protects the hash chains, the LRU list and the
+// reference counts, but never page contents.  Nothing calls
+// kalloc or kfree while holding it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "pcache.h"
+#include "meminfo.h"
+
+#define NPCHASH 61
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+struct {
+  struct spinlock lock;
+  struct cpage *hash[NPCHASH];
+
+  // Linked list of all cached pages, through prev/next.
+  // head.next is most recently used.
+  struct cpage head;
+
+  struct cpage *free;  // unused cpage structs, through hnext
+  int n;               // number of cached pages
+} pcache;
+
+static uint
+pchash(uint dev, uint inum, uint pgno)
+{
+  return (dev * 31 + inum * 17 + pgno) % NPCHASH;
+}
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+}
+
+// Move cp to the front of the LRU list.
+// Caller must hold pcache.lock.
+static void
+pcfront(struct cpage *cp)
+{
+  if(cp->next){
+    cp->next->prev = cp->prev;
+    cp->prev->next = cp->next;
+  }
+  cp->next = pcache.head.next;
+  cp->prev = &pcache.head;
+  pcache.head.next->prev = cp;
+  pcache.head.next = cp;
+}
+
+// Take cp out of the hash table and the LRU list, and
+// push it on *list through hnext.
+// Caller must hold pcache.lock.
+static void
+pcunlink(struct cpage *cp, struct cpage **list)
+{
+  struct cpage **pp;
+
+  for(pp = &pcache.hash[pchash(cp->dev, cp->inum, cp->pgno)]; *pp != cp; pp = &(*pp)->hnext)
+    ;
+  *pp = cp->hnext;
+  cp->next->prev = cp->prev;
+  cp->prev->next = cp->next;
+  cp->hnext = *list;
+  *list = cp;
+  pcache.n--;
+}
+
+// Free the data pages of a list made by pcunlink() and
+// return its structs to the free list.
+// Caller must not hold pcache.lock.
+static int
+pcdrop(struct cpage *list)
+{
+  struct cpage *cp, *last;
+  int n;
+
+  if(list == 0)
+    return 0;
+  n = 0;
+  for(cp = list; cp; cp = cp->hnext){
+    kfree(cp->data);
+    last = cp;
+    n++;
+  }
+  acquire(&pcache.lock);
+  last->hnext = pcache.free;
+  pcache.free = list;
+  release(&pcache.lock);
+  return n;
+}
+
+// Allocate a cpage struct, carving a fresh page into
+// structs if none is free.
+static struct cpage*
+cpalloc(void)
+{
+  struct cpage *cp;
+  char *mem;
+  int i;
+
+  acquire(&pcache.lock);
+  if(pcache.free == 0){
+    release(&pcache.lock);
+    if((mem = kalloc(KM_CACHE)) == 0)
+      return 0;
+    acquire(&pcache.lock);
+    for(i = 0; i + sizeof(*cp) <= PGSIZE; i += sizeof(*cp)){
+      cp = (struct cpage*)(mem + i);
+      cp->hnext = pcache.free;
+      pcache.free = cp;
+    }
+  }
+  cp = pcache.free;
+  pcache.free = cp->hnext;
+  release(&pcache.lock);
+  return cp;
+}
+
+static struct cpage*
+pclookup(uint dev, uint inum, uint pgno)
+{
+  struct cpage *cp;
+
+  for(cp = pcache.hash[pchash(dev, inum, pgno)]; cp; cp = cp->hnext)
+    if(cp->dev == dev && cp->inum == inum && cp->pgno == pgno)
+      return cp;
+  return 0;
+}
+
+// Return page pgno of the file (dev, inum), with a reference.
+// A page not in the cache is added, not valid.
+// Returns 0 if there is no memory for the page.
+struct cpage*
+pcget(uint dev, uint inum, uint pgno)
+{
+  struct cpage *cp, *old;
+  char *data;
+  uint h;
+
+  acquire(&pcache.lock);
+  if((cp = pclookup(dev, inum, pgno)) != 0){
+    cp->ref++;
+    pcfront(cp);
+    release(&pcache.lock);
+    return cp;
+  }
+  release(&pcache.lock);
+
+  if((data = kalloc(KM_CACHE)) == 0)
+    return 0;
+  if((cp = cpalloc()) == 0){
+    kfree(data);
+    return 0;
+  }
+  cp->dev = dev;
+  cp->inum = inum;
+  cp->pgno = pgno;
+  cp->valid = 0;
+  cp->filling = 0;
+  cp->ref = 1;
+  cp->data = data;
+  cp->next = 0;
+
+  acquire(&pcache.lock);
+  if((old = pclookup(dev, inum, pgno)) != 0){
+    // Another reader with the inode locked shared was first.
+    old->ref++;
+    pcfront(old);
+    release(&pcache.lock);
+    cp->hnext = 0;
+    pcdrop(cp);
+    return old;
+  }
+  h = pchash(dev, inum, pgno);
+  cp->hnext = pcache.hash[h];
+  pcache.hash[h] = cp;
+  pcfront(cp);
+  pcache.n++;
+  release(&pcache.lock);
+  return cp;
+}
+
+// Claim the reading in of cp, not valid when pcget() returned
+// it.  Returns 1 if the caller is to fill it and then call
+// pcfilled(), or 0 once another reader has filled it: readers
+// holding the inode lock shared may find the page together.
+int
+pcclaim(struct cpage *cp)
+{
+  int r;
+
+  acquire(&pcache.lock);
+  while(cp->filling)
+    sleep(cp, &pcache.lock);
+  r = !cp->valid;
+  if(r)
+    cp->filling = 1;
+  release(&pcache.lock);
+  return r;
+}
+
+// cp, claimed with pcclaim(), now holds the file's data.
+void
+pcfilled(struct cpage *cp)
+{
+  acquire(&pcache.lock);
+  cp->valid = 1;
+  cp->filling = 0;
+  wakeup(cp);
+  release(&pcache.lock);
+}
+
+// Is page pgno of the file (dev, inum) in the cache?
+int
+pchas(uint dev, uint inum, uint pgno)
+{
+  int r;
+
+  acquire(&pcache.lock);
+  r = pclookup(dev, inum, pgno) != 0;
+  release(&pcache.lock);
+  return r;
+}
+
+// Release a page returned by pcget.
+// A page left invalid is dropped from the cache.
+void
+pcput(struct cpage *cp)
+{
+  struct cpage *list;
+
+  list = 0;
+  acquire(&pcache.lock);
+  if(cp->ref < 1)
+    panic("pcput");
+  if(--cp->ref == 0 && !cp->valid)
+    pcunlink(cp, &list);
+  release(&pcache.lock);
+  pcdrop(list);
+}
+
+// Copy n bytes written at off in the file (dev, inum)
+// into the pages of it that are cached.
+// Caller must hold the inode's lock.
+void
+pcwrite(uint dev, uint inum, char *src, uint off, uint n)
+{
+  struct cpage *cp, *list;
+  uint tot, m;
+
+  list = 0;
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    acquire(&pcache.lock);
+    if((cp = pclookup(dev, inum, off/PGSIZE)) != 0){
+      if(krefcount(cp->data) > 1){
+        // Mapped into user memory (see readipage()), which
+        // must keep the old data: stop caching it instead.
+        pcunlink(cp, &list);
+        cp = 0;
+      } else
+        cp->ref++;
+    }
+    release(&pcache.lock);
+    if(cp == 0)
+      continue;
+    if(cp->valid)
+      memmove(cp->data + off%PGSIZE, src, m);
+    pcput(cp);
+  }
+  pcdrop(list);
+}
+
+// Discard all cached pages of the file (dev, inum).
+// Caller must hold the inode's lock.
+void
+pcinval(uint dev, uint inum)
+{
+  struct cpage *cp, *next, *list;
+
+  list = 0;
+  acquire(&pcache.lock);
+  for(cp = pcache.head.next; cp != &pcache.head; cp = next){
+    next = cp->next;
+    if(cp->dev == dev && cp->inum == inum){
+      if(cp->ref != 0)
+        panic("pcinval");
+      pcunlink(cp, &list);
+    }
+  }
+  release(&pcache.lock);
+  pcdrop(list);
+}
+
+// Free up to n unreferenced pages, least recently used first.
+// Returns the number of pages freed.
+int
+pcreclaim(int n)
+{
+  struct cpage *cp, *prev, *list;
+  int i;
+
+  list = 0;
+  i = 0;
+  acquire(&pcache.lock);
+  for(cp = pcache.head.prev; cp != &pcache.head && i < n; cp = prev){
+    prev = cp->prev;
+    if(cp->ref == 0){
+      pcunlink(cp, &list);
+      i++;
+    }
+  }
+  release(&pcache.lock);
+  return pcdrop(list);
+}
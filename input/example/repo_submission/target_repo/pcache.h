@@ -0,0 +1,13 @@
+// A page of cached file data (see pcache.c).
+struct cpage {
+  uint dev;
+  uint inum;
+  uint pgno;           // page number within the file
+  int valid;           // has the page been read from disk?
+  int filling;         // a reader is reading it in (pcclaim())
+  int ref;
+  char *data;          // PGSIZE bytes
+  struct cpage *hnext; // hash chain
+  struct cpage *prev;  // LRU list
+  struct cpage *next;
+};
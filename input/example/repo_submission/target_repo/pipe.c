@@ -2,23 +2,135 @@
 #include "defs.h"
 #include "param.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "file.h"
+#include "poll.h"
+#include "meminfo.h"
 
-#define PIPESIZE 512
+// A pipe's buffer is a ring of up to PIPEPAGES pages.  It
+// starts as one page and doubles each time a writer finds it
+// full, so a pipe only takes the memory a slow reader makes it
+// need.  Its size is always a power of two, so the ring
+// positions nread % size and nwrite % size stay consistent as
+// the counters wrap.
+#define PIPEPAGES 16
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[PIPEPAGES];
+  uint npage;     // pages in the ring
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rbusy;      // a splice is copying out of the ring
+  int wbusy;      // a writer is in the middle of a write
+  int nrwait;     // readers asleep on nread
+  int nwwait;     // writers asleep on nwrite, or on wbusy
 };
 
+#define PIPESIZE(p) ((p)->npage * PGSIZE)
+
+// pipesplicein() and pipespliceout() copy between the ring and
+// a file without p->lock, since file I/O sleeps.  rbusy and
+// wbusy keep other readers and writers away meanwhile: the
+// bytes a reader is copying aren't free space until nread
+// moves past them, and the space a writer is filling isn't
+// data until nwrite does.  A writer holds wbusy for its whole
+// call, since it may sleep with part of its data written.
+//
+// Every wakeup takes ptable.lock, so the pipe counts its
+// sleepers and only wakes them when there are some: readers
+// when data arrives, writers once a page is free (half the
+// ring while it is one page), rather than for every byte a
+// reader takes from a full ring.
+
+// Pipes come from a slab cache; a free pipe keeps its lock
+// and its first buffer page.
+static struct kmcache pipecache;
+
+static void
+pipector(void *o)
+{
+  struct pipe *p = o;
+
+  initlock(&p->lock, "pipe");
+  p->npage = 0;
+}
+
+void
+pipeinit(void)
+{
+  kmcacheinit(&pipecache, "pipe", sizeof(struct pipe), pipector);
+}
+
+static void pipeput(struct pipe*);
+
+// Sleep on chan, counted in *nwait.  Caller holds p->lock.
+static void
+pipesleep(struct pipe *p, void *chan, int *nwait)
+{
+  (*nwait)++;
+  sleep(chan, &p->lock);
+  (*nwait)--;
+}
+
+// Is there room enough to wake a writer for?
+#define PIPEROOM(p) ((p)->nread + PIPESIZE(p) - (p)->nwrite >= \
+                     ((p)->npage == 1 ? PGSIZE/2 : PGSIZE))
+
+// Wake the readers, if any.  Caller holds p->lock.
+static void
+pipewakeread(struct pipe *p)
+{
+  if(p->nrwait)
+    wakeup(&p->nread);
+  pollwakeup();
+}
+
+// Wake the writers waiting for space, if any and there is
+// enough of it.  Caller holds p->lock.
+static void
+pipewakewrite(struct pipe *p)
+{
+  if(PIPEROOM(p)){
+    if(p->nwwait)
+      wakeup(&p->nwrite);
+    pollwakeup();
+  }
+}
+
+static struct pipe*
+pipeget(void)
+{
+  struct pipe *p;
+
+  if((p = slaballoc(&pipecache)) == 0)
+    return 0;
+  if(p->npage == 0){
+    if((p->page[0] = kalloc(KM_PIPE)) == 0){
+      pipeput(p);
+      return 0;
+    }
+    p->npage = 1;
+  }
+  return p;
+}
+
+// Give back p's buffer pages but the first, and p itself.
+static void
+pipeput(struct pipe *p)
+{
+  while(p->npage > 1)
+    kfree(p->page[--p->npage]);
+  slabfree(&pipecache, p);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +140,16 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((p = (struct pipe*)kalloc()) == 0)
+  if((p = pipeget()) == 0)
     goto bad;
   p->readopen = 1;
   p->writeopen = 1;
+  p->rbusy = 0;
+  p->wbusy = 0;
+  p->nrwait = 0;
+  p->nwwait = 0;
   p->nwrite = 0;
   p->nread = 0;
-  initlock(&p->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -48,7 +163,7 @@ pipealloc(struct file **f0, struct file **f1)
 //PAGEBREAK: 20
  bad:
   if(p)
-    kfree((char*)p);
+    pipeput(p);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -67,55 +182,280 @@ pipeclose(struct pipe *p, int writable)
     p->readopen = 0;
     wakeup(&p->nwrite);
   }
+  pollwakeup();
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
-    kfree((char*)p);
+    pipeput(p);
   } else
     release(&p->lock);
 }
 
+// Double the full ring of p, with p->lock held.  The new
+// pages can't be kalloc'd under the lock, so it is dropped
+// meanwhile and the caller must look at the pipe again unless
+// this returns 0: the ring is PIPEPAGES already.  Returns -1
+// if there was no memory, 1 otherwise.
+static int
+pipegrow(struct pipe *p)
+{
+  char *mem[PIPEPAGES];
+  uint n, i, r;
+
+  n = p->npage;
+  if(n == PIPEPAGES)
+    return 0;
+  release(&p->lock);
+  for(i = 0; i < n; i++){
+    if((mem[i] = kalloc(KM_PIPE)) == 0){
+      while(i > 0)
+        kfree(mem[--i]);
+      acquire(&p->lock);
+      return -1;
+    }
+  }
+  acquire(&p->lock);
+  if(p->npage != n || p->nwrite != p->nread + PIPESIZE(p)){
+    for(i = 0; i < n; i++)
+      kfree(mem[i]);
+    return 1;
+  }
+
+  // Renumber the bytes so the oldest is at ring position r in
+  // both sizes.  The ones that had wrapped around to [0, r)
+  // now belong at [size, size+r): move those whole pages up,
+  // and copy the start of the page r is in.
+  r = p->nread % PIPESIZE(p);
+  p->nread = r;
+  p->nwrite = r + PIPESIZE(p);
+  for(i = 0; i < n; i++){
+    if((i+1) * PGSIZE <= r){
+      p->page[n+i] = p->page[i];
+      p->page[i] = mem[i];
+    } else {
+      p->page[n+i] = mem[i];
+      if(i * PGSIZE < r)
+        memmove(mem[i], p->page[i], r % PGSIZE);
+    }
+  }
+  p->npage = 2*n;
+  return 1;
+}
+
+// Wait with p->lock held until no other writer is busy, then
+// become the busy one.  Returns -1 if the caller was killed.
+static int
+pipewbegin(struct pipe *p)
+{
+  while(p->wbusy){
+    if(myproc()->killed)
+      return -1;
+    pipesleep(p, &p->wbusy, &p->nwwait);
+  }
+  p->wbusy = 1;
+  return 0;
+}
+
+static void
+pipewend(struct pipe *p)
+{
+  p->wbusy = 0;
+  if(p->nwwait)
+    wakeup(&p->wbusy);
+  pipewakeread(p);  //DOC: pipewrite-wakeup1
+  release(&p->lock);
+}
+
+// Wait with p->lock held for free space in the ring, growing
+// it if the reader is behind.  Returns the number of bytes
+// that can be written at ring position nwrite without
+// crossing a page, or -1 if the reader has gone.
+static int
+pipespace(struct pipe *p, int *grow)
+{
+  uint w;
+  int m, g;
+
+  while(p->nwrite == p->nread + PIPESIZE(p)){  //DOC: pipewrite-full
+    if(p->readopen == 0 || myproc()->killed)
+      return -1;
+    if(*grow && (g = pipegrow(p)) != 0){
+      if(g < 0)
+        *grow = 0;  // no memory: wait for the reader
+      continue;
+    }
+    pipewakeread(p);
+    pipesleep(p, &p->nwrite, &p->nwwait);  //DOC: pipewrite-sleep
+  }
+  w = p->nwrite % PIPESIZE(p);
+  m = PGSIZE - w % PGSIZE;
+  if(m > p->nread + PIPESIZE(p) - p->nwrite)
+    m = p->nread + PIPESIZE(p) - p->nwrite;
+  return m;
+}
+
 //PAGEBREAK: 40
 int
 pipewrite(struct pipe *p, char *addr, int n)
 {
-  int i;
+  int i, m, grow;
+  uint w;
 
+  grow = 1;
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
-      if(p->readopen == 0 || myproc()->killed){
-        release(&p->lock);
-        return -1;
-      }
-      wakeup(&p->nread);
-      sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+  if(pipewbegin(p) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  for(i = 0; i < n; i += m){
+    if((m = pipespace(p, &grow)) < 0){
+      pipewend(p);
+      return -1;
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    if(m > n - i)
+      m = n - i;
+    w = p->nwrite % PIPESIZE(p);
+    memmove(p->page[w / PGSIZE] + w % PGSIZE, addr + i, m);
+    p->nwrite += m;
   }
-  wakeup(&p->nread);  //DOC: pipewrite-wakeup1
-  release(&p->lock);
+  pipewend(p);
   return n;
 }
 
+// Move up to n bytes from file f into pipe p, reading them
+// straight into the ring.  Returns the number of bytes moved,
+// fewer than n only at the end of f, or -1.
 int
-piperead(struct pipe *p, char *addr, int n)
+pipesplicein(struct pipe *p, struct file *f, int n)
 {
-  int i;
+  int i, m, r, grow;
+  uint w;
 
+  grow = 1;
   acquire(&p->lock);
-  while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
-    if(myproc()->killed){
-      release(&p->lock);
-      return -1;
+  if(pipewbegin(p) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  for(i = 0; i < n; i += r){
+    if((m = pipespace(p, &grow)) < 0){
+      pipewend(p);
+      return i > 0 ? i : -1;
+    }
+    if(m > n - i)
+      m = n - i;
+    w = p->nwrite % PIPESIZE(p);
+    release(&p->lock);
+    r = fileread(f, p->page[w / PGSIZE] + w % PGSIZE, m);
+    acquire(&p->lock);
+    if(r < 0){
+      pipewend(p);
+      return i > 0 ? i : -1;
+    }
+    p->nwrite += r;
+    pipewakeread(p);
+    if(r < m){
+      i += r;
+      break;
     }
-    sleep(&p->nread, &p->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
+  pipewend(p);
+  return i;
+}
+
+// Wait with p->lock held until there is data and no splice
+// is copying it out.  Returns -1 if the caller was killed.
+static int
+pipedata(struct pipe *p)
+{
+  while((p->nread == p->nwrite && p->writeopen) || p->rbusy){  //DOC: pipe-empty
+    if(myproc()->killed)
+      return -1;
+    pipesleep(p, &p->nread, &p->nrwait); //DOC: piperead-sleep
+  }
+  return 0;
+}
+
+// Move up to n bytes of what is in pipe p to file f, writing
+// them straight from the ring.  Waits only for the first
+// byte, as piperead() does.  Returns the number of bytes
+// moved or -1.
+int
+pipespliceout(struct pipe *p, struct file *f, int n)
+{
+  int i, m, r;
+  uint rd;
+
+  acquire(&p->lock);
+  if(pipedata(p) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  p->rbusy = 1;
+  r = 0;
+  for(i = 0; i < n && p->nread != p->nwrite; i += m){
+    rd = p->nread % PIPESIZE(p);
+    m = PGSIZE - rd % PGSIZE;
+    if(m > p->nwrite - p->nread)
+      m = p->nwrite - p->nread;
+    if(m > n - i)
+      m = n - i;
+    release(&p->lock);
+    r = filewrite(f, p->page[rd / PGSIZE] + rd % PGSIZE, m);
+    acquire(&p->lock);
+    if(r != m)
       break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+    p->nread += m;
+    pipewakewrite(p);
+  }
+  p->rbusy = 0;
+  pipewakeread(p);  // for readers waiting on rbusy
+  release(&p->lock);
+  return r < 0 && i == 0 ? -1 : i;
+}
+
+int
+piperead(struct pipe *p, char *addr, int n)
+{
+  int i, m;
+  uint r;
+
+  acquire(&p->lock);
+  if(pipedata(p) < 0){
+    release(&p->lock);
+    return -1;
+  }
+  for(i = 0; i < n && p->nread != p->nwrite; i += m){  //DOC: piperead-copy
+    r = p->nread % PIPESIZE(p);
+    m = PGSIZE - r % PGSIZE;
+    if(m > p->nwrite - p->nread)
+      m = p->nwrite - p->nread;
+    if(m > n - i)
+      m = n - i;
+    memmove(addr + i, p->page[r / PGSIZE] + r % PGSIZE, m);
+    p->nread += m;
   }
-  wakeup(&p->nwrite);  //DOC: piperead-wakeup
+  pipewakewrite(p);  //DOC: piperead-wakeup
   release(&p->lock);
   return i;
 }
+
+// Return the POLL* events pipe p is ready for.  A writer is
+// only ready once a reader would wake it: see PIPEROOM.
+int
+pipepoll(struct pipe *p)
+{
+  int r;
+
+  r = 0;
+  acquire(&p->lock);
+  if(p->nread != p->nwrite)
+    r |= POLLIN;
+  if(p->readopen && PIPEROOM(p))
+    r |= POLLOUT;
+  if(!p->writeopen)
+    r |= POLLIN | POLLHUP;   // read() returns 0 at once
+  if(!p->readopen)
+    r |= POLLOUT | POLLHUP;  // write() fails at once
+  release(&p->lock);
+  return r;
+}
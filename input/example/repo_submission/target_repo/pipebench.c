@@ -0,0 +1,184 @@
+// pipebench: pipe throughput and latency.
+//   pipebench
+// sends messages of 1 byte to 64KB through a pipe, from a
+// parent to a child process and from one thread to another,
+// reporting KB/sec and messages/sec for each size, then times
+// 1-byte round trips over a pair of pipes.  Lines have the form
+//   name: value unit (n ops in us us)
+// for runbench.  Times come from the TSC.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "thread.h"
+
+#define TOTAL  (4*1024*1024)  // bytes sent per size, at most
+#define MAXMSG 20000          // messages sent per size, at most
+#define BUFSZ  (64*1024)
+#define NRT    5000           // round trips
+
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
+uint cpus;  // TSC cycles per microsecond
+char wbuf[BUFSZ];
+char rbuf[BUFSZ];
+
+uint
+since(uint64 t0)
+{
+  uint us;
+
+  us = udiv64(rdtsc() - t0, cpus);
+  return us ? us : 1;
+}
+
+void
+fail(char *what)
+{
+  printf(2, "pipebench: %s failed\n", what);
+  exit();
+}
+
+// Read n bytes from fd, in pieces of whatever size arrives.
+void
+drain(int fd, uint n)
+{
+  int m;
+
+  for(; n > 0; n -= m)
+    if((m = read(fd, rbuf, n < BUFSZ ? n : BUFSZ)) <= 0)
+      fail("read");
+}
+
+int pfd[2];
+uint want;  // bytes the reader thread expects
+
+void
+reader(void *a1, void *a2)
+{
+  drain(pfd[0], want);
+  exit();
+}
+
+// Send messages of size bytes through a pipe to a thread,
+// or to a child process if proc.
+void
+stream(int proc, uint size)
+{
+  uint nmsg, i, us;
+  int tid;
+  uint64 t0;
+
+  nmsg = TOTAL / size;
+  if(nmsg > MAXMSG)
+    nmsg = MAXMSG;
+  if(pipe(pfd) < 0)
+    fail("pipe");
+  want = nmsg * size;
+  t0 = rdtsc();
+  if(proc){
+    if((tid = fork()) < 0)
+      fail("fork");
+    if(tid == 0){
+      close(pfd[1]);
+      drain(pfd[0], want);
+      exit();
+    }
+  } else if(thread_create(&tid, reader, 0, 0) < 0)
+    fail("thread_create");
+  for(i = 0; i < nmsg; i++)
+    if(write(pfd[1], wbuf, size) != size)
+      fail("write");
+  if(proc)
+    wait();
+  else
+    thread_join(tid);
+  us = since(t0);
+  close(pfd[0]);
+  close(pfd[1]);
+  printf(1, "pipe %s %dB: %d KB/sec (%d ops in %d us)\n",
+         proc ? "proc" : "thread", size,
+         udiv64((uint64)want * 1000000 / 1024, us), nmsg, us);
+  printf(1, "pipe %s %dB msgs: %d msgs/sec (%d ops in %d us)\n",
+         proc ? "proc" : "thread", size,
+         udiv64((uint64)nmsg * 1000000, us), nmsg, us);
+}
+
+int ping[2], pong[2];
+
+// Bounce each byte from ping back on pong, NRT times.
+void
+bouncer(void *a1, void *a2)
+{
+  char c;
+  int i;
+
+  for(i = 0; i < NRT; i++){
+    if(read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1)
+      fail("bounce");
+  }
+  exit();
+}
+
+void
+roundtrip(int proc)
+{
+  char c;
+  int i, tid;
+  uint us;
+  uint64 t0;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0)
+    fail("pipe");
+  if(proc){
+    if((tid = fork()) < 0)
+      fail("fork");
+    if(tid == 0)
+      bouncer(0, 0);
+  } else if(thread_create(&tid, bouncer, 0, 0) < 0)
+    fail("thread_create");
+  c = 'p';
+  t0 = rdtsc();
+  for(i = 0; i < NRT; i++){
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+      fail("round trip");
+  }
+  us = since(t0);
+  if(proc)
+    wait();
+  else
+    thread_join(tid);
+  close(ping[0]);
+  close(ping[1]);
+  close(pong[0]);
+  close(pong[1]);
+  printf(1, "pipe %s round trip: %d ns/op (%d ops in %d us)\n",
+         proc ? "proc" : "thread", udiv64((uint64)us * 1000, NRT), NRT, us);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint size;
+
+  if((cpus = vtscpertick() / USPERTICK) == 0){
+    printf(2, "pipebench: TSC not calibrated yet, assuming 1GHz\n");
+    cpus = 1000;
+  }
+  memset(wbuf, 'p', sizeof(wbuf));
+  for(size = 1; size <= BUFSZ; size *= 16){
+    stream(1, size);
+    stream(0, size);
+  }
+  roundtrip(1);
+  roundtrip(0);
+  exit();
+}
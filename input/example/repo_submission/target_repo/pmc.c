@@ -0,0 +1,112 @@
+// Hardware performance counters.
+//
+// pmcinit() programs general-purpose counter i of each cpu to
+// count event PMC_i (rusage.h), in user and kernel mode, with
+// the architectural events of cpuid leaf 0xA; cpus without it
+// (such as AMD's, and QEMU without KVM) count nothing.  The
+// counters run all the time.  Every switch in the scheduler
+// calls pmcswitch(), which adds what the counters have counted
+// since the last switch on that cpu to the cpu's totals, which
+// perfctr() reads, and to those of the process that was
+// running, which getrusage() reads.  So a process's counts
+// follow it from cpu to cpu, as its utime and stime do.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "x86.h"
+#include "rusage.h"
+#include "proc.h"
+
+#define MSR_PMC0        0x0C1  // IA32_PMC0, and i more for counter i
+#define MSR_PERFEVTSEL0 0x186  // IA32_PERFEVTSEL0, likewise
+#define MSR_GLOBAL_CTRL 0x38F  // IA32_PERF_GLOBAL_CTRL, from version 2
+
+// PERFEVTSEL bits
+#define EVTSEL_USR  (1<<16)  // count in user mode
+#define EVTSEL_OS   (1<<17)  // and in the kernel
+#define EVTSEL_EN   (1<<22)  // enable
+
+// Event select and unit mask of each PMC_, and the bit of
+// cpuid 0xA's %ebx that is set if the cpu lacks it.
+static struct {
+  uint evsel;
+  uint absent;
+} events[NPMC] = {
+[PMC_CYCLES]  { 0x003C, 1<<0 },
+[PMC_INSTR]   { 0x00C0, 1<<1 },
+[PMC_LLCMISS] { 0x412E, 1<<4 },
+[PMC_BRMISS]  { 0x00C5, 1<<6 },
+};
+
+static int pmcmask;    // bit i: PMC_i is counted
+static uint64 pmcwrap; // counters are this wide
+
+// Program this cpu's counters.
+void
+pmcinit(void)
+{
+  struct cpu *c = mycpu();
+  uint a, b;
+  int i, mask;
+
+  a = cpuideax(0) >= 0xA ? cpuideax(0xA) : 0;
+  if((a & 0xFF) == 0 || (a >> 8 & 0xFF) < NPMC)
+    return;
+  b = cpuidebx(0xA);
+  pmcwrap = (1ULL << (a >> 16 & 0xFF)) - 1;
+  mask = 0;
+  for(i = 0; i < NPMC; i++){
+    wrmsr(MSR_PERFEVTSEL0 + i, 0);
+    if(b & events[i].absent)
+      continue;
+    wrmsr(MSR_PMC0 + i, 0);
+    wrmsr(MSR_PERFEVTSEL0 + i, events[i].evsel | EVTSEL_USR | EVTSEL_OS | EVTSEL_EN);
+    c->pmclast[i] = 0;
+    mask |= 1<<i;
+  }
+  if((a & 0xFF) >= 2)
+    wrmsr(MSR_GLOBAL_CTRL, (1<<NPMC) - 1);
+  pmcmask = mask;
+}
+
+// Charge the events since the last call on this cpu to it
+// and to p, if not 0.  Interrupts must be off.
+void
+pmcswitch(struct proc *p)
+{
+  struct cpu *c;
+  uint64 now, d;
+  int i;
+
+  if(pmcmask == 0)
+    return;
+  c = mycpu();
+  for(i = 0; i < NPMC; i++){
+    if((pmcmask & 1<<i) == 0)
+      continue;
+    now = rdpmc(i);
+    d = (now - c->pmclast[i]) & pmcwrap;
+    c->pmclast[i] = now;
+    c->pmc[i] += d;
+    if(p)
+      p->ru.pmc[i] += d;
+  }
+}
+
+// Copy the counts of cpu, since it started, to pmc.  Another
+// cpu's are as of its last switch.  Returns which PMC_ are
+// counted, as bits, or -1 if none are or there is no cpu.
+int
+perfctr(int cpu, uint64 *pmc)
+{
+  if(pmcmask == 0 || cpu < 0 || cpu >= ncpu)
+    return -1;
+  pushcli();
+  if(cpu == cpuid())
+    pmcswitch(myproc());
+  memmove(pmc, cpus[cpu].pmc, sizeof(cpus[cpu].pmc));
+  popcli();
+  return pmcmask;
+}
@@ -0,0 +1,11 @@
+// A file descriptor for poll() and the events to wait for.
+struct pollfd {
+  int fd;          // ignored if negative
+  short events;    // POLLIN, POLLOUT wanted
+  short revents;   // set by poll()
+};
+
+#define POLLIN    0x001  // reading won't block
+#define POLLOUT   0x004  // writing won't block
+#define POLLHUP   0x010  // the other end of a pipe is closed
+#define POLLNVAL  0x020  // fd is not open
@@ -4,26 +4,649 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
+#include "rusage.h"
 #include "proc.h"
 #include "spinlock.h"
-
+#include "trace.h"
+#include "mm.h"
+#include "sched.h"
+#include "clone.h"
+#include "meminfo.h"
+#include "counter.h"
+
+// Proc structs are carved out of kalloc'd pages on demand and
+// never given back; UNUSED ones wait on a free list.  Every
+// struct ever carved stays on the all list, so code that
+// really needs to look at every process can still do so.
+// ptable.lock covers those lists and process states; the family
+// tree (parent, children, siblings) has a lock of its own, so
+// fork(), wait() and exit() walk it without stopping the
+// schedulers.  Lock order: proctree.lock before ptable.lock.
+#define NPIDHASH 64  // power of two
 struct {
   struct spinlock lock;
-  struct proc proc[NPROC];
+  struct proc *all;            // Every proc struct, linked by allnext
+  struct proc *free[NCPU];     // UNUSED procs, by the cpu that freed them,
+                               // linked by freenext
+  int nproc;                   // Procs not on the free list
+  int nkstack;                 // Kernel stacks in KSTACKS given out
+  struct proc *pidhash[NPIDHASH];  // In-use procs by pid, linked by pidnext
+  struct mm *reap;             // Dead address spaces for reaper(),
+                               // linked by reapnext
 } ptable;
 
+struct {
+  struct spinlock lock;
+} proctree;
+
+// Per-CPU queues of RUNNABLE processes, so that scheduler()
+// can pick the next process without scanning ptable.
+// A process is on at most one queue, linked through p->rqnext,
+// on the list of its scheduling class.
+// Lock order: ptable.lock before runq.lock.
+struct rqlist {
+  struct proc *head;
+  struct proc *tail;
+  int len;
+};
+
+struct runq {
+  struct spinlock lock;
+  struct rqlist q[NSCHED];     // One list per scheduling class
+  volatile int len;            // Read without the lock by idle cpus
+};
+
+static struct runq runqs[NCPU];
+static int usemwait;  // idle cpus mwait on their run queue
+
+// A scheduling class orders the RUNNABLE processes of its
+// kind on a run queue; the lists are otherwise handled by
+// the rq functions below.  The classes are tried in order of
+// their SCHED_ number, so a SCHED_FIFO process always runs
+// before a SCHED_FAIR one.
+struct schedclass {
+  // Insert p in l.
+  void (*enqueue)(struct rqlist *l, struct proc *p);
+  // Choose the process in l to run next, setting *prev to
+  // the one before it; pgdir is the loaded page table.
+  struct proc *(*pick)(struct rqlist *l, pde_t *pgdir, struct proc **prev);
+  // p has run for t units of 1024 TSC cycles.
+  void (*charge)(struct proc *p, uint t);
+  // Whether the clock tick should preempt p.
+  int (*preempt)(struct proc *p);
+};
+
+// SCHED_FIFO: real-time.  Highest p->prio first, first come
+// first served within a priority, never preempted by the tick.
+
+static void
+fifoenqueue(struct rqlist *l, struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &l->head; *pp && (*pp)->prio >= p->prio; pp = &(*pp)->rqnext)
+    ;
+  p->rqnext = *pp;
+  *pp = p;
+  if(p->rqnext == 0)
+    l->tail = p;
+  l->len++;
+}
+
+static struct proc*
+fifopick(struct rqlist *l, pde_t *pgdir, struct proc **prev)
+{
+  *prev = 0;
+  return l->head;
+}
+
+static void
+fifocharge(struct proc *p, uint t)
+{
+}
+
+static int
+fifopreempt(struct proc *p)
+{
+  return 0;
+}
+
+// SCHED_FAIR: weighted fair share between address spaces.
+// The threads of a process share its mm's virtual run time,
+// which grows by the time they run divided by their weight
+// (from p->prio, a nice value), and the queued process whose
+// mm has run least goes next.  So a process with 30 threads
+// gets the cpu time of one single-threaded process, not 30.
+// A sibling of the loaded page table within RQSCAN entries
+// may go first if it is within SCHEDGRAN of the least.  An
+// address space that slept is put back no more than SCHEDLAG
+// behind vmin, the least virtual run time lately picked.
+
+static uint vmin;
+
+// Weights for nice -20..19; nice 0 is 1024, and each step is
+// about 10% of cpu time.
+static uint fairweight[40] = {
+  88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+  9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+  1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+  110, 87, 70, 56, 45, 36, 29, 23, 18, 15,
+};
+
+// The virtual run time a new address space starts with.
+uint
+schedvmin(void)
+{
+  return vmin;
+}
+
+static void
+fairenqueue(struct rqlist *l, struct proc *p)
+{
+  struct mm *mm = p->mm;
+
+  if((int)(mm->vruntime - (vmin - SCHEDLAG)) < 0)
+    mm->vruntime = vmin - SCHEDLAG;
+  p->rqnext = 0;
+  if(l->tail)
+    l->tail->rqnext = p;
+  else
+    l->head = p;
+  l->tail = p;
+  l->len++;
+}
+
+static struct proc*
+fairpick(struct rqlist *l, pde_t *pgdir, struct proc **prev)
+{
+  struct proc *p, *pp, *best, *bestprev, *sib, *sibprev;
+  int i;
+
+  best = bestprev = sib = sibprev = 0;
+  pp = 0;
+  for(i = 0, p = l->head; p; i++, pp = p, p = p->rqnext){
+    if(best == 0 || (int)(p->mm->vruntime - best->mm->vruntime) < 0){
+      best = p;
+      bestprev = pp;
+    }
+    if(pgdir && sib == 0 && i < RQSCAN && p->mm->pgdir == pgdir){
+      sib = p;
+      sibprev = pp;
+    }
+  }
+  if(sib && (int)(sib->mm->vruntime - best->mm->vruntime) < SCHEDGRAN){
+    best = sib;
+    bestprev = sibprev;
+  }
+  if(best && (int)(best->mm->vruntime - vmin) > 0)
+    vmin = best->mm->vruntime;
+  *prev = bestprev;
+  return best;
+}
+
+static void
+faircharge(struct proc *p, uint t)
+{
+  if(t > (1 << 21))
+    t = 1 << 21;  // keep t * 1024 in range
+  p->mm->vruntime += t * 1024 / fairweight[p->prio + 20];
+}
+
+static int
+fairpreempt(struct proc *p)
+{
+  return 1;
+}
+
+static struct schedclass schedclasses[NSCHED] = {
+[SCHED_FIFO] { fifoenqueue, fifopick, fifocharge, fifopreempt },
+[SCHED_FAIR] { fairenqueue, fairpick, faircharge, fairpreempt },
+};
+
+// Sleeping processes, hashed by channel, so that wakeup()
+// only looks at processes that might be sleeping on chan.
+// Linked through p->sqnext and protected by ptable.lock.
+#define NSLEEPQ 64  // power of two
+static struct proc *sleepq[NSLEEPQ];
+
+static struct proc**
+sleepbucket(void *chan)
+{
+  return &sleepq[(((uint)chan * 2654435761U) >> 16) & (NSLEEPQ-1)];
+}
+
+// Futexes: wait queues for user words (see futexkey()).
+// futexlock orders the value check in futexwait() against
+// futexwake().
+static struct spinlock futexlock;
+
 static struct proc *initproc;
+extern pde_t *kpgdir;  // vm.c
+
+static int nextpid = 1;  // taken with an atomic add
+
+static struct proc**
+pidbucket(int pid)
+{
+  return &ptable.pidhash[pid & (NPIDHASH-1)];
+}
+
+// Return the in-use proc with the given pid, or 0.
+// Caller must hold ptable.lock.
+static struct proc*
+pidlookup(int pid)
+{
+  struct proc *p;
+
+  for(p = *pidbucket(pid); p; p = p->pidnext)
+    if(p->pid == pid)
+      return p;
+  return 0;
+}
+
+// Kernel stacks that fit in KSTACKS, each under a guard page.
+#define NKSTACK ((KSTACKSEND - KSTACKS) / (KSTACKSIZE + PGSIZE))
+
+// Carve a fresh page into proc structs for the free list, each
+// with a place for its kernel stack for allocproc() to map.
+// Caller must hold ptable.lock.
+static int
+procgrow(void)
+{
+  struct proc *p;
+  char *mem;
+  int i;
+
+  if(ptable.nkstack >= NKSTACK || (mem = kzalloc(KM_SLAB)) == 0)
+    return -1;
+  for(i = 0; i + sizeof(*p) <= PGSIZE && ptable.nkstack < NKSTACK; i += sizeof(*p)){
+    p = (struct proc*)(mem + i);
+    p->kstack = (char*)KSTACKS + ptable.nkstack++ * (KSTACKSIZE + PGSIZE) + PGSIZE;
+    p->allnext = ptable.all;
+    ptable.all = p;
+    p->freenext = ptable.free[cpuid()];
+    ptable.free[cpuid()] = p;
+  }
+  return 0;
+}
+
+// Take an UNUSED proc off the free lists, or 0 if there are
+// none.  The one this cpu freed last comes first: its kernel
+// stack and the proc struct itself are the likeliest to still
+// be in this cpu's cache, as when a thread is joined and
+// another cloned in its place.
+// Caller must hold ptable.lock.
+static struct proc*
+procfree(void)
+{
+  struct proc **head, *p;
+  int i;
+
+  for(i = 0; i < ncpu; i++){
+    head = &ptable.free[(cpuid() + i) % ncpu];
+    if((p = *head) != 0){
+      *head = p->freenext;
+      p->freenext = 0;
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Add p to parent's list of child threads or of child
+// processes, so wait() and join() each look only at their own
+// kind.  Must hold proctree.lock.
+static void
+linkchild(struct proc *parent, struct proc *p)
+{
+  struct proc **head;
+
+  head = p->is_thread ? &parent->threads : &parent->children;
+  p->parent = parent;
+  p->sibling = *head;
+  if(p->sibling)
+    p->sibling->sibprev = &p->sibling;
+  *head = p;
+  p->sibprev = head;
+}
+
+// Remove p from its parent's list of children, if it is on
+// one.  Must hold proctree.lock if it is.
+static void
+unlinkchild(struct proc *p)
+{
+  if(p->sibprev == 0)
+    return;
+  *p->sibprev = p->sibling;
+  if(p->sibling)
+    p->sibling->sibprev = p->sibprev;
+  p->sibling = 0;
+  p->sibprev = 0;
+}
+
+// Add the usage in b to a.
+static void
+ruadd(struct rusage *a, struct rusage *b)
+{
+  int i;
+
+  a->utime += b->utime;
+  a->stime += b->stime;
+  a->nvcsw += b->nvcsw;
+  a->nivcsw += b->nivcsw;
+  a->minflt += b->minflt;
+  a->inblock += b->inblock;
+  a->oublock += b->oublock;
+  for(i = 0; i < NPMC; i++)
+    a->pmc[i] += b->pmc[i];
+}
+
+static void wakeup1(void *chan);
 
-int nextpid = 1;
+// Release the address space reference of p, unlink it from
+// its parent and the pid hash and put it back on the free
+// list.  It keeps its kernel stack (see kstackmap()).  The
+// last reference to an address space leaves it to reaper(),
+// so wait() doesn't spend its time, with ptable.lock held,
+// freeing page tables and pages.
+// Caller must hold ptable.lock, and proctree.lock if p has
+// been linked to a parent.
+static void
+freeproc(struct proc *p)
+{
+  struct proc **pp;
+
+  if(p->mm){
+    ruadd(&p->mm->ru, &p->ru);
+    if(mmunref(p->mm)){
+      p->mm->reapnext = ptable.reap;
+      ptable.reap = p->mm;
+      wakeup1(&ptable.reap);
+    }
+    p->mm = 0;
+  }
+  for(pp = pidbucket(p->pid); *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->pidnext = 0;
+  p->tgprev->tgnext = p->tgnext;
+  p->tgnext->tgprev = p->tgprev;
+  p->tgnext = p->tgprev = p;
+  unlinkchild(p);
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->is_thread = 0;
+  p->user_stack = 0;
+  p->state = UNUSED;
+  p->freenext = ptable.free[cpuid()];
+  ptable.free[cpuid()] = p;
+  ptable.nproc--;
+}
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
+static int wakeupn1(void *chan, int n);
 
 void
 pinit(void)
 {
-  initlock(&ptable.lock, "ptable");
+  int i;
+
+  initlockq(&ptable.lock, "ptable");
+  initlock(&proctree.lock, "proctree");
+  initlock(&futexlock, "futex");
+  for(i = 0; i < NCPU; i++){
+    initlock(&runqs[i].lock, "runq");
+    cpus[i].rq = &runqs[i];
+  }
+  usemwait = (cpuidecx(1) & CPUID_MONITOR) && (cpuidecx(5) & CPUID_MWAITINT);
+}
+
+// Queue p on cpu c's run queue.
+static void
+rqpush(struct cpu *c, struct proc *p)
+{
+  struct runq *rq = c->rq;
+
+  acquire(&rq->lock);
+  schedclasses[p->sclass].enqueue(&rq->q[p->sclass], p);
+  rq->len++;
+  release(&rq->lock);
+}
+
+// Put p at the head of its list on cpu c's run queue.
+static void
+rqpushhead(struct cpu *c, struct proc *p)
+{
+  struct runq *rq = c->rq;
+  struct rqlist *l = &rq->q[p->sclass];
+
+  acquire(&rq->lock);
+  p->rqnext = l->head;
+  l->head = p;
+  if(l->tail == 0)
+    l->tail = p;
+  l->len++;
+  rq->len++;
+  release(&rq->lock);
+}
+
+// Work has been queued on cpu c: wake it if it is halted in
+// the idle loop, or else wake some halted cpu to steal it.
+// A cpu in mwait on its own queue woke when the work went on.
+// Called with interrupts off.
+static void
+rqkick(struct cpu *c)
+{
+  int i;
+
+  if(c->idle == IDLE_MWAIT)
+    return;
+  if(!c->idle)
+    for(i = 0; i < ncpu && !c->idle; i++)
+      c = &cpus[i];
+  if(c->idle && c != mycpu())
+    lapicipi(c->apicid, T_IRQ0 + IRQ_WAKE);
+}
+
+// Unlink p, which follows prev (0 if p is the head), from
+// list l of rq.  Caller must hold rq->lock.
+static struct proc*
+rqremove(struct runq *rq, struct rqlist *l, struct proc *prev, struct proc *p)
+{
+  if(prev)
+    prev->rqnext = p->rqnext;
+  else
+    l->head = p->rqnext;
+  if(l->tail == p)
+    l->tail = prev;
+  p->rqnext = 0;
+  l->len--;
+  rq->len--;
+  return p;
+}
+
+// Remove and return the process cpu c should run next, as
+// its scheduling class picks it, or 0 if the run queue is
+// empty.  pgdir, if non-zero, is the loaded page table.
+static struct proc*
+rqpop(struct cpu *c, pde_t *pgdir)
+{
+  struct runq *rq = c->rq;
+  struct proc *p, *prev;
+  int i;
+
+  if(rq->len == 0)  // Don't bounce the lock while idle.
+    return 0;
+  acquire(&rq->lock);
+  p = 0;
+  for(i = 0; i < NSCHED && p == 0; i++)
+    if(rq->q[i].len > 0 &&
+       (p = schedclasses[i].pick(&rq->q[i], pgdir, &prev)) != 0)
+      rqremove(rq, &rq->q[i], prev, p);
+  release(&rq->lock);
+  return p;
+}
+
+// Gang mode: hand the RUNNABLE siblings of pgdir queued on
+// cpu c to the other cpus, one each at the head of their
+// queues, so the threads of a process run side by side
+// rather than taking turns while holding each other's locks.
+static void
+gangspread(struct cpu *c, pde_t *pgdir)
+{
+  struct rqlist *l = &c->rq->q[SCHED_FAIR];
+  struct proc *sib[NCPU], *p, *prev, *next;
+  int i, n;
+
+  n = 0;
+  acquire(&c->rq->lock);
+  prev = 0;
+  for(p = l->head; p && n < ncpu-1; p = next){
+    next = p->rqnext;
+    if(p->mm->pgdir == pgdir)
+      sib[n++] = rqremove(c->rq, l, prev, p);
+    else
+      prev = p;
+  }
+  release(&c->rq->lock);
+
+  for(i = 0; i < n; i++){
+    rqpushhead(&cpus[(c - cpus + 1 + i) % ncpu], sib[i]);
+    rqkick(&cpus[(c - cpus + 1 + i) % ncpu]);
+  }
+}
+
+// Steal work for an idle cpu c: detach the older half of each
+// list of the busiest peer's run queue and queue it on c.
+// Peers on c's NUMA node come first, so that processes stay
+// near the memory they allocated there (kalloc.c).
+// The batch is unlinked before c's lock is taken so that two
+// cpus stealing from each other can't deadlock; while in
+// flight its processes are RUNNABLE but on no queue, which
+// is safe because nothing but a scheduler touches them.
+// Returns the number of processes moved.
+static int
+rqsteal(struct cpu *c)
+{
+  struct runq *rq, *victim;
+  struct rqlist *l;
+  struct proc *head, *tail, *p;
+  int i, k, n;
+
+  victim = 0;
+  for(k = 0; k < 2 && victim == 0; k++)
+    for(i = 0; i < ncpu; i++){
+      rq = &runqs[i];
+      if(rq != c->rq && rq->len > 0 && (k || cpus[i].node == c->node) &&
+         (victim == 0 || rq->len > victim->len))
+        victim = rq;
+    }
+  if(victim == 0)
+    return 0;
+
+  head = tail = 0;
+  n = 0;
+  acquire(&victim->lock);
+  for(k = 0; k < NSCHED; k++){
+    l = &victim->q[k];
+    for(i = (l->len + 1) / 2; i > 0; i--){
+      p = rqremove(victim, l, 0, l->head);
+      if(tail)
+        tail->rqnext = p;
+      else
+        head = p;
+      tail = p;
+      n++;
+    }
+  }
+  release(&victim->lock);
+  if(n == 0)
+    return 0;
+
+  rq = c->rq;
+  acquire(&rq->lock);
+  for(p = head; p; p = head){
+    head = p->rqnext;
+    schedclasses[p->sclass].enqueue(&rq->q[p->sclass], p);
+    rq->len++;
+  }
+  release(&rq->lock);
+  return n;
+}
+
+// Index of the cpu with the shortest run queue, counting one
+// more for cpus on other NUMA nodes than node, since a new
+// process shares its memory with its parent until it writes.
+// Used to place new processes; the lengths are only a hint.
+static int
+rqleast(int node)
+{
+  int i, best, len, bestlen;
+
+  best = 0;
+  bestlen = runqs[0].len + (cpus[0].node != node);
+  for(i = 1; i < ncpu; i++){
+    len = runqs[i].len + (cpus[i].node != node);
+    if(len < bestlen){
+      best = i;
+      bestlen = len;
+    }
+  }
+  return best;
+}
+
+// Halt this cpu, which has nothing to run, until an interrupt
+// or, with mwait, a write to its run queue brings work.  Its
+// timer is stopped but for the timers on its wheel.
+static void
+cpuidle(struct cpu *c)
+{
+  uint64 t0;
+  int i;
+
+  cli();
+  if(usemwait)
+    monitor(&c->rq->len);
+  c->idle = usemwait ? IDLE_MWAIT : IDLE_HLT;
+  __sync_synchronize();
+  // rqkick() only wakes idle cpus, so look again for work
+  // queued before c->idle was set.
+  for(i = 0; i < ncpu; i++)
+    if(runqs[i].len > 0)
+      break;
+  if(i == ncpu){
+    t0 = rdtsc();
+    timeridle(1);
+    if(usemwait)
+      mwait();  // an interrupt that woke us is taken at sti()
+    else {
+      stihlt();
+      cli();
+    }
+    c->idlecycles += rdtsc() - t0;
+  }
+  c->idle = 0;
+  timeridle(0);
+  sti();
+}
+
+// Mark p RUNNABLE and queue it on the run queue of the
+// cpu it last ran on.  Caller must hold ptable.lock.
+static void
+makerunnable(struct proc *p)
+{
+  if(!holding(&ptable.lock))
+    panic("makerunnable");
+  p->state = RUNNABLE;
+  rqpush(&cpus[p->rqcpu], p);
+  rqkick(&cpus[p->rqcpu]);
 }
 
 // Must be called with interrupts disabled
@@ -32,107 +655,82 @@ cpuid() {
   return mycpu()-cpus;
 }
 
-// Must be called with interrupts disabled to avoid the caller being
-// rescheduled between reading lapicid and running through the loop.
+// Must be called with interrupts disabled, so that the caller
+// isn't moved to another cpu while it uses the result.
+// The kernel's %fs is based at this cpu's struct cpu (see
+// seginit()); a kernel for one cpu just has cpus[0].
 struct cpu*
 mycpu(void)
 {
-  int apicid, i;
-  
+#if NCPU > 1
+  struct cpu *c;
+
   if(readeflags()&FL_IF)
     panic("mycpu called with interrupts enabled\n");
-  
-  apicid = lapicid();
-  // APIC IDs are not guaranteed to be contiguous. Maybe we should have
-  // a reverse map, or reserve a register to store &cpus[i].
-  for (i = 0; i < ncpu; ++i) {
-    if (cpus[i].apicid == apicid)
-      return &cpus[i];
-  }
-  panic("unknown apicid\n");
+  asm volatile("movl %%fs:%c1, %0" : "=r" (c) :
+               "i" (__builtin_offsetof(struct cpu, self)));
+  return c;
+#else
+  return cpus;
+#endif
 }
 
 
 static struct proc* allocproc(void);
+static void procrelease(struct proc*);
+static void ipcexit(struct proc*);
 void wakeup1(void *chan);
 
-// Disable interrupts so that we are not rescheduled
-// while reading proc from the cpu structure
+// One load through %fs, so it can't be rescheduled halfway;
+// whichever cpu it runs on, its proc is the caller.
 struct proc*
 myproc(void) {
-  struct cpu *c;
   struct proc *p;
-  pushcli();
-  c = mycpu();
-  p = c->proc;
-  popcli();
+
+  asm volatile("movl %%fs:%c1, %0" : "=r" (p) :
+               "i" (__builtin_offsetof(struct cpu, proc)));
   return p;
 }
 int
-clone(void (*fcn)(void *, void *), void *arg1, void *arg2, void *stack)
+clone(void (*fcn)(void *, void *), void *arg1, void *arg2, void *stack, int flags, uint tls)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *curproc = myproc();
 
-  // --- Add this debug line ---
-  cprintf("kernel clone: called with stack=0x%x, fcn=0x%x\n", stack, fcn);
-  // --- End of debug line ---
-
   // Allocate process.
   if((np = allocproc()) == 0){
-    cprintf("kernel clone: allocproc failed\n"); // Debug
+    KLOG(KL_DEBUG, "kernel clone: allocproc failed\n");
     return -1;
   }
 
   // Share address space:
-  // Parent and child pgdir point to the same page table.
-  // No need for copyuvm.
-  np->pgdir = curproc->pgdir;
-  np->sz = curproc->sz; // Size of address space is the same
+  // Parent and child use the same mm, and so the same page
+  // table and size.  No need for copyuvm.
+  if((np->mm = mmdup(curproc->mm)) == 0){
+    KLOG(KL_DEBUG, "kernel clone: mmdup failed\n");
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
+    return -1;
+  }
 
-  np->parent = curproc;
   *np->tf = *curproc->tf; // Copy trap frame (registers, etc.)
 
   // Set up the new thread's user stack:
-  // Arguments are pushed in reverse order (arg2, then arg1 for fcn(arg1, arg2))
-  // Then a fake return address.
+  // a fake return address (0xffffffff), then fcn's arguments
+  // arg1 and arg2, at the top of the page, in one copyout.
   // PGSIZE is from kernel/memlayout.h
   uint ustack_ptr = (uint)stack + PGSIZE; // Start at the top of the page
-
-  uint fake_ret_pc_val = 0xffffffff; // Variable to hold the value for copyout
-
-  // Fake return PC (0xffffffff as suggested)
-  ustack_ptr -= 4;
-  // Corrected copyout: pass address of a kernel variable
-  if(copyout(np->pgdir, ustack_ptr, &fake_ret_pc_val, sizeof(uint)) < 0) {
-      cprintf("kernel clone: copyout fake_ret_pc failed\n"); // Debug
-      kfree(np->kstack);
-      np->kstack = 0;
-      np->state = UNUSED;
-      np->is_thread = 0; np->user_stack = 0; // Reset fields
-      return -1;
-  }
-
-  // Push arg2
-  ustack_ptr -= 4;
-  if(copyout(np->pgdir, ustack_ptr, &arg2, sizeof(void *)) < 0) {
-      cprintf("kernel clone: copyout arg2 failed\n"); // Debug
-      kfree(np->kstack);
-      np->kstack = 0;
-      np->state = UNUSED;
-      np->is_thread = 0; np->user_stack = 0; // Reset fields
-      return -1;
-  }
-  
-  // Push arg1
-  ustack_ptr -= 4;
-  if(copyout(np->pgdir, ustack_ptr, &arg1, sizeof(void *)) < 0) {
-      cprintf("kernel clone: copyout arg1 failed\n"); // Debug
-      kfree(np->kstack);
-      np->kstack = 0;
-      np->state = UNUSED;
-      np->is_thread = 0; np->user_stack = 0; // Reset fields
+  uint frame[3] = { 0xffffffff, (uint)arg1, (uint)arg2 };
+
+  ustack_ptr -= sizeof(frame);
+  if(copyout(np->mm->pgdir, ustack_ptr, frame, sizeof(frame)) < 0) {
+      KLOG(KL_DEBUG, "kernel clone: copyout of the stack frame failed\n");
+      procrelease(np);
+      acquire(&ptable.lock);
+      freeproc(np);
+      release(&ptable.lock);
       return -1;
   }
 
@@ -142,89 +740,58 @@ clone(void (*fcn)(void *, void *), void *arg1, void *arg2, void *stack)
   // Set return value for child thread to 0
   np->tf->eax = 0;
 
+  // Give the thread its own %gs segment, or inherit the caller's.
+  if(flags & CLONE_SETTLS){
+    np->tls = tls;
+    np->tf->gs = (SEG_UTLS << 3) | DPL_USER;
+  } else
+    np->tls = curproc->tls;
+
   // Mark as a thread and store its user stack base (for join)
   np->is_thread = 1;
   np->user_stack = stack; // Store the original stack pointer passed to clone
-
-  // Copy open files.
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
+  np->tgid = curproc->tgid;
+
+  // Share or copy open files and the current directory.
+  if(flags & CLONE_FILES)
+    np->files = fdtdup(curproc->files);
+  else
+    np->files = fdtcopy(curproc->files);
+  if(flags & CLONE_FS)
+    np->cwd = cwddup(curproc->cwd);
+  else
+    np->cwd = cwdcopy(curproc->cwd);
+  if(np->files == 0 || np->cwd == 0){
+    KLOG(KL_DEBUG, "kernel clone: out of memory for files\n");
+    procrelease(np);
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
+    return -1;
+  }
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name)); // Can give a more specific name if desired
+  np->sclass = np->bsclass = curproc->bsclass;
+  np->prio = np->bprio = curproc->bprio;
 
   pid = np->pid;
 
+  acquire(&proctree.lock);
+  linkchild(curproc, np);
+  release(&proctree.lock);
   acquire(&ptable.lock);
-  np->state = RUNNABLE;
+  np->tgnext = curproc->tgnext;
+  np->tgprev = curproc;
+  curproc->tgnext->tgprev = np;
+  curproc->tgnext = np;
+  makerunnable(np);
+  cntadd(CNT_FORK, 1);
   release(&ptable.lock);
+  trace(TR_CLONE, pid);
 
-  cprintf("kernel clone: success for pid %d, child of %d\n", pid, curproc->pid); // Debug
   return pid; // Return PID to parent
 }
 
-// In kernel/proc.c
-// Wait for a child thread to exit and return its PID and stack.
-// The user-provided stack_ptr_user is where the child's user_stack will be copied.
-// int
-// join(void **stack_ptr_user)
-// {
-//   struct proc *p;
-//   int havekids, pid;
-//   struct proc *curproc = myproc();
-
-//   acquire(&ptable.lock);
-//   for(;;){ // Loop forever until a condition is met
-//     // Scan through table looking for exited children (threads).
-//     havekids = 0;
-//     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-//       if(p->parent != curproc || !p->is_thread) // Not my child or not a thread
-//         continue;
-      
-//       havekids = 1;
-//       if(p->state == ZOMBIE){
-//         // Found an exited child thread.
-//         pid = p->pid;
-
-//         // Copy out the child's user stack pointer.
-//         // p->user_stack was set by clone.
-//         if (copyout(curproc->pgdir, (uint)stack_ptr_user, &p->user_stack, sizeof(void *)) < 0) {
-//             // Failed to copy out stack pointer, this is problematic.
-//             // Release lock and return error. Or, perhaps proceed without freeing stack?
-//             // For now, let's consider it an error that prevents full cleanup.
-//             release(&ptable.lock);
-//             return -2; // Indicate a copyout error
-//         }
-
-//         kfree(p->kstack);
-//         p->kstack = 0;
-//         // pgdir is shared, DO NOT free it here like in wait() for a full process.
-//         // The address space is freed only when the last process/thread using it exits.
-//         // This logic will be in exit() and wait().
-//         p->pid = 0;
-//         p->parent = 0;
-//         p->name[0] = 0;
-//         p->killed = 0;
-//         p->state = UNUSED;
-//         p->is_thread = 0; // Reset flag
-//         p->user_stack = 0; // Reset
-        
-//         release(&ptable.lock);
-//         return pid;
-//       }
-//     }
-
-//     // No exited child threads found.
-//     if(!havekids || curproc->killed){
-//       release(&ptable.lock);
-//       return -1; // No children to wait for, or process was killed.
-//     }
-
-//     // Wait for a child thread to exit.
-//     sleep(curproc, &ptable.lock);  //DOC: wait-sleep
-//   }
-// }
 //PAGEBREAK: 32
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
@@ -235,27 +802,45 @@ allocproc(void)
 {
   struct proc *p;
   char *sp;
+  int pid;
 
+  pid = __sync_fetch_and_add(&nextpid, 1);
   acquire(&ptable.lock);
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
+  if(ptable.nproc >= NPROC ||
+     ((p = procfree()) == 0 && (procgrow() < 0 || (p = procfree()) == 0))){
+    release(&ptable.lock);
+    return 0;
+  }
+  ptable.nproc++;
 
-found:
   p->state = EMBRYO;
-  p->pid = nextpid++;
+  p->pid = pid;
+  p->tgid = pid;
+  p->tgnext = p->tgprev = p;
+  p->pidnext = *pidbucket(p->pid);
+  *pidbucket(p->pid) = p;
   p->is_thread = 0; // Default to not a thread; fork() will keep this, clone() will set it
   p->user_stack = 0;
+  p->tls = 0;
+  p->vfork = 0;
+  p->ipcstate = 0;
+  p->fpuused = 0;
+  p->rqnext = 0;
+  p->rqcpu = rqleast(mycpu()->node);
+  p->sclass = p->bsclass = SCHED_FAIR;
+  p->prio = p->bprio = 0;
+  p->nlent = 0;
+  memset(&p->ru, 0, sizeof(p->ru));
+  memset(&p->cru, 0, sizeof(p->cru));
 
   release(&ptable.lock);
 
-  // Allocate kernel stack.
-  if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
+  // Map its kernel stack, unless an earlier process here did.
+  if(kstackmap(p->kstack) < 0){
+    acquire(&ptable.lock);
+    freeproc(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -283,15 +868,17 @@ void
 userinit(void)
 {
   struct proc *p;
+  pde_t *pgdir;
   extern char _binary_initcode_start[], _binary_initcode_size[];
 
   p = allocproc();
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((pgdir = setupkvm()) == 0)
+    panic("userinit: out of memory?");
+  inituvm(pgdir, _binary_initcode_start, (int)_binary_initcode_size);
+  if((p->mm = mmalloc(pgdir, PGSIZE)) == 0)
     panic("userinit: out of memory?");
-  inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-  p->sz = PGSIZE;
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -302,7 +889,8 @@ userinit(void)
   p->tf->eip = 0;  // beginning of initcode.S
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  if((p->files = fdtalloc()) == 0 || (p->cwd = cwdalloc(namei("/"))) == 0)
+    panic("userinit: out of memory?");
 
   // this assignment to p->state lets other cores
   // run this process. the acquire forces the above
@@ -310,30 +898,93 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  makerunnable(p);
+
+  release(&ptable.lock);
+}
+
+// Kernel threads start here, holding ptable.lock from
+// scheduler(), and "return" into their function.
+static void
+kthreadret(void)
+{
+  release(&ptable.lock);
+}
+
+// The address space of kernel threads: kpgdir itself, with no
+// user memory, so none needs a page table of its own and
+// switching between one and the scheduler leaves %cr3 alone.
+// Made by the first kthreadstart() and never freed, as kernel
+// threads never exit.  Protected by proctree.lock.
+static struct mm *kmm;
+
+// Start a kernel thread running fn(arg), which must never
+// return.  It is a child of init, so the scheduler treats it
+// like any other process.  Returns its pid, or -1 if out of
+// memory.
+int
+kthreadstart(void (*fn)(void*), void *arg, char *name)
+{
+  struct proc *np;
+  uint *sp;
+
+  if((np = allocproc()) == 0)
+    return -1;
+  acquire(&proctree.lock);
+  if(kmm == 0 && (kmm = mmalloc(kpgdir, 0)) == 0){
+    release(&proctree.lock);
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
+    return -1;
+  }
+  np->mm = mmdup(kmm);
+  linkchild(initproc, np);
+  release(&proctree.lock);
+
+  // allocproc() left trapret as forkret's return address; fn
+  // "returns" there instead, and finds arg above its own return
+  // address, which it never uses.
+  sp = (uint*)(np->kstack + KSTACKSIZE - sizeof(*np->tf) - 4);
+  sp[0] = (uint)fn;
+  sp[2] = (uint)arg;
+  np->context->eip = (uint)kthreadret;
+  safestrcpy(np->name, name, sizeof(np->name));
 
+  acquire(&ptable.lock);
+  makerunnable(np);
   release(&ptable.lock);
+  return np->pid;
 }
 
 // Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// The size lives in the shared mm, so every thread sees the
+// change, and the mm lock keeps concurrent sbrks apart.
+// Return the old size on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
-  struct proc *curproc = myproc();
+  uint sz, oldsz;
+  struct mm *mm = myproc()->mm;
 
-  sz = curproc->sz;
+  acquire(&mm->lock);
+  oldsz = sz = mm->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    // Pages are allocated when first touched (see pagein()).
+    if(sz + n < sz || sz + n >= KERNBASE || vmaoverlap(mm, sz, sz + n)){
+      release(&mm->lock);
       return -1;
+    }
+    sz += n;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if((sz = deallocuvm(mm->pgdir, sz, sz + n)) == 0){
+      release(&mm->lock);
       return -1;
+    }
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
-  return 0;
+  mm->sz = sz;  // deallocuvm() flushed the TLBs
+  release(&mm->lock);
+  return oldsz;
 }
 
 // Create a new process copying p as the parent.
@@ -342,7 +993,7 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *curproc = myproc();
 
@@ -351,216 +1002,341 @@ fork(void)
     return -1;
   }
 
-  // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+  // Copy process state from proc, reclaiming memory once if
+  // there isn't enough.
+  if((np->mm = mmcopy(curproc->mm)) == 0 &&
+     (reclaim(NRECLAIM) == 0 || (np->mm = mmcopy(curproc->mm)) == 0)){
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
     return -1;
   }
-  np->sz = curproc->sz;
-  np->parent = curproc;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
+  np->tls = curproc->tls;
+  fpufork(np);
 
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
+  np->files = fdtcopy(curproc->files);
+  np->cwd = cwdcopy(curproc->cwd);
+  if(np->files == 0 || np->cwd == 0){
+    procrelease(np);
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
+    return -1;
+  }
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+  np->sclass = np->bsclass = curproc->bsclass;
+  np->prio = np->bprio = curproc->bprio;
 
   pid = np->pid;
 
-  acquire(&ptable.lock);
-
-  np->state = RUNNABLE;
+  acquire(&proctree.lock);
+  linkchild(curproc, np);
+  release(&proctree.lock);
 
+  acquire(&ptable.lock);
+  makerunnable(np);
+  cntadd(CNT_FORK, 1);
   release(&ptable.lock);
 
   return pid;
 }
 
-// Exit the current process.  Does not return.
-// An exited process remains in the zombie state
-// until its parent calls wait() to find out it exited.
-void
-exit(void)
+// Create a child process that shares the caller's address space
+// until it calls exec() or exits, and sleep until it has.  The
+// child runs on the caller's stack, so it should do little more
+// than set up its files and exec.
+int
+vfork(void)
 {
+  int pid;
+  struct proc *np;
   struct proc *curproc = myproc();
-  struct proc *p;
-  int fd;
-
-  if(curproc == initproc)
-    panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
-    }
+  if((np = allocproc()) == 0)
+    return -1;
+  np->mm = mmdup(curproc->mm);
+  *np->tf = *curproc->tf;
+  np->tf->eax = 0;
+  np->tls = curproc->tls;
+
+  np->files = fdtcopy(curproc->files);
+  np->cwd = cwdcopy(curproc->cwd);
+  if(np->files == 0 || np->cwd == 0){
+    procrelease(np);
+    acquire(&ptable.lock);
+    freeproc(np);
+    release(&ptable.lock);
+    return -1;
   }
 
-  begin_op();
-  iput(curproc->cwd);
-  end_op();
-  curproc->cwd = 0;
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+  np->sclass = np->bsclass = curproc->bsclass;
+  np->prio = np->bprio = curproc->bprio;
+  np->vfork = 1;
+  fpufork(np);
+
+  pid = np->pid;
 
+  // Only this process reaps np, so it stays until we wake.
+  acquire(&proctree.lock);
+  linkchild(curproc, np);
+  release(&proctree.lock);
   acquire(&ptable.lock);
+  makerunnable(np);
+  cntadd(CNT_FORK, 1);
+  while(np->vfork)
+    sleep(np, &ptable.lock);
+  release(&ptable.lock);
 
-  // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  return pid;
+}
 
-  // Pass abandoned children to init.
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->parent == curproc){
-      p->parent = initproc;
-      if(p->state == ZOMBIE)
-        wakeup1(initproc);
-    }
+// p, a vfork() child, is done with its parent's address space.
+void
+vforkdone(struct proc *p)
+{
+  acquire(&ptable.lock);
+  p->vfork = 0;
+  wakeup1(p);
+  release(&ptable.lock);
+}
+
+// Drop p's references to its fd table and current directory,
+// and stop using its address space (see mmexit()); freeproc()
+// drops the mm itself.  Can sleep, so the caller must not hold
+// ptable.lock.
+static void
+procrelease(struct proc *p)
+{
+  if(p->mm)
+    mmexit(p->mm);
+  if(p->files){
+    fdtput(p->files);
+    p->files = 0;
+  }
+  if(p->cwd){
+    begin_op();
+    cwdput(p->cwd);
+    end_op();
+    p->cwd = 0;
   }
+}
 
-  // Jump into the scheduler, never to return.
+// Exit the current process.  Does not return.
+// An exited process remains in the zombie state
+// until its parent calls wait() to find out it exited.
+void
+exit(void)
+{
+  struct proc *curproc = myproc();
+  struct proc *p;
+  int zombies;
+
+  if(curproc == initproc)
+    panic("init exiting");
+
+  // Close all open files, unless other threads still share them.
+  procrelease(curproc);
+
+  // Pass abandoned children to init.  Children only become
+  // ZOMBIE under proctree.lock, so their state can be read here.
+  acquire(&proctree.lock);
+  zombies = 0;
+  while((p = curproc->children) != 0 || (p = curproc->threads) != 0){
+    unlinkchild(p);
+    linkchild(initproc, p);
+    if(p->state == ZOMBIE)
+      zombies = 1;
+  }
+
+  acquire(&ptable.lock);
+  if(zombies)
+    wakeup1(initproc);
+
+  ipcexit(curproc);
+
+  // Parent might be sleeping in wait(), or in vfork().
+  wakeup1(curproc->parent);
+  if(curproc->vfork){
+    curproc->vfork = 0;
+    wakeup1(curproc);
+  }
+
+  // Jump into the scheduler, never to return.  The parent
+  // can't see the ZOMBIE until proctree.lock is released, nor
+  // reap it until the scheduler releases ptable.lock.
   curproc->state = ZOMBIE;
+  release(&proctree.lock);
   sched();
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
+// Reap exited child thread p: hand its user stack back
+// through *stack and free the slot.  Must hold proctree.lock
+// and ptable.lock.
+static int
+reapthread(struct proc *p, void **stack)
+{
+  int pid;
+
+  pid = p->pid;
+  trace(TR_JOIN, pid);
+  *stack = p->user_stack;
+  // The mm is shared; freeproc() only drops this thread's
+  // reference, and the last user to be reaped frees it.
+  freeproc(p);
+  return pid;
+}
 
-// In kernel/proc.c
-// Wait for a child thread to exit and return its PID and stack.
-// The user-provided stack_ptr_user is where the child's user_stack will be copied.
+// Wait for child thread tid, or for any child thread if tid
+// is -1, to exit.  Store the user stack it was given to clone()
+// in *stack and return its pid, or -1 if there is no such thread.
+// stack must be a valid user address (see sys_join).
 int
-join(void **stack_ptr_user)
+join(int tid, void **stack)
 {
   struct proc *p;
-  int havekids, pid;
+  int havekids;
   struct proc *curproc = myproc();
 
-  acquire(&ptable.lock);
-  for(;;){ // Loop forever until a condition is met
-    // Scan through table looking for exited children (threads).
+  acquire(&proctree.lock);
+  for(;;){
     havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc || !p->is_thread) // Not my child or not a thread
-        continue;
-      
-      havekids = 1;
-      if(p->state == ZOMBIE){
-        // Found an exited child thread.
-        pid = p->pid;
-
-        // Copy out the child's user stack pointer.
-        // p->user_stack was set by clone.
-        if (copyout(curproc->pgdir, (uint)stack_ptr_user, &p->user_stack, sizeof(void *)) < 0) {
-            // Failed to copy out stack pointer, this is problematic.
-            // Release lock and return error. Or, perhaps proceed without freeing stack?
-            // For now, let's consider it an error that prevents full cleanup.
-            release(&ptable.lock);
-            return -2; // Indicate a copyout error
+    acquire(&ptable.lock);
+    if(tid != -1){
+      p = pidlookup(tid);
+      if(p && p->parent == curproc && p->is_thread){
+        havekids = 1;
+        if(p->state == ZOMBIE){
+          tid = reapthread(p, stack);
+          release(&ptable.lock);
+          release(&proctree.lock);
+          return tid;
+        }
+      }
+    } else {
+      for(p = curproc->threads; p; p = p->sibling){
+        havekids = 1;
+        if(p->state == ZOMBIE){
+          tid = reapthread(p, stack);
+          release(&ptable.lock);
+          release(&proctree.lock);
+          return tid;
         }
-
-        kfree(p->kstack);
-        p->kstack = 0;
-        // pgdir is shared, DO NOT free it here like in wait() for a full process.
-        // The address space is freed only when the last process/thread using it exits.
-        // This logic will be in exit() and wait().
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
-        p->is_thread = 0; // Reset flag
-        p->user_stack = 0; // Reset
-        
-        release(&ptable.lock);
-        return pid;
       }
     }
+    release(&ptable.lock);
 
-    // No exited child threads found.
+    // No point waiting if there's nothing to join.
     if(!havekids || curproc->killed){
-      release(&ptable.lock);
-      return -1; // No children to wait for, or process was killed.
+      release(&proctree.lock);
+      return -1;
     }
 
     // Wait for a child thread to exit.
-    sleep(curproc, &ptable.lock);  //DOC: wait-sleep
+    sleep(curproc, &proctree.lock);  //DOC: wait-sleep
   }
 }
 
-// In kernel/proc.c
-// Call this *before* clearing p->pgdir, when p is ZOMBIE and being reaped.
-// Assumes ptable.lock is held.
-void
-check_and_free_shared_pgdir(struct proc *dying_proc)
+// Wait for all n child threads in tids[] to exit, storing the
+// stack of tids[i] in stacks[i].  Return n, or -1 if some tid is
+// not a child thread or the caller is killed; threads reaped
+// before that still have their stacks[] entry set, the rest 0.
+// Pids are never reused, so a tid that is gone has been reaped.
+int
+join_many(int *tids, int n, void **stacks)
 {
-  struct proc *p_iter;
-  int shared_pgdir_users = 0;
-
-  if (dying_proc->pgdir == 0) // Already freed or never had one
-      return;
+  struct proc *p;
+  int i, left;
+  struct proc *curproc = myproc();
 
-  // Count how many other active (not UNUSED, not ZOMBIE, not self) processes/threads use this pgdir
-  for (p_iter = ptable.proc; p_iter < &ptable.proc[NPROC]; p_iter++) {
-    if (p_iter != dying_proc &&                        // Not the dying process itself
-        p_iter->pgdir == dying_proc->pgdir &&         // Shares the same page directory
-        p_iter->state != UNUSED && p_iter->state != ZOMBIE) { // Is an active user
-      shared_pgdir_users++;
+  acquire(&proctree.lock);
+  acquire(&ptable.lock);
+  for(i = 0; i < n; i++){
+    p = pidlookup(tids[i]);
+    if(p == 0 || p->parent != curproc || !p->is_thread){
+      release(&ptable.lock);
+      release(&proctree.lock);
+      return -1;
     }
+    stacks[i] = 0;
   }
 
-  if (shared_pgdir_users == 0) {
-    // No other active users of this page directory, safe to free.
-    freevm(dying_proc->pgdir);
+  for(;;){
+    left = 0;
+    for(i = 0; i < n; i++){
+      if((p = pidlookup(tids[i])) == 0)
+        continue;
+      if(p->state == ZOMBIE)
+        reapthread(p, &stacks[i]);
+      else
+        left++;
+    }
+    release(&ptable.lock);
+    if(left == 0){
+      release(&proctree.lock);
+      return n;
+    }
+    if(curproc->killed){
+      release(&proctree.lock);
+      return -1;
+    }
+    sleep(curproc, &proctree.lock);  //DOC: wait-sleep
+    acquire(&ptable.lock);
   }
-  // The caller (wait or exit) will set dying_proc->pgdir = 0 after this.
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
 int
 wait(void)
 {
-  struct proc *p;
+  struct proc *p, *np;
   int havekids, pid;
   struct proc *curproc = myproc();
 
-  acquire(&ptable.lock);
+  acquire(&proctree.lock);
   for(;;){
+    // Threads whose process has exited come to init, which
+    // can't join them; free the ones that are done.
+    if(curproc == initproc){
+      acquire(&ptable.lock);
+      for(p = curproc->threads; p; p = np){
+        np = p->sibling;
+        if(p->state == ZOMBIE)
+          freeproc(p);
+      }
+      release(&ptable.lock);
+    }
+
     havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      // MODIFIED: Only consider non-thread children
-      if(p->parent != curproc || p->is_thread) 
-        continue;
+    for(p = curproc->children; p; p = p->sibling){
       havekids = 1;
       if(p->state == ZOMBIE){
+        // Once we hold ptable.lock p is off its cpu for good.
+        acquire(&ptable.lock);
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-
-        // Address space freeing logic (see below)
-        check_and_free_shared_pgdir(p); 
-
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
-        // p->is_thread should already be 0 for processes handled by wait()
+        ruadd(&curproc->cru, &p->ru);
+        ruadd(&curproc->cru, &p->cru);
+        if(p->mm->ref == 1)
+          ruadd(&curproc->cru, &p->mm->ru);  // its reaped threads
+        freeproc(p);  // frees the address space with its last user
         release(&ptable.lock);
+        release(&proctree.lock);
         return pid;
       }
     }
 
     if(!havekids || curproc->killed){
-      release(&ptable.lock);
+      release(&proctree.lock);
       return -1;
     }
-    sleep(curproc, &ptable.lock);
+    sleep(curproc, &proctree.lock);
   }
 }
 
@@ -577,34 +1353,86 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  pde_t *last;
+  int streak;
+  uint64 t0, t1;
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
+    // Take the next process off this cpu's run queue,
+    // stealing a batch from a busier cpu if it is empty.
+    // Queued processes are only started under ptable.lock,
+    // so one that is still inside sched() on another cpu
+    // cannot be switched to before its context is saved.
+    if((p = rqpop(c, 0)) == 0 && rqsteal(c) > 0)
+      p = rqpop(c, 0);
+    if(p == 0){
+      // Nothing to run: zero a page for kzalloc(), or if
+      // there are enough, halt.
+      if(!kzeroidle())
+        cpuidle(c);
+      continue;
+    }
 
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
+    // Run queued processes back to back while holding
+    // ptable.lock.  The last process's page table stays
+    // loaded in between: it can't be freed while we hold
+    // the lock, and if the next process is a sibling thread
+    // the CR3 reload and TLB flush are skipped.
+    acquire(&ptable.lock);
+    last = 0;
+    streak = 0;
+    while(p){
+      if(p->state == RUNNABLE){
+        if(GANGSCHED)
+          gangspread(c, p->mm->pgdir);
+
+        // Switch to chosen process.  It is the process's job
+        // to release ptable.lock and then reacquire it
+        // before jumping back to us.
+        c->proc = p;
+        p->rqcpu = c - cpus;
+        if(c->pgdir == p->mm->pgdir)
+          switchtss(p);
+        else
+          switchuvm(p);
+        p->state = RUNNING;
+        trace(TR_SWITCH, p->pid);
+
+        pmcswitch(0);
+        cntadd(CNT_CSWITCH, 1);
+        t0 = p->runstart = rdtsc();
+        swtch(&(c->scheduler), p->context);
+        t1 = rdtsc();
+        pmcswitch(p);
+        p->ru.stime += t1 - p->runstart;
+        schedclasses[p->sclass].charge(p, (t1 - t0) >> 10);
+
+        // Process is done running for now.
+        // It should have changed its p->state before coming back.
+        c->proc = 0;
+        streak = (c->pgdir == last) ? streak + 1 : 0;
+        last = c->pgdir;
+      }
 
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+      // Run a process handed this cpu by sleepto() next.
+      // Otherwise prefer a thread sharing the loaded page
+      // table, but only SCHEDAFFINITY times in a row so the
+      // head of the queue isn't starved.
+      if(c->handoff){
+        p = c->handoff;
+        c->handoff = 0;
+      } else if(GANGSCHED || streak >= SCHEDAFFINITY)
+        p = rqpop(c, 0);
+      else
+        p = rqpop(c, c->pgdir);
     }
+    switchkvm();
+    c->pgdir = 0;
     release(&ptable.lock);
-
   }
 }
 
@@ -630,6 +1458,7 @@ sched(void)
   if(readeflags()&FL_IF)
     panic("sched interruptible");
   intena = mycpu()->intena;
+  fpusave(p);
   swtch(&p->context, mycpu()->scheduler);
   mycpu()->intena = intena;
 }
@@ -639,11 +1468,34 @@ void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  makerunnable(myproc());
   sched();
   release(&ptable.lock);
 }
 
+// Free the address spaces freeproc() leaves on ptable.reap,
+// a batch at a time.  The pages go to the cache of whichever
+// cpu runs this, ready for the next fork() or sbrk() there.
+static void
+reaper(void *arg)
+{
+  struct mm *mm, *next;
+
+  acquire(&ptable.lock);
+  for(;;){
+    while(ptable.reap == 0)
+      sleep(&ptable.reap, &ptable.lock);
+    mm = ptable.reap;
+    ptable.reap = 0;
+    release(&ptable.lock);
+    for(; mm; mm = next){
+      next = mm->reapnext;
+      mmfree(mm);
+    }
+    acquire(&ptable.lock);
+  }
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch here.  "Return" to user space.
 void
@@ -658,17 +1510,50 @@ forkret(void)
     // of a regular process (e.g., they call sleep), and thus cannot
     // be run from main().
     first = 0;
+    workinit();
+    kloginit();
+    if(kthreadstart(reaper, 0, "reaper") < 0)
+      panic("reaper");
     iinit(ROOTDEV);
     initlog(ROOTDEV);
+    orphaninit(ROOTDEV);
+    swapinit(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// Remove sleeping process p from its sleep queue bucket.
+// Caller must hold ptable.lock.
+static void
+sqremove(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = sleepbucket(p->chan); *pp; pp = &(*pp)->sqnext){
+    if(*pp == p){
+      *pp = p->sqnext;
+      p->sqnext = 0;
+      return;
+    }
+  }
+  panic("sqremove");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
+{
+  sleepcond(chan, lk, 0);
+}
+
+// Like sleep(), but if cond is set and *cond is 0 once
+// ptable.lock is held, don't sleep.  A waker that can't take
+// lk, like a timer, clears *cond and then calls wakeproc(),
+// and can't be missed.
+void
+sleepcond(void *chan, struct spinlock *lk, volatile int *cond)
 {
   struct proc *p = myproc();
   
@@ -688,14 +1573,20 @@ sleep(void *chan, struct spinlock *lk)
     acquire(&ptable.lock);  //DOC: sleeplock1
     release(lk);
   }
-  // Go to sleep.
-  p->chan = chan;
-  p->state = SLEEPING;
-
-  sched();
-
-  // Tidy up.
-  p->chan = 0;
+  if(cond == 0 || *cond){
+    // Go to sleep.
+    trace(TR_SLEEP, (uint)chan);
+    p->ru.nvcsw++;
+    p->chan = chan;
+    p->state = SLEEPING;
+    p->sqnext = *sleepbucket(chan);
+    *sleepbucket(chan) = p;
+
+    sched();
+
+    // Tidy up.
+    p->chan = 0;
+  }
 
   // Reacquire original lock.
   if(lk != &ptable.lock){  //DOC: sleeplock2
@@ -704,17 +1595,52 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
+// Like sleep() on chan with ptable.lock held, but if to is
+// asleep, wake it and give it this cpu straight away, ahead
+// of anything on the run queue, as when the caller will sleep
+// until to answers it.
+static void
+sleepto(void *chan, struct proc *to)
+{
+  if(to->state == SLEEPING){
+    sqremove(to);
+    to->state = RUNNABLE;
+    trace(TR_WAKEUP, to->pid);
+    mycpu()->handoff = to;
+  }
+  sleep(chan, &ptable.lock);
+}
+
 //PAGEBREAK!
 // Wake up all processes sleeping on chan.
 // The ptable lock must be held.
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
+  wakeupn1(chan, NPROC);
+}
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+// Wake up at most n processes sleeping on chan and return
+// how many were woken.  The ptable lock must be held.
+static int
+wakeupn1(void *chan, int n)
+{
+  struct proc **pp, *p;
+  int woken;
+
+  woken = 0;
+  pp = sleepbucket(chan);
+  while(woken < n && (p = *pp) != 0){
+    if(p->chan == chan){
+      *pp = p->sqnext;
+      p->sqnext = 0;
+      makerunnable(p);
+      trace(TR_WAKEUP, p->pid);
+      woken++;
+    } else
+      pp = &p->sqnext;
+  }
+  return woken;
 }
 
 // Wake up all processes sleeping on chan.
@@ -726,7 +1652,520 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
-// Kill the process with the given pid.
+// Wake p if it is sleeping on chan.
+void
+wakeproc(struct proc *p, void *chan)
+{
+  acquire(&ptable.lock);
+  if(p->state == SLEEPING && p->chan == chan){
+    sqremove(p);
+    makerunnable(p);
+    trace(TR_WAKEUP, p->pid);
+  }
+  release(&ptable.lock);
+}
+
+// The futex channel for the user word at addr, or 0 if addr is
+// not mapped; sets *w to the word's kernel address.  A word in a
+// MAP_SHARED or shm page (uvashared()) is keyed by that kernel
+// address, so every process mapping the page finds the same
+// queue, and *mm is 0.  Any other word is private to the
+// address space, and fork()'s copy-on-write, swapping and
+// uvmsharepage() can move it to another physical page under a
+// waiter; it is keyed by addr itself, and *mm is the address
+// space that waiters must be in too.  Kernel channels all lie
+// above KERNBASE, so a user address never meets one.  argptr()
+// has faulted the word in.
+static void*
+futexkey(uint addr, int **w, struct mm **mm)
+{
+  pde_t *pgdir;
+  char *ka;
+
+  if(addr & 3)
+    return 0;
+  pgdir = myproc()->mm->pgdir;
+  if((ka = uva2ka(pgdir, (char*)PGROUNDDOWN(addr))) == 0)
+    return 0;
+  *w = (int*)(ka + (addr & (PGSIZE-1)));
+  if(uvashared(pgdir, (char*)addr)){
+    *mm = 0;
+    return *w;
+  }
+  *mm = myproc()->mm;
+  return (void*)addr;
+}
+
+// Wake at most n processes sleeping on the futex channel chan
+// in address space mm, or in any if mm is 0, and return how
+// many were woken.  The ptable lock must be held.
+static int
+futexwake1(void *chan, struct mm *mm, int n)
+{
+  struct proc **pp, *p;
+  int woken;
+
+  woken = 0;
+  pp = sleepbucket(chan);
+  while(woken < n && (p = *pp) != 0){
+    if(p->chan == chan && (mm == 0 || p->mm == mm)){
+      *pp = p->sqnext;
+      p->sqnext = 0;
+      makerunnable(p);
+      trace(TR_WAKEUP, p->pid);
+      woken++;
+    } else
+      pp = &p->sqnext;
+  }
+  return woken;
+}
+
+// Sleep on the user word at addr as long as it holds val, for
+// at most timeout ticks (forever if timeout is negative).
+// Return 0 when woken by futexwake(), 1 if the timeout passed
+// first, -1 if the word did not hold val or the caller was
+// killed.
+int
+futexwait(uint addr, int val, int timeout)
+{
+  struct mm *mm;
+  void *chan;
+  int *w, r;
+
+  acquire(&futexlock);
+  if((chan = futexkey(addr, &w, &mm)) == 0 || *w != val ||
+     myproc()->killed){
+    release(&futexlock);
+    return -1;
+  }
+  r = 0;
+  if(timeout < 0)
+    sleep(chan, &futexlock);
+  else
+    r = sleeptimeout(chan, &futexlock, timeout);
+  release(&futexlock);
+  return myproc()->killed ? -1 : r;
+}
+
+// Wake at most n threads sleeping on the user word at addr.
+// Return how many were woken, or -1 if addr is not mapped.
+int
+futexwake(uint addr, int n)
+{
+  struct mm *mm;
+  void *chan;
+  int *w;
+
+  acquire(&futexlock);
+  if((chan = futexkey(addr, &w, &mm)) == 0){
+    release(&futexlock);
+    return -1;
+  }
+  acquire(&ptable.lock);
+  n = futexwake1(chan, mm, n);
+  release(&ptable.lock);
+  release(&futexlock);
+  return n;
+}
+
+// Synchronous IPC.  A client's ipccall() hands a message to
+// a server blocked in ipcreplywait() and sleeps until the
+// server replies, the cpu going from one straight to the other
+// (see sleepto()), so a round trip costs two switches and
+// nothing from the run queue.  The message is the four
+// words the two leave in the %ebx, %esi, %edi and %ebp of
+// their trap frames (see usys.S), copied from frame to frame.
+// A client whose server is busy waits on the server's ipcsend
+// list for it to come back for the next call.  All of this is
+// under ptable.lock.
+
+static void
+ipccopy(struct trapframe *dst, struct trapframe *src)
+{
+  dst->ebx = src->ebx;
+  dst->esi = src->esi;
+  dst->edi = src->edi;
+  dst->ebp = src->ebp;
+}
+
+// Wake p, which has been given its answer, if it is asleep
+// waiting for it.
+static void
+ipcwake(struct proc *p)
+{
+  if(p->state == SLEEPING){
+    sqremove(p);
+    makerunnable(p);
+  }
+}
+
+// End p's wait in IPC with result ret, without waking it.
+static void
+ipcdone(struct proc *p, int ret)
+{
+  struct proc **pp;
+
+  if(p->ipcstate == IPC_SEND){
+    for(pp = &p->ipcpeer->ipcsend; *pp != p; pp = &(*pp)->ipcnext)
+      ;
+    *pp = p->ipcnext;
+    p->ipcnext = 0;
+  }
+  if(p->ipcpeer){
+    p->ipcpeer->ipcclients--;
+    p->ipcpeer = 0;
+  }
+  p->ipcret = ret;
+  p->ipcstate = 0;
+}
+
+// Sleep until the caller's IPC wait ends, first handing the
+// cpu to to if it is not 0.  Returns the wait's result, or -1
+// if the caller is killed.
+static int
+ipcwait(struct proc *to)
+{
+  struct proc *p = myproc();
+
+  while(p->ipcstate){
+    if(p->killed){
+      ipcdone(p, -1);
+      break;
+    }
+    if(to){
+      sleepto(&p->ipcstate, to);
+      to = 0;
+    } else
+      sleep(&p->ipcstate, &ptable.lock);
+  }
+  return p->ipcret;
+}
+
+// Send the caller's message to process pid and wait for the
+// reply, which replaces it.  Returns 0, or -1 if there is no
+// such process, it exits first or the caller is killed.
+int
+ipccall(int pid)
+{
+  struct proc *p = myproc(), *s, **pp;
+  int ret;
+
+  acquire(&ptable.lock);
+  if((s = pidlookup(pid)) == 0 || s == p || s->state == ZOMBIE || p->killed){
+    release(&ptable.lock);
+    return -1;
+  }
+  p->ipcpeer = s;
+  s->ipcclients++;
+  if(s->ipcstate == IPC_RECV){
+    ipccopy(s->tf, p->tf);
+    ipcdone(s, p->pid);
+    p->ipcstate = IPC_REPLY;
+    ret = ipcwait(s);
+  } else {
+    for(pp = &s->ipcsend; *pp; pp = &(*pp)->ipcnext)
+      ;
+    *pp = p;
+    p->ipcstate = IPC_SEND;
+    ret = ipcwait(0);
+  }
+  release(&ptable.lock);
+  return ret;
+}
+
+// Send the caller's message as the reply to the call of
+// process pid, if pid is not 0, then if wait, wait for the
+// next call to the caller and take its message.  Returns the
+// pid of the new caller if wait, else 0; -1 if pid is not
+// waiting for a reply from the caller, or the caller is killed.
+int
+ipcreplywait(int pid, int wait)
+{
+  struct proc *p = myproc(), *c, *s;
+
+  acquire(&ptable.lock);
+  c = 0;
+  if(pid != 0){
+    if((c = pidlookup(pid)) == 0 || c->ipcstate != IPC_REPLY || c->ipcpeer != p){
+      release(&ptable.lock);
+      return -1;
+    }
+    ipccopy(c->tf, p->tf);
+    ipcdone(c, 0);
+  }
+  if(!wait || p->killed){
+    if(c)
+      ipcwake(c);
+    release(&ptable.lock);
+    return wait ? -1 : 0;
+  }
+  if((s = p->ipcsend) != 0){
+    // A client is waiting already: take its call.
+    if(c)
+      ipcwake(c);
+    p->ipcsend = s->ipcnext;
+    s->ipcnext = 0;
+    s->ipcstate = IPC_REPLY;
+    ipccopy(p->tf, s->tf);
+    release(&ptable.lock);
+    return s->pid;
+  }
+  p->ipcstate = IPC_RECV;
+  pid = ipcwait(c);
+  release(&ptable.lock);
+  return pid;
+}
+
+// p is exiting: fail the calls waiting on it.  Caller must
+// hold ptable.lock.
+static void
+ipcexit(struct proc *p)
+{
+  struct proc *q;
+
+  for(q = ptable.all; q && p->ipcclients > 0; q = q->allnext){
+    if(q->ipcstate && q->ipcpeer == p){
+      ipcdone(q, -1);
+      ipcwake(q);
+    }
+  }
+}
+
+// Fill in *ru with the usage of process pid (the caller if
+// 0) for who, RUSAGE_ in rusage.h.  Returns -1 if there is no
+// such process.
+int
+getrusage(int pid, int who, struct rusage *ru)
+{
+  struct proc *p, *q;
+  uint64 now;
+
+  acquire(&ptable.lock);
+  p = pid == 0 ? myproc() : pidlookup(pid);
+  if(p == 0 || who < RUSAGE_SELF || who > RUSAGE_THREAD){
+    release(&ptable.lock);
+    return -1;
+  }
+  if(p == myproc()){
+    now = rdtsc();
+    p->ru.stime += now - p->runstart;
+    p->runstart = now;
+    pmcswitch(p);
+  }
+  memset(ru, 0, sizeof(*ru));
+  if(who == RUSAGE_THREAD)
+    ruadd(ru, &p->ru);
+  else if(who == RUSAGE_CHILDREN)
+    ruadd(ru, &p->cru);
+  else if(p->mm){
+    ruadd(ru, &p->mm->ru);
+    for(q = ptable.all; q; q = q->allnext)
+      if(q->state != UNUSED && q->mm == p->mm)
+        ruadd(ru, &q->ru);
+  }
+  safestrcpy(ru->name, p->name, sizeof(ru->name));
+  release(&ptable.lock);
+  return 0;
+}
+
+// The address space of the live process with the smallest
+// pid above *pid, with a reference for the caller to mmput(),
+// and set *pid to its pid.  If there is none, set *pid to 0
+// and return 0.  For reclaim()'s sweep.
+struct mm*
+mmnext(int *pid)
+{
+  struct proc *p, *best;
+  struct mm *mm;
+
+  acquire(&ptable.lock);
+  best = 0;
+  for(p = ptable.all; p; p = p->allnext)
+    if(p->state != UNUSED && p->state != EMBRYO && p->state != ZOMBIE &&
+       p->mm && p->mm->sz && p->pid > *pid && (best == 0 || p->pid < best->pid))
+      best = p;
+  if(best == 0){
+    release(&ptable.lock);
+    *pid = 0;
+    return 0;
+  }
+  mm = best->mm;
+  acquire(&mm->lock);
+  mm->ref++;
+  release(&mm->lock);
+  *pid = best->pid;
+  release(&ptable.lock);
+  return mm;
+}
+
+// Resident pages in the address space of process pid (the
+// caller if 0), or -1 if there is no such process.
+int
+procrss(int pid)
+{
+  struct proc *p;
+  struct mm *mm;
+  int n;
+
+  acquire(&ptable.lock);
+  p = pid == 0 ? myproc() : pidlookup(pid);
+  if(p == 0 || (mm = p->mm) == 0){
+    release(&ptable.lock);
+    return -1;
+  }
+  // Hold on to the page table while walking it.
+  acquire(&mm->lock);
+  mm->ref++;
+  release(&mm->lock);
+  release(&ptable.lock);
+  n = uvmrss(mm->pgdir);
+  mmput(mm);
+  return n;
+}
+
+// Rank of class sclass at priority prio: a process of higher
+// rank is picked first.
+static int
+schedrank(int sclass, int prio)
+{
+  if(sclass == SCHED_FIFO)
+    return 40 + prio;
+  return 19 - prio;
+}
+
+// Move p to class sclass at priority prio, requeueing it if
+// it is waiting on a run queue.  Caller must hold ptable.lock.
+static void
+rqmove(struct proc *p, int sclass, int prio)
+{
+  struct runq *rq;
+  struct proc *q, *prev;
+  int i;
+
+  for(i = 0; p->state == RUNNABLE && i < ncpu; i++){
+    rq = &runqs[i];
+    acquire(&rq->lock);
+    prev = 0;
+    for(q = rq->q[p->sclass].head; q && q != p; q = q->rqnext)
+      prev = q;
+    if(q){
+      rqremove(rq, &rq->q[p->sclass], prev, p);
+      p->sclass = sclass;
+      p->prio = prio;
+      schedclasses[sclass].enqueue(&rq->q[sclass], p);
+      rq->len++;
+      release(&rq->lock);
+      return;
+    }
+    release(&rq->lock);
+  }
+  p->sclass = sclass;
+  p->prio = prio;
+}
+
+// Whether the clock tick should make p yield the cpu.
+int
+schedpreempt(struct proc *p)
+{
+  return schedclasses[p->sclass].preempt(p);
+}
+
+// Move process pid (the caller if 0) to scheduling class
+// sclass at priority prio.  A queued process moves the next
+// time it is queued.  Returns -1 if there is no such process
+// or prio is out of the class's range.
+int
+setpriority(int pid, int sclass, int prio)
+{
+  struct proc *p;
+
+  if(sclass == SCHED_FIFO ? prio < 1 || prio > 99 :
+     sclass == SCHED_FAIR ? prio < -20 || prio > 19 : 1)
+    return -1;
+  acquire(&ptable.lock);
+  p = pid == 0 ? myproc() : pidlookup(pid);
+  if(p == 0 || p->state == ZOMBIE){
+    release(&ptable.lock);
+    return -1;
+  }
+  p->bsclass = sclass;
+  p->bprio = prio;
+  if(p->nlent == 0 || schedrank(sclass, prio) > schedrank(p->sclass, p->prio)){
+    p->sclass = sclass;
+    p->prio = prio;
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
+// Priority inheritance for sleeplocks.  A process about to
+// wait for a sleeplock lends its priority to the holder if
+// that is lower, so a SCHED_FIFO process isn't held up behind
+// a fair-share holder that can't get the cpu.  The holder
+// keeps the best priority lent to it until it has released
+// every lock that was lent one (p->nlent), then goes back to
+// bsclass and bprio.  A lock's lent records whether a waiter
+// lent its holder priority; it is protected by the lock's
+// spinlock and p->nlent by ptable.lock.
+
+// Lend the caller's priority to p, the holder of a sleeplock
+// whose lent is *lent, if p's is lower.
+void
+schedlend(struct proc *p, int *lent)
+{
+  struct proc *me = myproc();
+
+  acquire(&ptable.lock);
+  if(p->state != ZOMBIE &&
+     schedrank(me->sclass, me->prio) > schedrank(p->sclass, p->prio)){
+    if(!*lent){
+      *lent = 1;
+      p->nlent++;
+    }
+    rqmove(p, me->sclass, me->prio);
+  }
+  release(&ptable.lock);
+}
+
+// p is releasing a sleeplock whose lent is *lent.
+void
+schedunlend(struct proc *p, int *lent)
+{
+  if(!*lent)
+    return;
+  acquire(&ptable.lock);
+  *lent = 0;
+  if(--p->nlent == 0){
+    p->sclass = p->bsclass;
+    p->prio = p->bprio;
+  }
+  release(&ptable.lock);
+}
+
+// Mark p and the other threads of its group killed, waking
+// those asleep; each exits the next time it would return to
+// user space.  The last to be freed frees the address space.
+// Caller must hold ptable.lock.
+static void
+killgroup(struct proc *p)
+{
+  struct proc *q;
+
+  q = p;
+  do {
+    if(q->state != ZOMBIE){
+      q->killed = 1;
+      // Wake process from sleep if necessary.
+      if(q->state == SLEEPING){
+        sqremove(q);
+        makerunnable(q);
+      }
+    }
+    q = q->tgnext;
+  } while(q != p);
+}
+
+// Kill the process with the given pid, and its threads.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
 int
@@ -735,18 +2174,24 @@ kill(int pid)
   struct proc *p;
 
   acquire(&ptable.lock);
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->pid == pid){
-      p->killed = 1;
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
-      release(&ptable.lock);
-      return 0;
-    }
+  if((p = pidlookup(pid)) == 0){
+    release(&ptable.lock);
+    return -1;
   }
+  killgroup(p);
+  release(&ptable.lock);
+  return 0;
+}
+
+// Kill the caller's whole thread group, itself included.
+// Does not return.
+void
+exitgroup(void)
+{
+  acquire(&ptable.lock);
+  killgroup(myproc());
   release(&ptable.lock);
-  return -1;
+  exit();
 }
 
 //PAGEBREAK: 36
@@ -769,7 +2214,7 @@ procdump(void)
   char *state;
   uint pc[10];
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+  for(p = ptable.all; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -1,14 +1,34 @@
 // Per-CPU state
 struct cpu {
+  struct cpu *self;            // This struct, read through %fs by mycpu()
   uchar apicid;                // Local APIC ID
+  uchar node;                  // NUMA node (acpi.c)
   struct context *scheduler;   // swtch() here to enter scheduler
   struct taskstate ts;         // Used by x86 to find stack for interrupt
   struct segdesc gdt[NSEGS];   // x86 global descriptor table
   volatile uint started;       // Has the CPU started?
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
+  uint64 clitsc;               // rdtsc at the outermost pushcli
+  uint clipcs[10];             // Its call stack, with LOCKSTAT
+  uint clilong;                // Sections with interrupts off over CLIMAX
+  uint64 climax;               // The longest, in cycles,
+  uint climaxpcs[10];          // and where it began
   struct proc *proc;           // The process running on this cpu or null
-};
+  struct proc *handoff;        // To run next, ahead of rq (see sleepto())
+  struct runq *rq;             // RUNNABLE processes waiting for this cpu
+  pde_t *pgdir;                // Page table loaded by switchuvm, or 0
+  volatile int idle;           // Halted in scheduler(): IDLE_*
+  uint64 idlecycles;           // rdtsc cycles spent halted
+  struct proc *fpu;            // Whose FPU registers it has, or 0 (fpu.c)
+  uint64 pmclast[NPMC];        // Performance counters at the last switch
+  uint64 pmc[NPMC];            // and events since boot (pmc.c)
+  struct taskstate dfts;       // The double fault task (see dfault())
+  uchar dfstack[2048];         // and its stack
+} __attribute__((aligned(CACHELINE)));  // cpus write their own all the time
+
+#define IDLE_HLT   1  // in hlt: IRQ_WAKE wakes it
+#define IDLE_MWAIT 2  // in mwait on rq->len: queueing work wakes it
 
 extern struct cpu cpus[NCPU];
 extern int ncpu;
@@ -36,8 +56,9 @@ enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
-  uint sz;                     // Size of process memory (bytes)
-  pde_t* pgdir;                // Page table
+  uchar fpu[512] __attribute__((aligned(16)));  // FPU and SSE registers, by fxsave
+  int fpuused;                 // fpu holds the process's registers
+  struct mm *mm;               // Address space (see mm.h)
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
@@ -46,16 +67,53 @@ struct proc {
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct fdtable *files;       // Open files (see file.h)
+  struct cwd *cwd;             // Current directory
   char name[16];               // Process name (debugging)
+  struct proc *rqnext;         // Next process on the same run queue
+  int rqcpu;                   // Index of the cpu whose run queue p uses
+  int sclass;                  // Scheduling class, SCHED_ in sched.h
+  int prio;                    // Priority within the class
+  int bsclass;                 // sclass and prio as set, before any
+  int bprio;                   // lent by sleeplock waiters
+  int nlent;                   // Sleeplocks held that were lent one
+  struct rusage ru;            // Resources used (see rusage.h)
+  struct rusage cru;           // Used by the children it has waited for
+  uint64 runstart;             // rdtsc when ru's utime or stime last grew
+  struct proc *sqnext;         // Next process in the same sleep queue bucket
+  struct proc *allnext;        // Next proc struct in ptable.all
+  struct proc *freenext;       // Next UNUSED proc on a ptable.free list
+  struct proc *pidnext;        // Next process in the same pid hash bucket
+  struct proc *children;       // First child process
+  struct proc *threads;        // First child thread
+  struct proc *sibling;        // Next child on the same list
+  struct proc **sibprev;       // Link that points at this proc in that list
+  int lognew;                  // Blocks this FS call has added to the log
+  int sysarg[NSYSARG];         // This system call's arguments, for argint()
+  int nsysarg;                 // and how many of them the stack holds
 
   // Fields added for Assignment 2: Kernel Threads
   int is_thread;               // 1 if this is a thread, 0 if a full process
   void *user_stack;            // Pointer to the base of the user stack allocated by thread_create
+  uint tls;                    // Base of the SEG_UTLS segment (CLONE_SETTLS)
                                // and passed to clone. Used by join() to return to user-level.
+  int vfork;                   // Parent sleeps in vfork() until this is 0
+  int tgid;                    // Pid of the process whose threads these are
+  struct proc *tgnext;         // Ring of the procs with the same tgid
+  struct proc *tgprev;
+  int ipcstate;                // IPC_ while blocked in IPC, else 0
+  int ipcret;                  // Its result, set by whoever ends it
+  struct proc *ipcpeer;        // Server called, in IPC_SEND or IPC_REPLY
+  struct proc *ipcsend;        // Clients in IPC_SEND on this server, FIFO
+  struct proc *ipcnext;        // Next of them
+  int ipcclients;              // Procs with this as ipcpeer
 };
 
+// IPC states (see ipccall())
+#define IPC_RECV  1  // server waiting for a call
+#define IPC_SEND  2  // client queued, its message not taken yet
+#define IPC_REPLY 3  // client waiting for the reply
+
 // Process memory is laid out contiguously, low addresses first:
 //   text
 //   original data and bss
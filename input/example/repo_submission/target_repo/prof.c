@@ -0,0 +1,114 @@
+// Sampling profiler.
+//
+// While it is on, every profevery-th timer interrupt on each
+// cpu records where it came in, and which process in which
+// mode it interrupted, in that cpu's ring.  Reading the PROF
+// device (/dev/prof) takes the samples, as struct profsample;
+// writing a number to it starts sampling every that many
+// ticks, and 0 stops it.  Samples that find the ring full are
+// dropped and counted.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "prof.h"
+
+#define NPROFSAMPLE 256  // samples each cpu keeps
+
+struct {
+  struct spinlock lock;
+  int every;           // sample every this many ticks; 0: off
+  uint dropped;
+  struct {
+    uint ticks;
+    uint head, tail;   // samples [tail, head) are unread
+    struct profsample s[NPROFSAMPLE];
+  } __attribute__((aligned(CACHELINE))) cpu[NCPU];
+} prof;
+
+// Called by the timer interrupt.
+void
+profsample(struct trapframe *tf)
+{
+  struct proc *p;
+  struct profsample *s;
+  int c;
+
+  if(prof.every == 0)
+    return;
+  c = cpuid();
+  if(++prof.cpu[c].ticks % prof.every)
+    return;
+  p = myproc();
+  acquire(&prof.lock);
+  if(prof.cpu[c].head - prof.cpu[c].tail == NPROFSAMPLE)
+    prof.dropped++;
+  else {
+    s = &prof.cpu[c].s[prof.cpu[c].head++ % NPROFSAMPLE];
+    s->eip = tf->eip;
+    s->user = (tf->cs & 3) == DPL_USER;
+    s->pid = p ? p->pid : 0;
+    safestrcpy(s->name, p ? p->name : "-", sizeof(s->name));
+  }
+  release(&prof.lock);
+}
+
+// Read as many whole samples as fit in n bytes.
+static int
+profread(struct inode *ip, char *dst, int n)
+{
+  int c, i;
+
+  i = 0;
+  acquire(&prof.lock);
+  for(c = 0; c < ncpu; c++){
+    while(prof.cpu[c].tail != prof.cpu[c].head &&
+          (i+1) * sizeof(struct profsample) <= n){
+      memmove(dst + i*sizeof(struct profsample),
+              &prof.cpu[c].s[prof.cpu[c].tail++ % NPROFSAMPLE],
+              sizeof(struct profsample));
+      i++;
+    }
+  }
+  release(&prof.lock);
+  return i * sizeof(struct profsample);
+}
+
+// Start sampling every n ticks, n written in decimal; stop
+// at 0.  Starting throws away the samples not yet read.
+static int
+profwrite(struct inode *ip, char *src, int n)
+{
+  int i, every, c;
+
+  every = 0;
+  for(i = 0; i < n && src[i] >= '0' && src[i] <= '9'; i++)
+    every = every*10 + src[i] - '0';
+  acquire(&prof.lock);
+  if(every && !prof.every){
+    for(c = 0; c < NCPU; c++)
+      prof.cpu[c].head = prof.cpu[c].tail = 0;
+    if(prof.dropped)
+      cprintf("prof: %d samples dropped\n", prof.dropped);
+    prof.dropped = 0;
+  }
+  prof.every = every;
+  release(&prof.lock);
+  return n;
+}
+
+void
+profinit(void)
+{
+  initlock(&prof.lock, "prof");
+  devsw[PROF].read = profread;
+  devsw[PROF].write = profwrite;
+}
@@ -0,0 +1,7 @@
+// A sample of the sampling profiler, as read from /dev/prof.
+struct profsample {
+  uint eip;          // where the timer interrupt came in
+  int pid;           // of the process it interrupted, 0 if none
+  int user;          // it was in user mode
+  char name[16];     // the process's name
+};
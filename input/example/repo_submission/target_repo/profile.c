@@ -0,0 +1,40 @@
+// profile: drive the sampling profiler.
+//   profile n   sample every n ticks (0 stops)
+//   profile     print the samples taken so far, one per line,
+//               for profsym.pl to resolve on the host:
+//               prof <name> <k|u> <eip in hex>
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "prof.h"
+
+struct profsample s[32];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, i;
+
+  if(argc > 2){
+    printf(2, "usage: profile [every]\n");
+    exit();
+  }
+  if((fd = open("dev/prof", argc == 2 ? O_WRONLY : O_RDONLY)) < 0){
+    printf(2, "profile: cannot open dev/prof\n");
+    exit();
+  }
+  if(argc == 2){
+    if(write(fd, argv[1], strlen(argv[1])) < 0)
+      printf(2, "profile: write failed\n");
+    close(fd);
+    exit();
+  }
+  while((n = read(fd, (char*)s, sizeof(s))) > 0){
+    for(i = 0; i < n / sizeof(s[0]); i++)
+      printf(1, "prof %s %s %x\n", s[i].name, s[i].user ? "u" : "k", s[i].eip);
+  }
+  close(fd);
+  exit();
+}
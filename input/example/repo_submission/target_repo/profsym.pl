@@ -0,0 +1,54 @@
+#!/usr/bin/perl -w
+
+# Resolve the samples "profile" prints in xv6 (captured from
+# the console, e.g. with make qemu-nox | tee log) against
+# kernel.sym and the user programs' <name>.sym, and print the
+# functions by number of samples.
+#
+#   ./profsym.pl log
+
+use strict;
+
+my %syms;    # file => [ [addr, name], ... ] sorted by addr
+
+sub loadsyms {
+    my ($file) = @_;
+    return $syms{$file} if exists $syms{$file};
+    my @s;
+    if (open(my $f, '<', $file)) {
+        while (<$f>) {
+            push @s, [hex($1), $2] if /^([0-9a-f]+) (\S+)$/;
+        }
+        close($f);
+    }
+    @s = sort { $a->[0] <=> $b->[0] } @s;
+    return $syms{$file} = \@s;
+}
+
+# The name of the last symbol at or below addr.
+sub lookup {
+    my ($s, $addr) = @_;
+    my ($lo, $hi) = (0, scalar(@$s) - 1);
+    return undef if $hi < 0 || $addr < $s->[0][0];
+    while ($lo < $hi) {
+        my $mid = int(($lo + $hi + 1) / 2);
+        if ($s->[$mid][0] <= $addr) { $lo = $mid; } else { $hi = $mid - 1; }
+    }
+    return $s->[$lo][1];
+}
+
+my (%count, $total);
+while (<>) {
+    next unless /^prof (\S+) ([ku]) ([0-9a-f]+)\s*$/;
+    my ($prog, $mode, $eip) = ($1, $2, hex($3));
+    my $file = $mode eq 'k' ? 'kernel.sym' : "$prog.sym";
+    my $name = lookup(loadsyms($file), $eip);
+    $name = sprintf("0x%x", $eip) unless defined $name;
+    $name = "$prog:$name" if $mode eq 'u';
+    $count{$name}++;
+    $total++;
+}
+exit 0 unless $total;
+foreach my $name (sort { $count{$b} <=> $count{$a} } keys %count) {
+    printf("%6d %5.1f%% %s\n", $count{$name}, 100 * $count{$name} / $total, $name);
+}
@@ -0,0 +1,39 @@
+// ps: list the processes and threads, with what each has used:
+// user and system time in milliseconds, voluntary and
+// involuntary context switches, page faults, and disk blocks
+// read and written.  With -g, totals for each thread group.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "rusage.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct rusage ru;
+  int pid, last, who;
+  uint perms;
+
+  who = RUSAGE_THREAD;
+  if(argc == 2 && strcmp(argv[1], "-g") == 0)
+    who = RUSAGE_SELF;
+  else if(argc > 1){
+    printf(2, "usage: ps [-g]\n");
+    exit();
+  }
+  // A tick is 10ms; without a TSC rate, show kilocycles.
+  if((perms = vtscpertick() / 10) == 0)
+    perms = 1000;
+  // Pids are handed out in order and never reused.
+  last = getpid();
+  printf(1, "pid\tname\tuser\tsys\tvcsw\tivcsw\tflt\tin\tout\n");
+  for(pid = 1; pid <= last; pid++){
+    if(getrusage(pid, who, &ru) < 0)
+      continue;
+    printf(1, "%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", pid, ru.name,
+           udiv64(ru.utime, perms), udiv64(ru.stime, perms),
+           ru.nvcsw, ru.nivcsw, ru.minflt, ru.inblock, ru.oublock);
+  }
+  exit();
+}
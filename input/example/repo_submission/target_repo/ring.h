@@ -0,0 +1,9 @@
+// A system call for ringenter() to make: op is its number from
+// syscall.h, arg[] its arguments, and res gets its result.
+struct ringop {
+  int op;
+  int arg[4];
+  int res;
+};
+
+#define RING_MAX 64  // most ops one ringenter() takes
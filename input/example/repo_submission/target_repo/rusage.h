@@ -0,0 +1,23 @@
+// Hardware events counted in pmc[], and by perfctr() per cpu.
+#define PMC_CYCLES  0  // unhalted core cycles
+#define PMC_INSTR   1  // instructions retired
+#define PMC_LLCMISS 2  // last-level cache misses
+#define PMC_BRMISS  3  // mispredicted branches retired
+#define NPMC        4
+
+// Resource usage, from getrusage().
+struct rusage {
+  uint64 utime;      // rdtsc cycles spent running in user space
+  uint64 stime;      // rdtsc cycles spent running in the kernel
+  uint nvcsw;        // voluntary context switches (sleeps)
+  uint nivcsw;       // involuntary ones (preempted by the tick)
+  uint minflt;       // page faults handled
+  uint inblock;      // disk blocks read
+  uint oublock;      // disk blocks written
+  uint64 pmc[NPMC];  // hardware events, PMC_ above (pmc.c)
+  char name[16];     // name of the process asked about
+};
+
+#define RUSAGE_SELF     0  // the thread group: its threads, live and reaped
+#define RUSAGE_CHILDREN 1  // children waited for, and their waited-for children
+#define RUSAGE_THREAD   2  // the one process or thread
@@ -0,0 +1,4 @@
+// Scheduling classes, for setpriority().
+#define SCHED_FIFO 0  // real time: prio 1..99, highest first, not time sliced
+#define SCHED_FAIR 1  // fair share between processes: prio is nice, -20..19
+#define NSCHED     2
@@ -53,6 +53,17 @@ int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
 
+// Background jobs: the commands of a line that end in &, which
+// the shell runs itself so that it can wait for them.  A slot is
+// free once its job has been reaped and reported.
+#define NJOB 16
+
+struct job {
+  int pid;          // 0 if the slot is free
+  int done;         // reaped, not yet reported
+  char line[100];   // the line it came from
+} jobs[NJOB];
+
 // Execute cmd.  Never returns.
 void
 runcmd(struct cmd *cmd)
@@ -141,10 +152,216 @@ getcmd(char *buf, int nbuf)
   return 0;
 }
 
+// Note that background job pid has been reaped.
+void
+jobreaped(int pid)
+{
+  struct job *j;
+
+  for(j = jobs; j < jobs+NJOB; j++)
+    if(j->pid == pid)
+      j->done = 1;
+}
+
+// Report and forget the jobs that have finished.
+void
+jobreport(void)
+{
+  struct job *j;
+
+  for(j = jobs; j < jobs+NJOB; j++){
+    if(j->pid && j->done){
+      printf(2, "[%d] done %s\n", (int)(j - jobs) + 1, j->line);
+      j->pid = 0;
+    }
+  }
+}
+
+// Wait for process pid, or with pid 0 for every background
+// job, noting the jobs reaped meanwhile.
+void
+waitfor(int pid)
+{
+  struct job *j;
+  int w;
+
+  for(;;){
+    if(pid == 0){
+      for(j = jobs; j < jobs+NJOB && (j->pid == 0 || j->done); j++)
+        ;
+      if(j == jobs+NJOB)
+        return;
+    }
+    if((w = wait()) < 0 || w == pid)
+      return;
+    jobreaped(w);
+  }
+}
+
+// Builtins: simple commands the shell runs itself, saving a
+// fork and an exec.  Each does what the program of that name
+// does, with in and out for its standard input and output.  A
+// path, as in "/cat", runs the program instead.
+char catbuf[8192];
+
+void
+bicat(int fd, int out)
+{
+  int n;
+
+  // Let the kernel move the data.
+  if((n = splice(fd, out, sizeof(catbuf))) >= 0){
+    while(n > 0)
+      n = splice(fd, out, sizeof(catbuf));
+    if(n < 0)
+      printf(out, "cat: splice error\n");
+    return;
+  }
+  while((n = read(fd, catbuf, sizeof(catbuf))) > 0)
+    if(write(out, catbuf, n) != n){
+      printf(out, "cat: write error\n");
+      return;
+    }
+  if(n < 0)
+    printf(out, "cat: read error\n");
+}
+
+void
+biecho(char **argv, int in, int out)
+{
+  int i;
+
+  for(i = 1; argv[i]; i++)
+    printf(out, "%s%s", argv[i], argv[i+1] ? " " : "\n");
+}
+
+void
+bicatfiles(char **argv, int in, int out)
+{
+  int fd, i;
+
+  if(argv[1] == 0)
+    bicat(in, out);
+  for(i = 1; argv[i]; i++){
+    if((fd = open(argv[i], 0)) < 0){
+      printf(out, "cat: cannot open %s\n", argv[i]);
+      return;
+    }
+    bicat(fd, out);
+    close(fd);
+  }
+}
+
+struct {
+  char *name;
+  void (*fn)(char**, int, int);
+} builtins[] = {
+  { "echo", biecho },
+  { "cat",  bicatfiles },
+};
+#define NBUILTIN ((int)(sizeof(builtins) / sizeof(builtins[0])))
+
+// Run cmd here if it is a builtin, perhaps with redirections,
+// and return 1; otherwise return 0.
+int
+runbuiltin(struct cmd *cmd)
+{
+  struct redircmd *rcmd;
+  struct execcmd *ecmd;
+  struct cmd *c;
+  int i, fd, in, out;
+
+  for(c = cmd; c->type == REDIR; c = ((struct redircmd*)c)->cmd)
+    ;
+  if(c->type != EXEC)
+    return 0;
+  ecmd = (struct execcmd*)c;
+  for(i = 0; i < NBUILTIN; i++)
+    if(ecmd->argv[0] && strcmp(ecmd->argv[0], builtins[i].name) == 0)
+      break;
+  if(i == NBUILTIN)
+    return 0;
+
+  // Open the files in the order runcmd() would, the innermost
+  // redirection of each fd winning.
+  in = 0;
+  out = 1;
+  for(c = cmd; c->type == REDIR; c = rcmd->cmd){
+    rcmd = (struct redircmd*)c;
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      printf(2, "open %s failed\n", rcmd->file);
+      break;
+    }
+    if(rcmd->fd == 0){
+      if(in != 0)
+        close(in);
+      in = fd;
+    } else {
+      if(out != 1)
+        close(out);
+      out = fd;
+    }
+  }
+  if(c->type == EXEC)
+    builtins[i].fn(ecmd->argv, in, out);
+  if(in != 0)
+    close(in);
+  if(out != 1)
+    close(out);
+  return 1;
+}
+
+// Run a parsed line.  Its background commands become jobs,
+// started by the shell; a list runs from left to right here, so
+// that those in it do too.  Anything else runs in a child, which
+// the shell waits for.
+void
+runline(struct cmd *cmd, char *line)
+{
+  struct listcmd *lcmd;
+  struct job *j;
+  int pid;
+
+  if(cmd && cmd->type == LIST){
+    lcmd = (struct listcmd*)cmd;
+    runline(lcmd->left, line);
+    runline(lcmd->right, line);
+    return;
+  }
+  if(cmd && cmd->type == BACK){
+    if((pid = fork1()) == 0)
+      runcmd(((struct backcmd*)cmd)->cmd);
+    for(j = jobs; j < jobs+NJOB && j->pid; j++)
+      ;
+    if(j == jobs+NJOB){
+      printf(2, "%d: too many jobs to track\n", pid);
+      return;
+    }
+    j->pid = pid;
+    j->done = 0;
+    strcpy(j->line, line);
+    printf(2, "[%d] %d\n", (int)(j - jobs) + 1, pid);
+    return;
+  }
+  if(cmd && runbuiltin(cmd))
+    return;
+  // The child only runs cmd, which this process waits for
+  // anyway, so it can borrow the shell's memory rather than
+  // copy it.  A simple command execs at once; others fork as
+  // they go.
+  if((pid = vfork()) == 0)
+    runcmd(cmd);
+  if(pid < 0)
+    panic("fork");
+  waitfor(pid);
+}
+
 int
 main(void)
 {
-  static char buf[100];
+  static char buf[100], line[100];
+  struct cmd *cmd;
+  struct job *j;
   int fd;
 
   // Ensure that three file descriptors are open.
@@ -156,7 +373,10 @@ main(void)
   }
 
   // Read and run input commands.
-  while(getcmd(buf, sizeof(buf)) >= 0){
+  for(;;){
+    jobreport();
+    if(getcmd(buf, sizeof(buf)) < 0)
+      break;
     if(buf[0] == 'c' && buf[1] == 'd' && buf[2] == ' '){
       // Chdir must be called by the parent, not the child.
       buf[strlen(buf)-1] = 0;  // chop \n
@@ -164,9 +384,20 @@ main(void)
         printf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait();
+    if(strcmp(buf, "jobs\n") == 0){
+      for(j = jobs; j < jobs+NJOB; j++)
+        if(j->pid && !j->done)
+          printf(1, "[%d] %d %s\n", (int)(j - jobs) + 1, j->pid, j->line);
+      continue;
+    }
+    if(strcmp(buf, "wait\n") == 0){
+      waitfor(0);
+      continue;
+    }
+    strcpy(line, buf);
+    line[strlen(line)-1] = 0;  // chop \n
+    if((cmd = parsecmd(buf)) != 0)
+      runline(cmd, line);
   }
   exit();
 }
@@ -192,12 +423,16 @@ fork1(void)
 //PAGEBREAK!
 // Constructors
 
+// Each command line's nodes come from one arena, emptied
+// at once before the next line is parsed.
+struct arena *cmdarena;
+
 struct cmd*
 execcmd(void)
 {
   struct execcmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = arena_alloc(cmdarena, sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = EXEC;
   return (struct cmd*)cmd;
@@ -208,7 +443,7 @@ redircmd(struct cmd *subcmd, char *file, char *efile, int mode, int fd)
 {
   struct redircmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = arena_alloc(cmdarena, sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = REDIR;
   cmd->cmd = subcmd;
@@ -224,7 +459,7 @@ pipecmd(struct cmd *left, struct cmd *right)
 {
   struct pipecmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = arena_alloc(cmdarena, sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = PIPE;
   cmd->left = left;
@@ -237,7 +472,7 @@ listcmd(struct cmd *left, struct cmd *right)
 {
   struct listcmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = arena_alloc(cmdarena, sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = LIST;
   cmd->left = left;
@@ -250,7 +485,7 @@ backcmd(struct cmd *subcmd)
 {
   struct backcmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = arena_alloc(cmdarena, sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = BACK;
   cmd->cmd = subcmd;
@@ -324,18 +559,39 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// The first syntax error in the line being parsed, or 0.
+// Parsing carries on after one, so that the shell survives it.
+char *synerr;
+
+void
+syntax(char *msg)
+{
+  if(synerr == 0)
+    synerr = msg;
+}
+
+// Parse the line s, or print why not and return 0.
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  if(cmdarena)
+    arena_reset(cmdarena);
+  else if((cmdarena = arena_create()) == 0)
+    panic("arena");
+  synerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
   if(s != es){
     printf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(synerr){
+    printf(2, "%s\n", synerr);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -379,8 +635,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -405,8 +663,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -431,13 +691,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc + 1 >= MAXARGS){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -0,0 +1,157 @@
+// Shared memory segments.
+//
+// shmopen(key, size) finds the segment called key, or makes
+// one of size bytes of zeroed pages, and returns its id.
+// shmattach(id) maps all of it into the caller with
+// mmapshared(), as one region that munmap() removes and fork()
+// children share.  shmunlink(key) removes the segment.
+//
+// A segment holds a reference to each of its pages, and each
+// mapping of a page another, so a removed segment's memory
+// lives on until the last process using it unmaps it.
+//
+// shm.lock protects the table.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "meminfo.h"
+
+#define SHMMAXPG (PGSIZE/sizeof(char*))  // pages in a segment, at most
+
+struct shmseg {
+  int key;
+  uint npages;          // 0 if the slot is free
+  char **pages;         // a page of pointers to the pages
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shm;
+
+void
+shminit(void)
+{
+  initlock(&shm.lock, "shm");
+}
+
+// Free a segment's pages and page list.
+static void
+shmfree(char **pages, uint n)
+{
+  uint i;
+
+  for(i = 0; i < n; i++)
+    kfree(pages[i]);
+  kfree((char*)pages);
+}
+
+// Caller holds shm.lock.
+static struct shmseg*
+shmlookup(int key)
+{
+  struct shmseg *s;
+
+  for(s = shm.seg; s < &shm.seg[NSHM]; s++)
+    if(s->npages && s->key == key)
+      return s;
+  return 0;
+}
+
+// The id of segment key, made with size bytes if there is
+// none yet.  Returns -1 if there is none and size is 0, or if
+// the segment that exists is smaller than size.
+int
+shmopen(int key, uint size)
+{
+  struct shmseg *s;
+  char **pages;
+  uint n, i;
+  int id;
+
+  n = PGROUNDUP(size) / PGSIZE;
+  if(size > SHMMAXPG*PGSIZE)
+    return -1;
+  acquire(&shm.lock);
+  if((s = shmlookup(key)) != 0){
+    id = s->npages >= n ? s - shm.seg : -1;
+    release(&shm.lock);
+    return id;
+  }
+  release(&shm.lock);
+  if(n == 0)
+    return -1;
+
+  // Allocate the pages without the lock, then look again.
+  if((pages = (char**)kalloc(KM_KERN)) == 0)
+    return -1;
+  for(i = 0; i < n; i++){
+    if((pages[i] = kzalloc(KM_USER)) == 0){
+      shmfree(pages, i);
+      return -1;
+    }
+  }
+  acquire(&shm.lock);
+  if((s = shmlookup(key)) != 0){
+    id = s->npages >= n ? s - shm.seg : -1;
+    release(&shm.lock);
+    shmfree(pages, n);
+    return id;
+  }
+  for(s = shm.seg; s < &shm.seg[NSHM] && s->npages; s++)
+    ;
+  if(s == &shm.seg[NSHM]){
+    release(&shm.lock);
+    shmfree(pages, n);
+    return -1;
+  }
+  s->key = key;
+  s->npages = n;
+  s->pages = pages;
+  release(&shm.lock);
+  return s - shm.seg;
+}
+
+// Map segment id into the current process.  Returns the
+// address, or -1.
+int
+shmattach(int id)
+{
+  struct shmseg *s;
+  int va;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  acquire(&shm.lock);
+  s = &shm.seg[id];
+  va = s->npages ? mmapshared(myproc()->mm, s->pages, s->npages) : -1;
+  release(&shm.lock);
+  return va;
+}
+
+// Remove segment key.  Processes that have it mapped keep it.
+int
+shmunlink(int key)
+{
+  struct shmseg *s;
+  char **pages;
+  uint n;
+
+  acquire(&shm.lock);
+  if((s = shmlookup(key)) == 0){
+    release(&shm.lock);
+    return -1;
+  }
+  pages = s->pages;
+  n = s->npages;
+  s->npages = 0;
+  s->pages = 0;
+  release(&shm.lock);
+  shmfree(pages, n);
+  return 0;
+}
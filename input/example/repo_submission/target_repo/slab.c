@@ -0,0 +1,132 @@
+// Object caches for kernel structures.
+//
+// A kmcache hands out objects of one size, carved from whole
+// kalloc()'d pages (slabs) as it needs them, each at the start
+// of its own cache lines.  The ctor runs once per object, when
+// its slab is carved; objects come back from slabfree() in the
+// state they were freed in, so a structure can keep its locks
+// and other constructed state from one use to the next.  Slabs
+// are never given back, since initialized locks must not be
+// freed (see initlock()).
+//
+// Like kalloc(), each cpu keeps a few free objects of every
+// cache, so most slaballoc()s and slabfree()s take no lock; it
+// trades them with the cache's list KMBATCH at a time.  A free
+// object's link lives in its last word, past size, leaving
+// the object itself alone.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "meminfo.h"
+
+#define KMCPUMAX 16
+#define KMBATCH   8
+
+#define KMLINK(c, o) (*(void**)((char*)(o) + (c)->slot - sizeof(void*)))
+
+// Set c up to hand out objects of size bytes, running ctor
+// (if not 0) on each one when it is first carved.
+void
+kmcacheinit(struct kmcache *c, char *name, uint size, void (*ctor)(void*))
+{
+  int i;
+
+  c->slot = (size + sizeof(void*) + CACHELINE-1) & ~(CACHELINE-1);
+  if(c->slot > PGSIZE)
+    panic("kmcacheinit");
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->ctor = ctor;
+  c->free = 0;
+  for(i = 0; i < NCPU; i++){
+    c->cpu[i].free = 0;
+    c->cpu[i].n = 0;
+  }
+}
+
+// Carve a new slab into c's free list.  Returns 0 if out of
+// memory.  Caller must not hold c->lock: ctors may take locks.
+static int
+kmgrow(struct kmcache *c)
+{
+  char *mem, *o;
+  void *head, **tail;
+
+  if((mem = kalloc(KM_SLAB)) == 0)
+    return 0;
+  head = 0;
+  tail = &head;
+  for(o = mem; o + c->slot <= mem + PGSIZE; o += c->slot){
+    if(c->ctor)
+      c->ctor(o);
+    *tail = o;
+    tail = &KMLINK(c, o);
+  }
+  acquire(&c->lock);
+  *tail = c->free;
+  c->free = head;
+  release(&c->lock);
+  return 1;
+}
+
+// Allocate an object from c.  Returns 0 if out of memory.
+void*
+slaballoc(struct kmcache *c)
+{
+  struct kmcpu *kc;
+  void *o;
+  int i;
+
+  pushcli();
+  kc = &c->cpu[cpuid()];
+  if(kc->free == 0){
+    acquire(&c->lock);
+    for(i = 0; i < KMBATCH && (o = c->free) != 0; i++){
+      c->free = KMLINK(c, o);
+      KMLINK(c, o) = kc->free;
+      kc->free = o;
+      kc->n++;
+    }
+    release(&c->lock);
+  }
+  if((o = kc->free) != 0){
+    kc->free = KMLINK(c, o);
+    kc->n--;
+  }
+  popcli();
+  if(o == 0 && kmgrow(c))
+    return slaballoc(c);
+  return o;
+}
+
+// Give object o back to c.
+void
+slabfree(struct kmcache *c, void *o)
+{
+  struct kmcpu *kc;
+  void *head, *tail;
+  int i;
+
+  pushcli();
+  kc = &c->cpu[cpuid()];
+  KMLINK(c, o) = kc->free;
+  kc->free = o;
+  if(++kc->n > KMCPUMAX){
+    head = tail = kc->free;
+    for(i = 1; i < KMBATCH; i++)
+      tail = KMLINK(c, tail);
+    kc->free = KMLINK(c, tail);
+    kc->n -= KMBATCH;
+    acquire(&c->lock);
+    KMLINK(c, tail) = c->free;
+    c->free = head;
+    release(&c->lock);
+  }
+  popcli();
+}
@@ -0,0 +1,15 @@
+// An object cache (see slab.c).
+struct kmcpu {
+  void *free;        // this cpu's free objects
+  int n;
+} __attribute__((aligned(CACHELINE)));
+
+struct kmcache {
+  struct spinlock lock;  // protects free
+  char *name;
+  uint size;         // bytes asked for
+  uint slot;         // bytes each object takes, a multiple of CACHELINE
+  void (*ctor)(void*);
+  void *free;        // free objects not in a cpu's cache
+  struct kmcpu cpu[NCPU];
+};
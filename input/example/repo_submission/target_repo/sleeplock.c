@@ -6,6 +6,7 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
@@ -17,27 +18,149 @@ initsleeplock(struct sleeplock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
+  lk->nsleep = 0;
+  lk->readers = 0;
+  lk->wwait = 0;
+  lk->lent = 0;
+  lockstatreg(lk);
+}
+
+// The holder of lk may be about to let go.  While it is
+// running, on another cpu, spin up to SLEEPSPIN times waiting
+// for it, with lk->lk released so that it can.  Returns with
+// lk->lk held again.  Proc structs are never freed, so owner
+// can be looked at without a lock; a stale look only costs a
+// sleep or some spinning.
+static void
+spinsleep(struct sleeplock *lk)
+{
+  struct proc *o;
+  int i;
+
+  if((o = lk->owner) == 0 || o->state != RUNNING)
+    return;
+  release(&lk->lk);
+  for(i = 0; i < SLEEPSPIN && lk->locked && lk->owner == o &&
+      o->state == RUNNING; i++)
+    asm volatile("pause" ::: "memory");
+  acquire(&lk->lk);
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+#if LOCKSTAT
+  uint64 t0 = rdtsc();
+  int contended;
+#endif
+
   acquire(&lk->lk);
-  while (lk->locked) {
+#if LOCKSTAT
+  contended = lk->locked || lk->readers;
+#endif
+  if(lk->locked)
+    spinsleep(lk);
+  while (lk->locked || lk->readers) {
+    if(lk->owner)
+      schedlend(lk->owner, &lk->lent);
+    lk->nsleep++;
+    lk->wwait++;
     sleep(lk, &lk->lk);
+    lk->wwait--;
+    lk->nsleep--;
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->owner = myproc();
+#if LOCKSTAT
+  lockstatacquired(&lk->stat, lk->name, contended, t0,
+                   (uint)__builtin_return_address(0));
+#endif
+  release(&lk->lk);
+}
+
+// Take lk only if nobody holds it.  Returns 1 if it did.
+int
+tryacquiresleep(struct sleeplock *lk)
+{
+#if LOCKSTAT
+  uint64 t0 = rdtsc();
+#endif
+  int r;
+
+  acquire(&lk->lk);
+  r = !lk->locked && !lk->readers;
+  if(r){
+    lk->locked = 1;
+    lk->pid = myproc()->pid;
+    lk->owner = myproc();
+#if LOCKSTAT
+    lockstatacquired(&lk->stat, lk->name, 0, t0,
+                     (uint)__builtin_return_address(0));
+#endif
+  }
   release(&lk->lk);
+  return r;
 }
 
 void
 releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
+#if LOCKSTAT
+  lockstatreleased(&lk->stat);
+#endif
+  if(lk->owner)
+    schedunlend(lk->owner, &lk->lent);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  lk->owner = 0;
+  if(lk->nsleep)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Take lk in shared mode, alongside other readers but no
+// exclusive holder.  A waiting exclusive acquirer goes first,
+// so a stream of readers can't keep it out.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+#if LOCKSTAT
+  uint64 t0 = rdtsc();
+  int contended;
+#endif
+
+  acquire(&lk->lk);
+#if LOCKSTAT
+  contended = lk->locked || lk->wwait;
+#endif
+  if(lk->locked)
+    spinsleep(lk);
+  while(lk->locked || lk->wwait){
+    if(lk->owner)
+      schedlend(lk->owner, &lk->lent);
+    lk->nsleep++;
+    sleep(lk, &lk->lk);
+    lk->nsleep--;
+  }
+  lk->readers++;
+#if LOCKSTAT
+  lockstatacquired(&lk->stat, lk->name, contended, t0,
+                   (uint)__builtin_return_address(0));
+#endif
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepshared");
+  if(--lk->readers == 0 && lk->nsleep)
+    wakeup(lk);
   release(&lk->lk);
 }
 
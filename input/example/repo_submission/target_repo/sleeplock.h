@@ -2,9 +2,16 @@
 struct sleeplock {
   uint locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
-  
+  struct proc *owner; // Process holding lock, for acquiresleep() to watch
+  int nsleep;        // Processes asleep waiting for it
+  int readers;       // Holders in shared mode (locked is 0 then)
+  int wwait;         // Exclusive waiters, which new readers let go first
+  int lent;          // A waiter lent owner its priority (see schedlend())
+
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+  struct lockstat stat;
+  struct sleeplock *statnext; // Next lock on the lockstat list
 };
 
@@ -0,0 +1,17 @@
+// File actions for spawn(), applied in order in the child
+// before it execs.  Each makes fd refer to something else:
+// SPAWN_CLOSE just closes it, SPAWN_DUP makes it a copy of fd
+// arg, SPAWN_OPEN opens path with mode arg.  Like sh's
+// redirections, a new fd lands on the lowest one free, so the
+// fds below it must be open.  SPAWN_END ends the list.
+#define SPAWN_END   0
+#define SPAWN_CLOSE 1
+#define SPAWN_DUP   2
+#define SPAWN_OPEN  3
+
+struct spawnact {
+  int op;
+  int fd;
+  int arg;
+  char *path;
+};
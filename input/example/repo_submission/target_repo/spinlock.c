@@ -1,4 +1,10 @@
 // Mutual exclusion spin locks.
+//
+// A kernel built for one cpu (NCPU 1, make UP=1) has nothing
+// to spin for: with interrupts off, nothing else can run, so
+// acquire() and release() only turn them off and on and mark
+// the lock for holding().  There are no MCS queues, lock
+// statistics or call stacks then.
 
 #include "types.h"
 #include "defs.h"
@@ -6,15 +12,124 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+
+#if NCPU > 1
+// Queue nodes for MCS locks, a few per cpu because locks nest.
+// mcsused[c] has bit i set while mcsnodes[c][i] is in use.
+#define NMCSNODE 8
+static struct mcsnode mcsnodes[NCPU][NMCSNODE];
+static PERCPU(uint, mcsused);
+#endif
+
+// Every lock ever initialized, for lockstat().  Locks are
+// pushed without locking because initlock() runs before
+// acquire() can, and never leave the list, so the memory of
+// an initialized lock must not be freed.
+static struct spinlock *spinlocks;
+static struct sleeplock *sleeplocks;
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
+  lk->queued = 0;
+  lk->tail = 0;
+  lk->node = 0;
   lk->cpu = 0;
+  memset(&lk->stat, 0, sizeof(lk->stat));
+  do
+    lk->statnext = spinlocks;
+  while(cmpxchg((uint*)&spinlocks, (uint)lk->statnext, (uint)lk) != (uint)lk->statnext);
+}
+
+// Add sleeplock lk to the lockstat list.  Called by initsleeplock().
+void
+lockstatreg(struct sleeplock *lk)
+{
+  memset(&lk->stat, 0, sizeof(lk->stat));
+  do
+    lk->statnext = sleeplocks;
+  while(cmpxchg((uint*)&sleeplocks, (uint)lk->statnext, (uint)lk) != (uint)lk->statnext);
+}
+
+// Initialize lk as an MCS lock: waiters queue in FIFO order
+// and each spins on its own cache line, instead of all of
+// them hammering lk->locked.  Worth it for hot locks on
+// machines with many cpus; acquire() and release() are the
+// same for both kinds.
+void
+initlockq(struct spinlock *lk, char *name)
+{
+  initlock(lk, name);
+  lk->queued = 1;
+}
+
+#if NCPU > 1
+// Take a free queue node of this cpu.  Interrupts are off.
+static struct mcsnode*
+mcsget(void)
+{
+  int c, i;
+
+  c = mycpu() - cpus;
+  for(i = 0; i < NMCSNODE; i++){
+    if((percpuof(mcsused, c) & (1 << i)) == 0){
+      percpuof(mcsused, c) |= 1 << i;
+      return &mcsnodes[c][i];
+    }
+  }
+  panic("mcsget");
+}
+
+// Returns whether the lock had to be waited for.
+static int
+mcsacquire(struct spinlock *lk)
+{
+  struct mcsnode *n, *pred;
+
+  n = mcsget();
+  n->next = 0;
+  n->locked = 1;
+  __sync_synchronize();
+  pred = (struct mcsnode*)xchg((uint*)&lk->tail, (uint)n);
+  if(pred){
+    pred->next = n;
+    while(n->locked){
+      asm volatile("pause");
+      tlbpoll();
+    }
+  }
+  lk->node = n;
+  lk->locked = 1;
+  return pred != 0;
+}
+
+static void
+mcsrelease(struct spinlock *lk)
+{
+  struct mcsnode *n;
+  int c;
+
+  n = lk->node;
+  lk->node = 0;
+  lk->locked = 0;
+  if(n->next == 0){
+    // No known successor: try to empty the queue, else wait
+    // for the waiter that is linking itself in.
+    if(cmpxchg((uint*)&lk->tail, (uint)n, 0) == (uint)n)
+      goto done;
+    while(n->next == 0)
+      asm volatile("pause");
+  }
+  n->next->locked = 0;
+done:
+  c = mycpu() - cpus;
+  percpuof(mcsused, c) &= ~(1 << (n - mcsnodes[c]));
 }
 
 // Acquire the lock.
@@ -24,13 +139,29 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  int contended;
+#if LOCKSTAT
+  uint64 t0;
+#endif
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+#if LOCKSTAT
+  t0 = rdtsc();
+#endif
+  if(lk->queued)
+    contended = mcsacquire(lk);
+  else {
+    // The xchg is atomic.  Spinning cpus answer TLB
+    // shootdowns, since the holder may be waiting on one.
+    contended = 0;
+    while(xchg(&lk->locked, 1) != 0){
+      contended = 1;
+      tlbpoll();
+    }
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +171,9 @@ acquire(struct spinlock *lk)
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
   getcallerpcs(&lk, lk->pcs);
+#if LOCKSTAT
+  lockstatacquired(&lk->stat, lk->name, contended, t0, lk->pcs[0]);
+#endif
 }
 
 // Release the lock.
@@ -49,6 +183,9 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+#if LOCKSTAT
+  lockstatreleased(&lk->stat);
+#endif
   lk->pcs[0] = 0;
   lk->cpu = 0;
 
@@ -59,13 +196,39 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  if(lk->queued)
+    mcsrelease(lk);
+  else {
+    // Release the lock, equivalent to lk->locked = 0.
+    // This code can't use a C assignment, since it might
+    // not be atomic. A real OS would use C atomics here.
+    asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  }
+
+  popcli();
+}
+
+#else
+void
+acquire(struct spinlock *lk)
+{
+  pushcli();
+  if(lk->locked)
+    panic("acquire");
+  lk->locked = 1;
+  asm volatile("" ::: "memory");
+}
 
+void
+release(struct spinlock *lk)
+{
+  if(!lk->locked)
+    panic("release");
+  asm volatile("" ::: "memory");
+  lk->locked = 0;
   popcli();
 }
+#endif
 
 // Record the current call stack in pcs[] by following the %ebp chain.
 void
@@ -89,38 +252,272 @@ getcallerpcs(void *v, uint pcs[])
 int
 holding(struct spinlock *lock)
 {
+#if NCPU > 1
   int r;
   pushcli();
   r = lock->locked && lock->cpu == mycpu();
   popcli();
   return r;
+#else
+  return lock->locked;
+#endif
 }
 
 
 // Pushcli/popcli are like cli/sti except that they are matched:
 // it takes two popcli to undo two pushcli.  Also, if interrupts
 // are off, then pushcli, popcli leaves them off.
+//
+// The outermost pushcli notes the time, for needbreak(), and
+// with LOCKSTAT popcli records sections that turned interrupts
+// off for longer than CLIMAX cycles, for lockstat().
 
 void
 pushcli(void)
 {
+  struct cpu *c;
   int eflags;
 
   eflags = readeflags();
   cli();
-  if(mycpu()->ncli == 0)
-    mycpu()->intena = eflags & FL_IF;
-  mycpu()->ncli += 1;
+  c = mycpu();
+  if(c->ncli == 0){
+    c->intena = eflags & FL_IF;
+    c->clitsc = rdtsc();
+#if LOCKSTAT
+    getcallerpcs((uint*)__builtin_frame_address(0) + 2, c->clipcs);
+#endif
+  }
+  c->ncli += 1;
 }
 
+#if LOCKSTAT
+// Called by the outermost popcli().
+static void
+clicheck(struct cpu *c)
+{
+  uint64 t;
+
+  t = rdtsc() - c->clitsc;
+  if(t < CLIMAX)
+    return;
+  c->clilong++;
+  if(t > c->climax){
+    c->climax = t;
+    memmove(c->climaxpcs, c->clipcs, sizeof(c->clipcs));
+  }
+}
+#endif
+
 void
 popcli(void)
 {
+  struct cpu *c;
+
   if(readeflags()&FL_IF)
     panic("popcli - interruptible");
-  if(--mycpu()->ncli < 0)
+  c = mycpu();
+  if(--c->ncli < 0)
     panic("popcli");
-  if(mycpu()->ncli == 0 && mycpu()->intena)
+  if(c->ncli == 0 && c->intena){
+#if LOCKSTAT
+    clicheck(c);
+#endif
     sti();
+  }
+}
+
+// Whether the caller, holding one spinlock and nothing else
+// that turned interrupts off, has kept them off for LOCKBREAK
+// cycles.  Long loops under a lock check this, and release and
+// reacquire the lock when it says so, letting in the pending
+// interrupts: a timer tick then preempts the caller as it
+// would a process in user space.
+int
+needbreak(void)
+{
+  struct cpu *c;
+
+  c = mycpu();
+  return c->ncli == 1 && c->intena && rdtsc() - c->clitsc >= LOCKBREAK;
+}
+
+//PAGEBREAK!
+// Lock contention statistics.
+
+// Contended acquisitions by call site, so the worst callers
+// of a hot lock can be found.  Open addressing on pc; once
+// full, new sites are dropped.
+#define NLOCKSITE 128
+#define LOCKSITETOP 10
+static struct {
+  uint pc;
+  char *name;
+  uint n;
+  uint wait;         // Waiting cycles >> 10
+} locksites[NLOCKSITE];
+
+static void
+locksite(char *name, uint pc, uint64 wait)
+{
+  uint i, h;
+
+  h = (pc >> 2) % NLOCKSITE;
+  for(i = 0; i < NLOCKSITE; i++, h = (h + 1) % NLOCKSITE){
+    if(locksites[h].pc == 0)
+      cmpxchg(&locksites[h].pc, 0, pc);  // claim an empty slot
+    if(locksites[h].pc != pc)
+      continue;
+    locksites[h].name = name;
+    __sync_fetch_and_add(&locksites[h].n, 1);
+    __sync_fetch_and_add(&locksites[h].wait, (uint)(wait >> 10));
+    return;
+  }
+}
+
+// Record an acquisition of a lock with stats st by its new
+// holder.  The wait started at t0; pc is the caller.
+void
+lockstatacquired(struct lockstat *st, char *name, int contended, uint64 t0, uint pc)
+{
+  uint64 now;
+
+  now = rdtsc();
+  st->nacquire++;
+  if(contended){
+    st->ncontend++;
+    st->wait += now - t0;
+    locksite(name, pc, now - t0);
+  }
+  st->tacquire = now;
+}
+
+// Record the release of a lock with stats st by its holder.
+void
+lockstatreleased(struct lockstat *st)
+{
+  uint64 hold;
+
+  hold = rdtsc() - st->tacquire;
+  if(hold > st->maxhold)
+    st->maxhold = hold;
+}
+
+// Totals over all the locks with one name.
+#define NLOCKNAME 48
+static struct lockgroup {
+  char *name;
+  int sleep;         // Sleeplocks?
+  int nlocks;
+  uint nacquire;
+  uint ncontend;
+  uint64 wait;
+  uint64 maxhold;
+} lockgroups[NLOCKNAME];
+
+static void
+lockgroupadd(char *name, int sleep, struct lockstat *st)
+{
+  struct lockgroup *g;
+
+  for(g = lockgroups; g < lockgroups + NLOCKNAME; g++){
+    if(g->name == 0){
+      g->name = name;
+      g->sleep = sleep;
+      break;
+    }
+    if(g->sleep == sleep && strncmp(g->name, name, 16) == 0)
+      break;
+  }
+  if(g == lockgroups + NLOCKNAME)
+    return;
+  g->nlocks++;
+  g->nacquire += st->nacquire;
+  g->ncontend += st->ncontend;
+  g->wait += st->wait;
+  if(st->maxhold > g->maxhold)
+    g->maxhold = st->maxhold;
 }
 
+// Print lock statistics by lock name, then the most contended
+// call sites (resolve the pcs against kernel.asm).  Cycle
+// counts are in units of 1024.  If reset, zero the counters.
+// The counters are read without the locks, so the totals are
+// only approximate while the system is busy.
+int
+lockstatdump(int reset)
+{
+  static struct spinlock dumplock;  // zeroed: unlocked; protects lockgroups
+  struct spinlock *lk;
+  struct sleeplock *slk;
+  struct lockgroup *g;
+  struct cpu *c;
+  int i, j, k, best, seen[LOCKSITETOP];
+
+  if(!LOCKSTAT)
+    return -1;
+  acquire(&dumplock);
+  memset(lockgroups, 0, sizeof(lockgroups));
+  for(lk = spinlocks; lk; lk = lk->statnext)
+    lockgroupadd(lk->name, 0, &lk->stat);
+  for(slk = sleeplocks; slk; slk = slk->statnext)
+    lockgroupadd(slk->name, 1, &slk->stat);
+
+  cprintf("lock: locks acquires contended wait maxhold\n");
+  for(g = lockgroups; g < lockgroups + NLOCKNAME && g->name; g++){
+    if(g->nacquire == 0)
+      continue;
+    cprintf("%s%s: %d %d %d %d %d\n", g->name, g->sleep ? " (sleep)" : "",
+            g->nlocks, g->nacquire, g->ncontend,
+            (uint)(g->wait >> 10), (uint)(g->maxhold >> 10));
+  }
+
+  cprintf("contended call sites: pc lock count wait\n");
+  for(i = 0; i < LOCKSITETOP; i++){
+    best = -1;
+    for(j = 0; j < NLOCKSITE; j++){
+      if(locksites[j].n == 0)
+        continue;
+      if(best >= 0 && locksites[j].n <= locksites[best].n)
+        continue;
+      for(k = 0; k < i && seen[k] != j; k++)
+        ;
+      if(k < i)
+        continue;
+      best = j;
+    }
+    if(best < 0)
+      break;
+    seen[i] = best;
+    cprintf("0x%x %s %d %d\n", locksites[best].pc, locksites[best].name,
+            locksites[best].n, locksites[best].wait);
+  }
+
+  cprintf("interrupts off too long: cpu count max pcs\n");
+  for(c = cpus; c < cpus + ncpu; c++){
+    if(c->clilong == 0)
+      continue;
+    cprintf("%d %d %d", c - cpus, c->clilong, (uint)(c->climax >> 10));
+    for(i = 0; i < NELEM(c->climaxpcs) && c->climaxpcs[i]; i++)
+      cprintf(" 0x%x", c->climaxpcs[i]);
+    cprintf("\n");
+  }
+
+  if(reset){
+    for(lk = spinlocks; lk; lk = lk->statnext){
+      lk->stat.nacquire = lk->stat.ncontend = 0;
+      lk->stat.wait = lk->stat.maxhold = 0;
+    }
+    for(slk = sleeplocks; slk; slk = slk->statnext){
+      slk->stat.nacquire = slk->stat.ncontend = 0;
+      slk->stat.wait = slk->stat.maxhold = 0;
+    }
+    memset(locksites, 0, sizeof(locksites));
+    for(c = cpus; c < cpus + ncpu; c++){
+      c->clilong = 0;
+      c->climax = 0;
+    }
+  }
+  release(&dumplock);
+  return 0;
+}
@@ -1,11 +1,33 @@
+// Queue node for an MCS lock.  Each waiter spins on its own
+// node, so a release touches only the next waiter's cache line.
+struct mcsnode {
+  struct mcsnode *volatile next;
+  volatile uint locked;        // Still waiting for the lock?
+} __attribute__((aligned(CACHELINE)));
+
+// Contention counters kept in each lock when LOCKSTAT is set.
+// Updated by the lock's holder, so they need no locking.
+struct lockstat {
+  uint nacquire;     // Acquisitions
+  uint ncontend;     // Acquisitions that had to wait
+  uint64 wait;       // Cycles spent waiting
+  uint64 maxhold;    // Longest hold, in cycles
+  uint64 tacquire;   // When the current holder got the lock
+};
+
 // Mutual exclusion lock.
 struct spinlock {
   uint locked;       // Is the lock held?
+  int queued;        // MCS lock (see initlockq)?
+  struct mcsnode *tail;  // Last waiter of an MCS lock
+  struct mcsnode *node;  // Holder's queue node
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uint pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
-};
+  struct lockstat stat;
+  struct spinlock *statnext;  // Next lock on the lockstat list
+} __attribute__((aligned(CACHELINE)));  // apart from other locks and data
 
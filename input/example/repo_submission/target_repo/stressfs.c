@@ -12,6 +12,18 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "syscall.h"
+#include "ring.h"
+
+// Queue call op with arguments a0..a2 in ops[i].
+static void
+ringop(struct ringop *ops, int i, int op, int a0, int a1, int a2)
+{
+  ops[i].op = op;
+  ops[i].arg[0] = a0;
+  ops[i].arg[1] = a1;
+  ops[i].arg[2] = a2;
+}
 
 int
 main(int argc, char *argv[])
@@ -19,6 +31,7 @@ main(int argc, char *argv[])
   int fd, i;
   char path[] = "stressfs0";
   char data[512];
+  struct ringop ops[21];
 
   printf(1, "stressfs starting\n");
   memset(data, 'a', sizeof(data));
@@ -30,18 +43,21 @@ main(int argc, char *argv[])
   printf(1, "write %d\n", i);
 
   path[8] += i;
+  // The writes and the close after them go to the kernel in
+  // one ringenter(), and so do the reads.
   fd = open(path, O_CREATE | O_RDWR);
   for(i = 0; i < 20; i++)
-//    printf(fd, "%d\n", i);
-    write(fd, data, sizeof(data));
-  close(fd);
+    ringop(ops, i, SYS_write, fd, (int)data, sizeof(data));
+  ringop(ops, 20, SYS_close, fd, 0, 0);
+  ringenter(ops, 21);
 
   printf(1, "read\n");
 
   fd = open(path, O_RDONLY);
-  for (i = 0; i < 20; i++)
-    read(fd, data, sizeof(data));
-  close(fd);
+  for(i = 0; i < 20; i++)
+    ringop(ops, i, SYS_read, fd, (int)data, sizeof(data));
+  ringop(ops, 20, SYS_close, fd, 0, 0);
+  ringenter(ops, 21);
 
   wait();
 
@@ -0,0 +1,185 @@
+// Page reclaim and swap space.
+//
+// When kalloc() has nothing left, callers that may sleep call
+// reclaim(), which frees unreferenced page-cache pages first,
+// then writes user pages out to the swap area that mkfs leaves
+// after the file system, and frees them.
+//
+// User pages are picked by a clock: reclaim() visits the
+// address spaces in pid order, and uvmswapout() sweeps each
+// from where it stopped last, clearing the accessed bit of
+// pages that have it and taking those that don't, so a page
+// goes out only if nothing touched it for a whole sweep.
+//
+// The PTE of a page out on swap has no PTE_P but the slot in
+// its address bits (see mm.h); pagein() reads it back on the
+// next touch.  fork() children share the slot.  swap.ref counts
+// the PTEs and in-progress reads that refer to each slot, and
+// swap.lock protects it.  swap.io serializes the disk transfers
+// through swap.buf, and swap.scan the clock.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define SWAPBLKS (PGSIZE/BSIZE)  // disk blocks per page
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;                // first block of the swap area
+  uint nslot;                // pages it holds
+  uint hint;                 // where to look for a free slot
+  ushort ref[NSWAP];
+
+  struct sleeplock io;
+  struct buf buf[SWAPBLKS];
+
+  struct sleeplock scan;
+  int hand;                  // pid of the address space swept last
+} swap;
+
+void
+swapinit(int dev)
+{
+  struct superblock sb;
+  int i;
+
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io, "swapio");
+  initsleeplock(&swap.scan, "swapscan");
+  for(i = 0; i < SWAPBLKS; i++){
+    initsleeplock(&swap.buf[i].lock, "swapbuf");
+    swap.buf[i].data = swap.buf[i].space;
+  }
+  readsb(dev, &sb);
+  swap.dev = dev;
+  swap.start = sb.swapstart;
+  swap.nslot = sb.nswap / SWAPBLKS;
+  if(swap.nslot > NSWAP)
+    swap.nslot = NSWAP;
+}
+
+// Allocate a swap slot, with one reference.
+// Returns -1 if swap is full.
+static int
+swapalloc(void)
+{
+  uint i, s;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot; i++){
+    s = (swap.hint + i) % swap.nslot;
+    if(swap.ref[s] == 0){
+      swap.ref[s] = 1;
+      swap.hint = s + 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Take another reference to slot s.
+void
+swapdup(uint s)
+{
+  acquire(&swap.lock);
+  if(s >= swap.nslot || swap.ref[s] == 0)
+    panic("swapdup");
+  swap.ref[s]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot s.
+void
+swapfree(uint s)
+{
+  acquire(&swap.lock);
+  if(s >= swap.nslot || swap.ref[s] == 0)
+    panic("swapfree");
+  swap.ref[s]--;
+  release(&swap.lock);
+}
+
+// Move the page at mem to (write) or from slot s.
+static void
+swaprw(uint s, char *mem, int write)
+{
+  struct buf *b;
+  int i;
+
+  acquiresleep(&swap.io);
+  for(i = 0; i < SWAPBLKS; i++){
+    b = &swap.buf[i];
+    acquiresleep(&b->lock);
+    b->dev = swap.dev;
+    b->blockno = swap.start + s*SWAPBLKS + i;
+    if(write){
+      memmove(b->data, mem + i*BSIZE, BSIZE);
+      b->flags = B_DIRTY;
+    } else
+      b->flags = 0;
+    idestartrw(b);
+  }
+  for(i = 0; i < SWAPBLKS; i++){
+    b = &swap.buf[i];
+    ideawait(b);
+    if(!write)
+      memmove(mem + i*BSIZE, b->data, BSIZE);
+    releasesleep(&b->lock);
+  }
+  releasesleep(&swap.io);
+}
+
+// Write the page at mem to a new slot.  Returns the slot, with
+// a reference for the caller, or -1 if swap is full.
+int
+swapwrite(char *mem)
+{
+  int s;
+
+  if((s = swapalloc()) < 0)
+    return -1;
+  swaprw(s, mem, 1);
+  return s;
+}
+
+// Read slot s into the page at mem.  The caller holds a
+// reference to s.
+void
+swapread(uint s, char *mem)
+{
+  swaprw(s, mem, 0);
+}
+
+// Free up to n pages.  Returns the number freed.  May sleep,
+// so the caller must hold no spinlocks.
+int
+reclaim(int n)
+{
+  struct mm *mm;
+  int got, sweeps;
+
+  got = pcreclaim(n);
+  if(got >= n || swap.nslot == 0)
+    return got;
+  acquiresleep(&swap.scan);
+  // Two sweeps: the first may only clear accessed bits.
+  for(sweeps = 0; got < n && sweeps < 2; ){
+    if((mm = mmnext(&swap.hand)) == 0){
+      sweeps++;
+      continue;
+    }
+    got += uvmswapout(mm, n - got);
+    mmput(mm);
+  }
+  releasesleep(&swap.scan);
+  return got;
+}
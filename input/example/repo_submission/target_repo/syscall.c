@@ -3,9 +3,14 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "mm.h"
 #include "x86.h"
 #include "syscall.h"
+#include "ring.h"
+#include "counter.h"
 
 // User code makes a system call with INT T_SYSCALL.
 // System call number in %eax.
@@ -17,9 +22,12 @@
 int
 fetchint(uint addr, int *ip)
 {
-  struct proc *curproc = myproc();
+  struct mm *mm = myproc()->mm;
+  uint end;
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  // Below sz needs no look at the mmap() regions.
+  end = addr < mm->sz && mm->sz - addr >= 4 ? mm->sz : uvmend(mm, addr);
+  if(addr >= end || addr+4 > end)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -32,12 +40,11 @@ int
 fetchstr(uint addr, char **pp)
 {
   char *s, *ep;
-  struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  ep = (char*)uvmend(myproc()->mm, addr);
+  if((char*)addr >= ep)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
     if(*s == 0)
       return s - *pp;
@@ -45,30 +52,87 @@ fetchstr(uint addr, char **pp)
   return -1;
 }
 
+// Copy the arguments of the system call p is making from its
+// stack into p->sysarg[], checking them against the address
+// space once for the whole call rather than once per argument:
+// NSYSARG words, or fewer if the stack ends sooner.
+static void
+fetchargs(struct proc *p)
+{
+  uint addr, end;
+  int n;
+
+  addr = p->tf->esp + 4;
+  if(addr < p->mm->sz && p->mm->sz - addr >= sizeof(p->sysarg))
+    n = NSYSARG;
+  else {
+    end = uvmend(p->mm, addr);
+    n = addr < end ? (end - addr) / 4 : 0;
+    if(n > NSYSARG)
+      n = NSYSARG;
+  }
+  memmove(p->sysarg, (void*)addr, n * 4);
+  p->nsysarg = n;
+}
+
 // Fetch the nth 32-bit system call argument.
 int
 argint(int n, int *ip)
 {
-  return fetchint((myproc()->tf->esp) + 4 + 4*n, ip);
+  struct proc *p = myproc();
+
+  if(n < 0 || n >= p->nsysarg)
+    return -1;
+  *ip = p->sysarg[n];
+  return 0;
 }
 
-// Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// Check that the size bytes at addr are memory of the current
+// process, writable if write, and fault them in.
 int
-argptr(int n, char **pp, int size)
+fetchbuf(uint addr, int size, int write)
+{
+  uint end;
+
+  end = uvmend(myproc()->mm, addr);
+  if(size < 0 || addr >= end || addr+size > end)
+    return -1;
+  // The kernel may use the buffer while holding a spinlock,
+  // where a page can't be read in.
+  if(uvmprefault(addr, size, write) < 0)
+    return -1;
+  return 0;
+}
+
+// argptr() and argptrw().
+static int
+argbuf(int n, char **pp, int size, int write)
 {
   int i;
-  struct proc *curproc = myproc();
  
-  if(argint(n, &i) < 0)
-    return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(argint(n, &i) < 0 || fetchbuf(i, size, write) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Fetch the nth word-sized system call argument as a pointer
+// to a block of memory of size bytes.  Check that the pointer
+// lies within the process address space.
+int
+argptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 0);
+}
+
+// Like argptr, for a block the kernel will write to.  Fails if
+// part of it is read-only.
+int
+argptrw(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -88,7 +152,20 @@ extern int sys_dup(void);
 extern int sys_exec(void);
 extern int sys_exit(void);
 extern int sys_fork(void);
+extern int sys_vfork(void);
 extern int sys_fstat(void);
+extern int sys_getdents(void);
+extern int sys_exit_group(void);
+extern int sys_mount(void);
+extern int sys_fdatasync(void);
+extern int sys_sync(void);
+extern int sys_perfctr(void);
+extern int sys_ipc_call(void);
+extern int sys_ipc_reply(void);
+extern int sys_ipc_reply_wait(void);
+extern int sys_madvise(void);
+extern int sys_counters(void);
+extern int sys_futex_timedwait(void);
 extern int sys_getpid(void);
 extern int sys_kill(void);
 extern int sys_link(void);
@@ -105,6 +182,29 @@ extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_clone(void);
 extern int sys_join(void);
+extern int sys_join_many(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_mprotect(void);
+extern int sys_lockstat(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_fsync(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_pread(void);
+extern int sys_pwrite(void);
+extern int sys_splice(void);
+extern int sys_poll(void);
+extern int sys_ringenter(void);
+extern int sys_sysstat(void);
+extern int sys_usleep(void);
+extern int sys_setpriority(void);
+extern int sys_getrusage(void);
+extern int sys_meminfo(void);
+extern int sys_shm_open(void);
+extern int sys_shm_attach(void);
+extern int sys_shm_unlink(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -130,7 +230,123 @@ static int (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_clone]   sys_clone,
 [SYS_join]    sys_join,
+[SYS_join_many] sys_join_many,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_mprotect] sys_mprotect,
+[SYS_lockstat] sys_lockstat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_fsync]   sys_fsync,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_splice]  sys_splice,
+[SYS_poll]    sys_poll,
+[SYS_ringenter] sys_ringenter,
+[SYS_sysstat] sys_sysstat,
+[SYS_usleep]  sys_usleep,
+[SYS_setpriority] sys_setpriority,
+[SYS_getrusage] sys_getrusage,
+[SYS_meminfo] sys_meminfo,
+[SYS_shm_open] sys_shm_open,
+[SYS_shm_attach] sys_shm_attach,
+[SYS_shm_unlink] sys_shm_unlink,
+[SYS_vfork]   sys_vfork,
+[SYS_getdents] sys_getdents,
+[SYS_exit_group] sys_exit_group,
+[SYS_mount]   sys_mount,
+[SYS_fdatasync] sys_fdatasync,
+[SYS_sync]    sys_sync,
+[SYS_perfctr] sys_perfctr,
+[SYS_ipc_call] sys_ipc_call,
+[SYS_ipc_reply] sys_ipc_reply,
+[SYS_ipc_reply_wait] sys_ipc_reply_wait,
+[SYS_madvise] sys_madvise,
+[SYS_counters] sys_counters,
+[SYS_futex_timedwait] sys_futex_timedwait,
+};
+
+// Per-cpu counts and rdtsc latencies of each system call, for
+// sysstat().  hist[i] counts the calls that took 2^(i+SYSHIST0)
+// to 2^(i+SYSHIST0+1) cycles; the first and last buckets also
+// take everything below and above.  A call that sleeps is
+// counted with the cpu it finishes on.
+#define NSYSHIST 24
+#define SYSHIST0 8
+struct sysstat {
+  uint n;
+  uint64 cycles;
+  uint hist[NSYSHIST];
 };
+static struct {
+  struct sysstat s[NELEM(syscalls)];
+} __attribute__((aligned(CACHELINE))) sysstats[NCPU];
+
+static void
+sysstatadd(int num, uint64 cycles)
+{
+  struct sysstat *st;
+  uint64 c;
+  int b;
+
+  b = 0;
+  for(c = cycles >> (SYSHIST0+1); c && b < NSYSHIST-1; c >>= 1)
+    b++;
+  pushcli();
+  st = &sysstats[cpuid()].s[num];
+  st->n++;
+  st->cycles += cycles;
+  st->hist[b]++;
+  popcli();
+}
+
+// Print, for each system call made since the last reset, the
+// number of calls, their mean cycles and the histogram of
+// their cycles by power of two, on the console.  Zero the
+// counters if reset.  The counters are read without stopping
+// the other cpus, so the totals are approximate while they
+// make calls.
+int
+sysstatdump(int reset)
+{
+  static struct spinlock dumplock;  // zeroed: unlocked
+  struct sysstat sum;
+  int num, c, b;
+  uint n;
+
+  if(!SYSSTAT)
+    return -1;
+  acquire(&dumplock);
+  cprintf("syscall: calls cycles/call; calls by log2 cycles\n");
+  for(num = 1; num < NELEM(syscalls); num++){
+    memset(&sum, 0, sizeof(sum));
+    for(c = 0; c < ncpu; c++){
+      sum.n += sysstats[c].s[num].n;
+      sum.cycles += sysstats[c].s[num].cycles;
+      for(b = 0; b < NSYSHIST; b++)
+        sum.hist[b] += sysstats[c].s[num].hist[b];
+    }
+    if(sum.n == 0)
+      continue;
+    // The kernel has no 64-bit division: scale down to 32 bits.
+    n = sum.n;
+    while(sum.cycles >> 32){
+      sum.cycles >>= 1;
+      n >>= 1;
+    }
+    cprintf("%d: %d %d;", num, sum.n, n ? (uint)sum.cycles / n : 0);
+    for(b = 0; b < NSYSHIST; b++)
+      if(sum.hist[b])
+        cprintf(" %d:%d", b + SYSHIST0, sum.hist[b]);
+    cprintf("\n");
+  }
+  if(reset)
+    memset(sysstats, 0, sizeof(sysstats));
+  release(&dumplock);
+  return 0;
+}
 
 void
 syscall(void)
@@ -140,10 +356,62 @@ syscall(void)
 
   num = curproc->tf->eax;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    fetchargs(curproc);
+    cntadd(CNT_SYSCALL, 1);
+#if SYSSTAT
+    uint64 t0 = rdtsc();
     curproc->tf->eax = syscalls[num]();
+    sysstatadd(num, rdtsc() - t0);
+#else
+    curproc->tf->eax = syscalls[num]();
+#endif
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             curproc->pid, curproc->name, num);
     curproc->tf->eax = -1;
   }
 }
+
+// The system calls ringenter() makes: file I/O that neither
+// changes the address space nor leaves the process.
+static char ringcalls[NELEM(syscalls)] = {
+[SYS_read] 1, [SYS_write] 1, [SYS_open] 1, [SYS_close] 1,
+[SYS_fstat] 1, [SYS_pread] 1, [SYS_pwrite] 1,
+};
+
+// Make the n system calls in ops in turn, in one trap.  Each
+// call finds its arguments in its ringop, as if the user stack
+// pointed just below them, and is counted in sysstat() as if
+// made on its own.  Returns how many were made, fewer than n
+// only if the process was killed.
+int
+sys_ringenter(void)
+{
+  struct proc *curproc = myproc();
+  struct ringop *ops;
+  int n, i, op;
+  uint esp;
+
+  if(argint(1, &n) < 0 || n < 0 || n > RING_MAX ||
+     argptrw(0, (char**)&ops, n*sizeof(ops[0])) < 0)
+    return -1;
+  esp = curproc->tf->esp;
+  for(i = 0; i < n && !curproc->killed; i++){
+    op = ops[i].op;
+    if(op <= 0 || op >= NELEM(syscalls) || !ringcalls[op]){
+      ops[i].res = -1;
+      continue;
+    }
+    curproc->tf->esp = (uint)ops[i].arg - 4;
+    fetchargs(curproc);
+#if SYSSTAT
+    uint64 t0 = rdtsc();
+    ops[i].res = syscalls[op]();
+    sysstatadd(op, rdtsc() - t0);
+#else
+    ops[i].res = syscalls[op]();
+#endif
+    curproc->tf->esp = esp;
+  }
+  return i;
+}
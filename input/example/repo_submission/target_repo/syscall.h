@@ -22,3 +22,39 @@
 #define SYS_close  21
 #define SYS_clone  22 // Or the next available number
 #define SYS_join   23 // Or the next available number
+#define SYS_join_many 24
+#define SYS_futex_wait 25
+#define SYS_futex_wake 26
+#define SYS_mprotect 27
+#define SYS_lockstat 28
+#define SYS_mmap   29
+#define SYS_munmap 30
+#define SYS_fsync  31
+#define SYS_readv  32
+#define SYS_writev 33
+#define SYS_pread  34
+#define SYS_pwrite 35
+#define SYS_splice 36
+#define SYS_poll   37
+#define SYS_ringenter 38
+#define SYS_sysstat 39
+#define SYS_usleep 40
+#define SYS_setpriority 41
+#define SYS_getrusage 42
+#define SYS_meminfo 43
+#define SYS_shm_open 44
+#define SYS_shm_attach 45
+#define SYS_shm_unlink 46
+#define SYS_vfork  47
+#define SYS_getdents 48
+#define SYS_exit_group 49
+#define SYS_mount  50
+#define SYS_fdatasync 51
+#define SYS_sync   52
+#define SYS_perfctr 53
+#define SYS_ipc_call 54
+#define SYS_ipc_reply 55
+#define SYS_ipc_reply_wait 56
+#define SYS_madvise 57
+#define SYS_counters 58
+#define SYS_futex_timedwait 59
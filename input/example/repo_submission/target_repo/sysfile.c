@@ -9,60 +9,98 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "uio.h"
+#include "poll.h"
+#include "dirstat.h"
+
+// Return the struct file for file descriptor fd in *pf.
+// If the fd table is shared with other threads, a reference to
+// the file is taken so that a close() in one of them can't free
+// it under us; fdget then returns 1 and the caller must drop the
+// reference with fdput().  An unshared table can't change while
+// its only user is in a system call, so it needs neither.
+static int
+fdget(int fd, struct file **pf)
+{
+  int held;
+  struct file *f;
+  struct fdtable *t = myproc()->files;
+
+  if(fd < 0)
+    return -1;
+  held = t->ref > 1;
+  if(!held){
+    if(fd >= t->arr->nfd || (f = t->arr->ofile[fd]) == 0)
+      return -1;
+  } else {
+    acquire(&t->lock);
+    if(fd >= t->arr->nfd || (f = t->arr->ofile[fd]) == 0){
+      release(&t->lock);
+      return -1;
+    }
+    filedup(f);
+    release(&t->lock);
+  }
+  *pf = f;
+  return held;
+}
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return both the descriptor and the corresponding struct file,
+// as fdget() does.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
-  int fd;
+  int fd, held;
   struct file *f;
 
-  if(argint(n, &fd) < 0)
-    return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(argint(n, &fd) < 0 || (held = fdget(fd, &f)) < 0)
     return -1;
   if(pfd)
     *pfd = fd;
   if(pf)
     *pf = f;
-  return 0;
+  return held;
 }
 
-// Allocate a file descriptor for the given file.
+// Release a file returned by argfd() or fdget(), which returned held.
+static void
+fdput(struct file *f, int held)
+{
+  if(held)
+    fileclose(f);
+}
+
+// Allocate the lowest free file descriptor for the given file.
 // Takes over file reference from caller on success.
 static int
 fdalloc(struct file *f)
 {
-  int fd;
-  struct proc *curproc = myproc();
-
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
-      return fd;
-    }
-  }
-  return -1;
+  return fdtinstall(myproc()->files, f);
 }
 
 int
 sys_dup(void)
 {
   struct file *f;
-  int fd;
+  int fd, held;
 
-  if(argfd(0, 0, &f) < 0)
+  if((held = argfd(0, 0, &f)) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fdput(f, held);
     return -1;
-  filedup(f);
+  }
+  if(!held)
+    filedup(f);  // else the reference argfd took moves to fd
   return fd;
 }
 
@@ -70,24 +108,190 @@ int
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r, held;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argptrw(1, &p, n) < 0 || (held = argfd(0, 0, &f)) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fdput(f, held);
+  return r;
 }
 
 int
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r, held;
+  char *p;
+
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || (held = argfd(0, 0, &f)) < 0)
+    return -1;
+  r = filewrite(f, p, n);
+  fdput(f, held);
+  return r;
+}
+
+// Fetch the iovec array of system call argument n, with cnt
+// entries, into iov, checking each buffer and that the total
+// length fits in the int the call returns.
+static int
+argiovec(int n, int cnt, struct iovec *iov, int write)
+{
+  char *p;
+  int i, tot;
+
+  if(cnt < 0 || cnt > IOV_MAX || argptr(n, &p, cnt*sizeof(*iov)) < 0)
+    return -1;
+  memmove(iov, p, cnt*sizeof(*iov));
+  tot = 0;
+  for(i = 0; i < cnt; i++){
+    if(fetchbuf((uint)iov[i].iov_base, iov[i].iov_len, write) < 0)
+      return -1;
+    if((tot += iov[i].iov_len) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt, r, held;
+
+  if(argint(2, &cnt) < 0 || argiovec(1, cnt, iov, 1) < 0 || (held = argfd(0, 0, &f)) < 0)
+    return -1;
+  r = filereadv(f, iov, cnt, -1);
+  fdput(f, held);
+  return r;
+}
+
+int
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt, r, held;
+
+  if(argint(2, &cnt) < 0 || argiovec(1, cnt, iov, 0) < 0 || (held = argfd(0, 0, &f)) < 0)
+    return -1;
+  r = filewritev(f, iov, cnt, -1);
+  fdput(f, held);
+  return r;
+}
+
+int
+sys_pread(void)
+{
+  struct file *f;
+  struct iovec v;
+  int n, off, r, held;
+  char *p;
+
+  if(argint(2, &n) < 0 || argptrw(1, &p, n) < 0 || argint(3, &off) < 0 || off < 0 ||
+     (held = argfd(0, 0, &f)) < 0)
+    return -1;
+  v.iov_base = p;
+  v.iov_len = n;
+  r = filereadv(f, &v, 1, off);
+  fdput(f, held);
+  return r;
+}
+
+int
+sys_pwrite(void)
+{
+  struct file *f;
+  struct iovec v;
+  int n, off, r, held;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argint(3, &off) < 0 || off < 0 ||
+     (held = argfd(0, 0, &f)) < 0)
+    return -1;
+  v.iov_base = p;
+  v.iov_len = n;
+  r = filewritev(f, &v, 1, off);
+  fdput(f, held);
+  return r;
+}
+
+// Move up to n bytes from fd_in to fd_out without copying them
+// through user memory: straight through the pipe's ring if one
+// is a pipe, or else through a kernel page.
+int
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n, r, hin, hout;
+
+  if(argint(2, &n) < 0 || n < 0 || (hin = argfd(0, 0, &in)) < 0)
     return -1;
-  return filewrite(f, p, n);
+  if((hout = argfd(1, 0, &out)) < 0){
+    fdput(in, hin);
+    return -1;
+  }
+  r = -1;
+  if(in->readable && out->writable){
+    if(in->type == FD_PIPE && !(out->type == FD_PIPE && out->pipe == in->pipe))
+      r = pipespliceout(in->pipe, out, n);
+    else if(out->type == FD_PIPE && in->type == FD_INODE)
+      r = pipesplicein(out->pipe, in, n);
+    else if(in->type == FD_INODE && out->type == FD_INODE)
+      r = filesplice(in, out, n);
+  }
+  fdput(out, hout);
+  fdput(in, hin);
+  return r;
+}
+
+// Wait until one of the n files in fds is ready for the events
+// asked for, or timeout ticks pass (never, if timeout is
+// negative).  Returns the number of fds with revents set.
+int
+sys_poll(void)
+{
+  struct pollfd *ufds, fds[NOFILE];
+  struct file *f;
+  int n, timeout, i, nready, held, left;
+  uint seq, deadline;
+
+  if(argint(1, &n) < 0 || n < 0 || n > NOFILE || argint(2, &timeout) < 0 ||
+     argptrw(0, (char**)&ufds, n*sizeof(fds[0])) < 0)
+    return -1;
+  memmove(fds, ufds, n*sizeof(fds[0]));
+  acquire(&tickslock);
+  deadline = ticks + timeout;
+  release(&tickslock);
+
+  for(;;){
+    seq = pollbegin();
+    nready = 0;
+    for(i = 0; i < n; i++){
+      fds[i].revents = 0;
+      if(fds[i].fd < 0)
+        continue;
+      if((held = fdget(fds[i].fd, &f)) < 0)
+        fds[i].revents = POLLNVAL;
+      else {
+        fds[i].revents = filepoll(f, fds[i].events);
+        fdput(f, held);
+      }
+      if(fds[i].revents)
+        nready++;
+    }
+    left = deadline - ticks;  // read ticks once: a negative wait never ends
+    if(nready > 0 || timeout == 0 || myproc()->killed ||
+       (timeout > 0 && left <= 0)){
+      pollwait(seq, 0, 0);
+      break;
+    }
+    pollwait(seq, 1, timeout < 0 ? -1 : left);
+  }
+  memmove(ufds, fds, n*sizeof(fds[0]));
+  return myproc()->killed && nready == 0 ? -1 : nready;
 }
 
 int
@@ -96,9 +300,8 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argint(0, &fd) < 0 || (f = fdtremove(myproc()->files, fd)) == 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -108,10 +311,112 @@ sys_fstat(void)
 {
   struct file *f;
   struct stat *st;
+  int r, held;
+
+  if(argptrw(1, (void*)&st, sizeof(*st)) < 0 || (held = argfd(0, 0, &f)) < 0)
+    return -1;
+  r = filestat(f, st);
+  fdput(f, held);
+  return r;
+}
+
+// Read up to n (at most PGSIZE) entries, each with the stat of
+// its inode, from directory fd into ds, continuing from where
+// the last call or read() stopped.  Returns the number read, 0
+// at the end.
+int
+sys_getdents(void)
+{
+  struct file *f;
+  struct direntstat *ds;
+  int n, r, held;
+
+  if(argint(2, &n) < 0 || n < 0 || n > PGSIZE ||
+     argptrw(1, (void*)&ds, n*sizeof(*ds)) < 0 || (held = argfd(0, 0, &f)) < 0)
+    return -1;
+  r = -1;
+  if(f->type == FD_INODE && f->readable){
+    begin_op();
+    r = dirstat(f->ip, &f->off, ds, n);
+    end_op();
+  }
+  fdput(f, held);
+  return r;
+}
+
+// Wait for the file system updates made so far, to fd's
+// file and every other, to be committed to disk.
+int
+sys_fsync(void)
+{
+  struct file *f;
+  int held;
+
+  if((held = argfd(0, 0, &f)) < 0)
+    return -1;
+  fdput(f, held);
+  logsync();
+  return 0;
+}
+
+// Wait for fd's data to be on disk, and for its inode only if
+// it has changed (its size, say) since it was last committed.
+int
+sys_fdatasync(void)
+{
+  struct file *f;
+  int held;
+  uint txn;
+
+  if((held = argfd(0, 0, &f)) < 0)
+    return -1;
+  txn = 0;  // no commit to wait for
+  if(f->type == FD_INODE){
+    ilockshared(f->ip);
+    txn = f->ip->txn;
+    iunlock(f->ip);
+  }
+  fdput(f, held);
+  logwait(txn);
+  return 0;
+}
+
+// Wait for every file system update made so far to be on disk.
+int
+sys_sync(void)
+{
+  logsync();
+  return 0;
+}
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+// Map a file, or zero-filled memory with MAP_ANONYMOUS, at an
+// address of the kernel's choosing; addr is ignored.
+int
+sys_mmap(void)
+{
+  struct file *f;
+  struct stat st;
+  int addr, len, prot, flags, off, r, held;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0)
+    return -1;
+  if(flags & MAP_ANONYMOUS)
+    return mmapregion(myproc()->mm, len, prot, flags, 0, 0, 0);
+  if((held = argfd(4, 0, &f)) < 0)
     return -1;
-  return filestat(f, st);
+  r = -1;
+  if(f->type == FD_INODE && f->readable &&
+     !((flags & MAP_SHARED) && (prot & PROT_WRITE))){
+    ilockshared(f->ip);
+    stati(f->ip, &st);
+    iunlock(f->ip);
+    r = mmapregion(myproc()->mm, len, prot, flags, f->ip, off, st.size);
+  }
+  fdput(f, held);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -171,10 +476,11 @@ isdirempty(struct inode *dp)
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  // "." and ".." need not come first in a hashed directory.
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -218,6 +524,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcenter(dp->dev, dp->inum, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -257,8 +564,10 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
-    panic("create: ialloc");
+  if((ip = ialloc(dp->dev, type)) == 0){
+    iunlockput(dp);  // tmpfs is full
+    return 0;
+  }
 
   ilock(ip);
   ip->major = major;
@@ -368,6 +677,26 @@ sys_mknod(void)
   return 0;
 }
 
+// Mount tmpfs on the directory path.
+int
+sys_mount(void)
+{
+  char *path;
+  struct inode *ip;
+  int r;
+
+  begin_op();
+  if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  r = mount(ip);
+  iunlockput(ip);
+  end_op();
+  return r;
+}
+
 int
 sys_chdir(void)
 {
@@ -387,9 +716,8 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(curproc->cwd);
+  iput(cwdset(curproc->cwd, ip));
   end_op();
-  curproc->cwd = ip;
   return 0;
 }
 
@@ -426,14 +754,14 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argptrw(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
+      fdtremove(myproc()->files, fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -5,7 +5,14 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "mm.h"
+#include "mman.h"
+#include "clone.h"
+#include "meminfo.h"
+#include "counter.h"
 
 int
 sys_fork(void)
@@ -13,6 +20,12 @@ sys_fork(void)
   return fork();
 }
 
+int
+sys_vfork(void)
+{
+  return vfork();
+}
+
 int
 sys_exit(void)
 {
@@ -20,6 +33,13 @@ sys_exit(void)
   return 0;  // not reached
 }
 
+int
+sys_exit_group(void)
+{
+  exitgroup();
+  return 0;  // not reached
+}
+
 int
 sys_wait(void)
 {
@@ -36,6 +56,61 @@ sys_kill(void)
   return kill(pid);
 }
 
+int
+sys_setpriority(void)
+{
+  int pid, sclass, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &sclass) < 0 || argint(2, &prio) < 0)
+    return -1;
+  return setpriority(pid, sclass, prio);
+}
+
+int
+sys_getrusage(void)
+{
+  int pid, who;
+  struct rusage *uru, ru;
+
+  if(argint(0, &pid) < 0 || argint(1, &who) < 0 ||
+     argptrw(2, (char**)&uru, sizeof(*uru)) < 0)
+    return -1;
+  if(getrusage(pid, who, &ru) < 0)
+    return -1;
+  memmove(uru, &ru, sizeof(ru));  // not under ptable.lock: may fault
+  return 0;
+}
+
+int
+sys_perfctr(void)
+{
+  int cpu;
+  uint64 *upmc, pmc[NPMC];
+  int mask;
+
+  if(argint(0, &cpu) < 0 || argptrw(1, (char**)&upmc, sizeof(pmc)) < 0)
+    return -1;
+  if((mask = perfctr(cpu, pmc)) < 0)
+    return -1;
+  memmove(upmc, pmc, sizeof(pmc));
+  return mask;
+}
+
+int
+sys_meminfo(void)
+{
+  int pid;
+  struct meminfo *mi;
+
+  if(argint(0, &pid) < 0 || argptrw(1, (char**)&mi, sizeof(*mi)) < 0)
+    return -1;
+  kmeminfo(mi);
+  mi->nbuf = bufcount();
+  if((mi->rss = procrss(pid)) < 0)
+    return -1;
+  return 0;
+}
+
 int
 sys_getpid(void)
 {
@@ -50,8 +125,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if((addr = growproc(n)) < 0)
     return -1;
   return addr;
 }
@@ -60,21 +134,24 @@ int
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n <= 0)
+    return myproc()->killed ? -1 : 0;
+  return timersleep(n, 0);
+}
+
+// Sleep for the given number of microseconds, as precisely as
+// the LAPIC timer allows once timer.c is tickless.
+int
+sys_usleep(void)
+{
+  int us;
+
+  if(argint(0, &us) < 0 || us < 0)
+    return -1;
+  return timersleep(us / USPERTICK, us % USPERTICK);
 }
 
 // return how many clock tick interrupts have occurred
@@ -94,14 +171,19 @@ sys_clone(void)
 {
   void (*fcn)(void *, void *);
   void *arg1, *arg2, *stack;
+  int flags, tls;
   struct proc *curproc = myproc();
 
   if (argptr(0, (char **)&fcn, sizeof(void (*)(void *, void *))) < 0 ||
       argptr(1, (char **)&arg1, sizeof(void *)) < 0 ||
       argptr(2, (char **)&arg2, sizeof(void *)) < 0 ||
-      argptr(3, (char **)&stack, sizeof(void *)) < 0) {
+      argptr(3, (char **)&stack, sizeof(void *)) < 0 ||
+      argint(4, &flags) < 0 ||
+      argint(5, &tls) < 0) {
     return -1;
   }
+  if (flags & ~(CLONE_FILES | CLONE_FS | CLONE_SETTLS))
+    return -1;
 
   // Check if stack is page-aligned (optional, but good practice as per spec)
   // PGSIZE is defined in memlayout.h
@@ -110,22 +192,239 @@ sys_clone(void)
   //     return -1;
   // }
 // Check if stack is within user address space (important!) - KEEP THIS CHECK
-if ((uint)stack >= curproc->sz || (uint)stack + PGSIZE > curproc->sz || (uint)stack + PGSIZE < (uint)stack /*overflow*/) {
+if ((uint)stack >= curproc->mm->sz || (uint)stack + PGSIZE > curproc->mm->sz || (uint)stack + PGSIZE < (uint)stack /*overflow*/) {
     // Or if stack is in kernel space: (uint)stack >= KERNBASE
-    cprintf("clone: stack invalid (outside user space or wraps around)\n"); // Modified message for clarity
+    KLOG(KL_DEBUG, "clone: stack invalid (outside user space or wraps around)\n");
     return -1;
 }
 
 
-  return clone(fcn, arg1, arg2, stack);
+  return clone(fcn, arg1, arg2, stack, flags, tls);
 }
 int
 sys_join(void)
 {
+  int tid;
   void **stack_ptr_user; // This is a pointer to where the user wants the stack address stored
 
-  if (argptr(0, (char **)&stack_ptr_user, sizeof(void **)) < 0) {
+  if (argint(0, &tid) < 0 ||
+      argptrw(1, (char **)&stack_ptr_user, sizeof(void *)) < 0) {
     return -1;
   }
-  return join(stack_ptr_user);
+  return join(tid, stack_ptr_user);
+}
+
+int
+sys_join_many(void)
+{
+  int *tids, n;
+  void **stacks;
+
+  if(argint(1, &n) < 0 || n <= 0 || n > NPROC)
+    return -1;
+  if(argptr(0, (char**)&tids, n*sizeof(int)) < 0 ||
+     argptrw(2, (char**)&stacks, n*sizeof(void*)) < 0)
+    return -1;
+  return join_many(tids, n, stacks);
+}
+
+int
+sys_futex_wait(void)
+{
+  int *addr, val;
+
+  if(argptr(0, (char**)&addr, sizeof(int)) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait((uint)addr, val, -1);
+}
+
+// futex_wait() that gives up after timeout ticks, returning 1.
+int
+sys_futex_timedwait(void)
+{
+  int *addr, val, timeout;
+
+  if(argptr(0, (char**)&addr, sizeof(int)) < 0 || argint(1, &val) < 0 ||
+     argint(2, &timeout) < 0 || timeout < 0)
+    return -1;
+  return futexwait((uint)addr, val, timeout);
+}
+
+// The IPC calls take their message in the trap frame; see
+// ipccall().
+int
+sys_ipc_call(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return ipccall(pid);
+}
+
+int
+sys_ipc_reply(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0 || pid == 0)
+    return -1;
+  return ipcreplywait(pid, 0);
+}
+
+int
+sys_ipc_reply_wait(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return ipcreplywait(pid, 1);
+}
+
+int
+sys_futex_wake(void)
+{
+  int *addr, n;
+
+  if(argptr(0, (char**)&addr, sizeof(int)) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(n <= 0)
+    return 0;
+  return futexwake((uint)addr, n);
+}
+
+int
+sys_mprotect(void)
+{
+  struct mm *mm = myproc()->mm;
+  int addr, len, prot, r;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0)
+    return -1;
+  if(len <= 0)
+    return -1;
+  if((uint)addr + len < (uint)addr || (uint)addr + len > uvmend(mm, addr))
+    return -1;
+  if(uvmprefault(addr, len, 0) < 0)  // only mapped pages have protections
+    return -1;
+  acquire(&mm->lock);
+  if((uint)addr + len > uvmend(mm, addr)){
+    release(&mm->lock);
+    return -1;
+  }
+  r = mprotectuvm(mm->pgdir, addr, len, prot);
+  tlbshootdown(mm->pgdir, addr, len);
+  release(&mm->lock);
+  return r;
+}
+
+// Remove the mmap() regions in [addr, addr+len).
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  if(len <= 0)
+    return -1;
+  return munmapregion(myproc()->mm, addr, len);
+}
+
+// Give back the pages of [addr, addr+len) for MADV_DONTNEED;
+// MADV_NORMAL does nothing.
+int
+sys_madvise(void)
+{
+  struct mm *mm = myproc()->mm;
+  int addr, len, advice;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0)
+    return -1;
+  if(len <= 0 || addr % PGSIZE != 0)
+    return -1;
+  if(advice != MADV_NORMAL && advice != MADV_DONTNEED)
+    return -1;
+  len = PGROUNDUP(len);
+  acquire(&mm->lock);
+  if((uint)addr + len < (uint)addr || (uint)addr + len > uvmend(mm, addr)){
+    release(&mm->lock);
+    return -1;
+  }
+  if(advice == MADV_DONTNEED)
+    madviseuvm(mm->pgdir, addr, len);
+  release(&mm->lock);
+  return 0;
+}
+
+int
+sys_shm_open(void)
+{
+  int key, size;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0 || size < 0)
+    return -1;
+  return shmopen(key, size);
+}
+
+int
+sys_shm_attach(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmattach(id);
+}
+
+int
+sys_shm_unlink(void)
+{
+  int key;
+
+  if(argint(0, &key) < 0)
+    return -1;
+  return shmunlink(key);
+}
+
+// Print lock contention statistics on the console; reset
+// the counters afterwards if asked.
+int
+sys_lockstat(void)
+{
+  int reset;
+
+  if(argint(0, &reset) < 0)
+    return -1;
+  return lockstatdump(reset);
+}
+
+// Print per-system-call counts and latencies on the console;
+// reset the counters afterwards if asked.
+int
+sys_sysstat(void)
+{
+  int reset;
+
+  if(argint(0, &reset) < 0)
+    return -1;
+  return sysstatdump(reset);
+}
+
+// Copy up to n counters, summed over the cpus, to ct; return
+// how many there are.
+int
+sys_counters(void)
+{
+  struct counter *ct;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0)
+    return -1;
+  if(n > NCNT)
+    n = NCNT;
+  if(argptrw(0, (char**)&ct, n*sizeof(*ct)) < 0)
+    return -1;
+  return cntread(ct, n);
 }
@@ -0,0 +1,18 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char **argv)
+{
+  int reset;
+
+  reset = argc > 1 && strcmp(argv[1], "-r") == 0;
+  if(argc > 2 || (argc == 2 && !reset)){
+    printf(2, "usage: sysstat [-r]\n");
+    exit();
+  }
+  if(sysstat(reset) < 0)
+    printf(2, "sysstat: not supported by this kernel\n");
+  exit();
+}
@@ -2,30 +2,159 @@
 #define _THREAD_H_
 
 #include "types.h" 
+#include "param.h"  // CACHELINE
+#include "atomic.h"
+#include "lockfree.h"
 
+// Ticket spinlock.  ticket, which arriving threads take, and
+// turn, which waiters spin on, are on separate cache lines, so
+// an arrival does not take the line from under the spinners.
 typedef struct __ticket_lock_t {
-  uint ticket;
-  uint turn;
-} ticket_lock_t;
+  volatile uint ticket;
+  char pad[CACHELINE - sizeof(uint)];
+  volatile uint turn;
+} __attribute__((aligned(CACHELINE))) ticket_lock_t;
+
+#define TICKET_BACKOFF 50  // pauses per waiter ahead between polls
+
+// Sleeping mutex: spins briefly, then waits in futex_wait().
+// state is 0 unlocked, 1 locked, 2 locked with sleepers.
+typedef struct __mutex_t {
+  volatile uint state;
+} mutex_t;
+
+#define MUTEX_SPINS 100  // tries before sleeping in the kernel
+
+// Condition variable.  Waiters sleep on seq, which every
+// signal or broadcast bumps.
+typedef struct __cond_t {
+  volatile uint seq;
+} cond_t;
+
+// Counting semaphore.
+typedef struct __sem_t {
+  volatile uint count;
+  volatile uint waiters;       // threads that may be in futex_wait
+} sem_t;
+
+// Reader-writer lock that prefers writers.  state holds the
+// number of readers, or RW_WRITER while write-locked, plus
+// RW_WAITING once a writer may be waiting, which holds off new
+// readers.  Everyone waits on state, so a change to anything
+// that makes a thread wait ends its futex_wait().
+typedef struct __rwlock_t {
+  volatile uint state;
+} rwlock_t;
+
+// Barrier for n threads.  Each round of waits bumps gen, which
+// is the sense that waiters see reverse, so a thread racing
+// ahead into the next round can't be confused with this one.
+// Waiters spin for BARRIER_SPINS polls, then sleep on gen.
+typedef struct __barrier_t {
+  volatile uint count;         // threads arrived this round
+  volatile uint gen;
+  volatile uint waiters;       // threads that may be in futex_wait
+  uint n;
+} barrier_t;
+
+#define BARRIER_SPINS 1000
+
+#define RW_WRITER  0x80000000
+#define RW_WAITING 0x40000000
+#define FUTEX_ALL 0x7fffffff  // futex_wake() count meaning "everyone"
+
+// Thread-local storage: each thread made by thread_create()
+// has THREAD_TLS_SIZE bytes of its own, zeroed at creation,
+// addressed through %gs.  The first word points at the block
+// itself, so thread_tls() is a single load; the second is the
+// thread's malloc() cache.  The main thread (with %gs still 0)
+// uses thread_main_tls.
+#define THREAD_TLS_SIZE 128
+
+extern char thread_main_tls[THREAD_TLS_SIZE];
+
+static inline void*
+thread_tls(void)
+{
+  ushort gs;
+  void *p;
+
+  asm volatile("movw %%gs, %0" : "=r" (gs));
+  if (gs == 0)
+    return thread_main_tls;
+  asm volatile("movl %%gs:0, %0" : "=r" (p));
+  return p;
+}
+
+// Declare a pointer, var, to this thread's copy of a
+// TLS-resident struct type, like __thread:
+//   TLS_VAR(struct mystats, st); st->count++;
+#define TLS_VAR(type, var) type *var = (type *)((char *)thread_tls() + 2*sizeof(void *))
+
+// Task handle for a thread pool; the caller owns its storage,
+// which must stay valid until task_wait() returns.
+typedef struct __task_t {
+  void (*fn)(void *);
+  void *arg;
+  volatile uint done;
+  volatile uint waiters;       // threads that may be in futex_wait
+} task_t;
+
+#define TPOOL_MAXWORKERS 8
+#define TPOOL_QSIZE 64         // power of two
+
+// Persistent worker pool.  Submission is a bounded lock-free
+// queue of tasks (lockfree.h).  Idle workers sleep on work,
+// which every submission bumps.
+typedef struct __tpool_t {
+  lfqueue_t queue;
+  struct lfslot slot[TPOOL_QSIZE];
+  volatile uint work;
+  volatile uint idle;          // workers that may be in futex_wait
+  volatile uint stop;
+  int nworkers;
+  int tids[TPOOL_MAXWORKERS];
+} tpool_t;
 
 
 int thread_create(int *tid, void (*start_routine)(void *, void *), void *arg1, void *arg2);
-int thread_join(void); 
+int thread_join(int tid);  // tid -1 joins any thread
+int thread_join_many(int *tids, int n);
+void thread_stack_config(uint size, int guard);
+void malloc_tls_flush(void *tls);  // umalloc.c
 
 // Lock functions
 void ticket_lock_init(ticket_lock_t *lk);
 void ticket_lock_acquire(ticket_lock_t *lk);
 void ticket_lock_release(ticket_lock_t *lk);
 
-// Atomic add using x86 xaddl instruction
-static inline uint
-xadd(volatile uint *addr, uint val)
-{
-  asm volatile("lock; xaddl %0, %1"
-               : "+r" (val), "+m" (*addr) // val in/out, *addr in/out
-               : // no pure inputs
-               : "memory");
-  return val; // xaddl returns the original value of *addr
-}
+void mutex_init(mutex_t *m);
+void mutex_lock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+
+void cond_init(cond_t *c);
+void cond_wait(cond_t *c, mutex_t *m);
+void cond_signal(cond_t *c);
+void cond_broadcast(cond_t *c);
+
+void sem_init(sem_t *s, uint value);
+void sem_wait(sem_t *s);
+void sem_post(sem_t *s);
+
+void rwlock_init(rwlock_t *rw);
+void rwlock_rdlock(rwlock_t *rw);
+void rwlock_rdunlock(rwlock_t *rw);
+void rwlock_wrlock(rwlock_t *rw);
+void rwlock_wrunlock(rwlock_t *rw);
+
+void barrier_init(barrier_t *b, uint n);
+int barrier_wait(barrier_t *b);
+
+int tpool_init(tpool_t *pool, int nworkers);
+void tpool_destroy(tpool_t *pool);
+void tpool_submit(tpool_t *pool, task_t *t, void (*fn)(void *), void *arg);
+void task_wait(tpool_t *pool, task_t *t);
+void parallel_for(tpool_t *pool, int begin, int end, int grain,
+                  void (*fn)(int lo, int hi, void *arg), void *arg);
 
 #endif
\ No newline at end of file
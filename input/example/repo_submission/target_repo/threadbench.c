@@ -0,0 +1,429 @@
+// threadbench: thread and lock microbenchmarks, in ops/sec.
+//   threadbench create        thread_create() + thread_join()
+//   threadbench lock [n]      acquire/release of a ticket lock,
+//                             futex mutex and MCS lock, n threads
+//                             (1..NCPU if n is not given)
+//   threadbench pingpong      two threads handing a futex back
+//                             and forth: a switch per op
+//   threadbench ipc           ipc_call() round trips to a server
+//                             thread: a switch each way per op
+//   threadbench green [n]     NGREEN green threads yielding on n
+//                             carriers (2 if n is not given):
+//                             a user-level switch per op
+//   threadbench falseshare [n]  n threads bumping counters that
+//                             share a cache line, then padded ones
+//   threadbench               all of them
+// Times come from the TSC, so compare runs on one machine.
+// Where the cpu has performance counters (perfctr()), each
+// rate is followed by cycles and instructions per op and cache
+// and branch misses per 1000 ops, which tell a lock that
+// bounces its line from one that just spins.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "rusage.h"
+#include "thread.h"
+#include "gthread.h"
+
+#define NCREATE  2000
+#define NLOCK    100000  // per thread
+#define NPING    20000
+#define NBUMP    1000000 // per thread
+#define NGREEN   10000
+#define NGYIELD  10      // per green thread
+
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
+uint cpus;  // TSC cycles per microsecond
+int pmcmask;          // PMC_ events perfctr() says are counted
+uint64 pmc0[NPMC];    // their counts when the run began
+
+// Event counts of this process, its threads and its waited-for
+// children so far.
+void
+pmcsnap(uint64 *pmc)
+{
+  struct rusage self, kids;
+  int i;
+
+  getrusage(0, RUSAGE_SELF, &self);
+  getrusage(0, RUSAGE_CHILDREN, &kids);
+  for(i = 0; i < NPMC; i++)
+    pmc[i] = self.pmc[i] + kids.pmc[i];
+}
+
+// Start a timed run.
+uint64
+start(void)
+{
+  pmcsnap(pmc0);
+  return rdtsc();
+}
+
+// Print ops done in the cycles since t0 as a rate.
+void
+report(char *what, int nthread, uint ops, uint64 t0)
+{
+  static char *names[NPMC] = { "cycles/op", "instr/op", "llcmiss/kop", "brmiss/kop" };
+  uint64 pmc[NPMC];
+  uint us;
+  int i;
+
+  us = udiv64(rdtsc() - t0, cpus);
+  pmcsnap(pmc);
+  if(us == 0)
+    us = 1;
+  if(ops == 0)
+    ops = 1;
+  printf(1, "%s", what);
+  if(nthread)
+    printf(1, " x%d", nthread);
+  printf(1, ": %d ops/sec (%d ops in %d us)",
+         udiv64((uint64)ops * 1000000, us), ops, us);
+  for(i = 0; i < NPMC; i++)
+    if(pmcmask & (1<<i))
+      printf(1, " %s=%d", names[i],
+             udiv64((pmc[i] - pmc0[i]) * (i < PMC_LLCMISS ? 1 : 1000), ops));
+  printf(1, "\n");
+}
+
+// Start n threads running fn(i, arg) and join them all.
+// Returns -1 if one could not be made.
+int
+runthreads(int n, void (*fn)(void*, void*), void *arg)
+{
+  int tids[NCPU], i, ok;
+
+  ok = 0;
+  for(i = 0; i < n; i++)
+    if(thread_create(&tids[i], fn, (void*)i, arg) < 0)
+      break;
+  if(i < n)
+    ok = -1;
+  thread_join_many(tids, i);
+  return ok;
+}
+
+void
+nothing(void *a1, void *a2)
+{
+  exit();
+}
+
+void
+benchcreate(void)
+{
+  int i, tid;
+  uint64 t0;
+
+  t0 = start();
+  for(i = 0; i < NCREATE; i++){
+    if(thread_create(&tid, nothing, 0, 0) < 0 || thread_join(tid) < 0){
+      printf(2, "threadbench: create failed\n");
+      return;
+    }
+  }
+  report("create+join", 0, NCREATE, t0);
+}
+
+// MCS lock: each waiter spins on a node of its own (on its
+// stack) rather than on the lock.
+struct mcsnode {
+  struct mcsnode *volatile next;
+  volatile uint locked;
+};
+
+struct mcslock {
+  struct mcsnode *volatile tail;
+};
+
+void
+mcsacquire(struct mcslock *l, struct mcsnode *me)
+{
+  struct mcsnode *prev;
+
+  me->next = 0;
+  me->locked = 1;
+  prev = (struct mcsnode*)xchg((volatile uint*)&l->tail, (uint)me);
+  if(prev == 0)
+    return;
+  prev->next = me;
+  while(me->locked)
+    ;
+}
+
+void
+mcsrelease(struct mcslock *l, struct mcsnode *me)
+{
+  if(me->next == 0){
+    if(cmpxchg((volatile uint*)&l->tail, (uint)me, 0) == (uint)me)
+      return;
+    while(me->next == 0)
+      ;
+  }
+  me->next->locked = 0;
+}
+
+ticket_lock_t tlock;
+mutex_t mlock;
+struct mcslock qlock;
+volatile uint counter;
+
+void
+ticketloop(void *a1, void *a2)
+{
+  int i;
+
+  for(i = 0; i < NLOCK; i++){
+    ticket_lock_acquire(&tlock);
+    counter++;
+    ticket_lock_release(&tlock);
+  }
+  exit();
+}
+
+void
+mutexloop(void *a1, void *a2)
+{
+  int i;
+
+  for(i = 0; i < NLOCK; i++){
+    mutex_lock(&mlock);
+    counter++;
+    mutex_unlock(&mlock);
+  }
+  exit();
+}
+
+void
+mcsloop(void *a1, void *a2)
+{
+  struct mcsnode me;
+  int i;
+
+  for(i = 0; i < NLOCK; i++){
+    mcsacquire(&qlock, &me);
+    counter++;
+    mcsrelease(&qlock, &me);
+  }
+  exit();
+}
+
+struct {
+  char *name;
+  void (*fn)(void*, void*);
+} locks[] = {
+  { "ticket", ticketloop },
+  { "futex",  mutexloop },
+  { "mcs",    mcsloop },
+};
+
+void
+benchlock(int lo, int hi)
+{
+  int i, n;
+  uint64 t0;
+
+  ticket_lock_init(&tlock);
+  mutex_init(&mlock);
+  for(i = 0; i < sizeof(locks)/sizeof(locks[0]); i++){
+    for(n = lo; n <= hi; n++){
+      counter = 0;
+      t0 = start();
+      if(runthreads(n, locks[i].fn, 0) < 0){
+        printf(2, "threadbench: thread_create failed\n");
+        return;
+      }
+      report(locks[i].name, n, counter, t0);
+      if(counter != n*NLOCK)
+        printf(1, "%s: FAILURE: counter %d, expected %d\n",
+               locks[i].name, counter, n*NLOCK);
+    }
+  }
+}
+
+volatile uint turn;
+
+// Thread i waits for turn == i, then hands it over.
+void
+pinger(void *a1, void *a2)
+{
+  uint me = (uint)a1;
+  int i;
+
+  for(i = 0; i < NPING; i++){
+    while(turn != me)
+      futex_wait(&turn, !me);
+    turn = !me;
+    futex_wake(&turn, 1);
+  }
+  exit();
+}
+
+void
+benchpingpong(void)
+{
+  uint64 t0;
+
+  turn = 0;
+  t0 = start();
+  if(runthreads(2, pinger, 0) < 0){
+    printf(2, "threadbench: thread_create failed\n");
+    return;
+  }
+  report("pingpong", 0, 2*NPING, t0);
+}
+
+// Answer each call with its first word plus one.
+void
+ipcserver(void *a1, void *a2)
+{
+  uint msg[4];
+  int i, pid;
+
+  pid = ipc_reply_wait(0, msg);
+  for(i = 1; i < NPING; i++){
+    msg[0]++;
+    pid = ipc_reply_wait(pid, msg);
+  }
+  msg[0]++;
+  ipc_reply(pid, msg);
+  exit();
+}
+
+void
+benchipc(void)
+{
+  uint msg[4];
+  int tid, i, bad;
+  uint64 t0;
+
+  t0 = start();
+  if(thread_create(&tid, ipcserver, 0, 0) < 0){
+    printf(2, "threadbench: thread_create failed\n");
+    return;
+  }
+  bad = 0;
+  for(i = 0; i < NPING; i++){
+    msg[0] = i;
+    if(ipc_call(tid, msg) < 0 || msg[0] != i + 1)
+      bad++;
+  }
+  thread_join(tid);
+  report("ipc call", 0, NPING, t0);
+  if(bad)
+    printf(1, "ipc call: FAILURE: %d bad replies\n", bad);
+}
+
+volatile uint gdone;
+
+void
+greeter(void *arg)
+{
+  int i;
+
+  for(i = 0; i < NGYIELD; i++)
+    gt_yield();
+  xadd(&gdone, 1);
+}
+
+void
+benchgreen(int n)
+{
+  uint64 t0;
+  int i;
+
+  if(gt_start(n) < 0){
+    printf(2, "threadbench: gt_start failed\n");
+    return;
+  }
+  gdone = 0;
+  t0 = start();
+  for(i = 0; i < NGREEN; i++)
+    if(gt_spawn(greeter, 0) < 0)
+      break;
+  gt_wait();
+  report("green yield", n, i*NGYIELD, t0);
+  if(gdone != i)
+    printf(1, "green yield: FAILURE: %d of %d finished\n", gdone, i);
+}
+
+// Counters for the false-sharing runs: packed[] puts them all
+// in one cache line, padded[] each in one of its own.
+volatile uint packed[NCPU];
+struct {
+  volatile uint n;
+  char pad[CACHELINE - sizeof(uint)];
+} padded[NCPU] __attribute__((aligned(CACHELINE)));
+
+void
+bumper(void *a1, void *a2)
+{
+  volatile uint *c;
+  int i;
+
+  c = a2 ? &padded[(uint)a1].n : &packed[(uint)a1];
+  for(i = 0; i < NBUMP; i++)
+    (*c)++;
+  exit();
+}
+
+void
+benchfalseshare(int n)
+{
+  uint64 t0;
+
+  t0 = start();
+  if(runthreads(n, bumper, 0) < 0)
+    goto bad;
+  report("shared line", n, n*NBUMP, t0);
+  t0 = start();
+  if(runthreads(n, bumper, (void*)1) < 0)
+    goto bad;
+  report("padded", n, n*NBUMP, t0);
+  return;
+
+bad:
+  printf(2, "threadbench: thread_create failed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if((cpus = vtscpertick() / USPERTICK) == 0){
+    printf(2, "threadbench: TSC not calibrated yet, assuming 1GHz\n");
+    cpus = 1000;
+  }
+  pmcmask = perfctr(0, pmc0);
+  if(pmcmask < 0)
+    pmcmask = 0;
+  n = argc > 2 ? atoi(argv[2]) : 0;
+  if(n < 0 || n > NCPU){
+    printf(2, "threadbench: at most %d threads\n", NCPU);
+    exit();
+  }
+  if(argc < 2 || strcmp(argv[1], "create") == 0)
+    benchcreate();
+  if(argc < 2 || strcmp(argv[1], "lock") == 0)
+    benchlock(n ? n : 1, n ? n : NCPU);
+  if(argc < 2 || strcmp(argv[1], "pingpong") == 0)
+    benchpingpong();
+  if(argc < 2 || strcmp(argv[1], "ipc") == 0)
+    benchipc();
+  if(argc < 2 || strcmp(argv[1], "green") == 0)
+    benchgreen(n ? n : 2);
+  if(argc < 2 || strcmp(argv[1], "falseshare") == 0)
+    benchfalseshare(n ? n : 2);
+  exit();
+}
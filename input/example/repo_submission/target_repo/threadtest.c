@@ -1,17 +1,26 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "rusage.h"
 #include "thread.h" // Your thread library header
 #include "fs.h"     // For T_DIR, etc if needed by other includes, not directly by test
 
 #define NUM_THREADS 2
 #define NUM_INCREMENTS 100000
+#define NUM_ELEMS 10000
 
 volatile int shared_counter = 0;
 ticket_lock_t counter_lock;
+mutex_t counter_mutex;
+
+// Per-thread counts, kept in thread-local storage.
+struct tls_counts {
+    int increments;
+};
 
 void incrementer_thread(void *arg1, void *arg2) { // Match clone's function signature
     int thread_num = *(int*)arg1;
+    TLS_VAR(struct tls_counts, mine);
     // arg2 is unused in this example, could be passed as 0 or another value
     printf(1, "Thread %d (PID %d): Starting...\n", thread_num, getpid());
     
@@ -19,25 +28,236 @@ void incrementer_thread(void *arg1, void *arg2) { // Match clone's function sign
         ticket_lock_acquire(&counter_lock);
         shared_counter++;
         ticket_lock_release(&counter_lock);
+        mine->increments++;
     }
+    if (mine->increments != NUM_INCREMENTS)
+        printf(1, "Thread %d: FAILURE: TLS count %d\n", thread_num, mine->increments);
     
     printf(1, "Thread %d (PID %d): Finished (%d increments).\n", thread_num, getpid(), NUM_INCREMENTS);
     exit(); // IMPORTANT: Threads must call exit()
 }
 
-int main(int argc, char *argv[]) {
+// Same as incrementer_thread, but waiters sleep on a futex instead of spinning.
+void mutex_incrementer_thread(void *arg1, void *arg2) {
+    int thread_num = *(int*)arg1;
+    printf(1, "Thread %d (PID %d): Starting (mutex)...\n", thread_num, getpid());
+
+    for (int i = 0; i < NUM_INCREMENTS; i++) {
+        mutex_lock(&counter_mutex);
+        shared_counter++;
+        mutex_unlock(&counter_mutex);
+    }
+
+    printf(1, "Thread %d (PID %d): Finished (%d increments).\n", thread_num, getpid(), NUM_INCREMENTS);
+    exit();
+}
+
+// Same again, but the lock is a token: the one node on a
+// Treiber stack, which a thread must pop to hold the lock.
+lfstack_t token_stack;
+lfnode_t token;
+
+void lfstack_incrementer_thread(void *arg1, void *arg2) {
+    int thread_num = *(int*)arg1;
+    lfnode_t *n;
+    printf(1, "Thread %d (PID %d): Starting (lock-free stack)...\n", thread_num, getpid());
+
+    for (int i = 0; i < NUM_INCREMENTS; i++) {
+        while ((n = lfstack_pop(&token_stack)) == 0)
+            cpu_relax();
+        shared_counter++;
+        lfstack_push(&token_stack, n);
+    }
+
+    printf(1, "Thread %d (PID %d): Finished (%d increments).\n", thread_num, getpid(), NUM_INCREMENTS);
+    exit();
+}
+
+#define NUM_ITEMS 10000
+#define QUEUE_SIZE 64          // power of two
+
+lfqueue_t queue;
+struct lfslot queue_slots[QUEUE_SIZE];
+spsc_t ring;
+void *ring_buf[QUEUE_SIZE];
+shcounter_t pushes;
+
+// Push 1..NUM_ITEMS onto the ring or, with arg2 set, the queue.
+void producer_thread(void *arg1, void *arg2) {
+    for (uint i = 1; i <= NUM_ITEMS; i++) {
+        if (arg2)
+            while (lfqueue_push(&queue, (void *)i) < 0)
+                cpu_relax();
+        else
+            while (spsc_push(&ring, (void *)i) < 0)
+                cpu_relax();
+        shcounter_add(&pushes, 1);
+    }
+    exit();
+}
+
+// Sum what NUM_THREADS producers send through the MPMC queue and
+// one producer through the SPSC ring, counting pushes on a
+// sharded counter.
+int lockfree_test(void) {
+    int tids[NUM_THREADS + 1];
+    int nitems = (NUM_THREADS + 1) * NUM_ITEMS;
+    int expected_value = (NUM_THREADS + 1) * (NUM_ITEMS * (NUM_ITEMS + 1) / 2);
+    int n = 0;
+    void *item;
+
+    printf(1, "Main (PID %d): Starting lock-free queue test with %d producers...\n",
+           getpid(), NUM_THREADS + 1);
+    lfqueue_init(&queue, queue_slots, QUEUE_SIZE);
+    spsc_init(&ring, ring_buf, QUEUE_SIZE);
+    shcounter_init(&pushes);
+    shared_counter = 0;
+    for (int i = 0; i <= NUM_THREADS; i++) {
+        if (thread_create(&tids[i], producer_thread, 0, (void *)(i < NUM_THREADS)) < 0) {
+            printf(1, "Main: Failed to create producer %d\n", i + 1);
+            return -1;
+        }
+    }
+    while (n < nitems) {
+        if ((item = lfqueue_pop(&queue)) != 0 || (item = spsc_pop(&ring)) != 0) {
+            shared_counter += (uint)item;
+            n++;
+        } else {
+            cpu_relax();
+        }
+    }
+    thread_join_many(tids, NUM_THREADS + 1);
+
+    printf(1, "Main: Final counter value: %d, pushes %d\n", shared_counter, shcounter_read(&pushes));
+    printf(1, "Main: Expected counter value: %d, pushes %d\n", expected_value, nitems);
+    if (shared_counter == expected_value && shcounter_read(&pushes) == nitems) {
+        printf(1, "SUCCESS: Counter matches expected value!\n");
+        return 0;
+    }
+    printf(1, "FAILURE: Counter mismatch!\n");
+    return -1;
+}
+
+#define NUM_PHASES 100
+
+barrier_t phase_barrier;
+volatile uint phase_counts[NUM_PHASES];
+volatile uint phase_errors;
+
+// Each phase, add to that phase's count, then check after the
+// barrier that every thread has.
+void phase_thread(void *arg1, void *arg2) {
+    for (int p = 0; p < NUM_PHASES; p++) {
+        xadd(&phase_counts[p], 1);
+        barrier_wait(&phase_barrier);
+        if (phase_counts[p] != NUM_THREADS)
+            xadd(&phase_errors, 1);
+    }
+    exit();
+}
+
+// Run NUM_THREADS threads through NUM_PHASES barrier rounds.
+int barrier_test(void) {
+    int tids[NUM_THREADS];
+
+    printf(1, "Main (PID %d): Starting barrier test with %d threads, %d phases...\n",
+           getpid(), NUM_THREADS, NUM_PHASES);
+    barrier_init(&phase_barrier, NUM_THREADS);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        if (thread_create(&tids[i], phase_thread, 0, 0) < 0) {
+            printf(1, "Main: Failed to create thread %d\n", i + 1);
+            return -1;
+        }
+    }
+    thread_join_many(tids, NUM_THREADS);
+
+    if (phase_errors == 0) {
+        printf(1, "SUCCESS: Every phase saw every thread!\n");
+        return 0;
+    }
+    printf(1, "FAILURE: %d phase checks failed!\n", phase_errors);
+    return -1;
+}
+
+int elems[NUM_ELEMS];
+
+// parallel_for body: add the chunk's sum to the counter.
+void sum_range(int lo, int hi, void *arg) {
+    int sum = 0;
+
+    for (int i = lo; i < hi; i++)
+        sum += elems[i];
+    mutex_lock(&counter_mutex);
+    shared_counter += sum;
+    mutex_unlock(&counter_mutex);
+}
+
+// Sum an array with parallel_for on a NUM_THREADS-worker pool.
+int pool_test(void) {
+    tpool_t pool;
+    int expected_value = 0;
+
+    printf(1, "Main (PID %d): Starting thread pool test with %d workers...\n",
+           getpid(), NUM_THREADS);
+    for (int i = 0; i < NUM_ELEMS; i++) {
+        elems[i] = i;
+        expected_value += i;
+    }
+    if (tpool_init(&pool, NUM_THREADS) < 0) {
+        printf(1, "Main: Failed to start thread pool\n");
+        return -1;
+    }
+
+    // Run several rounds so that the same workers are reused.
+    shared_counter = 0;
+    for (int round = 0; round < 10; round++)
+        parallel_for(&pool, 0, NUM_ELEMS, 100, sum_range, 0);
+    expected_value *= 10;
+    tpool_destroy(&pool);
+
+    printf(1, "Main: Final counter value: %d\n", shared_counter);
+    printf(1, "Main: Expected counter value: %d\n", expected_value);
+    if (shared_counter == expected_value) {
+        printf(1, "SUCCESS: Counter matches expected value!\n");
+        return 0;
+    }
+    printf(1, "FAILURE: Counter mismatch!\n");
+    return -1;
+}
+
+// Print the cycles and cache misses per increment since before,
+// where the cpu counts them (perfctr()), to tell a lock that
+// bounces its cache line from one that is just contended.
+void report_events(char *name, struct rusage *before) {
+    struct rusage after;
+    uint64 pmc[NPMC];
+    uint n = NUM_THREADS * NUM_INCREMENTS;
+
+    if (perfctr(0, pmc) < 0 || getrusage(0, RUSAGE_SELF, &after) < 0)
+        return;
+    printf(1, "Main: %s: %d cycles/increment, %d LLC misses and %d branch misses per 1000\n",
+           name, udiv64(after.pmc[PMC_CYCLES] - before->pmc[PMC_CYCLES], n),
+           udiv64((after.pmc[PMC_LLCMISS] - before->pmc[PMC_LLCMISS]) * 1000, n),
+           udiv64((after.pmc[PMC_BRMISS] - before->pmc[PMC_BRMISS]) * 1000, n));
+}
+
+// Run NUM_THREADS copies of fn, join them and check the shared counter.
+int run_test(char *name, void (*fn)(void *, void *)) {
     int tids[NUM_THREADS]; // To store PIDs returned by thread_create
     int args[NUM_THREADS];
+    struct rusage before;
     
-    printf(1, "Main (PID %d): Starting test with %d threads, %d increments each...\n",
-           getpid(), NUM_THREADS, NUM_INCREMENTS);
+    printf(1, "Main (PID %d): Starting %s test with %d threads, %d increments each...\n",
+           getpid(), name, NUM_THREADS, NUM_INCREMENTS);
     
-    ticket_lock_init(&counter_lock);
+    shared_counter = 0;
+    getrusage(0, RUSAGE_SELF, &before);
     
     for (int i = 0; i < NUM_THREADS; i++) {
         args[i] = i + 1; // Thread number 1 to N
+        tids[i] = 0;
         // Pass thread's own arg struct, and a null for arg2
-        int ret = thread_create(&tids[i], incrementer_thread, &args[i], 0); 
+        int ret = thread_create(&tids[i], fn, &args[i], 0); 
         if (ret < 0) {
             printf(1, "Main: Failed to create thread %d\n", i + 1);
             continue;
@@ -49,17 +269,16 @@ int main(int argc, char *argv[]) {
     for (int i = 0; i < NUM_THREADS; i++) {
         if (tids[i] == 0) continue; // If creation failed for this slot
 
-        int joined_pid = thread_join(); // Joins ANY child thread
+        int joined_pid = thread_join(tids[i]); // Joins this specific thread
         if (joined_pid < 0) {
-            printf(1, "Main: Error or no more threads to join.\n");
+            printf(1, "Main: Error joining thread %d.\n", tids[i]);
             break; 
         }
-        // To make sure we joined the correct number of threads,
-        // we don't really care *which* specific one joined here, just that one did.
         printf(1, "Main: Joined a thread with PID %d.\n", joined_pid);
     }
     
     printf(1, "Main: All threads believed to be joined.\n");
+    report_events(name, &before);
     
     int expected_value = NUM_THREADS * NUM_INCREMENTS;
     printf(1, "Main: Final counter value: %d\n", shared_counter);
@@ -67,9 +286,24 @@ int main(int argc, char *argv[]) {
 
     if (shared_counter == expected_value) {
         printf(1, "SUCCESS: Counter matches expected value!\n");
-    } else {
-        printf(1, "FAILURE: Counter mismatch!\n");
+        return 0;
     }
+    printf(1, "FAILURE: Counter mismatch!\n");
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    ticket_lock_init(&counter_lock);
+    mutex_init(&counter_mutex);
+
+    run_test("ticket lock", incrementer_thread);
+    run_test("mutex", mutex_incrementer_thread);
+    lfstack_init(&token_stack);
+    lfstack_push(&token_stack, &token);
+    run_test("lock-free stack", lfstack_incrementer_thread);
+    lockfree_test();
+    barrier_test();
+    pool_test();
    
     exit();
-}
\ No newline at end of file
+}
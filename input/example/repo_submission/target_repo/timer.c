@@ -0,0 +1,398 @@
+// The clock tick and per-cpu timers.
+//
+// Until vdsotick() has measured the TSC against the tick,
+// every cpu's LAPIC timer interrupts periodically and cpu 0
+// counts ticks.  After that the kernel is tickless: each cpu
+// arms its LAPIC timer one-shot for its next preemption tick
+// or for the earliest timer on its wheel, whichever is first,
+// and ticks counts periods of tscpertick TSC cycles, advanced
+// by whichever cpu's interrupt finds that one has passed.  A
+// cpu halted in the idle loop has nothing to preempt, so it
+// arms for its timers only, and an idle machine takes no
+// interrupts at all.  Code that sleeps on &ticks calls
+// tickhold() first, which keeps idle cpus ticking for it.
+//
+// Timers are kept per cpu, on a wheel of NTWHEEL slots hashed
+// by the wheel granule (a power of two cycles, at most a tick)
+// they expire in.  A timer wakes one sleeping process: the
+// one that armed it, if it still sleeps on the timer's
+// channel.  timersleep() puts the caller on the wheel of the
+// cpu it is running on and sleeps until the deadline, which
+// the LAPIC hits with sub-tick precision.  sleeptimeout()
+// sleeps on any channel, and the timer ends the sleep if no
+// wakeup() does first, so timed waits cost nothing per tick.
+// Before the kernel goes tickless, timers wait on ticktimers
+// instead, for ticked() to fire them.
+//
+// Each wheel's lock protects its slots; it is taken before
+// ptable.lock, and after the lock of a sleeptimeout() caller.
+// The rest of a wheel belongs to its cpu, which touches it
+// with interrupts off.  tickslock protects ticktimers.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+
+#define NTWHEEL 64
+
+struct timer {
+  uint64 when;          // TSC deadline, or tick on ticktimers
+  struct timer *next;
+  struct twheel *wheel; // the wheel it is on, 0 on ticktimers
+  int pending;          // 0 once it has fired
+  struct proc *p;       // the sleeper to wake
+  void *chan;           // what p sleeps on
+};
+
+struct twheel {
+  struct spinlock lock;
+  struct timer *slot[NTWHEEL];
+  int n;                // timers on the wheel
+  uint64 cur;           // granule expired up to
+  uint64 nexttick;      // TSC of this cpu's next preemption
+  uint64 armed;         // TSC of the next interrupt, ~0 if none
+  int idle;             // halted: no preemption tick
+} twheels[NCPU];
+
+static int tickless;
+static uint tscpertick;
+static uint tscshift;   // log2 of the wheel granule
+static uint tsc2lapic;  // LAPIC counts per cycle, << 24
+static uint64 ticktsc;  // TSC of the last tick
+static int tickholds;
+static struct timer *ticktimers;  // before tickless
+
+void
+timerinit(void)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++){
+    initlock(&twheels[i].lock, "timer");
+    twheels[i].armed = ~0ULL;
+  }
+}
+
+// n / d, which the kernel has no libgcc routine for.
+static uint
+div64(uint64 n, uint d)
+{
+  uint64 r;
+  uint q;
+  int i;
+
+  q = r = 0;
+  for(i = 63; i >= 0; i--){
+    r = (r << 1) | ((n >> i) & 1);
+    q <<= 1;
+    if(r >= d){
+      r -= d;
+      q |= 1;
+    }
+  }
+  return q;
+}
+
+// Keep idle cpus ticking (n 1) or let them stop (n -1), for
+// code about to sleep on, or done sleeping on, &ticks.
+void
+tickhold(int n)
+{
+  __sync_fetch_and_add(&tickholds, n);
+}
+
+// Tick work, after ticks changes.  Caller holds tickslock.
+static void
+ticked(void)
+{
+  struct timer **pp, *tm;
+  uint t;
+
+  t = ticks;
+  wakeup(&ticks);
+  for(pp = &ticktimers; (tm = *pp) != 0; ){
+    if((int)(t - (uint)tm->when) >= 0){
+      *pp = tm->next;
+      tm->pending = 0;
+      wakeproc(tm->p, tm->chan);
+    } else
+      pp = &tm->next;
+  }
+  release(&tickslock);
+  if((tscpertick = vdsotick(t)) != 0 && !tickless){
+    // Go tickless; the cpus switch on their next tick.
+    for(tscshift = 0; (2U << tscshift) <= tscpertick; tscshift++)
+      ;
+    tsc2lapic = div64((uint64)TICKCOUNT << 24, tscpertick);
+    ticktsc = rdtsc();
+    tickless = 1;
+  }
+}
+
+// Advance ticks to the TSC.  After a long idle spell this
+// loops once per tick missed, which is still cheap next to
+// the interrupts it saved.
+static void
+tickupdate(uint64 now)
+{
+  int n;
+
+  if(now < ticktsc + tscpertick)
+    return;
+  acquire(&tickslock);
+  for(n = 0; now >= ticktsc + tscpertick; n++){
+    ticktsc += tscpertick;
+    ticks++;
+  }
+  if(n == 0){
+    release(&tickslock);
+    return;
+  }
+  ticked();
+}
+
+// Put t on wheel w.  Caller holds w->lock.
+static void
+twadd(struct twheel *w, struct timer *t)
+{
+  struct timer **s;
+
+  s = &w->slot[(t->when >> tscshift) % NTWHEEL];
+  t->next = *s;
+  *s = t;
+  t->wheel = w;
+  t->pending = 1;
+  w->n++;
+}
+
+// Take t off its wheel.  Caller holds t->wheel->lock.
+static void
+twdel(struct timer *t)
+{
+  struct timer **pp;
+  struct twheel *w = t->wheel;
+
+  for(pp = &w->slot[(t->when >> tscshift) % NTWHEEL]; *pp != t; pp = &(*pp)->next)
+    ;
+  *pp = t->next;
+  t->pending = 0;
+  w->n--;
+}
+
+// Fire w's timers whose deadlines have passed.
+// Caller holds w->lock.
+static void
+twexpire(struct twheel *w, uint64 now)
+{
+  struct timer *t, *next;
+  uint64 g, end;
+
+  end = now >> tscshift;
+  g = w->cur;
+  if(end - g >= NTWHEEL)
+    g = end - NTWHEEL + 1;
+  for(; w->n > 0 && g <= end; g++){
+    for(t = w->slot[g % NTWHEEL]; t; t = next){
+      next = t->next;
+      if(t->when <= now){
+        twdel(t);
+        wakeproc(t->p, t->chan);
+      }
+    }
+  }
+  w->cur = end;
+}
+
+// The earliest deadline on w, or the end of the wheel's
+// horizon if all are further out, or ~0 if it is empty.
+// Caller holds w->lock.
+static uint64
+twnext(struct twheel *w, uint64 now)
+{
+  struct timer *t;
+  uint64 g, best;
+  int i;
+
+  if(w->n == 0)
+    return ~0ULL;
+  g = now >> tscshift;
+  for(i = 0; i < NTWHEEL; i++, g++){
+    best = ~0ULL;
+    for(t = w->slot[g % NTWHEEL]; t; t = t->next)
+      if((t->when >> tscshift) <= g && t->when < best)
+        best = t->when;
+    if(best != ~0ULL)
+      return best;
+  }
+  return g << tscshift;
+}
+
+// Arm this cpu's LAPIC timer for w's next event.
+// Caller holds w->lock.
+static void
+twarm(struct twheel *w, uint64 now)
+{
+  uint64 when, d;
+
+  when = twnext(w, now);
+  if((!w->idle || tickholds > 0) && w->nexttick < when)
+    when = w->nexttick;
+  w->armed = when;
+  if(when == ~0ULL){
+    lapiconeshot(0);
+    return;
+  }
+  d = when > now ? when - now : 1;
+  if(d > 0xFFFFFFFF)
+    d = 0xFFFFFFFF;
+  d = (d * tsc2lapic) >> 24;
+  lapiconeshot(d == 0 ? 1 : d > 0xFFFFFFFF ? 0xFFFFFFFF : d);
+}
+
+// The timer interrupt.  Returns whether this cpu's
+// preemption tick has come.
+int
+timerintr(void)
+{
+  struct twheel *w;
+  uint64 now;
+  int tick;
+
+  if(!tickless){
+    if(cpuid() == 0){
+      acquire(&tickslock);
+      ticks++;
+      ticked();
+    }
+    return 1;
+  }
+
+  now = rdtsc();
+  tickupdate(now);
+  w = &twheels[cpuid()];
+  acquire(&w->lock);
+  twexpire(w, now);
+  tick = !w->idle && now >= w->nexttick;
+  if(tick || w->nexttick == 0)
+    w->nexttick = now + tscpertick;
+  twarm(w, now);
+  release(&w->lock);
+  return tick;
+}
+
+// This cpu is about to halt in the idle loop (idle 1), or is
+// back from it (idle 0).  Called with interrupts off.
+void
+timeridle(int idle)
+{
+  struct twheel *w;
+  uint64 now;
+
+  if(!tickless)
+    return;
+  w = &twheels[cpuid()];
+  acquire(&w->lock);
+  now = rdtsc();
+  w->idle = idle;
+  if(!idle)
+    w->nexttick = now + tscpertick;
+  twarm(w, now);
+  release(&w->lock);
+}
+
+// Arm t to wake the caller, sleeping on chan, in n ticks and
+// us microseconds, us less than a tick.  Returns the lock
+// that guards t, held, for tdisarm().
+static struct spinlock*
+tarm(struct timer *t, void *chan, uint n, uint us)
+{
+  struct twheel *w;
+
+  t->p = myproc();
+  t->chan = chan;
+  if(!tickless){
+    // Ticks are all there is.
+    tickhold(1);
+    acquire(&tickslock);
+    t->when = ticks + n + (us + USPERTICK - 1) / USPERTICK;
+    t->wheel = 0;
+    t->pending = 1;
+    t->next = ticktimers;
+    ticktimers = t;
+    return &tickslock;
+  }
+
+  pushcli();
+  w = &twheels[cpuid()];
+  popcli();
+  acquire(&w->lock);
+  t->when = rdtsc() + (uint64)n * tscpertick +
+            div64((uint64)us * tscpertick, USPERTICK);
+  twadd(w, t);
+  if(t->when < w->armed && w == &twheels[cpuid()])
+    twarm(w, rdtsc());
+  return &w->lock;
+}
+
+// Take t off its wheel or ticktimers, if it has not fired.
+// Caller holds the lock tarm() returned.
+static void
+tdisarm(struct timer *t)
+{
+  struct timer **pp;
+
+  if(t->wheel){
+    if(t->pending)
+      twdel(t);
+    return;
+  }
+  if(t->pending){
+    for(pp = &ticktimers; *pp != t; pp = &(*pp)->next)
+      ;
+    *pp = t->next;
+    t->pending = 0;
+  }
+  tickhold(-1);
+}
+
+// Sleep for n ticks and us microseconds, us less than a
+// tick.  Returns -1 if killed.
+int
+timersleep(uint n, uint us)
+{
+  struct timer t;
+  struct spinlock *lk;
+
+  lk = tarm(&t, &t, n, us);
+  while(t.pending && !myproc()->killed)
+    sleep(&t, lk);
+  tdisarm(&t);
+  release(lk);
+  return myproc()->killed ? -1 : 0;
+}
+
+// Like sleep(chan, lk), but give up after n ticks if nobody
+// has woken chan by then.  Returns 1 if the n ticks passed,
+// else 0.  As with sleep(), the caller rechecks its condition
+// and myproc()->killed.  lk must not be ptable.lock.
+int
+sleeptimeout(void *chan, struct spinlock *lk, uint n)
+{
+  struct timer t;
+  struct spinlock *tl;
+  int timedout;
+
+  tl = tarm(&t, chan, n, 0);
+  release(tl);
+  sleepcond(chan, lk, &t.pending);
+  acquire(tl);
+  timedout = !t.pending;
+  tdisarm(&t);
+  release(tl);
+  return timedout;
+}
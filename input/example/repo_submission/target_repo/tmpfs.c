@@ -0,0 +1,213 @@
+// tmpfs: a file system kept in memory, for scratch files.
+//
+// Its inodes are those of device TMPDEV in the inode cache, and
+// fs.c's ialloc(), ilock(), iupdate(), itrunc(), readi() and
+// writei() hand them here instead of to the disk.  What the disk
+// would hold for an inode -- its type, link count and size -- is
+// in tmpfs.node[inum], and its data is in kalloc'd pages listed
+// by index pages, so nothing goes through the buffer cache or the
+// log.  Directories are ordinary directory data, so dirlookup()
+// and dirlink() work unchanged.  mount() in fs.c puts the root,
+// inum ROOTINO, on a directory of the disk.
+//
+// A node and its pages are protected by the lock of its inode,
+// as an on-disk inode is; tmpfs.lock only serializes allocating
+// nodes.  Pages start out zero and files only shrink to nothing,
+// so whatever lies past the end of a file reads as zero, as in
+// the fresh blocks balloc() gives the disk file system.
+//
+// readi() may hand a process a whole page of a file itself,
+// copy-on-write, instead of a copy (see uvmsharepage()), and
+// pagein() may map one; tmpwrite() writes to a copy of a page
+// that is shared in this way.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "meminfo.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define PPI     (PGSIZE / sizeof(char*))  // page pointers per index page
+#define NTMPIND ((MAXFILE*BSIZE/PGSIZE + PPI - 1) / PPI)
+
+struct tmpnode {
+  short type;     // 0 if the node is free
+  short major;
+  short minor;
+  short nlink;
+  uint size;
+  char **ind[NTMPIND];  // index pages, listing the data pages
+};
+
+struct {
+  struct spinlock lock;
+  struct tmpnode node[NTMPINODE];
+} tmpfs;
+
+void
+tmpinit(void)
+{
+  initlock(&tmpfs.lock, "tmpfs");
+  tmpfs.node[ROOTINO].type = T_DIR;
+  tmpfs.node[ROOTINO].nlink = 1;
+}
+
+// Allocate a node of type type.  Returns its inum, or 0 if
+// there are none free.
+uint
+tmpialloc(short type)
+{
+  struct tmpnode *t;
+
+  acquire(&tmpfs.lock);
+  for(t = &tmpfs.node[ROOTINO+1]; t < &tmpfs.node[NTMPINODE]; t++){
+    if(t->type == 0){
+      memset(t, 0, sizeof(*t));
+      t->type = type;
+      release(&tmpfs.lock);
+      return t - tmpfs.node;
+    }
+  }
+  release(&tmpfs.lock);
+  return 0;
+}
+
+// Fill in ip from its node, as ilock() does from the disk.
+void
+tmpiload(struct inode *ip)
+{
+  struct tmpnode *t = &tmpfs.node[ip->inum];
+
+  ip->type = t->type;
+  ip->major = t->major;
+  ip->minor = t->minor;
+  ip->nlink = t->nlink;
+  ip->size = t->size;
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+}
+
+// Copy ip to its node, as iupdate() does to the disk.  Type 0
+// frees the node.
+void
+tmpiupdate(struct inode *ip)
+{
+  struct tmpnode *t = &tmpfs.node[ip->inum];
+
+  t->major = ip->major;
+  t->minor = ip->minor;
+  t->nlink = ip->nlink;
+  t->size = ip->size;
+  acquire(&tmpfs.lock);
+  t->type = ip->type;
+  release(&tmpfs.lock);
+}
+
+// Return where the index of t lists page pgno, making the
+// index page if alloc is set; 0 if it can't.
+static char**
+tmpslot(struct tmpnode *t, uint pgno, int alloc)
+{
+  char ***ind;
+
+  ind = &t->ind[pgno / PPI];
+  if(*ind == 0 && (!alloc || (*ind = (char**)kzalloc(KM_TMPFS)) == 0))
+    return 0;
+  return *ind + pgno % PPI;
+}
+
+// Free the pages of ip.
+void
+tmptrunc(struct inode *ip)
+{
+  struct tmpnode *t = &tmpfs.node[ip->inum];
+  int i, j;
+
+  for(i = 0; i < NTMPIND; i++){
+    if(t->ind[i] == 0)
+      continue;
+    for(j = 0; j < PPI; j++)
+      if(t->ind[i][j])
+        kfree(t->ind[i][j]);
+    kfree((char*)t->ind[i]);
+    t->ind[i] = 0;
+  }
+}
+
+// Read n bytes at off in ip, which readi() has checked are
+// inside the file.  Caller must hold ip->lock.
+int
+tmpread(struct inode *ip, char *dst, uint off, uint n)
+{
+  struct tmpnode *t = &tmpfs.node[ip->inum];
+  uint tot, m;
+  char **pg;
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((pg = tmpslot(t, off/PGSIZE, 0)) == 0 || *pg == 0){
+      memset(dst, 0, m);
+      continue;
+    }
+    // A whole page for a page of user memory: share it.
+    if(m == PGSIZE && (uint)dst < KERNBASE && (uint)dst % PGSIZE == 0 &&
+       uvmsharepage((uint)dst, *pg) == 0)
+      continue;
+    memmove(dst, *pg + off%PGSIZE, m);
+  }
+  return n;
+}
+
+// Write n bytes at off in ip, which writei() has checked.
+// Returns the number written, which is short if memory runs
+// out, or -1 if none could be.  Caller must hold ip->lock
+// and update ip->size.
+int
+tmpwrite(struct inode *ip, char *src, uint off, uint n)
+{
+  struct tmpnode *t = &tmpfs.node[ip->inum];
+  uint tot, m;
+  char **pg, *mem;
+
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((pg = tmpslot(t, off/PGSIZE, 1)) == 0)
+      break;
+    if(*pg == 0){
+      if((*pg = kzalloc(KM_TMPFS)) == 0)
+        break;
+    } else if(krefcount(*pg) > 1){
+      // Mapped copy-on-write: leave the page to its readers.
+      if((mem = kalloc(KM_TMPFS)) == 0)
+        break;
+      memmove(mem, *pg, PGSIZE);
+      kfree(*pg);
+      *pg = mem;
+    }
+    memmove(*pg + off%PGSIZE, src, m);
+  }
+  if(tot == 0 && n > 0)
+    return -1;
+  return tot;
+}
+
+// Return the page of ip at page-aligned offset off, with a
+// kref() reference for the caller, as readipage() does, or 0.
+// Caller must hold ip->lock.
+char*
+tmppage(struct inode *ip, uint off)
+{
+  char **pg;
+
+  if((pg = tmpslot(&tmpfs.node[ip->inum], off/PGSIZE, 0)) == 0 || *pg == 0)
+    return 0;
+  kref(*pg);
+  return *pg;
+}
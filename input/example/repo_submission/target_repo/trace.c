@@ -0,0 +1,121 @@
+// Kernel event tracing.
+//
+// Tracepoints call trace(TR_..., arg), which appends an event
+// with a TSC timestamp to the running cpu's ring, with no lock:
+// only that cpu writes its ring, with interrupts off.  The
+// TRACE device (/dev/trace) reads the events not yet read, in
+// order per cpu; writing 1 to it starts tracing and 0 stops
+// it.  A reader can find an event being overwritten as it
+// copies it: it checks the ring's head again afterwards, and
+// events that were lapped count as dropped.  KTRACE in param.h
+// compiles the tracepoints out.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "trace.h"
+
+#define NTRACEEV 512  // events each cpu keeps
+
+int tracing;
+
+struct {
+  struct spinlock lock;  // serializes readers
+  uint dropped;
+  struct {
+    volatile uint head;  // events written
+    uint tail;           // events read
+    struct traceev ev[NTRACEEV];
+  } __attribute__((aligned(CACHELINE))) cpu[NCPU];
+} tracebuf;
+
+// Record event ev with argument arg.  Called by trace().
+void
+traceev(int ev, uint arg)
+{
+  struct traceev *e;
+  struct proc *p;
+  int c;
+
+  pushcli();
+  c = cpuid();
+  p = mycpu()->proc;
+  e = &tracebuf.cpu[c].ev[tracebuf.cpu[c].head % NTRACEEV];
+  e->tsc = rdtsc();
+  e->ev = ev;
+  e->cpu = c;
+  e->pid = p ? p->pid : 0;
+  e->arg = arg;
+  __sync_synchronize();
+  tracebuf.cpu[c].head++;
+  popcli();
+}
+
+// Read as many whole events as fit in n bytes.
+static int
+traceread(struct inode *ip, char *dst, int n)
+{
+  int c, i;
+  uint head, t;
+
+  i = 0;
+  acquire(&tracebuf.lock);
+  for(c = 0; c < ncpu; c++){
+    head = tracebuf.cpu[c].head;
+    t = tracebuf.cpu[c].tail;
+    if(head - t > NTRACEEV){
+      tracebuf.dropped += head - t - NTRACEEV;
+      t = head - NTRACEEV;
+    }
+    for(; t != head && (i+1) * sizeof(struct traceev) <= n; t++){
+      memmove(dst + i*sizeof(struct traceev),
+              &tracebuf.cpu[c].ev[t % NTRACEEV], sizeof(struct traceev));
+      __sync_synchronize();
+      if(tracebuf.cpu[c].head - t >= NTRACEEV)
+        tracebuf.dropped++;  // lapped while we copied it
+      else
+        i++;
+    }
+    tracebuf.cpu[c].tail = t;
+  }
+  release(&tracebuf.lock);
+  return i * sizeof(struct traceev);
+}
+
+// Write 1 to start tracing, 0 to stop.  Starting throws away
+// the events not yet read.
+static int
+tracewrite(struct inode *ip, char *src, int n)
+{
+  int c;
+
+  if(n < 1)
+    return -1;
+  acquire(&tracebuf.lock);
+  if(src[0] != '0' && !tracing){
+    for(c = 0; c < NCPU; c++)
+      tracebuf.cpu[c].tail = tracebuf.cpu[c].head;
+    if(tracebuf.dropped)
+      cprintf("trace: %d events dropped\n", tracebuf.dropped);
+    tracebuf.dropped = 0;
+  }
+  tracing = src[0] != '0';
+  release(&tracebuf.lock);
+  return n;
+}
+
+void
+traceinit(void)
+{
+  initlock(&tracebuf.lock, "trace");
+  devsw[TRACE].read = traceread;
+  devsw[TRACE].write = tracewrite;
+}
@@ -0,0 +1,27 @@
+// Kernel trace events, as read from /dev/trace.
+struct traceev {
+  uint64 tsc;        // rdtsc() when it happened
+  ushort ev;         // TR_ below
+  ushort cpu;
+  int pid;           // of the process running, 0 if none
+  uint arg;
+};
+
+// Events, with what arg holds.
+#define TR_TRAP       1  // trap entry: trapno
+#define TR_SWITCH     2  // scheduler runs a process: its pid
+#define TR_SLEEP      3  // sleep(): chan
+#define TR_WAKEUP     4  // wakeup() made a process runnable: its pid
+#define TR_DISKSUB    5  // disk request queued: blockno, TR_WRITE if a write
+#define TR_DISKDONE   6  // disk request done: blockno, TR_WRITE if a write
+#define TR_BEGINOP    7  // begin_op() joined a transaction
+#define TR_ENDOP      8  // end_op()
+#define TR_COMMIT     9  // commit() starts: blocks in the transaction
+#define TR_COMMITDONE 10 // commit() done
+#define TR_KALLOC     11 // kalloc(): the page
+#define TR_KFREE      12 // kfree(): the page
+#define TR_CLONE      13 // clone() made a thread: its pid
+#define TR_JOIN       14 // join() reaped a thread: its pid
+#define NTREV         15
+
+#define TR_WRITE 0x80000000
@@ -3,10 +3,13 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
 #include "spinlock.h"
+#include "trace.h"
+#include "counter.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
@@ -22,6 +25,9 @@ tvinit(void)
   for(i = 0; i < 256; i++)
     SETGATE(idt[i], 0, SEG_KCODE<<3, vectors[i], 0);
   SETGATE(idt[T_SYSCALL], 1, SEG_KCODE<<3, vectors[T_SYSCALL], DPL_USER);
+  // A double fault switches to the cpu's SEG_DFTSS task.
+  SETGATE(idt[T_DBLFLT], 0, SEG_DFTSS<<3, 0, 0);
+  idt[T_DBLFLT].type = STS_TG;
 
   initlock(&tickslock, "time");
 }
@@ -32,10 +38,49 @@ idtinit(void)
   lidt(idt, sizeof(idt));
 }
 
+// Charge the time since p last entered or left user space to
+// its user time if user is set, else to its system time.
+static void
+rucharge(struct proc *p, int user)
+{
+  uint64 now;
+
+  now = rdtsc();
+  if(user)
+    p->ru.utime += now - p->runstart;
+  else
+    p->ru.stime += now - p->runstart;
+  p->runstart = now;
+}
+
+// The double fault task, on the cpu's dfstack (see seginit()).
+// The task switch saved what faulted in the cpu's TSS.  A
+// kernel stack that overflows into its guard page faults again
+// pushing the page fault's frame, and ends up here.
+void
+dfault(void)
+{
+  struct cpu *c = mycpu();
+  uint esp, off;
+
+  esp = (uint)c->ts.esp;
+  off = (esp - KSTACKS) % (KSTACKSIZE + PGSIZE);
+  cprintf("double fault on cpu %d: eip %x esp %x\n", cpuid(), c->ts.eip, esp);
+  if(esp >= KSTACKS && esp < KSTACKSEND && off <= PGSIZE + 64)
+    panic(c->proc ? c->proc->name : "kernel stack overflow");
+  panic("double fault");
+}
+
 //PAGEBREAK: 41
 void
 trap(struct trapframe *tf)
 {
+  uint64 t0;
+  int tick;
+
+  trace(TR_TRAP, tf->trapno);
+  if(myproc() && (tf->cs&3) == DPL_USER)
+    rucharge(myproc(), 1);
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -43,16 +88,19 @@ trap(struct trapframe *tf)
     syscall();
     if(myproc()->killed)
       exit();
+    rucharge(myproc(), 0);
     return;
   }
 
+  tick = 0;
+  t0 = rdtsc();
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
-      acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
-      release(&tickslock);
+    if((tick = timerintr()) != 0){
+      cntadd(CNT_TICK, 1);
+      profsample(tf);
+      if(cpuid() == 0)
+        irqbalance();
     }
     lapiceoi();
     break;
@@ -71,6 +119,13 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_TLB:
+    tlbpoll();
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_WAKE:
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -78,8 +133,32 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // A page not touched yet or a write to a copy-on-write
+    // page, by the process or by the kernel on its behalf
+    // (e.g. read() into a user buffer).
+    if(myproc() && rcr2() < KERNBASE && pagefault(rcr2(), tf->err) == 0){
+      myproc()->ru.minflt++;
+      cntadd(CNT_PGFAULT, 1);
+      break;
+    }
+    // Otherwise a genuine fault.
+    // fall through
+
+  case T_DEVICE:
+    // An FPU or SSE instruction, with the registers not yet
+    // the process's own (see fpu.c).
+    if(tf->trapno == T_DEVICE && myproc() && fpuload() == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    if(virtioirq && tf->trapno == T_IRQ0 + virtioirq){
+      virtiointr();
+      lapiceoi();
+      break;
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -93,6 +172,7 @@ trap(struct trapframe *tf)
             tf->err, cpuid(), tf->eip, rcr2());
     myproc()->killed = 1;
   }
+  irqcount(tf->trapno, rdtsc() - t0);
 
   // Force process exit if it has been killed and is in user space.
   // (If it is still executing in the kernel, let it keep running
@@ -102,11 +182,15 @@ trap(struct trapframe *tf)
 
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
-  if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+  if(myproc() && myproc()->state == RUNNING && tick && schedpreempt(myproc())){
+    myproc()->ru.nivcsw++;
     yield();
+  }
 
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
+
+  if(myproc() && (tf->cs&3) == DPL_USER)
+    rucharge(myproc(), 0);
 }
@@ -34,5 +34,7 @@
 #define IRQ_COM1         4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_TLB         20      // TLB shootdown IPI (see tlbshootdown)
+#define IRQ_WAKE        21      // wake a cpu halted in scheduler()
 #define IRQ_SPURIOUS    31
 
@@ -1,4 +1,10 @@
 // Intel 8250 serial port (UART).
+//
+// Output goes into tx.buf, and the transmitter-empty interrupt
+// moves it out to the UART's FIFO, so a console writer only has
+// to queue its bytes.  Only when the ring is full does a writer
+// wait on the UART, one byte at a time.  uartputcsync() writes
+// directly, for panic() and for output before the console locks.
 
 #include "types.h"
 #include "defs.h"
@@ -9,6 +15,7 @@
 #include "fs.h"
 #include "file.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "x86.h"
 
@@ -16,13 +23,25 @@
 
 static int uart;    // is there a uart?
 
+#define UARTTXBUF 1024
+
+static struct {
+  struct spinlock lock;
+  char buf[UARTTXBUF];
+  uint r;           // next byte to send
+  uint w;           // next free slot
+  int fifo;         // bytes the transmitter holds
+} tx;
+
 void
 uartinit(void)
 {
   char *p;
 
-  // Turn off the FIFO
-  outb(COM1+2, 0);
+  initlock(&tx.lock, "uarttx");
+
+  // Turn on and clear the FIFOs, if it has them.
+  outb(COM1+2, 0x07);
 
   // 9600 baud, 8 data bits, 1 stop bit, parity off.
   outb(COM1+3, 0x80);    // Unlock divisor
@@ -30,12 +49,13 @@ uartinit(void)
   outb(COM1+1, 0);
   outb(COM1+3, 0x03);    // Lock divisor, 8 data bits.
   outb(COM1+4, 0);
-  outb(COM1+1, 0x01);    // Enable receive interrupts.
+  outb(COM1+1, 0x03);    // Enable receive and transmit interrupts.
 
   // If status is 0xFF, no serial port.
   if(inb(COM1+5) == 0xFF)
     return;
   uart = 1;
+  tx.fifo = (inb(COM1+2) & 0xC0) == 0xC0 ? 16 : 1;
 
   // Acknowledge pre-existing interrupt conditions;
   // enable interrupts.
@@ -45,18 +65,58 @@ uartinit(void)
 
   // Announce that we're here.
   for(p="xv6...\n"; *p; p++)
-    uartputc(*p);
+    uartputcsync(*p);
+}
+
+// Wait, a little, for the transmitter to be empty.
+static void
+uartwait(void)
+{
+  int i;
+
+  for(i = 0; i < 128 && !(inb(COM1+5) & 0x20); i++)
+    microdelay(10);
+}
+
+// Hand queued bytes to the transmitter if it is empty; else
+// its interrupt will call again.  Caller holds tx.lock.
+static void
+uartstart(void)
+{
+  int i;
+
+  if(!(inb(COM1+5) & 0x20))
+    return;
+  for(i = 0; i < tx.fifo && tx.r != tx.w; i++)
+    outb(COM1+0, tx.buf[tx.r++ % UARTTXBUF]);
 }
 
 void
 uartputc(int c)
 {
-  int i;
+  if(!uart)
+    return;
+  acquire(&tx.lock);
+  while(tx.w - tx.r == UARTTXBUF){
+    uartwait();
+    outb(COM1+0, tx.buf[tx.r++ % UARTTXBUF]);
+  }
+  tx.buf[tx.w++ % UARTTXBUF] = c;
+  uartstart();
+  release(&tx.lock);
+}
 
+// Send what is queued, then c, without locks or interrupts.
+void
+uartputcsync(int c)
+{
   if(!uart)
     return;
-  for(i = 0; i < 128 && !(inb(COM1+5) & 0x20); i++)
-    microdelay(10);
+  while(tx.r != tx.w){
+    uartwait();
+    outb(COM1+0, tx.buf[tx.r++ % UARTTXBUF]);
+  }
+  uartwait();
   outb(COM1+0, c);
 }
 
@@ -74,4 +134,8 @@ void
 uartintr(void)
 {
   consoleintr(uartgetc);
+  acquire(&tx.lock);
+  inb(COM1+2);  // reading IIR acknowledges a transmit interrupt
+  uartstart();
+  release(&tx.lock);
 }
@@ -3,6 +3,12 @@
 #include "fcntl.h"
 #include "user.h"   // For syscall wrappers (open, close, read, clone, join, etc.), printf
 #include "thread.h" // Your thread library header (for ticket_lock_t, xadd)
+#include "mmu.h"    // PGSIZE, PGROUNDUP
+#include "mman.h"   // PROT_NONE
+#include "clone.h"  // CLONE_FILES, CLONE_FS
+#include "param.h"  // NCPU
+#include "vdso.h"   // the kernel's shared page
+#include "spawn.h"
 // x86.h is not strictly needed here if stosb is handled by compiler/linker for user space,
 // or if you use a C version of memset. Let's assume it's fine for now.
 // #include "x86.h"
@@ -10,6 +16,26 @@
 // Define a reasonable stack size for user threads.
 #define USER_THREAD_STACK_SIZE 4096
 
+// Thread stacks come from a pool of page-aligned regions taken
+// straight from sbrk() and reused across create/join, rather
+// than from malloc().  A region is an optional guard page with
+// no user access, then the stack, with the thread's TLS block
+// and a struct tstack header in its top bytes.  clone() puts
+// the initial frame at stack+PGSIZE, so the stack handed to it
+// is tls-PGSIZE and join() gives that value back.
+struct tstack {
+  lfnode_t node;               // In the pool, while free
+  uint size;                   // Stack bytes, a multiple of PGSIZE
+  int guard;                   // Guard page below the stack?
+  uint pad;                    // Keep the frame below 16-byte aligned
+};
+
+char thread_main_tls[THREAD_TLS_SIZE];
+
+static lfstack_t stackpool;
+static uint stack_size = USER_THREAD_STACK_SIZE;
+static int stack_guard = 1;
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -41,11 +67,17 @@ strlen(const char *s)
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *)dst; // Cast to char* for byte-wise assignment
-  uint i;
-  for(i = 0; i < n; i++){
-    cdst[i] = (char)c; // Ensure c is treated as a byte
-  }
+  char *d;
+  uint cnt;
+
+  // Fill by dwords, then the odd bytes.
+  c &= 0xFF;
+  d = dst;
+  cnt = n/4;
+  asm volatile("cld; rep stosl; movl %3, %%ecx; rep stosb" :
+               "+D" (d), "+c" (cnt) :
+               "a" ((c<<24)|(c<<16)|(c<<8)|c), "r" (n%4) :
+               "memory", "cc");
   return dst;
 }
 
@@ -59,12 +91,22 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// Read a line from fd 0.  The console hands back at most a
+// line per read(), so from it the whole line comes in one call.
+// Other input is read a byte at a time, so none past the line
+// is taken from a child that shares the fd (as sh's do).
 char*
 gets(char *buf, int max)
 {
   int i, cc;
   char c;
+  struct stat st;
 
+  if(max > 1 && fstat(0, &st) == 0 && st.type == T_DEV){
+    cc = read(0, buf, max-1);
+    buf[cc > 0 ? cc : 0] = '\0';
+    return buf;
+  }
   for(i=0; i+1 < max; ){
     cc = read(0, &c, 1);
     if(cc < 1)
@@ -107,32 +149,322 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  int cnt;
 
+  if(n <= 0)
+    return vdst;
+  // Copy by dwords, then the odd bytes.
   dst = vdst;
   src = vsrc;
-  while(n-- > 0)
-    *dst++ = *src++;
+  cnt = n/4;
+  asm volatile("cld; rep movsl; movl %3, %%ecx; rep movsb" :
+               "+D" (dst), "+S" (src), "+c" (cnt) :
+               "r" (n%4) :
+               "memory", "cc");
   return vdst;
 }
 
+// Queries answered from the kernel's vdso page, without a
+// system call.
+static volatile struct vdso *vdso = (struct vdso*)VDSO;
+
+static inline uint
+lsl(uint sel)
+{
+  uint lim;
+
+  asm volatile("lsl %1, %0" : "=r" (lim) : "r" (sel));
+  return lim;
+}
+
+// n / d, for the 64-bit counters; there is no libgcc.
+uint
+udiv64(uint64 n, uint d)
+{
+  uint64 r;
+  uint q;
+  int i;
+
+  q = r = 0;
+  for(i = 63; i >= 0; i--){
+    r = (r << 1) | ((n >> i) & 1);
+    q <<= 1;
+    if(r >= d){
+      r -= d;
+      q |= 1;
+    }
+  }
+  return q;
+}
+
+// Like uptime().
+uint
+vuptime(void)
+{
+  return vdso->ticks;
+}
+
+// rdtsc() increments per tick, or 0 if the kernel hasn't
+// measured it yet.
+uint
+vtscpertick(void)
+{
+  return vdso->tscpertick;
+}
+
+// The index of the cpu the caller is running on.  It may have
+// moved on by the time it looks.
+int
+vgetcpu(void)
+{
+  return lsl(VDSO_CPUSEL);
+}
+
+// Like getpid(): the pid of the calling thread.  Reads the pid
+// of the process on the caller's cpu, and tries again if the
+// cpu switched process, or the caller moved, meanwhile.
+int
+vgetpid(void)
+{
+  uint c, seq;
+  int pid;
+
+  for(;;){
+    c = lsl(VDSO_CPUSEL);
+    seq = vdso->cpu[c].seq;
+    pid = vdso->cpu[c].pid;
+    if(lsl(VDSO_CPUSEL) == c && vdso->cpu[c].seq == seq)
+      return pid;
+  }
+}
+
+// Arenas: bump-pointer allocation from mmap()ed chunks, for
+// many small objects that are freed together.  The struct
+// arena sits in its first chunk, which arena_reset() keeps.
+#define ARENA_CHUNK (4*PGSIZE)
+
+struct arenachunk {
+  struct arenachunk *next;
+  uint size;              // bytes mapped, this header included
+};
+
+struct arena {
+  struct arenachunk *chunks;  // newest first; the first chunk last
+  char *p;                    // next free byte in chunks
+  char *end;
+};
+
+static struct arenachunk*
+arena_chunk(uint n)
+{
+  struct arenachunk *c;
+  uint len;
+
+  len = n + sizeof(*c) <= ARENA_CHUNK ? ARENA_CHUNK : PGROUNDUP(n + sizeof(*c));
+  c = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (c == MAP_FAILED)
+    return 0;
+  c->next = 0;
+  c->size = len;
+  return c;
+}
+
+struct arena*
+arena_create(void)
+{
+  struct arenachunk *c;
+  struct arena *a;
+
+  if ((c = arena_chunk(sizeof(*a))) == 0)
+    return 0;
+  a = (struct arena *)(c + 1);
+  a->chunks = c;
+  a->p = (char *)(a + 1);
+  a->end = (char *)c + c->size;
+  return a;
+}
+
+// n bytes, 8-byte aligned, that live until the arena is reset
+// or destroyed.  Not zeroed after a reset.
+void*
+arena_alloc(struct arena *a, uint n)
+{
+  struct arenachunk *c;
+  void *p;
+
+  if (n > 0x7FFFFFFF - ARENA_CHUNK)
+    return 0;
+  n = (n + 7) & ~7;
+  if (n > a->end - a->p) {
+    if ((c = arena_chunk(n)) == 0)
+      return 0;
+    c->next = a->chunks;
+    a->chunks = c;
+    a->p = (char *)(c + 1);
+    a->end = (char *)c + c->size;
+  }
+  p = a->p;
+  a->p += n;
+  return p;
+}
+
+// Free everything allocated from a.
+void
+arena_reset(struct arena *a)
+{
+  struct arenachunk *c, *first;
+
+  first = (struct arenachunk *)a - 1;
+  while ((c = a->chunks) != first) {
+    a->chunks = c->next;
+    munmap(c, c->size);
+  }
+  a->p = (char *)(a + 1);
+  a->end = (char *)first + first->size;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+  struct arenachunk *first;
+
+  arena_reset(a);
+  first = a->chunks;
+  munmap(first, first->size);
+}
+
+// Run path with argv in a new process, after applying the file
+// actions acts (0 for none) there.  Returns the child's pid, or
+// -1 if there is no child; a child whose actions or exec fail
+// says so and exits.  The child is made with vfork(), so the
+// caller's memory is never copied.
+int
+spawn(char *path, char **argv, struct spawnact *acts)
+{
+  struct spawnact *a;
+  int pid, fd;
+
+  if((pid = vfork()) != 0)
+    return pid;
+  for(a = acts; a && a->op != SPAWN_END; a++){
+    close(a->fd);
+    if(a->op == SPAWN_DUP)
+      fd = dup(a->arg);
+    else if(a->op == SPAWN_OPEN)
+      fd = open(a->path, a->arg);
+    else
+      fd = a->fd;
+    if(fd != a->fd){
+      printf(2, "spawn %s: fd %d failed\n", path, a->fd);
+      exit();
+    }
+  }
+  exec(path, argv);
+  printf(2, "exec %s failed\n", path);
+  exit();
+}
+
 // --- Thread library functions added below ---
 
+// Set the stack size (rounded up to whole pages) and whether a
+// guard page sits below each stack, for threads created from now on.
+// A thread_create() racing with this may mix the old and the new
+// setting, which still makes a usable stack.
+void
+thread_stack_config(uint size, int guard)
+{
+  stack_size = size < PGSIZE ? PGSIZE : PGROUNDUP(size);
+  stack_guard = guard;
+}
+
+static struct tstack*
+stack_get(void)
+{
+  struct tstack *t, *other = 0;
+  char *mem, *base;
+  uint size;
+  int guard;
+
+  // Pop stacks until one has the current setting, then push the
+  // others back; there are only others after a change of setting.
+  size = stack_size;
+  guard = stack_guard;
+  while ((t = (struct tstack *)lfstack_pop(&stackpool)) != 0) {
+    if (t->size == size && t->guard == guard)
+      break;
+    t->node.next = (lfnode_t *)other;
+    other = t;
+  }
+  while (other != 0) {
+    struct tstack *next = (struct tstack *)other->node.next;
+    lfstack_push(&stackpool, &other->node);
+    other = next;
+  }
+  if (t != 0)
+    return t;
+
+  // Other threads may sbrk() too, so allocate an extra page
+  // to align within rather than aligning the break first.
+  mem = sbrk(size + (guard ? PGSIZE : 0) + PGSIZE);
+  if (mem == (char *)-1)
+    return 0;
+  base = (char *)PGROUNDUP((uint)mem);
+  if (guard) {
+    if (mprotect(base, PGSIZE, PROT_NONE) < 0)
+      guard = 0;
+    else
+      base += PGSIZE;
+  }
+  t = (struct tstack *)(base + size) - 1;
+  t->size = size;
+  t->guard = guard;
+  return t;
+}
+
+// Stacks are never unmapped, as lfstack_pop() requires.
+static void
+stack_put(struct tstack *t)
+{
+  lfstack_push(&stackpool, &t->node);
+}
+
+// The TLS block of the thread using stack t.
+static char*
+stack_tls(struct tstack *t)
+{
+  return (char *)t - THREAD_TLS_SIZE;
+}
+
+// Map the stack value clone() and join() deal in to its header.
+static struct tstack*
+stack_hdr(void *stack)
+{
+  return (struct tstack *)((char *)stack + PGSIZE + THREAD_TLS_SIZE);
+}
+
 int
 thread_create(int *tid, void (*start_routine)(void *, void *), void *arg1, void *arg2)
 {
-  void *stack;
+  struct tstack *t;
+  char *tls;
 
-  stack = malloc(USER_THREAD_STACK_SIZE);
-  if (stack == 0) {
-    printf(1, "thread_create: unable to allocate stack using malloc.\n");
+  t = stack_get();
+  if (t == 0) {
+    printf(1, "thread_create: unable to allocate stack.\n");
     return -1;
   }
+  tls = stack_tls(t);
+  memset(tls, 0, THREAD_TLS_SIZE);
+  *(char **)tls = tls;
 
-  int pid = clone(start_routine, arg1, arg2, stack);
+  // Threads share the fd table and current directory, so
+  // creating one doesn't duplicate every open file.
+  int pid = clone(start_routine, arg1, arg2, tls - PGSIZE,
+                  CLONE_FILES | CLONE_FS | CLONE_SETTLS, tls);
 
   if (pid < 0) {
     printf(1, "thread_create: clone failed\n");
-    free(stack);
+    stack_put(t);
     return -1;
   }
 
@@ -146,21 +478,46 @@ thread_create(int *tid, void (*start_routine)(void *, void *), void *arg1, void
 
 
 int
-thread_join(void)
+thread_join(int tid)
 {
   void *child_stack;
   int pid;
 
-  pid = join(&child_stack);
+  pid = join(tid, &child_stack);
 
   if (pid > 0 && child_stack != 0) {
-    free(child_stack);
+    malloc_tls_flush(stack_tls(stack_hdr(child_stack)));
+    stack_put(stack_hdr(child_stack));
   } else if (pid > 0 && child_stack == 0) {
     printf(1, "thread_join: Null Stack! on joining thread PID %d\n", pid);
   }
   return pid;
 }
 
+// Join all n threads in tids with one system call and return
+// their stacks to the pool.  Returns n, or -1 if any of them can't be joined.
+int
+thread_join_many(int *tids, int n)
+{
+  void **stacks;
+  int i, r;
+
+  stacks = malloc(n * sizeof(void *));
+  if (stacks == 0) {
+    printf(1, "thread_join_many: unable to allocate stack array.\n");
+    return -1;
+  }
+  r = join_many(tids, n, stacks);
+  for (i = 0; i < n; i++) {
+    if (stacks[i] != 0) {
+      malloc_tls_flush(stack_tls(stack_hdr(stacks[i])));
+      stack_put(stack_hdr(stacks[i]));
+    }
+  }
+  free(stacks);
+  return r;
+}
+
 void
 ticket_lock_init(ticket_lock_t *lk)
 {
@@ -168,18 +525,389 @@ ticket_lock_init(ticket_lock_t *lk)
   lk->turn = 0;
 }
 
+// Waiters poll turn less often the further back in line they are,
+// as each holder ahead of them takes about the same time.
 void
 ticket_lock_acquire(ticket_lock_t *lk)
 {
   uint my_ticket = xadd(&lk->ticket, 1);
-  while (lk->turn != my_ticket) {
-    asm volatile("pause");
+  uint ahead, i;
+
+  while ((ahead = my_ticket - lk->turn) != 0) {
+    for (i = ahead * TICKET_BACKOFF; i > 0; i--)
+      asm volatile("pause");
   }
 }
 
+// Only the holder writes turn, so a plain store will do; x86
+// keeps it after the critical section's loads and stores, and
+// the barrier keeps the compiler from moving them past it.
 void
 ticket_lock_release(ticket_lock_t *lk)
 {
-  xadd(&lk->turn, 1);
+  asm volatile("" ::: "memory");
+  lk->turn = lk->turn + 1;
+}
+
+void
+mutex_init(mutex_t *m)
+{
+  m->state = 0;
+}
+
+void
+mutex_lock(mutex_t *m)
+{
+  uint c;
+  int i;
+
+  // Uncontended or briefly held: take it without a system call.
+  for (i = 0; i < MUTEX_SPINS; i++) {
+    if ((c = cmpxchg(&m->state, 0, 1)) == 0)
+      return;
+    asm volatile("pause");
+  }
+
+  // Mark the lock as having sleepers and wait until it is free.
+  if (c != 2)
+    c = xchg(&m->state, 2);
+  while (c != 0) {
+    futex_wait(&m->state, 2);
+    c = xchg(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(mutex_t *m)
+{
+  // Only enter the kernel if someone may be sleeping.
+  if (xchg(&m->state, 0) == 2)
+    futex_wake(&m->state, 1);
+}
+
+void
+cond_init(cond_t *c)
+{
+  c->seq = 0;
+}
+
+// Atomically release m and wait for a signal, then retake m.
+// As with any condition variable, callers must recheck their
+// condition in a loop.
+void
+cond_wait(cond_t *c, mutex_t *m)
+{
+  uint seq;
+
+  seq = c->seq;
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);  // returns at once if signalled since
+  mutex_lock(m);
+}
+
+void
+cond_signal(cond_t *c)
+{
+  xadd(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(cond_t *c)
+{
+  xadd(&c->seq, 1);
+  futex_wake(&c->seq, FUTEX_ALL);
+}
+
+void
+sem_init(sem_t *s, uint value)
+{
+  s->count = value;
+  s->waiters = 0;
+}
+
+void
+sem_wait(sem_t *s)
+{
+  uint c;
+
+  for (;;) {
+    c = s->count;
+    if (c > 0) {
+      if (cmpxchg(&s->count, c, c - 1) == c)
+        return;
+      continue;
+    }
+    xadd(&s->waiters, 1);
+    futex_wait(&s->count, 0);  // sleeps only while count is 0
+    xadd(&s->waiters, -1);
+  }
+}
+
+void
+sem_post(sem_t *s)
+{
+  xadd(&s->count, 1);
+  // A waiter that registers after this check sees count > 0
+  // in futex_wait() and does not sleep.
+  if (s->waiters)
+    futex_wake(&s->count, 1);
+}
+
+void
+rwlock_init(rwlock_t *rw)
+{
+  rw->state = 0;
+}
+
+void
+rwlock_rdlock(rwlock_t *rw)
+{
+  uint s;
+
+  for (;;) {
+    s = rw->state;
+    if (!(s & (RW_WRITER | RW_WAITING))) {
+      if (cmpxchg(&rw->state, s, s + 1) == s)
+        return;
+      continue;
+    }
+    // Only rwlock_wrunlock() clears both bits, and it wakes us.
+    futex_wait(&rw->state, s);
+  }
+}
+
+void
+rwlock_rdunlock(rwlock_t *rw)
+{
+  // The last reader out lets a waiting writer in.
+  if (xadd(&rw->state, -1) == (RW_WAITING | 1))
+    futex_wake(&rw->state, FUTEX_ALL);
 }
 
+void
+rwlock_wrlock(rwlock_t *rw)
+{
+  uint s;
+
+  if (cmpxchg(&rw->state, 0, RW_WRITER) == 0)
+    return;
+  // As in mutex_lock(), a writer that has waited takes the lock
+  // with RW_WAITING still set, since others may be waiting too.
+  for (;;) {
+    s = rw->state;
+    if ((s & ~RW_WAITING) == 0) {
+      if (cmpxchg(&rw->state, s, RW_WRITER | RW_WAITING) == s)
+        return;
+      continue;
+    }
+    if (!(s & RW_WAITING) && cmpxchg(&rw->state, s, s | RW_WAITING) != s)
+      continue;
+    futex_wait(&rw->state, s | RW_WAITING);
+  }
+}
+
+void
+rwlock_wrunlock(rwlock_t *rw)
+{
+  xchg(&rw->state, 0);
+  futex_wake(&rw->state, FUTEX_ALL);
+}
+
+void
+barrier_init(barrier_t *b, uint n)
+{
+  b->count = 0;
+  b->gen = 0;
+  b->waiters = 0;
+  b->n = n;
+}
+
+// Wait until all b->n threads have called barrier_wait().
+// Returns 1 in the last thread to arrive and 0 in the others,
+// so that one of them can do the work between rounds.
+int
+barrier_wait(barrier_t *b)
+{
+  uint gen = b->gen;
+  int i;
+
+  if (xadd(&b->count, 1) == b->n - 1) {
+    // Reset count before releasing anyone into the next round.
+    b->count = 0;
+    xadd(&b->gen, 1);
+    // As in sem_post(), a waiter that registers after this check
+    // sees gen changed in futex_wait() and does not sleep.
+    if (b->waiters)
+      futex_wake(&b->gen, FUTEX_ALL);
+    return 1;
+  }
+  for (i = 0; i < BARRIER_SPINS && b->gen == gen; i++)
+    cpu_relax();
+  while (b->gen == gen) {
+    xadd(&b->waiters, 1);
+    futex_wait(&b->gen, gen);
+    xsub(&b->waiters, 1);
+  }
+  return 0;
+}
+
+static void
+task_run(task_t *t)
+{
+  t->fn(t->arg);
+  xchg(&t->done, 1);
+  // As in sem_post(), a waiter that registers after this check
+  // sees done set in futex_wait() and does not sleep.
+  if (t->waiters)
+    futex_wake(&t->done, FUTEX_ALL);
+}
+
+static void
+tpool_worker(void *arg1, void *arg2)
+{
+  tpool_t *pool = arg1;
+  task_t *t;
+  uint w;
+
+  for (;;) {
+    w = pool->work;
+    if ((t = lfqueue_pop(&pool->queue)) != 0) {
+      task_run(t);
+      continue;
+    }
+    if (pool->stop)
+      break;
+    xadd(&pool->idle, 1);
+    futex_wait(&pool->work, w);  // returns at once if work was submitted since
+    xadd(&pool->idle, -1);
+  }
+  exit();
+}
+
+// Start nworkers (at most TPOOL_MAXWORKERS) threads that run
+// tasks until tpool_destroy().  Returns 0, or -1 if no worker
+// could be started.
+int
+tpool_init(tpool_t *pool, int nworkers)
+{
+  int i;
+
+  if (nworkers > TPOOL_MAXWORKERS)
+    nworkers = TPOOL_MAXWORKERS;
+  lfqueue_init(&pool->queue, pool->slot, TPOOL_QSIZE);
+  pool->work = pool->idle = pool->stop = 0;
+  pool->nworkers = 0;
+  for (i = 0; i < nworkers; i++) {
+    if (thread_create(&pool->tids[pool->nworkers], tpool_worker, pool, 0) < 0)
+      break;
+    pool->nworkers++;
+  }
+  return pool->nworkers > 0 ? 0 : -1;
+}
+
+// Run the tasks still queued, then stop and join the workers.
+void
+tpool_destroy(tpool_t *pool)
+{
+  pool->stop = 1;
+  xadd(&pool->work, 1);
+  futex_wake(&pool->work, FUTEX_ALL);
+  thread_join_many(pool->tids, pool->nworkers);
+  pool->nworkers = 0;
+}
+
+// Queue fn(arg) to run on a worker; wait for it with task_wait().
+// If the queue is full, the task runs in the caller instead.
+void
+tpool_submit(tpool_t *pool, task_t *t, void (*fn)(void *), void *arg)
+{
+  t->fn = fn;
+  t->arg = arg;
+  t->done = 0;
+  t->waiters = 0;
+  if (pool->nworkers == 0 || lfqueue_push(&pool->queue, t) < 0) {
+    task_run(t);
+    return;
+  }
+  xadd(&pool->work, 1);
+  if (pool->idle)
+    futex_wake(&pool->work, 1);
+}
+
+// Wait for t to finish, running queued tasks meanwhile so that
+// tasks which wait on other tasks can't deadlock the pool.
+void
+task_wait(tpool_t *pool, task_t *t)
+{
+  task_t *other;
+
+  while (!t->done) {
+    if ((other = lfqueue_pop(&pool->queue)) != 0) {
+      task_run(other);
+      continue;
+    }
+    xadd(&t->waiters, 1);
+    futex_wait(&t->done, 0);
+    xadd(&t->waiters, -1);
+  }
+}
+
+struct pfor {
+  volatile uint next;          // first index not yet claimed
+  int end;
+  int grain;
+  void (*fn)(int, int, void *);
+  void *arg;
+};
+
+// Claim grain-sized chunks of the range until it is used up.
+static void
+pfor_run(void *arg)
+{
+  struct pfor *pf = arg;
+  int lo, hi;
+
+  for (;;) {
+    lo = xadd(&pf->next, pf->grain);
+    if (lo >= pf->end)
+      break;
+    hi = lo + pf->grain;
+    if (hi > pf->end)
+      hi = pf->end;
+    pf->fn(lo, hi, pf->arg);
+  }
+}
+
+// Call fn(lo, hi, arg) over [begin, end) in chunks of grain
+// indices, on the pool's workers and the caller.  Chunks are
+// claimed dynamically, so uneven chunks balance themselves.
+void
+parallel_for(tpool_t *pool, int begin, int end, int grain,
+             void (*fn)(int lo, int hi, void *arg), void *arg)
+{
+  task_t tasks[TPOOL_MAXWORKERS];
+  struct pfor pf;
+  int i, n;
+
+  if (begin >= end)
+    return;
+  if (grain < 1)
+    grain = 1;
+  pf.next = begin;
+  pf.end = end;
+  pf.grain = grain;
+  pf.fn = fn;
+  pf.arg = arg;
+
+  // One helper per worker, but no more than there are chunks
+  // beyond the one the caller takes.
+  n = (end - begin + grain - 1) / grain - 1;
+  if (n > pool->nworkers)
+    n = pool->nworkers;
+  for (i = 0; i < n; i++)
+    tpool_submit(pool, &tasks[i], pfor_run, &pf);
+  pfor_run(&pf);
+  for (i = 0; i < n; i++)
+    task_wait(pool, &tasks[i]);
+}
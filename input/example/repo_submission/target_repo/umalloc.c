@@ -2,9 +2,44 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "thread.h"
+#include "mmu.h"
+#include "mman.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Small requests, SMALLMAX bytes or less with their header, are
+// rounded up to a power-of-two size class.  Each thread keeps
+// up to TCMAX free blocks of each class in a cache of its own,
+// found through the second word of its TLS block, so most small
+// malloc()s and free()s take no lock; the cache trades blocks
+// with the central lists TCBATCH at a time.  Small blocks are
+// carved from CARVE-byte chunks of the heap and stay in their
+// class once made.
+//
+// Larger requests come from the heap, the first-fit free list
+// of Kernighan and Ritchie, The C programming Language, 2nd ed.
+// Section 8.7.  Requests of MMAPMIN bytes or more get pages of
+// their own from mmap() instead, which free() unmaps.
+//
+// Free heap memory goes back to the kernel: once TRIMMIN bytes
+// at the top of the heap are free, free() shrinks the heap with
+// sbrk() to leave TRIMKEEP of them, and a freed block of
+// RELEASEMIN bytes or more below the top has its whole pages
+// dropped with madvise(MADV_DONTNEED), to be zero-filled if the
+// heap hands them out again.
+//
+// heaplock protects the heap and the central lists.
+
+#define NCLASS   8       // classes of 16, 32, ... 2048 bytes
+#define SMALLMAX 2048
+#define TCMAX    32
+#define TCBATCH  16
+#define CARVE    16384
+#define MMAPMIN  (64*1024)
+#define TRIMMIN  (128*1024)
+#define TRIMKEEP (32*1024)
+#define RELEASEMIN (16*1024)
 
 typedef long Align;
 
@@ -18,15 +53,28 @@ union header {
 
 typedef union header Header;
 
+// s.ptr of an allocated block: 0 for a heap block, whose s.size
+// is in Header units, or one of these.
+#define SMALL  ((Header*)1)  // s.size is the class
+#define MAPPED ((Header*)2)  // s.size is the bytes mapped
+
+struct tcache {
+  Header *free[NCLASS];  // linked through s.ptr
+  uint n[NCLASS];
+};
+
 static Header base;
 static Header *freep;
+static char *heaptop;  // the break, as morecore() last left it
+static Header *central[NCLASS];
+static mutex_t heaplock;
 
-void
-free(void *ap)
+// Put bp on the heap's free list.  Caller holds heaplock.
+static void
+hfree(Header *bp)
 {
-  Header *bp, *p;
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -54,14 +102,41 @@ morecore(uint nu)
   p = sbrk(nu * sizeof(Header));
   if(p == (char*)-1)
     return 0;
+  heaptop = p + nu * sizeof(Header);
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  hfree(hp);
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+// If the free block at the top of the heap is TRIMMIN bytes or
+// more, give all but TRIMKEEP of them back to the kernel.  It is
+// freep or the one after, where hfree() leaves a block it has
+// just freed.  Nothing is given back if the program has moved
+// the break itself.  Returns 1 if the heap shrank.
+// Caller holds heaplock.
+static int
+htrim(void)
+{
+  Header *p;
+  char *end;
+
+  p = freep;
+  if((char*)(p + p->s.size) != heaptop)
+    p = p->s.ptr;
+  if((char*)(p + p->s.size) != heaptop || p->s.size * sizeof(Header) < TRIMMIN)
+    return 0;
+  end = (char*)PGROUNDUP((uint)p + TRIMKEEP);
+  if(sbrk(0) != heaptop || sbrk(end - heaptop) == (char*)-1)
+    return 0;
+  p->s.size = (Header*)end - p;
+  heaptop = end;
+  return 1;
+}
+
+// Allocate from the heap.  Caller holds heaplock.
+static void*
+hmalloc(uint nbytes)
 {
   Header *p, *prevp;
   uint nunits;
@@ -80,6 +155,7 @@ malloc(uint nbytes)
         p += p->s.size;
         p->s.size = nunits;
       }
+      p->s.ptr = 0;
       freep = prevp;
       return (void*)(p + 1);
     }
@@ -88,3 +164,182 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+// The class of blocks of n bytes, header included.
+static int
+sizeclass(uint n)
+{
+  int c;
+
+  for(c = 0; (16 << c) < n; c++)
+    ;
+  return c;
+}
+
+// Move up to n blocks of class c from the central list to
+// tc, carving a new chunk if the list is empty.
+// Caller holds heaplock.
+static void
+refill(struct tcache *tc, int c, int n)
+{
+  char *p, *end;
+  Header *h;
+  uint sz;
+
+  if(central[c] == 0){
+    if((p = hmalloc(CARVE)) == 0)
+      return;
+    sz = 16 << c;
+    end = p + CARVE - sz;
+    for(; p <= end; p += sz){
+      h = (Header*)p;
+      h->s.ptr = central[c];
+      central[c] = h;
+    }
+  }
+  for(; n > 0 && (h = central[c]) != 0; n--){
+    central[c] = h->s.ptr;
+    h->s.ptr = tc->free[c];
+    tc->free[c] = h;
+    tc->n[c]++;
+  }
+}
+
+// Move n blocks of class c from tc to the central list.
+// Caller holds heaplock.
+static void
+drain(struct tcache *tc, int c, int n)
+{
+  Header *h;
+
+  for(; n > 0 && (h = tc->free[c]) != 0; n--){
+    tc->free[c] = h->s.ptr;
+    h->s.ptr = central[c];
+    central[c] = h;
+    tc->n[c]--;
+  }
+}
+
+// This thread's cache, made on first use; 0 if there is no
+// memory for one.
+static struct tcache*
+tcache(void)
+{
+  struct tcache **tp, *tc;
+
+  tp = (struct tcache**)thread_tls() + 1;
+  if((tc = *tp) != 0)
+    return tc;
+  mutex_lock(&heaplock);
+  tc = hmalloc(sizeof(*tc));
+  mutex_unlock(&heaplock);
+  if(tc)
+    memset(tc, 0, sizeof(*tc));
+  return *tp = tc;
+}
+
+void
+free(void *ap)
+{
+  struct tcache *tc;
+  Header *bp;
+  uint n, start, end;
+  int c;
+
+  if(ap == 0)
+    return;
+  bp = (Header*)ap - 1;
+  if(bp->s.ptr == MAPPED){
+    munmap(bp, bp->s.size);
+    return;
+  }
+  if(bp->s.ptr == SMALL){
+    c = bp->s.size;
+    if((tc = tcache()) == 0){
+      mutex_lock(&heaplock);
+      bp->s.ptr = central[c];
+      central[c] = bp;
+      mutex_unlock(&heaplock);
+      return;
+    }
+    bp->s.ptr = tc->free[c];
+    tc->free[c] = bp;
+    if(++tc->n[c] > TCMAX){
+      mutex_lock(&heaplock);
+      drain(tc, c, TCBATCH);
+      mutex_unlock(&heaplock);
+    }
+    return;
+  }
+  mutex_lock(&heaplock);
+  n = bp->s.size * sizeof(Header);
+  hfree(bp);
+  if(!htrim() && n >= RELEASEMIN){
+    // Its header, and whatever shares the first and last
+    // pages, stays.
+    start = PGROUNDUP((uint)(bp + 1));
+    end = PGROUNDDOWN((uint)bp + n);
+    if(end > start)
+      madvise((void*)start, end - start, MADV_DONTNEED);
+  }
+  mutex_unlock(&heaplock);
+}
+
+void*
+malloc(uint nbytes)
+{
+  struct tcache *tc;
+  Header *p;
+  uint len;
+  int c;
+
+  if(nbytes <= SMALLMAX - sizeof(Header) && (tc = tcache()) != 0){
+    c = sizeclass(nbytes + sizeof(Header));
+    if(tc->free[c] == 0){
+      mutex_lock(&heaplock);
+      refill(tc, c, TCBATCH);
+      mutex_unlock(&heaplock);
+      if(tc->free[c] == 0)
+        return 0;
+    }
+    p = tc->free[c];
+    tc->free[c] = p->s.ptr;
+    tc->n[c]--;
+    p->s.ptr = SMALL;
+    p->s.size = c;
+    return (void*)(p + 1);
+  }
+  if(nbytes >= MMAPMIN && nbytes <= 0x7FFFFFFF - 2*PGSIZE){
+    len = PGROUNDUP(nbytes + sizeof(Header));
+    p = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p != MAP_FAILED){
+      p->s.ptr = MAPPED;
+      p->s.size = len;
+      return (void*)(p + 1);
+    }
+    // Out of mappings; fall back to the heap.
+  }
+  mutex_lock(&heaplock);
+  p = hmalloc(nbytes);
+  mutex_unlock(&heaplock);
+  return p;
+}
+
+// Give the cache of the thread whose TLS block is tls back to
+// the central lists, once the thread is gone.
+void
+malloc_tls_flush(void *tls)
+{
+  struct tcache **tp, *tc;
+  int c;
+
+  tp = (struct tcache**)tls + 1;
+  if((tc = *tp) == 0)
+    return;
+  mutex_lock(&heaplock);
+  for(c = 0; c < NCLASS; c++)
+    drain(tc, c, tc->n[c]);
+  hfree((Header*)tc - 1);
+  mutex_unlock(&heaplock);
+  *tp = 0;
+}
@@ -1,9 +1,20 @@
 struct stat;
+struct iovec;
+struct pollfd;
+struct ringop;
 struct rtcdate;
+struct rusage;
+struct meminfo;
+struct counter;
+struct arena;
+struct spawnact;
+struct direntstat;
 
 // system calls
 int fork(void);
+int vfork(void) __attribute__((returns_twice));
 int exit(void) __attribute__((noreturn));
+int exit_group(void) __attribute__((noreturn));
 int wait(void);
 int pipe(int*);
 int write(int, const void*, int);
@@ -37,5 +48,49 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
-int clone(void(*fcn)(void *, void *), void *arg1, void *arg2, void *stack);
-int join(void **stack);
\ No newline at end of file
+uint udiv64(uint64, uint);
+struct arena* arena_create(void);
+void* arena_alloc(struct arena*, uint);
+void arena_reset(struct arena*);
+void arena_destroy(struct arena*);
+int spawn(char*, char**, struct spawnact*);
+uint vuptime(void);
+uint vtscpertick(void);
+int vgetcpu(void);
+int vgetpid(void);
+int clone(void(*fcn)(void *, void *), void *arg1, void *arg2, void *stack, int flags, void *tls);
+int join(int tid, void **stack);
+int join_many(int *tids, int n, void **stacks);
+int futex_wait(volatile uint *addr, uint val);
+int futex_wake(volatile uint *addr, int n);
+int mprotect(void *addr, int len, int prot);
+int lockstat(int reset);
+void* mmap(void *addr, int len, int prot, int flags, int fd, int off);
+int munmap(void *addr, int len);
+int madvise(void *addr, int len, int advice);
+int counters(struct counter *ct, int n);
+int futex_timedwait(volatile uint *addr, uint val, int ticks);
+int fsync(int fd);
+int fdatasync(int fd);
+int sync(void);
+int readv(int fd, const struct iovec *iov, int iovcnt);
+int writev(int fd, const struct iovec *iov, int iovcnt);
+int pread(int fd, void *buf, int n, int off);
+int pwrite(int fd, const void *buf, int n, int off);
+int splice(int fd_in, int fd_out, int n);
+int poll(struct pollfd *fds, int n, int timeout);
+int ringenter(struct ringop *ops, int n);
+int sysstat(int reset);
+int usleep(int);
+int setpriority(int pid, int sclass, int prio);
+int getrusage(int pid, int who, struct rusage*);
+int perfctr(int cpu, uint64 *pmc);
+int ipc_call(int pid, uint msg[4]);
+int ipc_reply(int pid, uint msg[4]);
+int ipc_reply_wait(int pid, uint msg[4]);
+int meminfo(int pid, struct meminfo*);
+int shm_open(int key, int size);
+void* shm_attach(int id);
+int shm_unlink(int key);
+int getdents(int fd, struct direntstat *ds, int n);
+int mount(char *path);
@@ -7,6 +7,13 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "mmu.h"
+#include "mman.h"
+#include "poll.h"
+#include "ring.h"
+#include "clone.h"
+#include "uio.h"
+#include "thread.h"
 
 char buf[8192];
 char name[3];
@@ -1383,7 +1390,7 @@ forktest(void)
 
   printf(1, "fork test\n");
 
-  for(n=0; n<1000; n++){
+  for(n=0; n<5000; n++){
     pid = fork();
     if(pid < 0)
       break;
@@ -1391,8 +1398,8 @@ forktest(void)
       exit();
   }
 
-  if(n == 1000){
-    printf(1, "fork claimed to work 1000 times!\n");
+  if(n == 5000){
+    printf(1, "fork claimed to work 5000 times!\n");
     exit();
   }
 
@@ -1724,6 +1731,593 @@ uio()
   printf(1, "uio test done\n");
 }
 
+// does free() give the heap back, and madvise() pages?
+void
+heaptrim(void)
+{
+  char *p[32], *top, *m;
+  int i;
+
+  printf(1, "heap trim test\n");
+  top = sbrk(0);
+  for(i = 0; i < 32; i++){
+    if((p[i] = malloc(8192)) == 0){
+      printf(1, "heap trim: malloc failed\n");
+      exit();
+    }
+    memset(p[i], 1, 8192);
+  }
+  if(sbrk(0) < top + 32*8192){
+    printf(1, "heap trim: heap didn't grow\n");
+    exit();
+  }
+  for(i = 31; i >= 0; i--)
+    free(p[i]);
+  if(sbrk(0) >= top + 32*8192){
+    printf(1, "heap trim: heap didn't shrink\n");
+    exit();
+  }
+
+  m = sbrk(2*PGSIZE);
+  m = (char*)PGROUNDUP((uint)m);
+  m[0] = 'x';
+  if(madvise(m, PGSIZE, MADV_DONTNEED) < 0 || m[0] != 0){
+    printf(1, "heap trim: madvise didn't drop the page\n");
+    exit();
+  }
+  if(madvise(m + 1, PGSIZE, MADV_DONTNEED) != -1){
+    printf(1, "heap trim: madvise took an unaligned address\n");
+    exit();
+  }
+  printf(1, "heap trim ok\n");
+}
+
+// do readv() and writev() take their buffers in turn, and do
+// pread() and pwrite() leave the file offset alone?
+void
+iovtest(void)
+{
+  struct iovec iov[IOV_MAX+1];
+  char a[4], b[8];
+  int fd;
+
+  printf(1, "iov test\n");
+  fd = open("iovfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "iov: create failed\n");
+    exit();
+  }
+  iov[0].iov_base = "hello";
+  iov[0].iov_len = 5;
+  iov[1].iov_base = " ";
+  iov[1].iov_len = 1;
+  iov[2].iov_base = "world";
+  iov[2].iov_len = 5;
+  if(writev(fd, iov, 3) != 11){
+    printf(1, "iov: writev failed\n");
+    exit();
+  }
+  if(pwrite(fd, "W", 1, 6) != 1 || pread(fd, b, 5, 6) != 5){
+    printf(1, "iov: pwrite/pread failed\n");
+    exit();
+  }
+  b[5] = 0;
+  if(strcmp(b, "World") != 0){
+    printf(1, "iov: pread read %s\n", b);
+    exit();
+  }
+  if(read(fd, b, 1) != 0){
+    printf(1, "iov: pread or pwrite moved the offset\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("iovfile", O_RDONLY);
+  iov[0].iov_base = a;
+  iov[0].iov_len = sizeof(a);
+  iov[1].iov_base = b;
+  iov[1].iov_len = sizeof(b);
+  if(readv(fd, iov, 2) != 11){
+    printf(1, "iov: readv failed\n");
+    exit();
+  }
+  b[7] = 0;
+  if(a[0] != 'h' || a[3] != 'l' || strcmp(b, "o World") != 0){
+    printf(1, "iov: readv read the wrong bytes\n");
+    exit();
+  }
+  if(readv(fd, iov, IOV_MAX+1) != -1){
+    printf(1, "iov: readv took more than IOV_MAX buffers\n");
+    exit();
+  }
+  close(fd);
+  unlink("iovfile");
+  printf(1, "iov ok\n");
+}
+
+// does poll() see a pipe become ready, and time out when it
+// doesn't?
+void
+polltest(void)
+{
+  struct pollfd pfd[2];
+  int fds[2], t0, pid;
+
+  printf(1, "poll test\n");
+  if(pipe(fds) != 0){
+    printf(1, "poll: pipe failed\n");
+    exit();
+  }
+  pfd[0].fd = fds[0];
+  pfd[0].events = POLLIN;
+  pfd[1].fd = -1;
+  t0 = uptime();
+  if(poll(pfd, 2, 5) != 0 || pfd[0].revents != 0){
+    printf(1, "poll: empty pipe is readable\n");
+    exit();
+  }
+  if(uptime() - t0 < 5){
+    printf(1, "poll: returned before its timeout\n");
+    exit();
+  }
+  pfd[1].fd = fds[1];
+  pfd[1].events = POLLOUT;
+  if(poll(pfd, 2, -1) != 1 || pfd[0].revents != 0 || pfd[1].revents != POLLOUT){
+    printf(1, "poll: pipe isn't writable\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(1, "poll: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    sleep(2);
+    write(fds[1], "x", 1);
+    exit();
+  }
+  if(poll(pfd, 1, -1) != 1 || !(pfd[0].revents & POLLIN)){
+    printf(1, "poll: didn't see the write\n");
+    exit();
+  }
+  wait();
+  close(fds[1]);
+  if(read(fds[0], buf, 1) != 1 || poll(pfd, 1, 0) != 1 || !(pfd[0].revents & POLLHUP)){
+    printf(1, "poll: didn't see the writer close\n");
+    exit();
+  }
+  close(fds[0]);
+  if(poll(pfd, 1, 0) != 1 || pfd[0].revents != POLLNVAL){
+    printf(1, "poll: closed fd isn't POLLNVAL\n");
+    exit();
+  }
+  printf(1, "poll ok\n");
+}
+
+// does ringenter() make the calls it may, with their own
+// arguments, and put each result in its ringop?
+void
+ringtest(void)
+{
+  struct ringop ops[RING_MAX+1];
+  struct stat st;
+  char b[4];
+  int fd;
+
+  printf(1, "ring test\n");
+  fd = open("ringfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "ring: create failed\n");
+    exit();
+  }
+  memset(ops, 0, sizeof(ops));
+  ops[0].op = SYS_write;
+  ops[0].arg[0] = fd;
+  ops[0].arg[1] = (int)"abc";
+  ops[0].arg[2] = 3;
+  ops[1].op = SYS_pwrite;
+  ops[1].arg[0] = fd;
+  ops[1].arg[1] = (int)"X";
+  ops[1].arg[2] = 1;
+  ops[1].arg[3] = 1;
+  ops[2].op = SYS_fstat;
+  ops[2].arg[0] = fd;
+  ops[2].arg[1] = (int)&st;
+  ops[3].op = SYS_fork;            // not allowed
+  ops[4].op = 0;                   // no such call
+  ops[5].op = SYS_close;
+  ops[5].arg[0] = fd;
+  ops[0].res = ops[3].res = ops[4].res = 99;
+  if(ringenter(ops, 6) != 6){
+    printf(1, "ring: ringenter didn't make 6 calls\n");
+    exit();
+  }
+  if(ops[0].res != 3 || ops[1].res != 1 || ops[2].res != 0 ||
+     ops[3].res != -1 || ops[4].res != -1 || ops[5].res != 0){
+    printf(1, "ring: wrong results %d %d %d %d %d %d\n", ops[0].res,
+           ops[1].res, ops[2].res, ops[3].res, ops[4].res, ops[5].res);
+    exit();
+  }
+  if(st.size != 3){
+    printf(1, "ring: fstat got size %d\n", st.size);
+    exit();
+  }
+
+  fd = open("ringfile", O_RDONLY);
+  ops[0].op = SYS_read;
+  ops[0].arg[0] = fd;
+  ops[0].arg[1] = (int)b;
+  ops[0].arg[2] = 3;
+  ops[1].op = SYS_close;
+  ops[1].arg[0] = fd;
+  if(ringenter(ops, 2) != 2 || ops[0].res != 3 || ops[1].res != 0){
+    printf(1, "ring: read back failed\n");
+    exit();
+  }
+  b[3] = 0;
+  if(strcmp(b, "aXc") != 0){
+    printf(1, "ring: read back %s\n", b);
+    exit();
+  }
+  if(ringenter(ops, RING_MAX+1) != -1){
+    printf(1, "ring: ringenter took more than RING_MAX calls\n");
+    exit();
+  }
+  unlink("ringfile");
+  printf(1, "ring ok\n");
+}
+
+// is a shm segment shared across fork() and a second
+// shm_attach(), and does it stay mapped after shm_unlink()?
+void
+shmtest(void)
+{
+  #define SHMKEY 0x7573
+
+  int id, pid;
+  char *p, *q;
+
+  printf(1, "shm test\n");
+  if((id = shm_open(SHMKEY, 2*PGSIZE)) < 0 || (p = shm_attach(id)) == MAP_FAILED){
+    printf(1, "shm: shm_open or shm_attach failed\n");
+    exit();
+  }
+  if(p[0] != 0 || p[PGSIZE] != 0){
+    printf(1, "shm: segment not zeroed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "shm: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    p[0] = 'c';
+    if((q = shm_attach(shm_open(SHMKEY, 0))) != MAP_FAILED)
+      q[PGSIZE] = 'd';
+    exit();
+  }
+  wait();
+  if(p[0] != 'c' || p[PGSIZE] != 'd'){
+    printf(1, "shm: child's writes not seen\n");
+    exit();
+  }
+  if(shm_unlink(SHMKEY) != 0 || shm_open(SHMKEY, 0) != -1){
+    printf(1, "shm: shm_unlink didn't remove the name\n");
+    exit();
+  }
+  p[1] = 'x';
+  if(p[0] != 'c' || p[1] != 'x'){
+    printf(1, "shm: mapping lost by shm_unlink\n");
+    exit();
+  }
+  if(munmap(p, 2*PGSIZE) != 0 || shm_unlink(SHMKEY) != -1){
+    printf(1, "shm: munmap failed\n");
+    exit();
+  }
+  printf(1, "shm ok\n");
+}
+
+// a thread that runs until its group is ended
+void
+spinthread(void *arg1, void *arg2)
+{
+  for(;;)
+    ;
+}
+
+// does exit_group() end the caller's other threads too?
+void
+exitgroup(void)
+{
+  struct pollfd pfd;
+  int fds[2], pid, i;
+  char *stack;
+
+  printf(1, "exit group test\n");
+  if(pipe(fds) != 0){
+    printf(1, "exit group: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "exit group: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    stack = (char*)PGROUNDUP((uint)sbrk(3*PGSIZE));
+    for(i = 0; i < 2; i++)
+      if(clone(spinthread, 0, 0, stack + i*PGSIZE, CLONE_FILES, 0) < 0){
+        write(fds[1], "f", 1);
+        break;
+      }
+    sleep(2);
+    exit_group();
+  }
+  close(fds[1]);
+  // The threads share the write end: the pipe reads end of
+  // file only once they are all gone.
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  if(poll(&pfd, 1, 500) != 1 || read(fds[0], buf, 1) != 0){
+    printf(1, "exit group: threads outlived exit_group\n");
+    exit();
+  }
+  wait();
+  close(fds[0]);
+  printf(1, "exit group ok\n");
+}
+
+// do fdatasync() and sync() work after appends and after
+// overwrites in place, and does fdatasync() check its fd?
+void
+synctest(void)
+{
+  int fd, i, fds[2];
+
+  printf(1, "sync test\n");
+  fd = open("syncfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "sync: create failed\n");
+    exit();
+  }
+  memset(buf, 's', 4*BSIZE);
+  if(write(fd, buf, 4*BSIZE) != 4*BSIZE || fdatasync(fd) != 0){
+    printf(1, "sync: append and fdatasync failed\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    buf[0] = '0' + i;
+    if(pwrite(fd, buf, 1, i*BSIZE) != 1 || fdatasync(fd) != 0){
+      printf(1, "sync: overwrite and fdatasync failed\n");
+      exit();
+    }
+  }
+  if(fsync(fd) != 0 || sync() != 0){
+    printf(1, "sync: fsync or sync failed\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++)
+    if(pread(fd, buf, 1, i*BSIZE) != 1 || buf[0] != '0' + i){
+      printf(1, "sync: block %d lost its overwrite\n", i);
+      exit();
+    }
+  close(fd);
+  if(fdatasync(fd) != -1){
+    printf(1, "sync: fdatasync took a closed fd\n");
+    exit();
+  }
+  if(pipe(fds) != 0 || fdatasync(fds[0]) != 0){
+    printf(1, "sync: fdatasync failed on a pipe\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("syncfile");
+  printf(1, "sync ok\n");
+}
+
+// a thread that wakes the futex_timedwait() in futextimeout
+void
+futexwaker(void *arg1, void *arg2)
+{
+  while(futex_wake((volatile uint*)arg1, 1) == 0)
+    sleep(1);
+  exit();
+}
+
+// does futex_timedwait() give up after its timeout, and return
+// early when woken?
+void
+futextimeout(void)
+{
+  volatile uint word = 0;
+  char *stack;
+  void *ustack;
+  int t0, tid;
+
+  printf(1, "futex timeout test\n");
+  if(futex_timedwait(&word, 1, 10) != -1){
+    printf(1, "futex timeout: waited though *addr != val\n");
+    exit();
+  }
+  t0 = uptime();
+  if(futex_timedwait(&word, 0, 10) != 1){
+    printf(1, "futex timeout: didn't time out\n");
+    exit();
+  }
+  if(uptime() - t0 < 9){
+    printf(1, "futex timeout: returned after %d of 10 ticks\n", uptime() - t0);
+    exit();
+  }
+
+  stack = (char*)PGROUNDUP((uint)sbrk(2*PGSIZE));
+  if((tid = clone(futexwaker, (void*)&word, 0, stack, 0, 0)) < 0){
+    printf(1, "futex timeout: clone failed\n");
+    exit();
+  }
+  if(futex_timedwait(&word, 0, 1000) != 0 || join(tid, &ustack) != tid){
+    printf(1, "futex timeout: wake didn't end the wait\n");
+    exit();
+  }
+  printf(1, "futex timeout ok\n");
+}
+
+mutex_t forkmutex;
+volatile uint forklocked;
+
+// a thread that blocks in mutex_lock() in forkfutex
+void
+forklocker(void *arg1, void *arg2)
+{
+  mutex_lock(&forkmutex);
+  forklocked = 1;
+  mutex_unlock(&forkmutex);
+  exit();
+}
+
+// does a thread blocked in mutex_lock() wake when the holder
+// forks before unlocking?  The fork makes the mutex's page
+// copy-on-write, so the unlock moves the word to a new page.
+void
+forkfutex(void)
+{
+  char *stack;
+  void *ustack;
+  int i, pid, tid;
+
+  printf(1, "fork futex test\n");
+  mutex_init(&forkmutex);
+  mutex_lock(&forkmutex);
+  stack = (char*)PGROUNDUP((uint)sbrk(2*PGSIZE));
+  if((tid = clone(forklocker, 0, 0, stack, 0, 0)) < 0){
+    printf(1, "fork futex: clone failed\n");
+    exit();
+  }
+  while(forkmutex.state != 2)
+    sleep(1);
+  sleep(2);  // into futex_wait()
+  pid = fork();
+  if(pid < 0){
+    printf(1, "fork futex: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    sleep(50);  // keep the page shared past the unlock
+    exit();
+  }
+  mutex_unlock(&forkmutex);
+  for(i = 0; i < 20 && !forklocked; i++)
+    sleep(1);
+  if(!forklocked){
+    printf(1, "fork futex: unlock after fork didn't wake the waiter\n");
+    exit();
+  }
+  if(join(tid, &ustack) != tid){
+    printf(1, "fork futex: join failed\n");
+    exit();
+  }
+  wait();
+  printf(1, "fork futex ok\n");
+}
+
+// a thread that waits in futex_wait() until *arg1 is set
+void
+idlethread(void *arg1, void *arg2)
+{
+  volatile uint *stop = arg1;
+
+  while(!*stop)
+    futex_wait(stop, 0);
+  exit();
+}
+
+// read() of whole pages into page-aligned memory hands over the
+// page-cache pages copy-on-write.  Does writing the buffer leave
+// the file alone, and writing the file leave the buffer alone?
+// With threaded, a second thread shares the address space.
+void
+sharedread1(char *name, int threaded)
+{
+  static volatile uint stop;
+  char *b;
+  void *ustack;
+  int fd, i, tid;
+
+  printf(1, "%s test\n", name);
+  b = (char*)PGROUNDUP((uint)sbrk(4*PGSIZE));
+  for(i = 0; i < 2*PGSIZE; i++)
+    b[i] = 'a' + i%26;
+  fd = open("sharedread", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, b, 2*PGSIZE) != 2*PGSIZE){
+    printf(1, "%s: create failed\n", name);
+    exit();
+  }
+  memset(b, 0, 2*PGSIZE);
+  tid = 0;
+  if(threaded){
+    stop = 0;
+    if((tid = clone(idlethread, (void*)&stop, 0, b + 2*PGSIZE, 0, 0)) < 0){
+      printf(1, "%s: clone failed\n", name);
+      exit();
+    }
+  }
+
+  if(pread(fd, b, 2*PGSIZE, 0) != 2*PGSIZE ||
+     b[0] != 'a' || b[PGSIZE] != 'a' + PGSIZE%26){
+    printf(1, "%s: read failed\n", name);
+    exit();
+  }
+  b[0] = 'X';
+  b[PGSIZE] = 'Y';
+  if(pread(fd, buf, 2*PGSIZE, 0) != 2*PGSIZE ||
+     buf[0] != 'a' || buf[PGSIZE] != 'a' + PGSIZE%26){
+    printf(1, "%s: writing the buffer changed the file\n", name);
+    exit();
+  }
+
+  if(pread(fd, b, 2*PGSIZE, 0) != 2*PGSIZE ||
+     pwrite(fd, "Z", 1, 0) != 1 || pwrite(fd, "Z", 1, PGSIZE) != 1){
+    printf(1, "%s: pwrite failed\n", name);
+    exit();
+  }
+  if(b[0] != 'a' || b[PGSIZE] != 'a' + PGSIZE%26){
+    printf(1, "%s: writing the file changed the buffer\n", name);
+    exit();
+  }
+  if(pread(fd, buf, 2*PGSIZE, 0) != 2*PGSIZE ||
+     buf[0] != 'Z' || buf[PGSIZE] != 'Z'){
+    printf(1, "%s: file lost the write\n", name);
+    exit();
+  }
+
+  if(threaded){
+    stop = 1;
+    futex_wake(&stop, 1);
+    if(join(tid, &ustack) != tid){
+      printf(1, "%s: join failed\n", name);
+      exit();
+    }
+  }
+  close(fd);
+  unlink("sharedread");
+  printf(1, "%s ok\n", name);
+}
+
+void
+sharedread(void)
+{
+  sharedread1("shared read", 0);
+}
+
+void
+sharedreadthread(void)
+{
+  sharedread1("shared read thread", 1);
+}
+
 void argptest()
 {
   int fd;
@@ -1745,59 +2339,193 @@ rand()
   return randstate;
 }
 
+// The tests, in the order a full run takes them.  Each runs in
+// a child process of its own, up to -j at once; an excl test
+// waits for the others to finish and runs alone, because it
+// uses up memory, processes or inodes, or shares file names
+// with another test.  exectest execs echo, so it runs last,
+// in usertests itself, and only if nothing failed.
+#define MAXJ 16
+
+struct test {
+  char *name;
+  void (*fn)(void);
+  int excl;
+} tests[] = {
+  { "argptest", argptest, 0 },
+  { "createdelete", createdelete, 0 },
+  { "linkunlink", linkunlink, 0 },
+  { "concreate", concreate, 0 },
+  { "fourfiles", fourfiles, 0 },
+  { "sharedfd", sharedfd, 0 },
+  { "bigargtest", bigargtest, 1 },
+  { "bigwrite", bigwrite, 0 },
+  { "bigargtest", bigargtest, 1 },
+  { "bsstest", bsstest, 0 },
+  { "heaptrim", heaptrim, 0 },
+  { "sbrktest", sbrktest, 1 },
+  { "validatetest", validatetest, 0 },
+  { "opentest", opentest, 0 },
+  { "writetest", writetest, 0 },
+  { "writetest1", writetest1, 0 },
+  { "createtest", createtest, 0 },
+  { "openiputtest", openiputtest, 0 },
+  { "exitiputtest", exitiputtest, 1 },
+  { "iputtest", iputtest, 0 },
+  { "mem", mem, 1 },
+  { "pipe1", pipe1, 0 },
+  { "preempt", preempt, 1 },
+  { "exitwait", exitwait, 0 },
+  { "rmdot", rmdot, 0 },
+  { "fourteen", fourteen, 0 },
+  { "bigfile", bigfile, 0 },
+  { "subdir", subdir, 0 },
+  { "linktest", linktest, 0 },
+  { "unlinkread", unlinkread, 0 },
+  { "dirfile", dirfile, 0 },
+  { "iref", iref, 1 },
+  { "forktest", forktest, 1 },
+  { "bigdir", bigdir, 0 }, // slow
+  { "uio", uio, 0 },
+  { "iovtest", iovtest, 0 },
+  { "polltest", polltest, 0 },
+  { "ringtest", ringtest, 0 },
+  { "shmtest", shmtest, 0 },
+  { "exitgroup", exitgroup, 0 },
+  { "synctest", synctest, 0 },
+  { "futextimeout", futextimeout, 0 },
+  { "forkfutex", forkfutex, 0 },
+  { "sharedread", sharedread, 0 },
+  { "sharedreadthread", sharedreadthread, 0 },
+};
+#define NTEST (sizeof(tests)/sizeof(tests[0]))
+
+// A test running in a child process.  The child writes a byte
+// to the pipe read through fd once the test returns; a test
+// that fails exits first, so the parent reads end of file.
+struct running {
+  struct test *t;
+  int pid;
+  int fd;
+  int start;
+} running[MAXJ];
+int nrunning;
+int nfailed;
+
+void
+starttest(struct test *t)
+{
+  struct running *r = &running[nrunning];
+  int pfd[2];
+
+  if(pipe(pfd) < 0){
+    printf(1, "usertests: pipe failed\n");
+    exit();
+  }
+  r->t = t;
+  r->start = uptime();
+  r->pid = fork();
+  if(r->pid < 0){
+    printf(1, "usertests: fork failed\n");
+    exit();
+  }
+  if(r->pid == 0){
+    close(pfd[0]);
+    t->fn();
+    write(pfd[1], "", 1);
+    exit();
+  }
+  close(pfd[1]);
+  r->fd = pfd[0];
+  nrunning++;
+}
+
+// Wait for one running test to finish and report it.
+void
+reaptest(void)
+{
+  struct running *r;
+  int pid;
+  char c;
+
+  if((pid = wait()) < 0){
+    printf(1, "usertests: wait failed\n");
+    exit();
+  }
+  for(r = running; r < &running[nrunning]; r++)
+    if(r->pid == pid)
+      break;
+  if(r == &running[nrunning])
+    return;
+  if(read(r->fd, &c, 1) == 1)
+    printf(1, "usertests: %s ok, %d ticks\n", r->t->name, uptime() - r->start);
+  else {
+    printf(1, "usertests: %s FAILED, %d ticks\n", r->t->name, uptime() - r->start);
+    nfailed++;
+  }
+  close(r->fd);
+  *r = running[--nrunning];
+}
+
+// usertests [-j n] [test...]: run the named tests, or all of
+// them, n at a time.
 int
 main(int argc, char *argv[])
 {
+  struct test *t;
+  int i, j, ntest, all, want;
+
+  j = 1;
+  ntest = 0;
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-j") == 0 && i+1 < argc){
+      j = atoi(argv[++i]);
+      if(j < 1 || j > MAXJ){
+        printf(2, "usertests: -j takes 1 to %d\n", MAXJ);
+        exit();
+      }
+    } else
+      ntest++;
+  }
+  all = ntest == 0;
+
   printf(1, "usertests starting\n");
 
-  if(open("usertests.ran", 0) >= 0){
-    printf(1, "already ran user tests -- rebuild fs.img\n");
-    exit();
-  }
-  close(open("usertests.ran", O_CREATE));
-
-  argptest();
-  createdelete();
-  linkunlink();
-  concreate();
-  fourfiles();
-  sharedfd();
-
-  bigargtest();
-  bigwrite();
-  bigargtest();
-  bsstest();
-  sbrktest();
-  validatetest();
-
-  opentest();
-  writetest();
-  writetest1();
-  createtest();
-
-  openiputtest();
-  exitiputtest();
-  iputtest();
-
-  mem();
-  pipe1();
-  preempt();
-  exitwait();
-
-  rmdot();
-  fourteen();
-  bigfile();
-  subdir();
-  linktest();
-  unlinkread();
-  dirfile();
-  iref();
-  forktest();
-  bigdir(); // slow
-
-  uio();
-
-  exectest();
+  if(all){
+    if(open("usertests.ran", 0) >= 0){
+      printf(1, "already ran user tests -- rebuild fs.img\n");
+      exit();
+    }
+    close(open("usertests.ran", O_CREATE));
+  }
+
+  for(t = tests; t < &tests[NTEST]; t++){
+    want = all;
+    for(i = 1; i < argc && !want; i++)
+      if(strcmp(argv[i], "-j") == 0)
+        i++;
+      else if(strcmp(argv[i], t->name) == 0)
+        want = 1;
+    if(!want)
+      continue;
+    while(nrunning > 0 && (t->excl || nrunning >= j))
+      reaptest();
+    starttest(t);
+    if(t->excl)
+      reaptest();
+  }
+  while(nrunning > 0)
+    reaptest();
+
+  if(nfailed){
+    printf(1, "usertests: %d FAILED\n", nfailed);
+    exit();
+  }
+  for(i = 1; i < argc && !all; i++)
+    if(strcmp(argv[i], "exectest") == 0)
+      all = 1;
+  if(all)
+    exectest();
 
   exit();
 }
@@ -0,0 +1,19 @@
+// A page the kernel keeps up to date and every process can
+// read, so that it can learn the time and who and where it is
+// without a system call.  The kernel maps it at VDSO, just
+// below DEVSPACE, in the kernel part of the address space that
+// all page tables share (see vdsoinit() in vm.c).
+#define VDSO 0xFDFFF000
+
+struct vdso {
+  uint ticks;              // what uptime() returns
+  uint tscpertick;         // rdtsc() increments per tick, 0 until measured
+  struct {
+    uint seq;              // bumped whenever the cpu switches process
+    int pid;               // of the process running on the cpu
+  } __attribute__((aligned(CACHELINE))) cpu[NCPU];  // each written by its cpu
+};
+
+// lsl of this selector, from user mode, gives the cpu's index:
+// each cpu's SEG_UCPU segment has its index as its limit.
+#define VDSO_CPUSEL ((SEG_UCPU << 3) | DPL_USER)
@@ -0,0 +1,236 @@
+// Virtio block device driver, for the file system disk when
+// QEMU provides it as a virtio-blk-pci device (make qemu
+// DISK=virtio).  ideinit() looks for the device, and ide.c
+// hands it the requests for disk 1 if there is one.
+//
+// Requests go into one virtqueue as three-descriptor chains:
+// a header saying what to do, the buffer's data, and a status
+// byte.  Many requests can be in the ring at once, the device
+// is only kicked once per batch, and one interrupt finishes
+// every request that is done.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "rusage.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "trace.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "virtio.h"
+
+#define NVRING 256          // most descriptors a ring may have
+#define NVREQ  (NVRING/3)
+
+// Ring memory, physically contiguous: room for NVRING
+// descriptors and the available ring, then the used ring.
+static char vqmem[3*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static struct {
+  struct spinlock lock;
+  uint iobase;
+  int n;                        // descriptors in the ring
+  struct vdesc *desc;
+  volatile struct vavail *avail;
+  volatile struct vused *used;
+  ushort usedidx;               // used entries finished so far
+  int nreq;                     // requests the ring has room for
+  struct {
+    struct buf *b;              // 0 if free
+    struct vblkreq hdr;
+    uchar status;
+  } req[NVREQ];
+  struct buf *pending;          // waiting for room, through qnext
+} vblk;
+
+uint virtioirq;   // PCI interrupt line, 0 if no device
+
+// Read and write PCI configuration space on bus 0,
+// through configuration mechanism #1.
+static uint
+pciread(int dev, int reg)
+{
+  outl(0xcf8, 0x80000000 | (dev << 11) | (reg & 0xfc));
+  return inl(0xcfc);
+}
+
+static void
+pciwrite(int dev, int reg, uint v)
+{
+  outl(0xcf8, 0x80000000 | (dev << 11) | (reg & 0xfc));
+  outl(0xcfc, v);
+}
+
+// Find and set up the virtio block device.
+// Returns 1 if there is one.
+int
+virtioinit(void)
+{
+  uint id, bar, io, usedoff;
+  int dev, n;
+
+  for(dev = 0; dev < 32; dev++){
+    id = pciread(dev, 0x00);
+    if((id & 0xffff) == VIRTIO_VENDOR && (id >> 16) == VIRTIO_BLK_DEVICE)
+      break;
+  }
+  if(dev == 32)
+    return 0;
+  bar = pciread(dev, 0x10);
+  if((bar & 1) == 0)
+    return 0;                   // not an I/O port BAR
+  io = bar & ~3;
+  pciwrite(dev, 0x04, pciread(dev, 0x04) | 0x5);  // I/O space, bus master
+
+  outb(io+VIRTIO_STATUS, 0);    // reset
+  outb(io+VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+  outb(io+VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+  outl(io+VIRTIO_GUEST_FEATURES, 0);  // need none
+
+  outw(io+VIRTIO_QUEUE_SEL, 0);
+  n = inw(io+VIRTIO_QUEUE_SIZE);
+  usedoff = PGROUNDUP(n*sizeof(struct vdesc) + sizeof(struct vavail) + (n+1)*sizeof(ushort));
+  if(n < 3 || n > NVRING ||
+     usedoff + sizeof(struct vused) + n*sizeof(struct vusedelem) + sizeof(ushort) > sizeof(vqmem)){
+    outb(io+VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+    return 0;
+  }
+
+  initlock(&vblk.lock, "virtio");
+  vblk.iobase = io;
+  vblk.n = n;
+  vblk.nreq = n/3;
+  memset(vqmem, 0, sizeof(vqmem));
+  vblk.desc = (struct vdesc*)vqmem;
+  vblk.avail = (struct vavail*)(vqmem + n*sizeof(struct vdesc));
+  vblk.used = (struct vused*)(vqmem + usedoff);
+  outl(io+VIRTIO_QUEUE_PFN, V2P(vqmem) / PGSIZE);
+
+  virtioirq = pciread(dev, 0x3c) & 0xff;
+  ioapicenablelevel(virtioirq, ncpu - 1);
+  outb(io+VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER |
+       VIRTIO_STATUS_DRIVER_OK);
+  cprintf("virtio: block device, %d descriptors, irq %d\n", n, virtioirq);
+  return 1;
+}
+
+// Put a request for b in the available ring, without telling
+// the device.  Returns 0 if the ring is full.
+// Caller must hold vblk.lock.
+static int
+vsubmit(struct buf *b)
+{
+  struct vdesc *d;
+  int i;
+
+  for(i = 0; i < vblk.nreq; i++)
+    if(vblk.req[i].b == 0)
+      break;
+  if(i == vblk.nreq)
+    return 0;
+
+  vblk.req[i].b = b;
+  vblk.req[i].hdr.type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  vblk.req[i].hdr.reserved = 0;
+  vblk.req[i].hdr.sector = b->blockno * (BSIZE/512);
+  vblk.req[i].status = 0xff;
+
+  d = &vblk.desc[3*i];
+  d[0].addr = V2P(&vblk.req[i].hdr);
+  d[0].len = sizeof(struct vblkreq);
+  d[0].flags = VRING_DESC_F_NEXT;
+  d[0].next = 3*i + 1;
+  d[1].addr = V2P(b->data);
+  d[1].len = BSIZE;
+  d[1].flags = VRING_DESC_F_NEXT | ((b->flags & B_DIRTY) ? 0 : VRING_DESC_F_WRITE);
+  d[1].next = 3*i + 2;
+  d[2].addr = V2P(&vblk.req[i].status);
+  d[2].len = 1;
+  d[2].flags = VRING_DESC_F_WRITE;
+  d[2].next = 0;
+
+  vblk.avail->ring[vblk.avail->idx % vblk.n] = 3*i;
+  __sync_synchronize();
+  vblk.avail->idx++;
+  return 1;
+}
+
+// Tell the device there are new requests, unless it says
+// it doesn't need telling.  Caller must hold vblk.lock.
+static void
+vkick(void)
+{
+  __sync_synchronize();
+  if((vblk.used->flags & VRING_USED_F_NO_NOTIFY) == 0)
+    outw(vblk.iobase+VIRTIO_QUEUE_NOTIFY, 0);
+}
+
+// Start syncing b with the disk, as idestartrw() does.
+void
+virtiorw(struct buf *b)
+{
+  struct buf **pp;
+
+  acquire(&vblk.lock);
+  if(vsubmit(b))
+    vkick();
+  else {
+    b->qnext = 0;
+    for(pp = &vblk.pending; *pp; pp = &(*pp)->qnext)
+      ;
+    *pp = b;
+  }
+  release(&vblk.lock);
+}
+
+// Wait for the request virtiorw() started on b to finish.
+void
+virtioawait(struct buf *b)
+{
+  acquire(&vblk.lock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &vblk.lock);
+  release(&vblk.lock);
+}
+
+// Interrupt handler: finish every request the device is
+// done with, then fill the ring from the pending list.
+void
+virtiointr(void)
+{
+  struct buf *b;
+  int i, n;
+
+  acquire(&vblk.lock);
+  inb(vblk.iobase+VIRTIO_ISR);  // acknowledge, lowering the line
+
+  while(vblk.usedidx != vblk.used->idx){
+    __sync_synchronize();
+    i = vblk.used->ring[vblk.usedidx % vblk.n].id / 3;
+    vblk.usedidx++;
+    if(vblk.req[i].status != 0)
+      panic("virtio: disk error");
+    b = vblk.req[i].b;
+    vblk.req[i].b = 0;
+    trace(TR_DISKDONE, b->blockno | (b->flags & B_DIRTY ? TR_WRITE : 0));
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->flags & B_ASYNC)
+      bdone(b);
+  }
+
+  n = 0;
+  while((b = vblk.pending) != 0 && vsubmit(b)){
+    vblk.pending = b->qnext;
+    n++;
+  }
+  if(n > 0)
+    vkick();
+  release(&vblk.lock);
+}
@@ -0,0 +1,61 @@
+// Legacy virtio over PCI, as QEMU's virtio-blk-pci provides.
+// See the Virtio PCI Card Specification v0.9.5.
+
+#define VIRTIO_VENDOR        0x1af4
+#define VIRTIO_BLK_DEVICE    0x1001  // legacy (transitional) block device
+
+// Registers, at offsets from the I/O port base in BAR0.
+#define VIRTIO_HOST_FEATURES 0x00  // 32 bits
+#define VIRTIO_GUEST_FEATURES 0x04 // 32 bits
+#define VIRTIO_QUEUE_PFN     0x08  // 32 bits: physical page of the ring
+#define VIRTIO_QUEUE_SIZE    0x0c  // 16 bits, read-only
+#define VIRTIO_QUEUE_SEL     0x0e  // 16 bits
+#define VIRTIO_QUEUE_NOTIFY  0x10  // 16 bits
+#define VIRTIO_STATUS        0x12  // 8 bits
+#define VIRTIO_ISR           0x13  // 8 bits; reading acknowledges
+
+// Status register bits.
+#define VIRTIO_STATUS_ACK    1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FAILED 128
+
+// A virtqueue: descriptors, then the available ring, then,
+// on the next page boundary, the used ring.
+#define VRING_ALIGN 4096
+
+struct vdesc {
+  uint64 addr;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+#define VRING_DESC_F_NEXT  1  // chained with another descriptor
+#define VRING_DESC_F_WRITE 2  // device writes (vs reads)
+
+struct vavail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vusedelem {
+  uint id;   // index of the head of the finished chain
+  uint len;
+};
+
+struct vused {
+  ushort flags;
+  ushort idx;
+  struct vusedelem ring[];
+};
+#define VRING_USED_F_NO_NOTIFY 1  // device doesn't need kicks
+
+// A block request: this header, the data, then a status byte.
+struct vblkreq {
+  uint type;
+  uint reserved;
+  uint64 sector;
+};
+#define VIRTIO_BLK_T_IN  0  // read
+#define VIRTIO_BLK_T_OUT 1  // write
@@ -4,12 +4,39 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "rusage.h"
 #include "proc.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "mm.h"
+#include "mman.h"
+#include "traps.h"
+#include "vdso.h"
+#include "meminfo.h"
 
 extern char data[];  // defined by kernel.ld
+extern void sysentry(void);  // in trapasm.S
+struct vdso *vdso;
+
+// vdsotick() measures the TSC over VDSOCALN ticks, from tick
+// VDSOCAL0, once boot has settled.
+#define VDSOCAL0 10
+#define VDSOCALN 100
+
+static void vdsoinit(void);
 pde_t *kpgdir;  // for use in scheduler()
 
+static struct kmcache mmcache;
+
+// Orders the decisions to copy, keep or let go of page tables
+// shared since fork() (see ptown()), between the processes
+// sharing them.
+static struct spinlock ptlock;
+
+static int copyrange(pde_t*, pde_t*, uint, uint, int, struct spinlock*);
+static char *uvmpage(void);
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -21,17 +48,166 @@ seginit(void)
   // Cannot share a CODE descriptor for both kernel and user
   // because it would have to have DPL_USR, but the CPU forbids
   // an interrupt from CPL=0 to DPL=3.
-  c = &cpus[cpuid()];
+  // mycpu() needs %fs, so find this cpu by its APIC id.
+  for(c = cpus; c < cpus+ncpu && c->apicid != lapicid(); c++)
+    ;
+  if(c == cpus+ncpu)
+    panic("seginit: unknown apicid");
   c->gdt[SEG_KCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, 0);
   c->gdt[SEG_KDATA] = SEG(STA_W, 0, 0xffffffff, 0);
   c->gdt[SEG_UCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, DPL_USER);
   c->gdt[SEG_UDATA] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
+  c->gdt[SEG_UCPU] = SEG16(STA_R, 0, c - cpus, DPL_USER);
+  c->gdt[SEG_KCPU] = SEG16(STA_W, c, sizeof(*c) - 1, 0);
+  c->self = c;
+
+  // A double fault, which is what running off the bottom of a
+  // kernel stack into its guard page turns into, switches to a
+  // task with a stack of its own, to run dfault().
+  c->dfts.cs = SEG_KCODE << 3;
+  c->dfts.ds = c->dfts.es = c->dfts.ss = SEG_KDATA << 3;
+  c->dfts.fs = SEG_KCPU << 3;
+  c->dfts.eip = (uint*)dfault;
+  c->dfts.esp = (uint*)(c->dfstack + sizeof(c->dfstack));
+  c->dfts.eflags = 0x2;  // interrupts off
+  c->dfts.cr3 = (void*)V2P(kpgdir);
+  c->dfts.iomb = (ushort) 0xFFFF;
+  c->gdt[SEG_DFTSS] = SEG16(STS_T32A, &c->dfts, sizeof(c->dfts)-1, 0);
+  c->gdt[SEG_DFTSS].s = 0;
   lgdt(c->gdt, sizeof(c->gdt));
+  loadfs(SEG_KCPU << 3);
+
+  // System calls come in with sysenter.  sysexit takes the
+  // user segments to be the two after SEG_KCODE and SEG_KDATA.
+  if(!(cpuidedx(1) & CPUID_SEP))
+    panic("seginit: no sysenter");
+  wrmsr(MSR_SYSENTER_CS, SEG_KCODE << 3);
+  wrmsr(MSR_SYSENTER_EIP, (uint)sysentry);
+
+  // Keep the kernel's TLB entries, which are the same in every
+  // page table, across CR3 loads.
+  if(cpuidedx(1) & CPUID_PGE)
+    lcr4(rcr4() | CR4_PGE);
+}
+
+// The directory entry of the 4MB user page holding va in
+// pgdir, or 0 if va isn't in one.
+static pde_t*
+superpde(pde_t *pgdir, uint va)
+{
+  pde_t *pde;
+
+  pde = &pgdir[PDX(va)];
+  if(va >= KERNBASE || (*pde & (PTE_P|PTE_PS)) != (PTE_P|PTE_PS))
+    return 0;
+  return pde;
+}
+
+// Replace the 4MB user page at pde with a page table mapping
+// the same frame 4KB at a time, for code that manages single
+// pages.  The TLB needn't be flushed: both map the same.
+static int
+splitsuper(pde_t *pde)
+{
+  pte_t *pgtab;
+  uint pa, flags, i;
+
+  if((pgtab = (pte_t*)kalloc(KM_PGTBL)) == 0)
+    return -1;
+  pa = PTE_ADDR(*pde);
+  flags = PTE_FLAGS(*pde) & ~PTE_PS;
+  for(i = 0; i < NPTENTRIES; i++)
+    pgtab[i] = (pa + i*PGSIZE) | flags;
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  return 0;
+}
+
+// fork() shares whole user page tables between parent and
+// child (see copyrange()): both directory entries point at the
+// one table, read-only and marked PDE_COW, and the table's page
+// holds a reference for each.  The pages the table maps hold
+// one reference for the table, however many share it.  Reading
+// through a shared table is fine; before anything changes a
+// PTE in it, walkpgdir() calls ptown() to give the directory a
+// table of its own.  The read-only entry makes a write by the
+// process fault, and cowfault() does the same.
+
+// Make the page table of the 4MB at va in pgdir, if shared
+// since fork(), pgdir's own: a copy if others still share it,
+// whose writable pages become copy-on-write in both, else the
+// table itself, writable again.  Returns -1 if out of memory.
+static int
+ptown(pde_t *pgdir, uint va)
+{
+  pde_t *pde;
+  pte_t *pgtab, *copy, pte;
+  uint i;
+
+  pde = &pgdir[PDX(va)];
+  acquire(&ptlock);
+  if((*pde & (PTE_P|PDE_COW)) != (PTE_P|PDE_COW)){
+    release(&ptlock);
+    return 0;  // another thread got here first
+  }
+  pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
+  if(krefcount((char*)pgtab) == 1){
+    *pde = (*pde | PTE_W) & ~PDE_COW;
+    release(&ptlock);
+    return 0;
+  }
+  if((copy = (pte_t*)kalloc(KM_PGTBL)) == 0){
+    release(&ptlock);
+    return -1;
+  }
+  for(i = 0; i < NPTENTRIES; i++){
+    pte = pgtab[i];
+    if(pte & PTE_P){
+      if((pte & (PTE_W|PTE_SHARED)) == PTE_W)
+        pgtab[i] = pte = (pte & ~PTE_W) | PTE_COW;
+      kref(P2V(PTE_ADDR(pte)));
+    } else if(pte)
+      swapdup(PTESLOT(pte));
+    copy[i] = pte;
+  }
+  *pde = V2P(copy) | PTE_P | PTE_W | PTE_U;
+  // No cpu may walk the old table for pgdir once the others
+  // could free it.
+  tlbshootdown(pgdir, va & ~(PDSIZE-1), PDSIZE);
+  kfree((char*)pgtab);
+  release(&ptlock);
+  return 0;
+}
+
+// Let go of pgdir's share of the page table of the 4MB at va,
+// shared since fork(), as for freeing the whole 4MB.  Returns
+// 1 if others still share it and it is gone from pgdir, or 0
+// if pgdir now owns it alone and must free its pages itself.
+static int
+ptdrop(pde_t *pgdir, uint va)
+{
+  pde_t *pde;
+  char *pgtab;
+  int shared;
+
+  pde = &pgdir[PDX(va)];
+  acquire(&ptlock);
+  pgtab = P2V(PTE_ADDR(*pde));
+  if((shared = krefcount(pgtab) > 1) != 0){
+    *pde = 0;
+    tlbshootdown(pgdir, va, PDSIZE);
+    kfree(pgtab);
+  } else
+    *pde = (*pde | PTE_W) & ~PDE_COW;
+  release(&ptlock);
+  return shared;
 }
 
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
+// create any required page table pages.  A 4MB user page
+// holding va is split into 4KB ones first, and a page table
+// shared since fork() is made pgdir's own (see ptown()), so
+// the caller may change the PTE.
 static pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
@@ -39,13 +215,16 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(superpde(pgdir, (uint)va) && splitsuper(pde) < 0)
+    return 0;
+  if((*pde & PDE_COW) && ptown(pgdir, (uint)va) < 0)
+    return 0;
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kzalloc(KM_PGTBL)) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -54,6 +233,20 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   return &pgtab[PTX(va)];
 }
 
+// The PTE for va in pgdir, for reading only: unlike
+// walkpgdir(), a shared page table stays shared.  Returns 0 if
+// there is no page table for va or va is in a 4MB page.
+static pte_t*
+lookpgdir(pde_t *pgdir, const void *va)
+{
+  pde_t pde;
+
+  pde = pgdir[PDX(va)];
+  if((pde & (PTE_P|PTE_PS)) != PTE_P)
+    return 0;
+  return &((pte_t*)P2V(PTE_ADDR(pde)))[PTX(va)];
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
@@ -92,13 +285,19 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+phystop: mapped to V2P(data)..phystop,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
+// The kernel part uses 4MB pages where it can and is built once,
+// in kpgdir; setupkvm() shares its entries with every page table.
+// Large anonymous user regions may get 4MB pages too (see
+// pagein()).
+//
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (phystop, as
+// kinit1() found it, but no more than PHYSMAX) (directly
+// addressable from end..P2V(phystop)).
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -110,40 +309,132 @@ static struct kmap {
 } kmap[] = {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+ { (void*)data,     V2P(data),     0,         PTE_W}, // kern data+memory, to phystop
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Like mappages(), but with a 4MB page wherever va and pa are
+// both 4MB aligned and one fits, for the kernel's mappings.
+static int
+mapkpages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
+{
+  char *a, *last;
+
+  a = (char*)PGROUNDDOWN((uint)va);
+  last = (char*)PGROUNDDOWN(((uint)va) + size - 1);
+  for(;;){
+    if((uint)a % PDSIZE == 0 && pa % PDSIZE == 0 &&
+       (uint)(last - a) >= PDSIZE - PGSIZE){
+      if(pgdir[PDX(a)] & PTE_P)
+        panic("remap");
+      pgdir[PDX(a)] = pa | perm | PTE_P | PTE_PS;
+      if((uint)(last - a) == PDSIZE - PGSIZE)
+        break;
+      a += PDSIZE;
+      pa += PDSIZE;
+      continue;
+    }
+    if(mappages(pgdir, a, PGSIZE, pa, perm) < 0)
+      return -1;
+    if(a == last)
+      break;
+    a += PGSIZE;
+    pa += PGSIZE;
+  }
+  return 0;
+}
+
+// Set up kernel part of a page table, sharing kpgdir's
+// page tables and 4MB pages.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kzalloc(KM_PGTBL)) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
-      freevm(pgdir);
-      return 0;
-    }
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes.  Its kernel part is the one
+// every page table uses.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+  uint a;
+
+  kmap[2].phys_end = phystop;
+  if((kpgdir = (pde_t*)kzalloc(KM_PGTBL)) == 0)
+    panic("kvmalloc");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(mapkpages(kpgdir, k->virt, k->phys_end - k->phys_start,
+                 (uint)k->phys_start, k->perm | PTE_G) < 0)
+      panic("kvmalloc");
+  // Page tables for the kernel stacks now, so that every page
+  // table shares them and sees the stacks kstackmap() adds.
+  for(a = KSTACKS; a < KSTACKSEND; a += PDSIZE)
+    if(walkpgdir(kpgdir, (char*)a, 1) == 0)
+      panic("kvmalloc");
+  vdsoinit();
   switchkvm();
 }
 
+// Give the kernel stack at kstack, in KSTACKS, fresh pages
+// where it has none yet.  Below it is its guard page, never
+// mapped.  A stack stays mapped when its process is freed, for
+// the next process to use that proc struct: taking pages out of
+// the kernel part of the page tables would mean flushing them
+// from every cpu's TLB.  Returns -1 if out of memory.
+int
+kstackmap(char *kstack)
+{
+  char *a, *mem;
+  pte_t *pte;
+
+  for(a = kstack; a < kstack + KSTACKSIZE; a += PGSIZE){
+    if((pte = walkpgdir(kpgdir, a, 0)) == 0)
+      panic("kstackmap");
+    if(*pte & PTE_P)
+      continue;
+    if((mem = kalloc(KM_KSTACK)) == 0)
+      return -1;
+    *pte = V2P(mem) | PTE_P | PTE_W | PTE_G;
+  }
+  return 0;
+}
+
+// Map the vdso page, user-readable, into kpgdir, before any
+// process page table copies its kernel part.
+static void
+vdsoinit(void)
+{
+  if(sizeof(struct vdso) > PGSIZE || VDSO + PGSIZE > DEVSPACE)
+    panic("vdsoinit");
+  if((vdso = (struct vdso*)kzalloc(KM_KERN)) == 0 ||
+     mappages(kpgdir, (char*)VDSO, PGSIZE, V2P(vdso), PTE_U | PTE_G) < 0)
+    panic("vdsoinit");
+}
+
+// Keep the vdso's ticks, and measure the TSC against them.
+// Called by the timer interrupt, after ticks changes.  Returns
+// the TSC cycles per tick once measured, else 0.
+uint
+vdsotick(uint t)
+{
+  static uint64 tsc0;
+
+  vdso->ticks = t;
+  if(t == VDSOCAL0)
+    tsc0 = rdtsc();
+  else if(t == VDSOCAL0 + VDSOCALN)
+    vdso->tscpertick = (rdtsc() - tsc0) / VDSOCALN;
+  return vdso->tscpertick;
+}
+
 // Switch h/w page table register to the kernel-only page table,
 // for when no process is running.
 void
@@ -158,22 +449,42 @@ switchuvm(struct proc *p)
 {
   if(p == 0)
     panic("switchuvm: no process");
-  if(p->kstack == 0)
-    panic("switchuvm: no kstack");
-  if(p->pgdir == 0)
+  if(p->mm == 0 || p->mm->pgdir == 0)
     panic("switchuvm: no pgdir");
 
+  pushcli();
+  switchtss(p);
+  mycpu()->pgdir = p->mm->pgdir;  // first, for tlbshootdown()
+  lcr3(V2P(p->mm->pgdir));  // switch to process's address space
+  popcli();
+}
+
+// Point this cpu's TSS at p's kernel stack and install p's
+// TLS segment, leaving the page table alone.  Enough on its
+// own when p shares the address space that is already loaded.
+// %gs picks up the segment when trapret reloads it.
+void
+switchtss(struct proc *p)
+{
+  if(p == 0)
+    panic("switchtss: no process");
+  if(p->kstack == 0)
+    panic("switchtss: no kstack");
+
   pushcli();
   mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
                                 sizeof(mycpu()->ts)-1, 0);
   mycpu()->gdt[SEG_TSS].s = 0;
   mycpu()->ts.ss0 = SEG_KDATA << 3;
   mycpu()->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
+  wrmsr(MSR_SYSENTER_ESP, mycpu()->ts.esp0);
+  vdso->cpu[cpuid()].seq++;
+  vdso->cpu[cpuid()].pid = p->pid;
   // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  mycpu()->gdt[SEG_UTLS] = SEG(STA_W, p->tls, 0xffffffff, DPL_USER);
   popcli();
 }
 
@@ -186,8 +497,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc(KM_USER);
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -231,15 +541,14 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = uvmpage();
     if(mem == 0){
-      cprintf("allocuvm out of memory\n");
+      KLOG(KL_WARN, "allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
-      cprintf("allocuvm out of memory (2)\n");
+      KLOG(KL_WARN, "allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
       kfree(mem);
       return 0;
@@ -255,14 +564,35 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
+  pde_t *pde;
   pte_t *pte;
-  uint a, pa;
+  uint a, pa, start;
+  char *freed[32];
+  int n;
 
   if(newsz >= oldsz)
     return oldsz;
 
-  a = PGROUNDUP(newsz);
+  // Pages are unmapped in batches, and only freed once no
+  // cpu's TLB can reach them.
+  n = 0;
+  start = a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
+    if((pgdir[PDX(a)] & PDE_COW) && a % PDSIZE == 0 && a + PDSIZE <= oldsz &&
+       ptdrop(pgdir, a)){
+      a += PDSIZE - PGSIZE;
+      continue;
+    }
+    if((pde = superpde(pgdir, a)) != 0 && a % PDSIZE == 0 && a + PDSIZE <= oldsz){
+      pa = PTE_ADDR(*pde);
+      *pde = 0;
+      tlbshootdown(pgdir, a, PDSIZE);
+      ksuperfree(P2V(pa));
+      a += PDSIZE - PGSIZE;
+      continue;
+    }
+    // Splits a 4MB page only partly freed.  If that runs out of
+    // memory the page stays, to be freed with the page table.
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
@@ -270,16 +600,28 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      freed[n++] = P2V(pa);
+      *pte = 0;
+      if(n == NELEM(freed)){
+        tlbshootdown(pgdir, start, a + PGSIZE - start);
+        kfreemany(freed, n);
+        n = 0;
+        start = a + PGSIZE;
+      }
+    } else if(*pte){
+      swapfree(PTESLOT(*pte));
       *pte = 0;
     }
   }
+  if(n > 0){
+    tlbshootdown(pgdir, start, a - start);
+    kfreemany(freed, n);
+  }
   return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  The kernel part belongs to kpgdir.
 void
 freevm(pde_t *pgdir)
 {
@@ -288,7 +630,7 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -310,49 +652,738 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
+// Set the protection of the user pages in [va, va+len), which
+// must be page aligned and mapped.  PROT_NONE clears PTE_U, as
+// clearpteu() does for exec's stack guard page; the kernel can
+// still write such pages, so system calls don't fault on them.
+// The caller must flush the TLB.
+int
+mprotectuvm(pde_t *pgdir, uint va, uint len, int prot)
+{
+  pte_t *pte;
+  uint a;
+
+  if(va % PGSIZE || len % PGSIZE)
+    return -1;
+  for(a = va; a < va + len; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte == 0 || *pte == 0)
+      return -1;  // not touched yet; out on swap is fine
+    if(prot & (PROT_READ|PROT_WRITE))
+      *pte |= PTE_U;
+    else
+      *pte &= ~PTE_U;
+  }
+  return 0;
+}
+
+// Free the user pages in [va, va+len), which must be page
+// aligned, for madvise(MADV_DONTNEED): the next touch reads
+// them from their file or zero-fills them again, as if they had
+// never been touched.  Pages shared with MAP_SHARED (PTE_SHARED)
+// and those without PTE_U (PROT_NONE and guard pages) are left
+// alone.  A 4MB page only partly in the range is split, as in
+// deallocuvm().  Caller holds the mm's lock.
+void
+madviseuvm(pde_t *pgdir, uint va, uint len)
+{
+  pde_t *pde;
+  pte_t *pte;
+  uint a, start;
+  char *freed[32], *mem;
+  int n;
+
+  n = 0;
+  start = va;
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pde = superpde(pgdir, a)) != 0 && a % PDSIZE == 0 && a + PDSIZE <= va + len){
+      mem = P2V(PTE_ADDR(*pde));
+      *pde = 0;
+      tlbshootdown(pgdir, a, PDSIZE);
+      ksuperfree(mem);
+      a += PDSIZE - PGSIZE;
+      continue;
+    }
+    if((pte = walkpgdir(pgdir, (char*)a, 0)) == 0){
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if((*pte & PTE_P) == 0){
+      if(*pte){
+        swapfree(PTESLOT(*pte));
+        *pte = 0;
+      }
+      continue;
+    }
+    if((*pte & (PTE_U|PTE_SHARED)) != PTE_U)
+      continue;
+    freed[n++] = P2V(PTE_ADDR(*pte));
+    *pte = 0;
+    if(n == NELEM(freed)){
+      tlbshootdown(pgdir, start, a + PGSIZE - start);
+      kfreemany(freed, n);
+      n = 0;
+      start = a + PGSIZE;
+    }
+  }
+  if(n > 0){
+    tlbshootdown(pgdir, start, a - start);
+    kfreemany(freed, n);
+  }
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  If cow, writable pages are shared
+// instead: both page tables map them read-only with PTE_COW
+// and the first write copies the page (see cowpage()).  Whole
+// 4MB page tables are shared too, until either side changes
+// one (see ptown()), so fork() costs a PDE per 4MB rather
+// than a PTE per page.  The caller must then shoot down the
+// parent's TLB entries.
+// If lk is set, the caller holds it, and it is released now
+// and then on a long copy (see needbreak()).
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir, uint sz, int cow, struct spinlock *lk)
 {
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
-  char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+  if(copyrange(d, pgdir, 0, sz, cow, lk) < 0){
+    freevm(d);
+    return 0;
+  }
+  return d;
+}
+
+// Copy the pages of [start, end) of pgdir into d, as for
+// copyuvm().  PTE_SHARED pages are mapped in both.  If cow, a
+// page table wholly inside the range is shared as it is.
+static int
+copyrange(pde_t *d, pde_t *pgdir, uint start, uint end, int cow,
+          struct spinlock *lk)
+{
+  pde_t *pde;
+  pte_t *pte, *dpte;
+  uint pa, i, flags;
+  char *mem;
+
+  for(i = start; i < end; i += PGSIZE){
+    if(lk && needbreak()){
+      // Other threads may run once lk is released, so the
+      // pages shared so far must be read-only to them first.
+      if(cow)
+        tlbshootdown(pgdir, start, i - start);
+      start = i;
+      release(lk);
+      acquire(lk);
+    }
+    pde = &pgdir[PDX(i)];
+    if(cow && i % PDSIZE == 0 && i + PDSIZE <= end &&
+       (*pde & (PTE_P|PTE_PS)) == PTE_P){
+      *pde = (*pde & ~PTE_W) | PDE_COW;
+      d[PDX(i)] = *pde;
+      kref(P2V(PTE_ADDR(*pde)));
+      i += PDSIZE - PGSIZE;
+      continue;
+    }
+    // 4MB pages are shared or copied 4KB at a time.
+    if((pde = superpde(pgdir, i)) != 0 && splitsuper(pde) < 0)
+      return -1;
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0 || *pte == 0)
+      continue;  // not touched yet; the child faults it in too
+    if(!(*pte & PTE_P)){
+      // Out on swap: the child shares the slot.
+      if((dpte = walkpgdir(d, (void*)i, 1)) == 0)
+        return -1;
+      swapdup(PTESLOT(*pte));
+      *dpte = *pte;
+      continue;
+    }
+    if(*pte & PTE_SHARED){
+      pa = PTE_ADDR(*pte);
+      if(mappages(d, (void*)i, PGSIZE, pa, PTE_FLAGS(*pte)) < 0)
+        return -1;
+      kref(P2V(pa));
+      continue;
+    }
+    if(cow && (*pte & (PTE_W|PTE_COW))){
+      // Share the page read-only in both page tables.
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      pa = PTE_ADDR(*pte);
+      if(mappages(d, (void*)i, PGSIZE, pa, PTE_FLAGS(*pte)) < 0)
+        return -1;
+      kref(P2V(pa));
+      continue;
+    }
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
+    if((mem = kalloc(KM_USER)) == 0)
+      return -1;
     memmove(mem, (char*)P2V(pa), PGSIZE);
     if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
       kfree(mem);
-      goto bad;
+      return -1;
     }
   }
-  return d;
+  return 0;
+}
+
+// If the page at va in pgdir is copy-on-write, give pgdir
+// a writable page of its own, copying the data unless no one
+// else shares it.  The caller must shoot down the TLB entry
+// for va and then kfree(*old), the shared page, if set.
+// Returns 1 if the page was made writable, 0 if it isn't
+// copy-on-write, -1 if out of memory.
+static int
+cowpage(pde_t *pgdir, uint va, char **old)
+{
+  pte_t *pte;
+  uint pa;
+  char *mem;
+
+  *old = 0;
+  if(superpde(pgdir, va))
+    return 0;  // never copy-on-write
+  if((pte = walkpgdir(pgdir, (char*)va, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_P|PTE_COW)) != (PTE_P|PTE_COW))
+    return 0;
+  pa = PTE_ADDR(*pte);
+  if(krefcount(P2V(pa)) == 1){
+    *pte = (*pte | PTE_W) & ~PTE_COW;
+    return 1;
+  }
+  if((mem = kalloc(KM_USER)) == 0)
+    return -1;
+  memmove(mem, P2V(pa), PGSIZE);
+  *pte = V2P(mem) | ((PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW);
+  *old = P2V(pa);
+  return 1;
+}
+
+// Handle a write fault at va in the current process, by the
+// process itself or by the kernel writing to user memory for
+// it.  Returns 0 if the write can be retried, -1 if the fault
+// is not a copy-on-write one.
+int
+cowfault(uint va)
+{
+  struct mm *mm = myproc()->mm;
+  pte_t *pte;
+  char *old;
+  int r;
+
+  acquire(&mm->lock);
+  r = -1;
+  old = 0;
+  if(va < uvmend(mm, va) && superpde(mm->pgdir, va))
+    r = 0;  // always writable, so a stale TLB entry
+  else if(va < uvmend(mm, va) && (pte = walkpgdir(mm->pgdir, (char*)va, 0)) != 0 &&
+     (*pte & (PTE_P|PTE_U)) == (PTE_P|PTE_U)){
+    if(*pte & PTE_COW)
+      r = cowpage(mm->pgdir, PGROUNDDOWN(va), &old) < 0 ? -1 : 0;
+    else if(*pte & PTE_W)
+      r = 0;  // a stale TLB entry; fixed by the flush below
+  }
+  // Other threads may still read the shared page through
+  // their TLBs.
+  if(r == 0)
+    tlbshootdown(mm->pgdir, PGROUNDDOWN(va), PGSIZE);
+  release(&mm->lock);
+  if(old)
+    kfree(old);
+  return r;
+}
+
+// Whether the 4MB of user memory around va in mm could be a
+// 4MB page: all below sz, none of it touched yet (so there is
+// no page table) and no part of it backed by a file.  Called
+// with mm->lock held.
+static int
+superok(struct mm *mm, uint va)
+{
+  struct vma *v;
+  uint base;
 
-bad:
-  freevm(d);
+  base = va & ~(PDSIZE-1);
+  if(NSUPERPAGE == 0 || base + PDSIZE > mm->sz || (mm->pgdir[PDX(base)] & PTE_P))
+    return 0;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->flags && v->start < base + PDSIZE && v->end > base)
+      return 0;
+  return 1;
+}
+
+// Map a zeroed 4MB page around va in mm, if there is a free
+// frame.  Returns 0 if va is now mapped.
+static int
+pageinsuper(struct mm *mm, uint va)
+{
+  char *mem;
+
+  if((mem = ksuperalloc()) == 0)
+    return -1;
+  acquire(&mm->lock);
+  if(superok(mm, va))
+    mm->pgdir[PDX(va)] = V2P(mem) | PTE_P | PTE_W | PTE_U | PTE_PS;
+  else {
+    ksuperfree(mem);
+    mem = 0;
+  }
+  release(&mm->lock);
+  return mem ? 0 : -1;
+}
+
+// PTE permissions for a vma's PROT_ bits.
+static int
+vmaperm(int prot)
+{
+  if(prot & PROT_WRITE)
+    return PTE_W|PTE_U;
+  if(prot & PROT_READ)
+    return PTE_U;
   return 0;
 }
 
+// A zeroed page for user memory, reclaiming memory once if
+// there is none.  Caller must hold no spinlocks.
+static char*
+uvmpage(void)
+{
+  char *mem;
+
+  if((mem = kzalloc(KM_USER)) == 0 && reclaim(NRECLAIM) > 0)
+    mem = kzalloc(KM_USER);
+  return mem;
+}
+
+// Read back the page at va in the current process, whose PTE
+// pte says it is out on swap.  Called with mm->lock held;
+// releases it.  Returns 0 if the access can be retried.
+static int
+swapin(struct mm *mm, uint va, pte_t pte)
+{
+  pte_t *p;
+  uint slot;
+  char *mem;
+
+  // Keep the slot while reading it, whatever else happens
+  // to the page meanwhile.
+  slot = PTESLOT(pte);
+  swapdup(slot);
+  release(&mm->lock);
+  if((mem = kalloc(KM_USER)) == 0 && reclaim(NRECLAIM) > 0)
+    mem = kalloc(KM_USER);
+  if(mem == 0){
+    swapfree(slot);
+    return -1;
+  }
+  swapread(slot, mem);
+  acquire(&mm->lock);
+  if((p = walkpgdir(mm->pgdir, (char*)va, 0)) != 0 && *p == pte){
+    *p = V2P(mem) | PTE_FLAGS(pte) | PTE_P;
+    swapfree(slot);
+    mem = 0;
+  }
+  release(&mm->lock);
+  if(mem)
+    kfree(mem);  // another thread read it first, or it was unmapped
+  swapfree(slot);
+  return 0;
+}
+
+// Bring in the page at va in the current process, which hasn't
+// been touched yet: read it from the file of the vma covering
+// it, or zero-fill it.  Returns 0 if the access can be retried,
+// -1 if va isn't part of the process or memory ran out.  May
+// sleep on the file, so user memory handed to code that holds
+// a spinlock must be faulted in first (see uvmprefault()).
+int
+pagein(uint va)
+{
+  struct mm *mm = myproc()->mm;
+  struct vma *v;
+  struct inode *ip;
+  pte_t *pte;
+  uint off, n;
+  char *mem;
+  int super, perm, share;
+
+  va = PGROUNDDOWN(va);
+  acquire(&mm->lock);
+  if(va >= uvmend(mm, va)){
+    release(&mm->lock);
+    return -1;
+  }
+  if(superpde(mm->pgdir, va) ||
+     ((pte = walkpgdir(mm->pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P))){
+    release(&mm->lock);
+    return 0;  // another thread got here first
+  }
+  if(pte && *pte)
+    return swapin(mm, va, *pte);
+  ip = 0;
+  off = n = 0;
+  share = 0;
+  perm = PTE_W|PTE_U;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->flags && va >= v->start && va < v->end){
+      perm = vmaperm(v->prot);
+      if(v->ip && va - v->start < v->filesz){
+        // munmap() could drop the vma's reference meanwhile.
+        ip = idup(v->ip);
+        off = v->off + (va - v->start);
+        n = v->filesz - (va - v->start);
+        if(n > PGSIZE)
+          n = PGSIZE;
+        // A whole page that the process can't change, or only
+        // privately, can be the page-cache page itself.
+        share = n == PGSIZE && (!(v->prot & PROT_WRITE) || (v->flags & MAP_PRIVATE));
+      }
+      break;
+    }
+  }
+  super = ip == 0 && superok(mm, va);
+  release(&mm->lock);
+  if(super && pageinsuper(mm, va) == 0)
+    return 0;
+
+  mem = 0;
+  if(ip){
+    ilockshared(ip);
+    if(share && (mem = readipage(ip, off)) != 0){
+      if(perm & PTE_W)
+        perm = (perm & ~PTE_W) | PTE_COW;
+    } else if((mem = uvmpage()) != 0 && readi(ip, mem, off, n) != n){
+      kfree(mem);
+      mem = 0;
+    }
+    iunlock(ip);
+    begin_op();
+    iput(ip);
+    end_op();
+  } else
+    mem = uvmpage();
+  if(mem == 0)
+    return -1;
+
+  acquire(&mm->lock);
+  if(va >= uvmend(mm, va) || (pte = walkpgdir(mm->pgdir, (char*)va, 1)) == 0){
+    release(&mm->lock);
+    kfree(mem);
+    return -1;
+  }
+  if(*pte & PTE_P)
+    kfree(mem);  // lost a race with another thread's fault
+  else
+    *pte = V2P(mem) | PTE_P | perm;
+  release(&mm->lock);
+  return 0;
+}
+
+// Handle a page fault at user address va in the current
+// process, taken by the process or by the kernel on its behalf.
+// err is the hardware error code.  Returns 0 if the access can
+// be retried.
+int
+pagefault(uint va, uint err)
+{
+  if(!(err & FEC_PR))
+    return pagein(va);
+  if(err & FEC_WR)
+    return cowfault(va);
+  return -1;
+}
+
+// Replace the page at page-aligned user address va of the
+// current process with mem, which the process then shares
+// copy-on-write with whoever else holds it.  Lets read() hand
+// over page-cache pages instead of copying them.  Returns -1,
+// changing nothing, unless va is an ordinary writable page:
+// not unmapped, 4MB, or shared with fork() children.
+int
+uvmsharepage(uint va, char *mem)
+{
+  struct mm *mm = myproc()->mm;
+  pte_t *pte;
+  char *old;
+
+  acquire(&mm->lock);
+  if(va >= uvmend(mm, va) || superpde(mm->pgdir, va) ||
+     (pte = walkpgdir(mm->pgdir, (char*)va, 0)) == 0 ||
+     (*pte & (PTE_P|PTE_U|PTE_SHARED)) != (PTE_P|PTE_U) ||
+     (*pte & (PTE_W|PTE_COW)) == 0){
+    release(&mm->lock);
+    return -1;
+  }
+  old = P2V(PTE_ADDR(*pte));
+  kref(mem);
+  *pte = V2P(mem) | (PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW;
+  tlbshootdown(mm->pgdir, va, PGSIZE);
+  release(&mm->lock);
+  kfree(old);
+  return 0;
+}
+
+// Number of user pages mapped in pgdir, the pages of a 4MB
+// superpage included.
+uint
+uvmrss(pde_t *pgdir)
+{
+  pte_t *pgtab;
+  uint i, j, n;
+
+  n = 0;
+  for(i = 0; i < PDX(KERNBASE); i++){
+    if((pgdir[i] & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      continue;
+    if(pgdir[i] & PTE_PS){
+      n += NPTENTRIES;
+      continue;
+    }
+    pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[i]));
+    for(j = 0; j < NPTENTRIES; j++)
+      if(pgtab[j] & PTE_P)
+        n++;
+  }
+  return n;
+}
+
+// Write up to n of mm's pages out to swap and free them,
+// sweeping on from mm->swaphand (see swap.c).  Only pages no
+// one else maps are taken.  Returns the number freed.  Caller
+// must hold no spinlocks.
+int
+uvmswapout(struct mm *mm, int n)
+{
+  struct {
+    uint va;
+    pte_t pte;      // before
+    pte_t ro;       // while being written out
+    int slot;
+  } v[16];
+  pte_t *pte;
+  uint va, lo, hi;
+  int i, nv, freed;
+
+  if(n > NELEM(v))
+    n = NELEM(v);
+  nv = 0;
+  lo = KERNBASE;
+  hi = 0;
+  acquire(&mm->lock);
+  for(va = mm->swaphand; va < KERNBASE && nv < n; va += PGSIZE){
+    if((mm->pgdir[PDX(va)] & (PTE_P|PTE_PS|PDE_COW)) != PTE_P){
+      va = PGADDR(PDX(va) + 1, 0, 0) - PGSIZE;
+      continue;  // none, 4MB, or shared since fork()
+    }
+    pte = walkpgdir(mm->pgdir, (char*)va, 0);
+    if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U) || (*pte & PTE_SHARED))
+      continue;
+    if(va < lo)
+      lo = va;
+    hi = va + PGSIZE;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;  // a second chance
+      continue;
+    }
+    if(krefcount(P2V(PTE_ADDR(*pte))) != 1)
+      continue;
+    // Until the page is on disk, a write to it makes a copy
+    // (see cowfault()), and so calls off the swap.
+    v[nv].va = va;
+    v[nv].pte = *pte;
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    v[nv].ro = *pte;
+    kref(P2V(PTE_ADDR(*pte)));
+    nv++;
+  }
+  mm->swaphand = va < KERNBASE ? va : 0;
+  if(lo < hi)
+    tlbshootdown(mm->pgdir, lo, hi - lo);  // the accessed and writable bits
+  release(&mm->lock);
+
+  for(i = 0; i < nv; i++)
+    if((v[i].slot = swapwrite(P2V(PTE_ADDR(v[i].pte)))) < 0)
+      break;
+  for(; i < nv; i++)
+    v[i].slot = -1;
+
+  freed = 0;
+  acquire(&mm->lock);
+  for(i = 0; i < nv; i++){
+    if(v[i].slot < 0)
+      continue;
+    pte = walkpgdir(mm->pgdir, (char*)v[i].va, 0);
+    if(pte && (*pte & ~PTE_A) == v[i].ro){
+      *pte = SWAPPTE(v[i].slot, PTE_FLAGS(v[i].pte));
+      freed++;
+    } else {
+      swapfree(v[i].slot);
+      v[i].slot = -1;
+    }
+  }
+  if(freed)
+    tlbshootdown(mm->pgdir, v[0].va, v[nv-1].va + PGSIZE - v[0].va);
+  release(&mm->lock);
+  for(i = 0; i < nv; i++){
+    if(v[i].slot >= 0)
+      kfree(P2V(PTE_ADDR(v[i].pte)));  // the mapping's reference
+    kfree(P2V(PTE_ADDR(v[i].pte)));
+  }
+  return freed;
+}
+
+// Fault in the pages of [va, va+len) in the current process
+// that haven't been touched yet, for buffers the kernel uses
+// while holding a spinlock.  If write, also copy copy-on-write
+// pages, and fail if a page isn't writable: the kernel can't
+// recover from a write fault of its own.  The caller must have
+// checked that the range is user memory (see uvmend()).
+int
+uvmprefault(uint va, uint len, int write)
+{
+  pde_t *pgdir = myproc()->mm->pgdir;
+  pte_t *pte;
+  uint a;
+
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    if(superpde(pgdir, a))
+      continue;
+    pte = lookpgdir(pgdir, (char*)a);
+    if((pte == 0 || !(*pte & PTE_P)) && pagein(a) < 0)
+      return -1;
+    // The caller is about to use it: keep uvmswapout() away.
+    if((pte = lookpgdir(pgdir, (char*)a)) != 0)
+      *pte |= PTE_A;
+    if(!write)
+      continue;
+    // A page table shared since fork() is read-only.
+    if((pgdir[PDX(a)] & PDE_COW) && cowfault(a) < 0)
+      return -1;
+    pte = lookpgdir(pgdir, (char*)a);
+    if(pte && (*pte & PTE_COW) && cowfault(a) < 0)
+      return -1;
+    if(superpde(pgdir, a) == 0 && (pte == 0 || !(*pte & PTE_W)))
+      return -1;
+  }
+  return 0;
+}
+
+// The TLB shootdown in progress, if any: the cpus in pending
+// must drop their entries for [va, va+len) of pgdir.  One at a
+// time, under lock.
+static struct {
+  struct spinlock lock;
+  pde_t *pgdir;
+  uint va;
+  uint len;
+  volatile uint pending;       // Bit per cpu yet to answer
+} shoot;
+
+// Drop this cpu's TLB entries for [va, va+len) of the loaded
+// user page table.  Kernel entries are global and stay.
+static void
+tlbflush(uint va, uint len)
+{
+  uint a;
+
+  if(len > 32*PGSIZE){
+    lcr3(rcr3());
+    return;
+  }
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    invlpg((void*)a);
+}
+
+// Make every cpu drop its TLB entries for [va, va+len) of
+// pgdir.  For after changing or removing PTEs, before freeing
+// the pages they mapped.  Only cpus with pgdir loaded are
+// interrupted; a cpu that switches page tables flushes anyway.
+// Cpus spinning for a lock answer from the spin loop, so the
+// caller may hold spinlocks.
+void
+tlbshootdown(pde_t *pgdir, uint va, uint len)
+{
+  struct cpu *c, *me;
+  uint targets;
+
+  pushcli();
+  me = mycpu();
+  if(me->pgdir == pgdir)
+    tlbflush(va, len);
+  __sync_synchronize();  // PTE changes before looking at other cpus
+  targets = 0;
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(c != me && c->pgdir == pgdir)
+      targets |= 1 << (c - cpus);
+  if(targets){
+    acquire(&shoot.lock);
+    shoot.pgdir = pgdir;
+    shoot.va = va;
+    shoot.len = len;
+    __sync_fetch_and_or(&shoot.pending, targets);
+    for(c = cpus; c < cpus+ncpu; c++)
+      if(targets & (1 << (c - cpus)))
+        lapicipi(c->apicid, T_IRQ0 + IRQ_TLB);
+    while(shoot.pending)
+      asm volatile("pause");
+    release(&shoot.lock);
+  }
+  popcli();
+}
+
+// Answer the TLB shootdown in progress if it is waiting for
+// this cpu.  Called with interrupts off, from the IPI and from
+// spin loops.
+void
+tlbpoll(void)
+{
+  struct cpu *c;
+  uint bit;
+
+  if(shoot.pending == 0)
+    return;
+  c = mycpu();
+  bit = 1 << (c - cpus);
+  if((shoot.pending & bit) == 0)
+    return;
+  if(c->pgdir == shoot.pgdir)
+    tlbflush(shoot.va, shoot.len);
+  __sync_fetch_and_and(&shoot.pending, ~bit);
+}
+
+// Whether the user page at uva is shared with other address
+// spaces by MAP_SHARED or shm (PTE_SHARED), so that it stays the
+// same physical page in all of them.
+int
+uvashared(pde_t *pgdir, char *uva)
+{
+  pte_t *pte;
+
+  if(superpde(pgdir, (uint)uva) != 0)
+    return 0;
+  pte = lookpgdir(pgdir, uva);
+  return pte != 0 && (*pte & (PTE_P|PTE_SHARED)) == (PTE_P|PTE_SHARED);
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
 uva2ka(pde_t *pgdir, char *uva)
 {
+  pde_t *pde;
   pte_t *pte;
 
-  pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if((pde = superpde(pgdir, (uint)uva)) != 0){
+    if((*pde & PTE_U) == 0)
+      return 0;
+    return (char*)P2V(PTE_ADDR(*pde)) + (PGROUNDDOWN((uint)uva) & (PDSIZE-1));
+  }
+  pte = lookpgdir(pgdir, uva);
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -362,16 +1393,29 @@ uva2ka(pde_t *pgdir, char *uva)
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
 // uva2ka ensures this only works for PTE_U pages.
+// Writing through the kernel mapping bypasses PTE_W, so
+// copy-on-write pages are copied first.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
-  char *buf, *pa0;
+  char *buf, *pa0, *old;
   uint n, va0;
+  int r;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    if((r = cowpage(pgdir, va0, &old)) < 0)
+      return -1;
+    if(r){
+      tlbshootdown(pgdir, va0, PGSIZE);
+      if(old)
+        kfree(old);
+    }
     pa0 = uva2ka(pgdir, (char*)va0);
+    if(pa0 == 0 && myproc() && myproc()->mm && myproc()->mm->pgdir == pgdir &&
+       pagein(va0) == 0)
+      pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (va - va0);
@@ -392,3 +1436,370 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 //PAGEBREAK!
 // Blank page.
 
+//PAGEBREAK!
+static void
+mmctor(void *o)
+{
+  initlock(&((struct mm*)o)->lock, "mm");
+}
+
+void
+mminit(void)
+{
+  kmcacheinit(&mmcache, "mm", sizeof(struct mm), mmctor);
+  initlock(&shoot.lock, "tlbshoot");
+  initlock(&ptlock, "ptshare");
+}
+
+// Wrap page table pgdir of size sz in a new mm with one reference.
+// Return 0 if out of memory; pgdir still belongs to the caller.
+struct mm*
+mmalloc(pde_t *pgdir, uint sz)
+{
+  struct mm *mm;
+
+  if((mm = slaballoc(&mmcache)) == 0)
+    return 0;
+
+  mm->pgdir = pgdir;
+  mm->sz = sz;
+  mm->ref = 1;
+  mm->users = 1;
+  mm->vruntime = schedvmin();
+  memset(&mm->ru, 0, sizeof(mm->ru));
+  memset(mm->vma, 0, sizeof(mm->vma));
+  return mm;
+}
+
+// Back [va, va+memsz) of mm with filesz bytes of ip at off,
+// to be read in as the pages are touched.  va must be page
+// aligned.  Takes a reference to ip.  Returns -1 if mm has no
+// free vma.  For exec(), before any other process uses mm.
+int
+mmaddfile(struct mm *mm, uint va, uint memsz, struct inode *ip, uint off, uint filesz)
+{
+  struct vma *v;
+
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->flags == 0){
+      v->start = va;
+      v->end = va + memsz;
+      v->ip = idup(ip);
+      v->off = off;
+      v->filesz = filesz;
+      v->prot = PROT_READ|PROT_WRITE;
+      v->flags = MAP_PRIVATE;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// End of the user memory of mm that starts at va and runs
+// without a gap: memory below sz and mmap() regions.  Returns
+// va if va isn't user memory.
+uint
+uvmend(struct mm *mm, uint va)
+{
+  struct vma *v;
+  uint end;
+
+  end = va < mm->sz ? mm->sz : va;
+again:
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->flags && v->start <= end && v->end > end){
+      end = v->end;
+      goto again;
+    }
+  }
+  return end;
+}
+
+// Whether any vma of mm overlaps [start, end).
+int
+vmaoverlap(struct mm *mm, uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->flags && v->start < end && v->end > start)
+      return 1;
+  return 0;
+}
+
+// Map len bytes of new memory into mm: size-off bytes of ip at
+// off (ip is size bytes long) and zeroes after that, or only
+// zeroes if ip is 0.  Returns the address, or -1.  Pages are
+// read in when touched, except that shared zero-filled memory
+// is allocated now, so that fork() children share all of it;
+// if pages is set, the shared memory is those pages instead,
+// and each mapping takes a reference to its page.
+static int
+vmamap(struct mm *mm, uint len, int prot, int flags,
+       struct inode *ip, uint off, uint size, char **pages)
+{
+  struct vma *v, *nv;
+  uint top, va, a;
+  char *mem;
+
+  if(len == 0 || len >= KERNBASE || off % PGSIZE)
+    return -1;
+  if(prot & ~(PROT_READ|PROT_WRITE))
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  len = PGROUNDUP(len);
+
+  acquire(&mm->lock);
+  // The highest gap below KERNBASE that fits, above sz.
+  top = KERNBASE;
+  nv = 0;
+  for(;;){
+    if(top < mm->sz || top - mm->sz < len){
+      release(&mm->lock);
+      return -1;
+    }
+    for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+      if(v->flags == 0)
+        nv = v;
+      else if(v->start < top && v->end > top - len)
+        break;
+    }
+    if(v == &mm->vma[NVMA])
+      break;
+    top = v->start;
+  }
+  if(nv == 0){
+    release(&mm->lock);
+    return -1;
+  }
+  va = top - len;
+
+  if((flags & MAP_SHARED) && ip == 0){
+    for(a = va; a < top; a += PGSIZE){
+      if(pages){
+        mem = pages[(a - va) / PGSIZE];
+        kref(mem);
+      } else
+        mem = kzalloc(KM_USER);
+      if(mem == 0 ||
+         mappages(mm->pgdir, (char*)a, PGSIZE, V2P(mem),
+                  vmaperm(prot) | PTE_SHARED) < 0){
+        if(mem)
+          kfree(mem);
+        deallocuvm(mm->pgdir, a, va);
+        release(&mm->lock);
+        return -1;
+      }
+    }
+  }
+  nv->start = va;
+  nv->end = top;
+  nv->ip = ip ? idup(ip) : 0;
+  nv->off = off;
+  nv->filesz = 0;
+  if(ip && off < size)
+    nv->filesz = size - off < len ? size - off : len;
+  nv->prot = prot;
+  nv->flags = flags;
+  release(&mm->lock);
+  return va;
+}
+
+int
+mmapregion(struct mm *mm, uint len, int prot, int flags,
+           struct inode *ip, uint off, uint size)
+{
+  return vmamap(mm, len, prot, flags, ip, off, size, 0);
+}
+
+// Map the n pages of pages into mm, read/write and shared with
+// fork() children, like MAP_SHARED anonymous memory.  For
+// shared memory segments (shm.c).  Returns the address, or -1.
+int
+mmapshared(struct mm *mm, char **pages, uint n)
+{
+  return vmamap(mm, n*PGSIZE, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_ANONYMOUS, 0, 0, 0, pages);
+}
+
+// Remove the mmap() regions of mm in [va, va+len), splitting
+// and trimming vmas as needed.  Returns -1 if the range isn't
+// page aligned, reaches below sz, or a split finds no free vma.
+int
+munmapregion(struct mm *mm, uint va, uint len)
+{
+  struct inode *drop[NVMA];
+  struct vma *v, *nv;
+  uint end, d;
+  int i, ndrop;
+
+  end = va + PGROUNDUP(len);
+  if(va % PGSIZE || len == 0 || end < va || end > KERNBASE)
+    return -1;
+
+  acquire(&mm->lock);
+  if(va < mm->sz){
+    release(&mm->lock);
+    return -1;
+  }
+  ndrop = 0;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->flags == 0 || v->start >= end || v->end <= va)
+      continue;
+    if(v->start < va && v->end > end){
+      // A hole in the middle: the part above becomes a vma
+      // of its own.
+      for(nv = mm->vma; nv < &mm->vma[NVMA] && nv->flags; nv++)
+        ;
+      if(nv == &mm->vma[NVMA]){
+        release(&mm->lock);
+        return -1;
+      }
+      *nv = *v;
+      d = end - v->start;
+      nv->start = end;
+      nv->off += d;
+      nv->filesz = nv->filesz > d ? nv->filesz - d : 0;
+      if(nv->ip)
+        idup(nv->ip);
+    }
+    if(v->start >= va && v->end <= end){
+      if(v->ip)
+        drop[ndrop++] = v->ip;
+      v->ip = 0;
+      v->flags = 0;
+    } else if(v->start >= va){
+      d = end - v->start;
+      v->start = end;
+      v->off += d;
+      v->filesz = v->filesz > d ? v->filesz - d : 0;
+    } else {
+      if(v->filesz > va - v->start)
+        v->filesz = va - v->start;
+      v->end = va;
+    }
+  }
+  deallocuvm(mm->pgdir, end, va);
+  release(&mm->lock);
+
+  if(ndrop > 0){
+    begin_op();
+    for(i = 0; i < ndrop; i++)
+      iput(drop[i]);
+    end_op();
+  }
+  return 0;
+}
+
+// The calling process is done with mm.  The last user drops
+// the vmas' files: that can sleep, so it can't wait for the
+// last mmput() under ptable.lock.  Must not be called inside
+// a transaction.
+void
+mmexit(struct mm *mm)
+{
+  struct vma *v;
+  int users;
+
+  acquire(&mm->lock);
+  users = --mm->users;
+  release(&mm->lock);
+  if(users > 0)
+    return;
+
+  begin_op();
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->ip)
+      iput(v->ip);
+    v->ip = 0;
+    v->flags = 0;
+  }
+  end_op();
+}
+
+// Take another reference to mm, for a thread sharing it.
+// Must be called by a process using mm.
+struct mm*
+mmdup(struct mm *mm)
+{
+  acquire(&mm->lock);
+  mm->ref++;
+  mm->users++;
+  release(&mm->lock);
+  return mm;
+}
+
+// Make a private copy of mm for a child process.  The pages
+// are only copied when written.  Must be called by a process
+// using mm.
+struct mm*
+mmcopy(struct mm *mm)
+{
+  struct mm *nmm;
+  struct vma *v;
+  pde_t *pgdir;
+  uint sz, hi;
+  int i;
+
+  acquire(&mm->lock);
+  sz = hi = mm->sz;
+  pgdir = copyuvm(mm->pgdir, sz, 1, &mm->lock);
+  for(v = mm->vma; pgdir && v < &mm->vma[NVMA]; v++){
+    if(v->flags && v->start >= sz){
+      if(copyrange(pgdir, mm->pgdir, v->start, v->end, 1, &mm->lock) < 0){
+        freevm(pgdir);
+        pgdir = 0;
+      }
+      if(v->end > hi)
+        hi = v->end;
+    }
+  }
+  tlbshootdown(mm->pgdir, 0, hi);  // our pages just became read-only
+  release(&mm->lock);
+  if(pgdir == 0)
+    return 0;
+  if((nmm = mmalloc(pgdir, sz)) == 0){
+    freevm(pgdir);
+    return 0;
+  }
+  for(i = 0; i < NVMA; i++){
+    nmm->vma[i] = mm->vma[i];
+    if(nmm->vma[i].ip)
+      idup(nmm->vma[i].ip);
+  }
+  return nmm;
+}
+
+// Drop a reference to mm.  Returns 1 if it was the last, and
+// the caller must mmfree() mm.
+int
+mmunref(struct mm *mm)
+{
+  int ref;
+
+  acquire(&mm->lock);
+  ref = --mm->ref;
+  release(&mm->lock);
+  return ref == 0;
+}
+
+// Free mm and its address space, once mmunref() has dropped
+// its last reference.  The page table must not be loaded on
+// any cpu by then.
+void
+mmfree(struct mm *mm)
+{
+  freevm(mm->pgdir);
+  mm->pgdir = 0;
+  slabfree(&mmcache, mm);
+}
+
+// Drop a reference to mm, freeing the address space with the last.
+// The page table must not be loaded on any cpu by then.
+void
+mmput(struct mm *mm)
+{
+  if(mmunref(mm))
+    mmfree(mm);
+}
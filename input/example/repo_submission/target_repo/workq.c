@@ -0,0 +1,102 @@
+// Work queues: run functions later in a kernel thread, so that
+// interrupt handlers and system calls can defer what need not
+// be done before they return.
+//
+// Each cpu has a queue and a worker thread, "kworker" plus the
+// cpu's number.  queuework() puts work on the calling cpu's
+// queue, so cpus queueing work don't contend for one lock, and
+// wakes that queue's worker.  Workers are ordinary kernel
+// threads, which the scheduler may move; a worker usually runs
+// where it last ran, on the cpu whose queue it serves.  Work on
+// one queue runs in order, one item at a time, and may sleep,
+// but not wait for the IDE disk: its completions are work too
+// (ide.c), and could be queued behind it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "rusage.h"
+#include "proc.h"
+#include "workq.h"
+
+struct workq {
+  struct spinlock lock;
+  struct work *head;
+  struct work *tail;
+};
+
+static PERCPU(struct workq, workqs);
+
+void
+initwork(struct work *w, void (*fn)(void*), void *arg)
+{
+  w->fn = fn;
+  w->arg = arg;
+  w->next = 0;
+  w->pending = 0;
+}
+
+// Queue w to run on a worker.  Safe from interrupt handlers.
+// Returns 0, or -1 if w is already queued and has not started.
+int
+queuework(struct work *w)
+{
+  struct workq *q;
+
+  pushcli();
+  q = &percpu(workqs);
+  acquire(&q->lock);
+  if(w->pending){
+    release(&q->lock);
+    popcli();
+    return -1;
+  }
+  w->pending = 1;
+  w->next = 0;
+  if(q->tail)
+    q->tail->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+  wakeup(q);
+  release(&q->lock);
+  popcli();
+  return 0;
+}
+
+static void
+worker(void *arg)
+{
+  struct workq *q = arg;
+  struct work *w;
+
+  for(;;){
+    acquire(&q->lock);
+    while((w = q->head) == 0)
+      sleep(q, &q->lock);
+    if((q->head = w->next) == 0)
+      q->tail = 0;
+    w->pending = 0;
+    release(&q->lock);
+    w->fn(w->arg);
+  }
+}
+
+// Start a worker for each cpu.  Needs a process context, for
+// kthreadstart().
+void
+workinit(void)
+{
+  char name[16];
+  int i;
+
+  for(i = 0; i < ncpu; i++){
+    initlock(&percpuof(workqs, i).lock, "workq");
+    safestrcpy(name, "kworker0", sizeof(name));
+    name[7] += i;
+    if(kthreadstart(worker, &percpuof(workqs, i), name) < 0)
+      panic("workinit");
+  }
+}
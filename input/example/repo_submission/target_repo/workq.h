@@ -0,0 +1,9 @@
+// Deferred work: fn(arg), run later by a kernel thread (see
+// workq.c).  The caller owns the storage, which must stay valid
+// until fn starts; it may be queued again once fn has started.
+struct work {
+  void (*fn)(void*);
+  void *arg;
+  struct work *next;     // Next on its queue
+  int pending;           // Queued and fn not yet started
+};
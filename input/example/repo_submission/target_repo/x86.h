@@ -9,6 +9,24 @@ inb(ushort port)
   return data;
 }
 
+static inline ushort
+inw(ushort port)
+{
+  ushort data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
 static inline void
 insl(int port, void *addr, int cnt)
 {
@@ -30,6 +48,12 @@ outw(ushort port, ushort data)
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 static inline void
 outsl(int port, const void *addr, int cnt)
 {
@@ -57,6 +81,30 @@ stosl(void *addr, int data, int cnt)
                "memory", "cc");
 }
 
+// Copy cnt dwords, then extra bytes, from src up to dst.
+static inline void
+movsl(void *dst, const void *src, int cnt, int extra)
+{
+  asm volatile("cld; rep movsl; movl %3, %%ecx; rep movsb" :
+               "+D" (dst), "+S" (src), "+c" (cnt) :
+               "r" (extra) :
+               "memory", "cc");
+}
+
+// Copy extra bytes, then cnt dwords, from src down to dst,
+// where src and dst point just past the end of the data.
+static inline void
+rmovsl(void *dst, const void *src, int cnt, int extra)
+{
+  dst = (char*)dst - 1;
+  src = (char*)src - 1;
+  asm volatile("std; rep movsb; subl $3, %%edi; subl $3, %%esi;"
+               "movl %3, %%ecx; rep movsl; cld" :
+               "+D" (dst), "+S" (src), "+c" (extra) :
+               "r" (cnt) :
+               "memory", "cc");
+}
+
 struct segdesc;
 
 static inline void
@@ -99,12 +147,28 @@ readeflags(void)
   return eflags;
 }
 
+// Read the time-stamp counter.
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
 static inline void
 loadgs(ushort v)
 {
   asm volatile("movw %0, %%gs" : : "r" (v));
 }
 
+static inline void
+loadfs(ushort v)
+{
+  asm volatile("movw %0, %%fs" : : "r" (v));
+}
+
 static inline void
 cli(void)
 {
@@ -117,6 +181,15 @@ sti(void)
   asm volatile("sti");
 }
 
+// Enable interrupts and halt until one arrives.  An interrupt
+// pending from before cannot slip in between: sti takes
+// effect after the next instruction.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -130,6 +203,20 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Atomically replace *addr with newval if it holds old.
+// Returns the value *addr held before.
+static inline uint
+cmpxchg(volatile uint *addr, uint old, uint newval)
+{
+  uint result;
+
+  asm volatile("lock; cmpxchgl %2, %1" :
+               "=a" (result), "+m" (*addr) :
+               "r" (newval), "0" (old) :
+               "cc", "memory");
+  return result;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -144,6 +231,160 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
+static inline uint
+rcr0(void)
+{
+  uint val;
+  asm volatile("movl %%cr0,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr0(uint val)
+{
+  asm volatile("movl %0,%%cr0" : : "r" (val));
+}
+
+static inline uint
+rcr4(void)
+{
+  uint val;
+  asm volatile("movl %%cr4,%0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr4(uint val)
+{
+  asm volatile("movl %0,%%cr4" : : "r" (val));
+}
+
+// Clear CR0.TS, so FPU and SSE instructions don't trap.
+static inline void
+clts(void)
+{
+  asm volatile("clts");
+}
+
+// Save the FPU and SSE registers to the 512 bytes at p,
+// which must be 16-byte aligned.
+static inline void
+fxsave(void *p)
+{
+  asm volatile("fxsave (%0)" : : "r" (p) : "memory");
+}
+
+static inline void
+fxrstor(void *p)
+{
+  asm volatile("fxrstor (%0)" : : "r" (p) : "memory");
+}
+
+static inline void
+fninit(void)
+{
+  asm volatile("fninit");
+}
+
+static inline void
+ldmxcsr(uint mxcsr)
+{
+  asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+}
+
+static inline void
+invlpg(void *addr)
+{
+  asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+// %edx of cpuid leaf info (feature flags for leaf 1).
+static inline uint
+cpuidedx(uint info)
+{
+  uint eax, ebx, ecx, edx;
+
+  asm volatile("cpuid" :
+               "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
+               "a" (info), "c" (0));
+  return edx;
+}
+
+// %eax of cpuid leaf info (the highest leaf for leaf 0).
+static inline uint
+cpuideax(uint info)
+{
+  uint eax, ebx, ecx, edx;
+
+  asm volatile("cpuid" :
+               "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
+               "a" (info), "c" (0));
+  return eax;
+}
+
+// %ebx of cpuid leaf info.
+static inline uint
+cpuidebx(uint info)
+{
+  uint eax, ebx, ecx, edx;
+
+  asm volatile("cpuid" :
+               "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
+               "a" (info), "c" (0));
+  return ebx;
+}
+
+// %ecx of cpuid leaf info.
+static inline uint
+cpuidecx(uint info)
+{
+  uint eax, ebx, ecx, edx;
+
+  asm volatile("cpuid" :
+               "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
+               "a" (info), "c" (0));
+  return ecx;
+}
+
+// Have mwait() return once addr's cache line is written.
+static inline void
+monitor(volatile void *addr)
+{
+  asm volatile("monitor" : : "a" (addr), "c" (0), "d" (0));
+}
+
+// Wait for a write to the monitored line, or an interrupt,
+// even with interrupts off.
+static inline void
+mwait(void)
+{
+  asm volatile("mwait" : : "a" (0), "c" (1));
+}
+
+static inline void
+wrmsr(uint msr, uint val)
+{
+  asm volatile("wrmsr" : : "c" (msr), "a" (val), "d" (0));
+}
+
+// Performance counter i.
+static inline uint64
+rdpmc(uint i)
+{
+  uint64 v;
+
+  asm volatile("rdpmc" : "=A" (v) : "c" (i));
+  return v;
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().
@@ -0,0 +1,104 @@
+// xargs: run a command once for each few words of the input.
+//   xargs [-P n] [-n k] cmd [arg ...]
+// runs cmd with its args and the next k (default 1) words of
+// the standard input, until the input ends, keeping up to n
+// (default NCPU) of the runs going at once, to use every cpu.
+
+#include "types.h"
+#include "param.h"
+#include "stat.h"
+#include "user.h"
+
+#define MAXWORD 128  // longer words are cut short
+#define MAXARGV 32
+
+char ibuf[512];
+int ipos, ilen;
+char words[MAXARGV][MAXWORD];
+
+// The next byte of the standard input, or -1 at its end.
+int
+getbyte(void)
+{
+  if(ipos == ilen){
+    if((ilen = read(0, ibuf, sizeof(ibuf))) <= 0)
+      return -1;
+    ipos = 0;
+  }
+  return (uchar)ibuf[ipos++];
+}
+
+int
+isspace(int c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Read the next word of the input into w.  Returns 0 at the end
+// of the input.
+int
+getword(char *w)
+{
+  int c, n;
+
+  while(isspace(c = getbyte()))
+    ;
+  if(c < 0)
+    return 0;
+  for(n = 0; c >= 0 && !isspace(c); c = getbyte())
+    if(n < MAXWORD-1)
+      w[n++] = c;
+  w[n] = 0;
+  return 1;
+}
+
+void
+usage(void)
+{
+  printf(2, "usage: xargs [-P n] [-n k] cmd [arg ...]\n");
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *av[MAXARGV];
+  int i, n, k, nfixed, got, running;
+
+  n = NCPU;
+  k = 1;
+  for(i = 1; i+1 < argc && argv[i][0] == '-'; i += 2){
+    if(strcmp(argv[i], "-P") == 0)
+      n = atoi(argv[i+1]);
+    else if(strcmp(argv[i], "-n") == 0)
+      k = atoi(argv[i+1]);
+    else
+      usage();
+  }
+  nfixed = argc - i;
+  if(nfixed < 1 || n < 1 || k < 1 || nfixed + k >= MAXARGV)
+    usage();
+  for(got = 0; got < nfixed; got++)
+    av[got] = argv[i+got];
+
+  // spawn() returns once the child has exec'd, so words[] is
+  // free for the next run as soon as it does.
+  running = 0;
+  for(;;){
+    for(got = 0; got < k && getword(words[got]); got++)
+      av[nfixed+got] = words[got];
+    if(got == 0)
+      break;
+    av[nfixed+got] = 0;
+    if(running == n && wait() >= 0)
+      running--;
+    if(spawn(av[0], av, 0) < 0){
+      printf(2, "xargs: cannot run %s\n", av[0]);
+      break;
+    }
+    running++;
+  }
+  while(running-- > 0)
+    wait();
+  exit();
+}
@@ -1,17 +1,100 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 
 #define MAX_ARGS 64       // Max arguments per command
 #define MAX_PATHS 64      // Max paths in search path
 #define MAX_COMMANDS 64   // Max parallel commands
+#define BUILTIN_BUF 4096  // I/O buffer of the builtin utilities
+#define HASH_SIZE 128     // Buckets in the command path cache
+#define SCRIPT_CHUNK 4096 // Least room to read more of a batch file into
 
 char *paths[MAX_PATHS];
 int path_count = 0;
 
+// A command of a line; its strings are in the line itself.
+struct command {
+    char *args[MAX_ARGS];
+    char *output_file;
+};
+
+// Where each command run so far was found in the search path,
+// so running it again needs no failed access() calls on the
+// directories before it.  Emptied whenever a new path or a new
+// directory could change the answers.
+struct hashed_command {
+    char *name;
+    char *full_path;
+    struct hashed_command *next;
+};
+
+struct hashed_command *command_hash[HASH_SIZE];
+
+unsigned hash_name(const char *name) {
+    unsigned h = 0;
+
+    while (*name != '\0') {
+        h = h * 31 + (unsigned char)*name++;
+    }
+    return h % HASH_SIZE;
+}
+
+void clear_hash(void) {
+    for (int i = 0; i < HASH_SIZE; i++) {
+        while (command_hash[i] != NULL) {
+            struct hashed_command *c = command_hash[i];
+            command_hash[i] = c->next;
+            free(c->name);
+            free(c->full_path);
+            free(c);
+        }
+    }
+}
+
+// Return where name is in the search path, or NULL if it isn't.
+// Let a command that has been removed since fail in execv().
+const char *find_command(const char *name) {
+    unsigned h = hash_name(name);
+    char full_path[256];
+
+    for (struct hashed_command *c = command_hash[h]; c != NULL; c = c->next) {
+        if (strcmp(c->name, name) == 0) {
+            return c->full_path;
+        }
+    }
+    for (int i = 0; i < path_count; i++) {
+        snprintf(full_path, sizeof(full_path), "%s/%s", paths[i], name);
+        if (access(full_path, X_OK) == 0) {
+            struct hashed_command *c = malloc(sizeof(*c));
+            if (c == NULL) {
+                return NULL;
+            }
+            c->name = strdup(name);
+            c->full_path = strdup(full_path);
+            c->next = command_hash[h];
+            command_hash[h] = c;
+            return c->full_path;
+        }
+    }
+    return NULL;
+}
+
+extern char **environ;
+
+void exit_shell(char **args) {
+    if (args[1] != NULL) {
+        write(STDERR_FILENO, "An error has occurred\n", 22);
+        return;
+    }
+    exit(0);
+}
+
 void change_directory(char **args) {
     if (args[1] == NULL || args[2] != NULL) {
         write(STDERR_FILENO, "An error has occurred\n", 22);
@@ -20,6 +103,8 @@ void change_directory(char **args) {
     if (chdir(args[1]) != 0) {
         write(STDERR_FILENO, "An error has occurred\n", 22);
     }
+    // Relative directories in the path now name others.
+    clear_hash();
 }
 
 void update_path(char **args) {
@@ -27,6 +112,7 @@ void update_path(char **args) {
         free(paths[i]);
     }
     path_count = 0;
+    clear_hash();
 
     int i = 1;
     while (args[i] != NULL && path_count < MAX_PATHS) {
@@ -36,217 +122,418 @@ void update_path(char **args) {
     }
 }
 
-int run_command(char **args) {
-    if (path_count == 0) {
+// "hash -r" forgets where commands were found.
+void hash_command(char **args) {
+    if (args[1] == NULL || strcmp(args[1], "-r") != 0 || args[2] != NULL) {
         write(STDERR_FILENO, "An error has occurred\n", 22);
-        return -1;
+        return;
     }
+    clear_hash();
+}
 
-    for (int i = 0; i < path_count; i++) {
-        char full_path[256];
-        snprintf(full_path, sizeof(full_path), "%s/%s", paths[i], args[0]);
-
-        if (access(full_path, X_OK) == 0) {
-            execv(full_path, args);
-            return -1;
+// Commands of the shell itself.
+struct shell_builtin {
+    const char *name;
+    void (*run)(char **args);
+};
+
+static const struct shell_builtin shell_builtins[] = {
+    {"exit", exit_shell},
+    {"cd", change_directory},
+    {"path", update_path},
+    {"hash", hash_command},
+};
+
+const struct shell_builtin *find_shell_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(shell_builtins) / sizeof(shell_builtins[0]); i++) {
+        if (strcmp(name, shell_builtins[i].name) == 0) {
+            return &shell_builtins[i];
         }
     }
+    return NULL;
+}
+
+// Start the program at full_path, with its standard output and
+// error going to output_file unless that is NULL.  posix_spawn()
+// lets the C library use a vfork-style clone instead of copying
+// the shell.  Returns the pid, or -1.
+pid_t spawn_command(const char *full_path, char **args, const char *output_file) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    if (output_file != NULL) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output_file,
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+    err = posix_spawn(&pid, full_path, &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        write(STDERR_FILENO, "An error has occurred\n", 22);
+        return -1;
+    }
+    return pid;
+}
+
+// Report a command that isn't in the path where its errors would
+// have gone: into output_file, if the shell can create it.
+void report_missing(const char *output_file) {
+    int fd;
 
+    if (output_file != NULL && (fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        write(fd, "An error has occurred\n", 22);
+        close(fd);
+        return;
+    }
     write(STDERR_FILENO, "An error has occurred\n", 22);
-    return -1;
 }
 
-void clean_input(char *input) {
-    char cleaned[1024];
-    int i = 0, j = 0;
-    int len = strlen(input);
+// Builtin versions of a few small utilities, run in the shell
+// itself without a fork and exec.  Each returns -1 to leave the
+// command to the real program: for options, or anything else
+// it doesn't handle the same way.
+int echo_builtin(char **args) {
+    char buf[BUILTIN_BUF];
+    size_t n = 0;
 
-    while (i < len) {
-        if (input[i] == '>' || input[i] == '&') {
-            if (j > 0 && cleaned[j - 1] != ' ') {
-                cleaned[j++] = ' ';
-            }
-            cleaned[j++] = input[i];
-            if (i + 1 < len && input[i + 1] != ' ') {
-                cleaned[j++] = ' ';
-            }
-        } else {
-            cleaned[j++] = input[i];
+    if (args[1] != NULL && args[1][0] == '-') {
+        return -1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t len = strlen(args[i]);
+        if (n + len + 1 >= sizeof(buf)) {
+            return -1;
+        }
+        memcpy(buf + n, args[i], len);
+        n += len;
+        if (args[i + 1] != NULL) {
+            buf[n++] = ' ';
         }
-        i++;
     }
-    cleaned[j] = '\0';
-    strcpy(input, cleaned);
+    buf[n++] = '\n';
+    write(STDOUT_FILENO, buf, n);
+    return 0;
 }
 
-int split_input(char *input, char **args, char **output_file) {
-    int argc = 0;
-    char *token;
-    int redirect_found = 0;
-    int no_more_args = 0;
-
-    clean_input(input);
+int true_builtin(char **args) {
+    (void)args;
+    return 0;
+}
 
-    while ((token = strsep(&input, " \t\n")) != NULL) {
-        if (strlen(token) == 0) {
-            continue;
-        }
+// Only files, not standard input, which the shell may be
+// reading commands from.
+int cat_builtin(char **args) {
+    char buf[BUILTIN_BUF];
+    ssize_t n;
 
-        if (no_more_args) {
-            write(STDERR_FILENO, "An error has occurred\n", 22);
+    if (args[1] == NULL) {
+        return -1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' || access(args[i], R_OK) != 0) {
             return -1;
         }
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        int fd = open(args[i], O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            write(STDOUT_FILENO, buf, n);
+        }
+        close(fd);
+    }
+    return 0;
+}
 
-        if (strcmp(token, ">") == 0) {
-            if (redirect_found || argc == 0) {
-                write(STDERR_FILENO, "An error has occurred\n", 22);
+struct builtin {
+    const char *name;
+    int (*run)(char **args);
+};
+
+static const struct builtin builtins[] = {
+    {"echo", echo_builtin},
+    {"true", true_builtin},
+    {"cat", cat_builtin},
+};
+
+// Run args in the shell if it is one of the builtins.  The
+// search path must still hold the program, so the path decides
+// what runs and what is an error, as it does for any other
+// command.  Returns 0 if it ran.
+int run_builtin(char **args) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(args[0], builtins[i].name) == 0) {
+            if (find_command(args[0]) == NULL) {
                 return -1;
             }
-            redirect_found = 1;
+            return builtins[i].run(args);
+        }
+    }
+    return -1;
+}
+
+// Reads a line's tokens in place.  A word ends at blank space or
+// at an operator, > or &, and the byte after it becomes its NUL.
+// If that byte was an operator it is kept in pending, to be the
+// next token.
+struct scanner {
+    char *pos;
+    char pending;
+};
+
+#define TOKEN_END '\0'
+#define TOKEN_WORD 'w'
+#define BLANKS " \t\n"
+
+// Return the next token: TOKEN_WORD with the word in *word, an
+// operator character, or TOKEN_END.
+char next_token(struct scanner *scan, char **word) {
+    char token;
+
+    if (scan->pending != '\0') {
+        token = scan->pending;
+        scan->pending = '\0';
+        return token;
+    }
+    scan->pos += strspn(scan->pos, BLANKS);
+    if (*scan->pos == '\0') {
+        return TOKEN_END;
+    }
+    if (*scan->pos == '>' || *scan->pos == '&') {
+        return *scan->pos++;
+    }
+    *word = scan->pos;
+    scan->pos += strcspn(scan->pos, BLANKS ">&");
+    if (*scan->pos != '\0') {
+        if (strchr(BLANKS, *scan->pos) == NULL) {
+            scan->pending = *scan->pos;
+        }
+        *scan->pos++ = '\0';
+    }
+    return TOKEN_WORD;
+}
+
+// Parse one command, up to & or the end of the line, into cmd.
+// Returns the token that ended it, or -1 after reporting a
+// syntax error, having skipped the rest of the command.
+int parse_command(struct scanner *scan, struct command *cmd) {
+    int argc = 0;
+    bool redirect_found = false;
+    bool bad = false;
+    char token;
+    char *word;
+
+    cmd->output_file = NULL;
+    while ((token = next_token(scan, &word)) != TOKEN_END && token != '&') {
+        if (bad) {
+            continue;
+        }
+        if (cmd->output_file != NULL) {
+            bad = true;
+        } else if (token == '>') {
+            bad = redirect_found || argc == 0;
+            redirect_found = true;
         } else if (redirect_found) {
-            *output_file = token;
-            redirect_found = 0;
-            no_more_args = 1;
+            cmd->output_file = word;
+        } else if (argc == MAX_ARGS - 1) {
+            bad = true;
         } else {
-            args[argc++] = token;
+            cmd->args[argc++] = word;
         }
     }
+    cmd->args[argc] = NULL;
 
-    if (redirect_found) {
+    if (bad || (redirect_found && cmd->output_file == NULL)) {
         write(STDERR_FILENO, "An error has occurred\n", 22);
         return -1;
     }
-
-    args[argc] = NULL;
-    return argc;
+    return token;
 }
 
-void execute_command(char *command) {
-    char *args[MAX_ARGS];
-    char *output_file = NULL;
+// Parse line in place into the commands separated by its &s,
+// leaving out empty commands and those with errors, and setting
+// *parallel if any & was found.  Returns the number of commands.
+int parse_line(char *line, struct command *commands, bool *parallel) {
+    struct scanner scan = {line, '\0'};
+    int count = 0;
+    int token;
+
+    *parallel = false;
+    do {
+        if (count == MAX_COMMANDS) {
+            write(STDERR_FILENO, "An error has occurred\n", 22);
+            break;
+        }
+        token = parse_command(&scan, &commands[count]);
+        if (token != -1 && commands[count].args[0] != NULL) {
+            count++;
+        }
+        if (token == '&') {
+            *parallel = true;
+        }
+    } while (token != TOKEN_END);
+    return count;
+}
 
-    int argc = split_input(command, args, &output_file);
+// Run cmd, a whole line or one of the parallel commands of a
+// line, without waiting for it.  Returns the pid of the process
+// started for it, or -1 if there is none.  A builtin of the shell
+// in a parallel command runs in a child, so that it can't affect
+// the shell or the other commands.
+pid_t execute_command(struct command *cmd, bool parallel) {
+    char **args = cmd->args;
+    const struct shell_builtin *builtin;
+    const char *full_path;
+
+    if ((builtin = find_shell_builtin(args[0])) != NULL) {
+        if (!parallel) {
+            builtin->run(args);
+            return -1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            builtin->run(args);
+            exit(0);
+        } else if (pid < 0) {
+            write(STDERR_FILENO, "An error has occurred\n", 22);
+        }
+        return pid;
+    }
+    if (cmd->output_file == NULL && run_builtin(args) == 0) {
+        // Ran without a fork; redirection is left to the programs.
+        return -1;
+    }
+    if ((full_path = find_command(args[0])) == NULL) {
+        report_missing(cmd->output_file);
+        return -1;
+    }
+    return spawn_command(full_path, args, cmd->output_file);
+}
 
-    if (argc == -1 || argc == 0) {
-        return;
+// Wait until fewer than limit of the *running processes are left.
+void wait_running(int limit, int *running) {
+    while (*running >= limit && wait(NULL) > 0) {
+        (*running)--;
     }
+}
 
-    if (strcmp(args[0], "exit") == 0) {
-        if (argc > 1) {
-            write(STDERR_FILENO, "An error has occurred\n", 22);
-        } else {
-            exit(0);
+// Run the commands of line, counting the processes started in
+// *running, and return once fewer than jobs are still running; for
+// one job, once the line is done.  A line with a builtin of the
+// shell first waits for all earlier lines, so that they see the
+// shell as it was.
+void run_line(char *line, int jobs, int *running) {
+    struct command commands[MAX_COMMANDS];
+    bool parallel;
+    int command_count = parse_line(line, commands, &parallel);
+
+    for (int i = 0; i < command_count; i++) {
+        if (find_shell_builtin(commands[i].args[0]) != NULL) {
+            wait_running(1, running);
         }
-    } else if (strcmp(args[0], "cd") == 0) {
-        change_directory(args);
-    } else if (strcmp(args[0], "path") == 0) {
-        update_path(args);
-    } else {
-        pid_t pid = fork();
-        if (pid == 0) {
-            if (output_file != NULL) {
-                int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd < 0) {
-                    write(STDERR_FILENO, "An error has occurred\n", 22);
-                    exit(1);
-                }
-                dup2(fd, STDOUT_FILENO);
-                dup2(fd, STDERR_FILENO);
-                close(fd);
-            }
-            if (run_command(args) == -1) {
-                exit(1);
+    }
+    for (int i = 0; i < command_count; i++) {
+        if (execute_command(&commands[i], parallel) > 0) {
+            (*running)++;
+        }
+    }
+    wait_running(jobs, running);
+}
+
+// Read all of the batch file name into memory, NUL-terminated, so
+// that its lines need no reads of their own.  Returns NULL if it
+// can't.
+char *read_script(const char *name) {
+    struct stat st;
+    size_t size, len = 0;
+    ssize_t n = 0;
+    char *buf;
+
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    size = (fstat(fd, &st) == 0 ? (size_t)st.st_size : 0) + SCRIPT_CHUNK;
+    buf = malloc(size);
+    while (buf != NULL && (n = read(fd, buf + len, size - len - 1)) > 0) {
+        len += n;
+        if (size - len - 1 < SCRIPT_CHUNK) {
+            char *bigger = realloc(buf, size * 2);
+            if (bigger == NULL) {
+                free(buf);
             }
-        } else if (pid > 0) {
-            wait(NULL);
-        } else {
-            write(STDERR_FILENO, "An error has occurred\n", 22);
+            buf = bigger;
+            size *= 2;
         }
     }
+    close(fd);
+    if (buf != NULL && n < 0) {
+        free(buf);
+        buf = NULL;
+    }
+    if (buf != NULL) {
+        buf[len] = '\0';
+    }
+    return buf;
 }
 
+// Usage: wish [[--jobs n] batch-file].  --jobs lets the lines of a
+// batch file overlap, with up to n processes running.  Lines are
+// independent then, unless a builtin of the shell orders them.
 int main(int argc, char **argv) {
     char *line = NULL;
     size_t len = 0;
-    ssize_t read;
-    FILE *input_file = stdin;
+    char *script = NULL;
+    char *next = NULL;
+    int jobs = 1;
+    int running = 0;
 
     paths[path_count++] = strdup("/bin");
 
+    if (argc == 4 && strcmp(argv[1], "--jobs") == 0 && (jobs = atoi(argv[2])) > 0) {
+        argv += 2;
+        argc -= 2;
+    }
     if (argc == 2) {
-        input_file = fopen(argv[1], "r");
-        if (input_file == NULL) {
+        if ((script = read_script(argv[1])) == NULL) {
             write(STDERR_FILENO, "An error has occurred\n", 22);
             exit(1);
         }
+        next = script;
     } else if (argc > 2) {
         write(STDERR_FILENO, "An error has occurred\n", 22);
         exit(1);
     }
 
     while (1) {
-        char *commands[MAX_COMMANDS];
-        int command_count = 0;
-
-        if (input_file == stdin) {
-            printf("wish> ");
-            fflush(stdout);
-        }
-
-        read = getline(&line, &len, input_file);
-        if (read == -1) {
-            break;
-        }
-
-        clean_input(line);
-
-        int contains_ampersand = 0;
-        for (int i = 0; line[i] != '\0'; i++) {
-            if (line[i] == '&') {
-                contains_ampersand = 1;
+        if (script != NULL) {
+            if (*next == '\0') {
                 break;
             }
-        }
-
-        if (contains_ampersand) {
-            char *token;
-            while ((token = strsep(&line, "&")) != NULL) {
-                if (strlen(token) > 0) {
-                    commands[command_count++] = strdup(token);
-                }
-            }
-
-            pid_t pids[MAX_COMMANDS];
-            for (int i = 0; i < command_count; i++) {
-                pid_t pid = fork();
-                if (pid == 0) {
-                    execute_command(commands[i]);
-                    exit(0);
-                } else if (pid > 0) {
-                    pids[i] = pid;
-                } else {
-                    write(STDERR_FILENO, "An error has occurred\n", 22);
-                }
-            }
-
-            for (int i = 0; i < command_count; i++) {
-                waitpid(pids[i], NULL, 0);
-            }
-
-            for (int i = 0; i < command_count; i++) {
-                free(commands[i]);
+            line = next;
+            next += strcspn(next, "\n");
+            if (*next != '\0') {
+                *next++ = '\0';
             }
         } else {
-            execute_command(line);
+            printf("wish> ");
+            fflush(stdout);
+            if (getline(&line, &len, stdin) == -1) {
+                break;
+            }
         }
+        run_line(line, jobs, &running);
     }
+    wait_running(1, &running);
 
     for (int i = 0; i < path_count; i++) {
         free(paths[i]);
     }
-    if (input_file != stdin) {
-        fclose(input_file);
-    }
-    free(line);
+    clear_hash();
+    free(script != NULL ? script : line);
     return 0;
 }